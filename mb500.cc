@@ -1,8 +1,11 @@
 #include "mb500.hh"
+#include "mb500_output.hh"
+#include "mb500_geodesy.hh"
 
 #include <math.h>
 #include <string.h>
 #include <string>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -26,6 +29,8 @@
 
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/split.hpp>
+#include <poll.h>
+#include <sys/uio.h>
 
 using namespace std;
 using namespace gps;
@@ -57,7 +62,40 @@ struct shmTime {
 
 MB500::MB500() : iodrivers_base::Driver(2048), processing_latency(0)
 	     , m_period(1000), m_acq_timeout(2000), ntp_shm(NULL)
+             , m_utc_day(-1), m_utc_time_of_day(-1)
+             , m_last_operation(0), m_command_written(0), m_process_error(0)
+             , m_correction_written(0)
+             , m_correction_queue_size(DEFAULT_CORRECTION_QUEUE_SIZE)
+             , m_output_profile(MB500_NMEA_OUTPUT)
+             , m_baudrate(DEFAULT_BAUDRATE)
+             , m_warm_start_max_age(base::Time::fromSeconds(4 * 3600))
+             , m_warm_start_period(base::Time::fromSeconds(60))
+             , m_warm_start_dirty(false)
+             , m_marker_event_count(0)
+             , m_gsv_next(0), m_gsv_talker(0), m_gsv_broken(false), m_gsa_broken(false)
+             , m_gsa_dropped_packets(0)
 {
+    for (int i = 0; i < PORT_ROLE_COUNT; ++i)
+        m_port_fds[i] = -1;
+    memset(&m_correction_status, 0, sizeof(m_correction_status));
+}
+
+MB500::Configuration::Configuration()
+    : maxBaudrate(0), processingRate(0), dynamics(0), hasUserDynamics(false)
+    , fixThreshold(-1), fastRTK(-1), hasBasePosition(false)
+    , periodicPeriod(0), periodicProfile(MB500_NMEA_OUTPUT), rawPeriod(0)
+    , movingBase(-1), headingPeriod(0), markerEnabled(false), markerRisingEdge(true)
+{
+}
+
+MB500::ReadBuffer::ReadBuffer()
+    : data(READ_BUFFER_SIZE), start(0), end(0), packetSize(0)
+{
+}
+
+void MB500::ReadBuffer::clear()
+{
+    start = end = packetSize = 0;
 }
 
 MB500::~MB500()
@@ -68,16 +106,157 @@ MB500::~MB500()
 
 bool MB500::openSerial(std::string const& filename)
 {
-    if( !iodrivers_base::Driver::openSerial(filename, 115200))
+    if( !iodrivers_base::Driver::openSerial(filename, DEFAULT_BAUDRATE))
     {
-        cerr << "dgps/mb500: cannot open " << filename << " at 115200 bauds" << endl;
+        cerr << "dgps/mb500: cannot open " << filename << " at " << DEFAULT_BAUDRATE << " bauds" << endl;
         return false;
     }
+    m_baudrate = DEFAULT_BAUDRATE;
+    m_configuration = Configuration();
+    m_configuration.device = filename;
+    clearReadBuffer();
+
+    // The board keeps the rate of a previous negotiateBaudrate() until
+    // it gets reset
+    if (!probeBaudrate())
+        cerr << "dgps/mb500: cannot find the board's baud rate, assuming " << DEFAULT_BAUDRATE << endl;
 
     disableAllOutputs();
     return true;
 }
 
+// Baud rates supported by the board, indexed by their $PASHS,SPD code
+static const int SPD_BAUDRATES[] = { 300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+static const int SPD_BAUDRATES_COUNT = sizeof(SPD_BAUDRATES) / sizeof(SPD_BAUDRATES[0]);
+// Order in which the host rates are tried by probeBaudrate()
+static const int PROBED_BAUDRATES[] = { 115200, 921600, 460800, 230400, 57600, 38400, 19200, 9600 };
+static const int PROBED_BAUDRATES_COUNT = sizeof(PROBED_BAUDRATES) / sizeof(PROBED_BAUDRATES[0]);
+static const int PROBE_TIMEOUT = 300;
+static const double KNOTS_TO_MS = 1852.0 / 3600;
+static const int64_t USECS_PER_DAY = 86400LL * 1000000;
+
+void MB500::clearReadBuffer()
+{
+    tcflush(getFileDescriptor(), TCIFLUSH);
+    m_command_buffer.clear();
+}
+
+bool MB500::setHostBaudrate(int rate)
+{
+    if (!setSerialBaudrate(rate))
+        return false;
+    m_baudrate = rate;
+    clearReadBuffer();
+    return true;
+}
+
+bool MB500::queryPortSetting(int timeout, string& port, int& baudrate)
+{
+    return queryPortSetting(getFileDescriptor(), m_command_buffer, timeout, port, baudrate);
+}
+
+bool MB500::queryPortSetting(int fd, ReadBuffer& buffer, int timeout, string& port, int& baudrate)
+{
+    write(fd, "$PASHQ,PRT\r\n", 1000);
+
+    base::Time deadline = base::Time::now() + base::Time::fromMilliseconds(timeout);
+    while(true)
+    {
+        int remaining = (deadline - base::Time::now()).toMilliseconds();
+        if (remaining <= 0)
+            return false;
+
+        string_ref reply;
+        if (tryRead(fd, buffer, reply, remaining, remaining) != READ_PACKET)
+            return false;
+
+        if (reply.starts_with("$PASHR,PRT,"))
+        {
+            vector<string> fields;
+            split( fields, reply, is_any_of(",*") );
+            int code = atoi(fields[3].c_str());
+            if (code < 0 || code >= SPD_BAUDRATES_COUNT)
+                return false;
+            port     = fields[2];
+            baudrate = SPD_BAUDRATES[code];
+            return true;
+        }
+        interpretPeriodicData(reply);
+    }
+}
+
+int MB500::probeBaudrate()
+{
+    string port;
+    int board_rate;
+    for (int i = 0; i < PROBED_BAUDRATES_COUNT; ++i)
+    {
+        if (!setHostBaudrate(PROBED_BAUDRATES[i]))
+            continue;
+        if (queryPortSetting(PROBE_TIMEOUT, port, board_rate) && board_rate == m_baudrate)
+        {
+            m_port_names[PORT_COMMAND] = port;
+            return m_baudrate;
+        }
+    }
+
+    setHostBaudrate(DEFAULT_BAUDRATE);
+    return 0;
+}
+
+int MB500::negotiateBaudrate(int max_rate)
+{
+    m_configuration.maxBaudrate = max_rate;
+    string port;
+    int current_rate;
+    if (!queryPortSetting(m_acq_timeout, port, current_rate))
+    {
+        cerr << "dgps/mb500: cannot get the board's port settings" << endl;
+        return 0;
+    }
+
+    for (int code = SPD_BAUDRATES_COUNT - 1; code >= 0; --code)
+    {
+        int rate = SPD_BAUDRATES[code];
+        if (rate > max_rate)
+            continue;
+        // A board faster than max_rate has to be switched down
+        else if (rate <= current_rate && current_rate <= max_rate)
+            break;
+
+        // The board acknowledges at the old rate and switches right after
+        write("$PASHS,SPD," + port + "," + boost::lexical_cast<string>(code) + "\r\n", 1000);
+        if (!verifyAcknowledge("SET BAUDRATE " + boost::lexical_cast<string>(rate)))
+            continue;
+
+        usleep(100000);
+        string new_port;
+        int confirmed_rate;
+        if (setHostBaudrate(rate) && queryPortSetting(m_acq_timeout, new_port, confirmed_rate) && confirmed_rate == rate)
+            return rate;
+
+        // Something went wrong on the way. Find where the board is and
+        // stop there
+        cerr << "dgps/mb500: could not confirm the switch to " << rate << " bauds" << endl;
+        current_rate = probeBaudrate();
+        if (!current_rate)
+            return 0;
+        break;
+    }
+
+    if (current_rate > max_rate)
+    {
+        cerr << "dgps/mb500: the board stays at " << current_rate << " bauds, above the maximum of " << max_rate << endl;
+        return 0;
+    }
+    return current_rate;
+}
+
+int MB500::getBaudrate() const
+{
+    return m_baudrate;
+}
+
 
 bool MB500::open(const string& filename)
 {
@@ -85,6 +264,7 @@ bool MB500::open(const string& filename)
         return false;
 
     resetStoredPosition();
+    startAcquisition(true);
     return true;
 }
 
@@ -102,95 +282,852 @@ void MB500::disableAllOutputs()
     stopRTKBase();
 }
 
-bool MB500::waitForBoardReset()
+bool MB500::waitForBoardReset()
+{
+    // The board prints its boot messages before it is ready, wait for it
+    // to answer a query instead
+    return waitForBoard(base::Time::fromSeconds(10));
+}
+
+bool MB500::waitForBoard(base::Time const& timeout)
+{
+    base::Time deadline = base::Time::now() + timeout;
+    int rates[2] = { m_baudrate, DEFAULT_BAUDRATE };
+    int rate_count = (m_baudrate == DEFAULT_BAUDRATE) ? 1 : 2;
+    for (int i = 0; base::Time::now() < deadline; ++i)
+    {
+        // Failing to configure the device is not going to improve by
+        // retrying right away, let the caller back off
+        if (rate_count > 1 && !setHostBaudrate(rates[i % rate_count]))
+        {
+            cerr << "dgps/mb500: cannot change the host baud rate to " << rates[i % rate_count] << endl;
+            return false;
+        }
+
+        string port;
+        int board_rate;
+        if (queryPortSetting(PROBE_TIMEOUT, port, board_rate) && board_rate == m_baudrate)
+        {
+            m_port_names[PORT_COMMAND] = port;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string MB500::getBoardID()
+{
+    write("$PASHQ,RID\r\n", 1000);
+    string_ref reply;
+    while(true)
+    {
+        reply = read(m_acq_timeout);
+        if (reply.starts_with("$PASHR,RID,"))
+            break;
+        interpretPeriodicData(reply);
+    }
+
+    // Return everything between "$PASHR,RID," and the checksum
+    string_ref id = reply.substr(11);
+    return string(id.begin(), id.begin() + id.rfind('*'));
+}
+
+bool MB500::openRover(std::string const& device_name)
+{
+    if (!open(device_name))
+        return false;
+
+    return setReceiverDynamics(MB500_ADAPTIVE);
+}
+
+bool MB500::setUserDynamics(int h_vel, int h_acc, int v_vec, int v_acc)
+{
+    write("$PASHS,UDP," +
+	    boost::lexical_cast<string>(h_vel) + "," +
+	    boost::lexical_cast<string>(h_acc) + "," +
+	    boost::lexical_cast<string>(v_vec) + "," +
+	    boost::lexical_cast<string>(v_acc) + "\r\n", 1000);
+    if (!verifyAcknowledge("USER DYNAMICS"))
+        return false;
+    int values[4] = { h_vel, h_acc, v_vec, v_acc };
+    m_configuration.hasUserDynamics = true;
+    copy(values, values + 4, m_configuration.userDynamics);
+    return true;
+}
+
+void MB500::reset(bool cold_start)
+{
+    if (cold_start)
+        write("$PASHS,INI,9,9,1\r\n", 1000);
+    else
+        write("$PASHS,INI,9,9,5\r\n", 1000);
+
+    waitForBoardReset();
+    stopPeriodicData();
+    startAcquisition(!cold_start);
+}
+
+/** Backoff between the attempts of recover(). USB adapters usually come
+ * back within a few hundred milliseconds */
+static const int RECOVERY_MIN_BACKOFF = 50;
+static const int RECOVERY_MAX_BACKOFF = 500;
+
+/** True if the device reports a hangup or an error, e.g. after a USB
+ * disconnection */
+static bool hasHangup(int fd)
+{
+    pollfd poll_fd = { fd, 0, 0 };
+    return poll(&poll_fd, 1, 0) == 1 && (poll_fd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+bool MB500::recover(base::Time const& timeout)
+{
+    RecoveryStatistics& stats = m_recovery_statistics;
+    base::Time start = getMonotonicTime();
+    base::Time outage_start = m_last_reception.isNull() ? start : m_last_reception;
+
+    bool disconnected = !isValid() || hasHangup(getFileDescriptor());
+    for (int i = 0; i < PORT_ROLE_COUNT; ++i)
+        disconnected = disconnected || (m_port_fds[i] != -1 && hasHangup(m_port_fds[i]));
+    if (disconnected)
+        ++stats.disconnections;
+    else
+        ++stats.stalls;
+
+    int backoff = RECOVERY_MIN_BACKOFF;
+    while (true)
+    {
+        ++stats.attempts;
+        // The board only stops sending while the device is up if it got
+        // reset
+        bool board_reset = !disconnected;
+        bool success = false;
+        try { success = reconnect(board_reset); }
+        catch(std::runtime_error& e) {}
+
+        if (success)
+        {
+            base::Time downtime = getMonotonicTime() - outage_start;
+            if (board_reset)
+                ++stats.boardResets;
+            stats.lastDowntime   = downtime;
+            stats.totalDowntime  = stats.totalDowntime + downtime;
+            if (downtime > stats.maxDowntime)
+                stats.maxDowntime = downtime;
+            stats.lastRecovery = base::Time::now();
+            return true;
+        }
+
+        if (getMonotonicTime() - start + base::Time::fromMilliseconds(backoff) > timeout)
+        {
+            ++stats.failures;
+            cerr << "dgps/mb500: cannot reach the board on " << m_configuration.device << endl;
+            return false;
+        }
+        usleep(backoff * 1000);
+        backoff = min(backoff * 2, RECOVERY_MAX_BACKOFF);
+    }
+}
+
+bool MB500::reconnect(bool& board_reset)
+{
+    // Start from scratch, whatever state the devices are in
+    Configuration configuration = m_configuration;
+    int rate = m_baudrate;
+    close();
+    if (!iodrivers_base::Driver::openSerial(configuration.device, rate))
+        return false;
+    m_baudrate = rate;
+    m_configuration = configuration;
+    clearReadBuffer();
+
+    if (!waitForBoard(base::Time::fromMilliseconds(2 * PROBE_TIMEOUT)))
+    {
+        close();
+        return false;
+    }
+    // The board falls back to its default rate when it resets
+    if (m_baudrate != rate)
+        board_reset = true;
+
+    m_raw_decoder.reset();
+    if (board_reset)
+        startAcquisition(true);
+    if (!applyConfiguration())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool MB500::applyConfiguration()
+{
+    // The setters record the settings again as they go
+    Configuration const configuration = m_configuration;
+
+    bool success = true;
+    if (configuration.maxBaudrate)
+        success = negotiateBaudrate(configuration.maxBaudrate) && success;
+    for (int role = PORT_DATA; role < PORT_ROLE_COUNT; ++role)
+    {
+        if (!configuration.portDevices[role].empty())
+            success = openPort(static_cast<PORT_ROLE>(role), configuration.portDevices[role]) && success;
+    }
+    if (configuration.processingRate)
+        success = setProcessingRate(configuration.processingRate) && success;
+    if (configuration.hasUserDynamics)
+    {
+        int const* values = configuration.userDynamics;
+        success = setUserDynamics(values[0], values[1], values[2], values[3]) && success;
+    }
+    if (configuration.dynamics)
+        success = setReceiverDynamics(static_cast<MB500_DYNAMICS_MODEL>(configuration.dynamics)) && success;
+    if (configuration.fixThreshold >= 0)
+        success = setFixThreshold(static_cast<MB500_AMBIGUITY_THRESHOLD>(configuration.fixThreshold)) && success;
+    if (configuration.fastRTK >= 0)
+        success = setFastRTK(configuration.fastRTK) && success;
+    if (configuration.movingBase >= 0)
+        success = setMovingBase(configuration.movingBase) && success;
+    if (configuration.hasBasePosition)
+    {
+        double const* position = configuration.basePosition;
+        success = setPosition(position[0], position[1], position[2]) && success;
+    }
+    if (!configuration.rtkInputPort.empty())
+        success = setRTKInputPort(configuration.rtkInputPort) && success;
+    if (!configuration.rtkBasePort.empty())
+        success = setRTKBase(configuration.rtkBasePort) && success;
+    if (configuration.periodicPeriod > 0)
+        success = setPeriodicData(configuration.periodicPort, configuration.periodicPeriod,
+                configuration.periodicProfile) && success;
+    if (configuration.rawPeriod > 0)
+        success = setRawDataOutput(configuration.rawPort, configuration.rawPeriod) && success;
+    if (configuration.headingPeriod > 0)
+        success = setHeadingOutput(configuration.headingPort, configuration.headingPeriod) && success;
+    if (configuration.markerEnabled)
+        success = setEventMarker(configuration.markerPort, true, configuration.markerRisingEdge) && success;
+    return success;
+}
+
+bool MB500::isStalled() const
+{
+    if (m_configuration.periodicPeriod <= 0 || m_last_solution_reception.isNull())
+        return false;
+
+    base::Time timeout = m_stall_timeout;
+    if (timeout.isNull())
+        timeout = base::Time::fromSeconds(2 * m_configuration.periodicPeriod + 0.5);
+    return getMonotonicTime() - m_last_solution_reception > timeout;
+}
+
+void MB500::setStallTimeout(base::Time const& timeout)
+{
+    m_stall_timeout = timeout;
+}
+
+RecoveryStatistics const& MB500::getRecoveryStatistics() const
+{
+    return m_recovery_statistics;
+}
+
+void MB500::setWarmStartCache(std::string const& path, base::Time const& max_age, base::Time const& save_period)
+{
+    m_warm_start_path = path;
+    m_warm_start_max_age = max_age;
+    m_warm_start_period = save_period;
+    if (!m_warm_start.load(path))
+        m_warm_start = WarmStartData();
+    m_warm_start_dirty = false;
+}
+
+void MB500::startAcquisition(bool warm_start)
+{
+    m_acquisition_start = base::Time::now();
+    m_time_to_first_fix = base::Time();
+    m_time_to_rtk_fix   = base::Time();
+    m_predictor.clear();
+
+    if (!warm_start || m_warm_start_path.empty() || !m_warm_start.hasPosition())
+        return;
+
+    base::Time age = base::Time::now() - m_warm_start.time;
+    if (age > m_warm_start_max_age)
+        cerr << "dgps/mb500: warm-start position is " << age.toSeconds() << " seconds old, ignoring it" << endl;
+    else if (!applyWarmStart(m_warm_start))
+        cerr << "dgps/mb500: the board refused the warm-start position" << endl;
+}
+
+static double deg2magellan(double value)
+{
+    double deg     = static_cast<int>(value);
+    double decimal = value - deg;
+    return deg * 100 + decimal * 60;
+}
+
+// Lower bound on the accuracy given to $PASHS,KPI, as the saved
+// deviations do not account for the motion since the save
+static const double WARM_START_MIN_ACCURACY = 1.0;
+
+bool MB500::applyWarmStart(WarmStartData const& data)
+{
+    if (!data.hasPosition())
+        return false;
+
+    return setKnownPointInit(
+            deg2magellan(fabs(data.latitude)),  data.latitude > 0 ? "N" : "S",
+            deg2magellan(fabs(data.longitude)), data.longitude > 0 ? "E" : "W",
+            data.height,
+            std::max(data.deviation_latitude, WARM_START_MIN_ACCURACY),
+            std::max(data.deviation_longitude, WARM_START_MIN_ACCURACY),
+            std::max(data.deviation_altitude, WARM_START_MIN_ACCURACY),
+            "0");
+}
+
+static bool hasFix(gps_base::GPS_SOLUTION_TYPES type)
+{
+    return type == AUTONOMOUS || type == DIFFERENTIAL ||
+        type == RTK_FIXED || type == RTK_FLOAT;
+}
+
+void MB500::setSolutionTime(base::Time const& time)
+{
+    ++m_stream_statistics.epochs;
+    if (!m_solution_time.isNull() && time > m_solution_time && m_period > 0)
+    {
+        int64_t steps = llround((time - m_solution_time).toSeconds() * 1000 / m_period);
+        if (steps > 1)
+            m_stream_statistics.missingEpochs += steps - 1;
+    }
+
+    m_solution_time = time;
+    m_last_solution_reception = m_read_time;
+    if (hasFix(position.positionType))
+    {
+        if (m_time_to_first_fix.isNull() && !m_acquisition_start.isNull())
+            m_time_to_first_fix = base::Time::now() - m_acquisition_start;
+        if (m_time_to_rtk_fix.isNull() && !m_acquisition_start.isNull() && position.positionType == RTK_FIXED)
+            m_time_to_rtk_fix = base::Time::now() - m_acquisition_start;
+
+        updateWarmStart();
+    }
+
+    base::Time host_time = getHostTime(position.time);
+    if (host_time.isNull())
+        host_time = base::Time::now() - base::Time::fromSeconds(processing_latency);
+    if (hasFix(position.positionType))
+        m_predictor.push(host_time, position, errors, velocity);
+    matchMarkerEvents(false);
+
+    m_rtk_monitor.update(position, solutionQuality, satellites,
+            m_time_to_first_fix, m_time_to_rtk_fix);
+    m_solution_bus.push(host_time, position, errors, solutionQuality, satellites);
+}
+
+void MB500::updateWarmStart()
+{
+    if (m_warm_start_path.empty())
+        return;
+
+    base::Time now = base::Time::now();
+    if (!m_warm_start_last_update.isNull() && now - m_warm_start_last_update < m_warm_start_period)
+        return;
+    m_warm_start_last_update = now;
+
+    m_warm_start.latitude  = position.latitude;
+    m_warm_start.longitude = position.longitude;
+    m_warm_start.height    = position.altitude + position.geoidalSeparation;
+    m_warm_start.deviation_latitude  = errors.deviationLatitude;
+    m_warm_start.deviation_longitude = errors.deviationLongitude;
+    m_warm_start.deviation_altitude  = errors.deviationAltitude;
+    m_warm_start.time = position.time;
+    m_warm_start_dirty = true;
+}
+
+bool MB500::hasWarmStartUpdate() const
+{
+    return m_warm_start_dirty;
+}
+
+bool MB500::saveWarmStart()
+{
+    if (!m_warm_start_dirty || m_warm_start_path.empty())
+        return true;
+    if (!m_warm_start.save(m_warm_start_path))
+    {
+        cerr << "dgps/mb500: cannot save the warm-start data in " << m_warm_start_path << endl;
+        return false;
+    }
+    m_warm_start_dirty = false;
+    return true;
+}
+
+bool MB500::saveAlmanac()
+{
+    vector<string> almanac;
+    if (!getAlmanac(almanac))
+        return false;
+
+    m_warm_start.almanac = almanac;
+    m_warm_start.almanac_time = base::Time::now();
+    if (m_warm_start_path.empty())
+        return true;
+    if (!m_warm_start.save(m_warm_start_path))
+        return false;
+    m_warm_start_dirty = false;
+    return true;
+}
+
+base::Time MB500::getTimeToFirstFix() const
+{
+    return m_time_to_first_fix;
+}
+
+base::Time MB500::getTimeToRTKFix() const
+{
+    return m_time_to_rtk_fix;
+}
+
+RTKMonitor const& MB500::getRTKMonitor() const
+{
+    return m_rtk_monitor;
+}
+
+bool MB500::publishRTKStatistics(std::string const& name)
+{
+    return m_rtk_monitor.publish(name);
+}
+
+bool MB500::publishSolutions(std::string const& name, uint32_t capacity)
+{
+    return m_solution_bus.publish(name, capacity);
+}
+
+bool MB500::stopPeriodicData()
+{
+    m_configuration.periodicPeriod = 0;
+    if(! setNMEALL("A", false)) return false;
+    if(! setNMEALL("B", false)) return false;
+    if(! setNMEALL("C", false)) return false;
+    return true;
+}
+
+void MB500::close()
+{
+    iodrivers_base::Driver::close();
+    for (int i = 0; i < PORT_ROLE_COUNT; ++i)
+    {
+        if (m_port_fds[i] != -1)
+            ::close(m_port_fds[i]);
+        m_port_fds[i] = -1;
+        m_port_names[i].clear();
+    }
+    m_command_buffer.clear();
+    m_data_buffer.clear();
+    // The owners of the queued operations wait for their results
+    while (!m_command_queue.empty())
+        completeCommand(COMMAND_ABORTED);
+    m_correction_queue.clear();
+    m_correction_written = 0;
+    m_correction_partial.clear();
+    m_correction_status.queuedBytes  = 0;
+    m_correction_status.queuedFrames = 0;
+    // No epoch will come after the pending events, deliver them as is
+    matchMarkerEvents(true);
+}
+
+bool MB500::openPort(PORT_ROLE role, std::string const& device_name)
+{
+    if (role == PORT_COMMAND)
+        return false;
+
+    int fd;
+    try { fd = iodrivers_base::Driver::openSerialIO(device_name, DEFAULT_BAUDRATE); }
+    catch(iodrivers_base::UnixError& e) { fd = -1; }
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open " << device_name << endl;
+        return false;
+    }
+
+    // Find the rate of the board's port, the reply telling which port
+    // it is as well
+    ReadBuffer buffer;
+    string port;
+    int board_rate;
+    for (int i = 0; i < PROBED_BAUDRATES_COUNT; ++i)
+    {
+        if (!iodrivers_base::Driver::setSerialBaudrate(fd, PROBED_BAUDRATES[i]))
+            continue;
+        tcflush(fd, TCIFLUSH);
+        buffer.clear();
+        if (queryPortSetting(fd, buffer, PROBE_TIMEOUT, port, board_rate) && board_rate == PROBED_BAUDRATES[i])
+        {
+            if (m_port_fds[role] != -1)
+                ::close(m_port_fds[role]);
+            m_port_fds[role]   = fd;
+            m_port_names[role] = port;
+            m_configuration.portDevices[role] = device_name;
+            if (role == PORT_DATA)
+                m_data_buffer.clear();
+            return true;
+        }
+    }
+
+    cerr << "dgps/mb500: the board does not reply on " << device_name << endl;
+    ::close(fd);
+    return false;
+}
+
+std::string MB500::getPortName(PORT_ROLE role) const
+{
+    if (m_port_fds[role] == -1)
+        return m_port_names[PORT_COMMAND];
+    return m_port_names[role];
+}
+
+int MB500::getPortFileDescriptor(PORT_ROLE role) const
+{
+    if (m_port_fds[role] == -1)
+        return getFileDescriptor();
+    return m_port_fds[role];
+}
+
+/** Checks that the board's name of a port is known, for the methods that
+ * pick the port by role */
+static bool checkPortName(std::string const& name)
+{
+    if (name.empty())
+        cerr << "dgps/mb500: the board's name of the port is not known" << endl;
+    return !name.empty();
+}
+
+bool MB500::setRawDataOutput(double period)
+{
+    string port = getPortName(PORT_DATA);
+    return checkPortName(port) && setRawDataOutput(port, period);
+}
+
+bool MB500::setRawDataOutput(std::string const& port, double period)
+{
+    char const* messages[] = { "1004", "1012" };
+    for (int i = 0; i < 2; ++i)
+    {
+        stringstream aux;
+        aux << "$PASHS,RT3," << messages[i] << "," << port;
+        if (period > 0)
+            aux << ",ON," << period;
+        else
+            aux << ",OFF";
+        write(aux.str() + "\r\n", 1000);
+        if (!verifyAcknowledge(string("RAW DATA ") + messages[i]))
+            return false;
+    }
+    m_configuration.rawPort   = port;
+    m_configuration.rawPeriod = period;
+    return true;
+}
+
+bool MB500::setMovingBase(bool enable)
+{
+    if (enable) write("$PASHS,CPD,MOV,ON\r\n", 1000);
+    else write("$PASHS,CPD,MOV,OFF\r\n", 1000);
+    if (!verifyAcknowledge(enable ? "MOVING BASE ON" : "MOVING BASE OFF"))
+        return false;
+    m_configuration.movingBase = enable;
+    return true;
+}
+
+bool MB500::setHeadingOutput(double period)
+{
+    string port = getPortName(PORT_DATA);
+    return checkPortName(port) && setHeadingOutput(port, period);
+}
+
+bool MB500::setHeadingOutput(std::string const& port, double period)
+{
+    if (!setNMEA("VEC", port, period > 0, period) ||
+            !setNMEA("HDT", port, period > 0, period))
+        return false;
+    m_configuration.headingPort   = port;
+    m_configuration.headingPeriod = period;
+    return true;
+}
+
+bool MB500::setEventMarker(bool enable, bool rising_edge)
+{
+    string port = getPortName(PORT_DATA);
+    return checkPortName(port) && setEventMarker(port, enable, rising_edge);
+}
+
+bool MB500::setEventMarker(std::string const& port, bool enable, bool rising_edge)
+{
+    if (enable)
+    {
+        if (rising_edge) write("$PASHS,PHE,R\r\n", 1000);
+        else write("$PASHS,PHE,F\r\n", 1000);
+        if (!verifyAcknowledge("EVENT MARKER EDGE"))
+            return false;
+    }
+    // TTT is sent on each event, it has no output rate
+    write("$PASHS,NME,TTT," + port + (enable ? ",ON\r\n" : ",OFF\r\n"), 1000);
+    if (!verifyAcknowledge(enable ? "EVENT MARKER ON" : "EVENT MARKER OFF"))
+        return false;
+    m_configuration.markerPort       = port;
+    m_configuration.markerEnabled    = enable;
+    m_configuration.markerRisingEdge = rising_edge;
+    return true;
+}
+
+MarkerEventQueue& MB500::getMarkerEvents()
+{
+    return m_marker_events;
+}
+
+// Events are delivered without waiting for the next epoch beyond that,
+// e.g. when the solutions stopped
+static const size_t MAX_PENDING_MARKER_EVENTS = 64;
+
+void MB500::matchMarkerEvents(bool flush)
+{
+    while (!m_pending_events.empty())
+    {
+        MarkerEvent& event = m_pending_events.front();
+        // Wait for the epoch after the event, so that the position gets
+        // interpolated rather than extrapolated
+        if (!flush && event.time > position.time &&
+                m_pending_events.size() <= MAX_PENDING_MARKER_EVENTS)
+            break;
+
+        event.sequence = m_marker_event_count++;
+        event.hostTime = getHostTime(event.time);
+        event.hasPosition = !event.hostTime.isNull() &&
+            m_predictor.predict(event.hostTime, event.position);
+        m_marker_events.push(event);
+        m_pending_events.pop_front();
+    }
+}
+
+bool MB500::setRTKInputPort()
+{
+    string port = getPortName(PORT_CORRECTIONS);
+    return checkPortName(port) && setRTKInputPort(port);
+}
+
+bool MB500::setRTKInputPort(string const& port_name)
+{
+    stringstream aux;
+    aux << "$PASHS,DIF,PRT," << port_name << ",RT3\r\n";
+    write(aux.str(), 1000);
+    if (!verifyAcknowledge("RTK INPUT PORT"))
+        return false;
+    m_configuration.rtkInputPort = port_name;
+    return true;
+}
+
+bool MB500::extractBufferedPacket(string_ref& packet)
+{
+    return extractBufferedPacket(m_command_buffer, packet);
+}
+
+bool MB500::extractBufferedPacket(ReadBuffer& buffer, string_ref& packet)
 {
-    int old_acq = m_acq_timeout;
-    m_acq_timeout = 200;
-    base::Time reset_start = base::Time::now();
-    while((base::Time::now() - reset_start).toSeconds() < 10)
+    // Release the packet returned by the last call
+    buffer.start += buffer.packetSize;
+    buffer.packetSize = 0;
+
+    // Frame the packet directly in the read buffer, it is handed out
+    // as-is to the caller
+    while (buffer.start < buffer.end)
     {
-        try
+        int packet_size = extractPacket(
+                reinterpret_cast<uint8_t const*>(&buffer.data[buffer.start]),
+                buffer.end - buffer.start);
+        if (packet_size > 0)
         {
-            read(m_acq_timeout);
-            m_acq_timeout = old_acq;
+            buffer.packetSize = packet_size;
+            packet = string_ref(&buffer.data[buffer.start], packet_size);
+            m_read_time = buffer.readTime;
+            ++buffer.statistics.packets;
             return true;
         }
-        catch(iodrivers_base::TimeoutError) {}
+        else if (packet_size < 0)
+        {
+            countDroppedPacket(buffer.statistics, &buffer.data[buffer.start], -packet_size);
+            buffer.start += -packet_size;
+        }
+        else break;
+    }
+
+    // Make room for more data, which is only needed when we reached
+    // the end of the buffer
+    if (buffer.start == buffer.end)
+        buffer.start = buffer.end = 0;
+    else if (buffer.end == buffer.data.size())
+    {
+        if (buffer.start == 0) // packet larger than the buffer, drop it
+        {
+            buffer.statistics.bytesDropped += buffer.end;
+            ++buffer.statistics.truncatedPackets;
+            buffer.end = 0;
+        }
+        else
+        {
+            memmove(&buffer.data[0], &buffer.data[buffer.start], buffer.end - buffer.start);
+            buffer.end  -= buffer.start;
+            buffer.start = 0;
+        }
     }
-    m_acq_timeout = old_acq;
     return false;
 }
 
-std::string MB500::getBoardID()
+void MB500::countDroppedPacket(LinkStatistics& statistics, char const* data, size_t size)
 {
-    write("$PASHQ,RID\r\n", 1000);
-    std::string reply;
-    do {
-        reply = read(m_acq_timeout);
-        std::cerr << "replied " << reply << std::endl;
+    statistics.bytesDropped += size;
+    if (static_cast<uint8_t>(data[0]) == 0xD3)
+        ++statistics.checksumFailures;
+    else if (data[0] == '$')
+    {
+        // extractPacket() rejects complete sentences only because of
+        // their checksum
+        if (size >= 6 && data[size - 1] == '\n' && data[size - 5] == '*')
+            ++statistics.checksumFailures;
+        else
+            ++statistics.truncatedPackets;
     }
-    while(reply.find("$PASHR,RID") != 0);
+}
 
-    vector<string> fields;
-    split( fields, reply, is_any_of(",*") );
-    return fields[1];
+uint64_t MB500::getDroppedPacketCount() const
+{
+    LinkStatistics const& command = m_command_buffer.statistics;
+    LinkStatistics const& data    = m_data_buffer.statistics;
+    return command.truncatedPackets + command.checksumFailures +
+        data.truncatedPackets + data.checksumFailures;
 }
 
-bool MB500::openRover(std::string const& device_name)
+LinkStatistics const& MB500::getLinkStatistics(PORT_ROLE role) const
 {
-    if (!open(device_name))
-        return false;
+    if (role == PORT_DATA && m_port_fds[PORT_DATA] != -1)
+        return m_data_buffer.statistics;
+    return m_command_buffer.statistics;
+}
 
-    return setReceiverDynamics(MB500_ADAPTIVE);
+StreamStatistics const& MB500::getStreamStatistics() const
+{
+    return m_stream_statistics;
 }
 
-bool MB500::setUserDynamics(int h_vel, int h_acc, int v_vec, int v_acc)
+int MB500::readDevice()
 {
-    write("$PASHS,UDP," +
-	    boost::lexical_cast<string>(h_vel) + "," +
-	    boost::lexical_cast<string>(h_acc) + "," +
-	    boost::lexical_cast<string>(v_vec) + "," +
-	    boost::lexical_cast<string>(v_acc) + "\r\n", 1000);
-    return verifyAcknowledge("USER DYNAMICS");
+    return readDevice(getFileDescriptor(), m_command_buffer);
 }
 
-void MB500::reset(bool cold_start)
+int MB500::readDevice(int fd, ReadBuffer& buffer)
 {
-    if (cold_start)
-        write("$PASHS,INI,9,9,1\r\n", 1000);
+    int rd = ::read(fd, &buffer.data[buffer.end], buffer.data.size() - buffer.end);
+    if (rd > 0)
+    {
+        buffer.readTime = getMonotonicTime();
+        m_last_reception = buffer.readTime;
+        buffer.end += rd;
+        buffer.statistics.bytesReceived += rd;
+        return rd;
+    }
+    else if (rd == 0)
+        return -2;
+    else if (errno == EAGAIN || errno == EINTR)
+        return 0;
     else
-        write("$PASHS,INI,9,9,5\r\n", 1000);
+        return -1;
+}
 
-    waitForBoardReset();
-    stopPeriodicData();
+MB500::READ_STATUS MB500::tryRead(string_ref& packet, int timeout, int packet_timeout)
+{
+    return tryRead(getFileDescriptor(), m_command_buffer, packet, timeout, packet_timeout);
 }
 
-bool MB500::stopPeriodicData()
+MB500::READ_STATUS MB500::tryReadData(string_ref& packet, int timeout, int packet_timeout)
 {
-    if(! setNMEALL("A", false)) return false;
-    if(! setNMEALL("B", false)) return false;
-    if(! setNMEALL("C", false)) return false;
-    return true;
+    if (m_port_fds[PORT_DATA] == -1)
+        return tryRead(packet, timeout, packet_timeout);
+    return tryRead(m_port_fds[PORT_DATA], m_data_buffer, packet, timeout, packet_timeout);
 }
 
-void MB500::close()
+MB500::READ_STATUS MB500::tryRead(int fd, ReadBuffer& buffer, string_ref& packet, int timeout, int packet_timeout)
 {
-    iodrivers_base::Driver::close();
+    packet = string_ref();
+    if (timeout > packet_timeout)
+        packet_timeout = timeout;
+
+    // Waiting on the command device in split mode, don't let the data
+    // device overflow meanwhile
+    bool drain_data = (&buffer == &m_command_buffer && m_port_fds[PORT_DATA] != -1);
+
+    base::Time start_time = base::Time::now();
+    bool read_something = false;
+    while(true)
+    {
+        if (extractBufferedPacket(buffer, packet))
+            return READ_PACKET;
+
+        int elapsed   = (base::Time::now() - start_time).toMilliseconds();
+        int remaining = (read_something ? packet_timeout : timeout) - elapsed;
+        pollfd poll_fds[2] = { { fd, POLLIN, 0 }, { m_port_fds[PORT_DATA], POLLIN, 0 } };
+        int ret = poll(poll_fds, drain_data ? 2 : 1, remaining > 0 ? remaining : 0);
+        if (ret < 0)
+        {
+            if (errno != EINTR)
+                throw iodrivers_base::UnixError("dgps/mb500: error waiting for data");
+            continue;
+        }
+        else if (ret == 0)
+            return read_something ? READ_PACKET_TIMEOUT : READ_FIRST_BYTE_TIMEOUT;
+
+        if (drain_data && poll_fds[1].revents)
+            drainDataDevice();
+        if (!poll_fds[0].revents)
+            continue;
+
+        int rd = readDevice(fd, buffer);
+        if (rd == -2)
+            throw iodrivers_base::UnixError("dgps/mb500: end of file on the board's device");
+        else if (rd == -1)
+            throw iodrivers_base::UnixError("dgps/mb500: error reading from the board");
+        else if (rd > 0)
+            read_something = true;
+    }
 }
 
-bool MB500::setRTKInputPort(string const& port_name)
+void MB500::drainDataDevice()
 {
-    stringstream aux;
-    aux << "$PASHS,DIF,PRT," << port_name << ",RT3\r\n";
-    write(aux.str(), 1000);
-    return verifyAcknowledge("RTK INPUT PORT");
+    while (true)
+    {
+        string_ref packet;
+        while (extractBufferedPacket(m_data_buffer, packet))
+            interpretPeriodicData(packet);
+
+        int rd = readDevice(m_port_fds[PORT_DATA], m_data_buffer);
+        if (rd == 0)
+            return;
+        else if (rd == -2)
+            throw iodrivers_base::UnixError("dgps/mb500: end of file on the board's data device");
+        else if (rd == -1)
+            throw iodrivers_base::UnixError("dgps/mb500: error reading from the board's data device");
+    }
 }
 
-string MB500::read(int timeout)
+string_ref MB500::read(int timeout, int packet_timeout)
 {
-    char buffer[MAX_PACKET_SIZE];
-    size_t packet_size = readPacket(reinterpret_cast<uint8_t *>( buffer), MAX_PACKET_SIZE, 5000, timeout);
-    return string(buffer, packet_size);
+    string_ref packet;
+    switch(tryRead(packet, timeout, packet_timeout))
+    {
+        case READ_PACKET_TIMEOUT:
+            throw iodrivers_base::TimeoutError(iodrivers_base::TimeoutError::PACKET, "dgps/mb500: timeout while reading a packet");
+        case READ_FIRST_BYTE_TIMEOUT:
+            throw iodrivers_base::TimeoutError(iodrivers_base::TimeoutError::FIRST_BYTE, "dgps/mb500: timeout while waiting for data");
+        default:
+            return packet;
+    }
 }
 
 bool MB500::setProcessingRate(int rate)
@@ -201,6 +1138,7 @@ bool MB500::setProcessingRate(int rate)
     m_acq_timeout = 5000;
     if (verifyAcknowledge("PROCESSING_RATE"))
     {
+        m_configuration.processingRate = rate;
         m_acq_timeout = 2000 / rate;
         if (m_acq_timeout < 500)
             m_acq_timeout = 500;
@@ -227,15 +1165,45 @@ void MB500::dumpStatus()
 }
 void MB500::dumpAlmanac()
 {
+    vector<string> almanac;
+    if (!getAlmanac(almanac))
+        throw std::runtime_error("no reply in dumpAlmanac");
+    for (size_t i = 0; i < almanac.size(); ++i)
+        cout << almanac[i] << endl;
+}
+
+// Time to wait for the first $PASHR,ALM sentence, and for each of the
+// following ones, in milliseconds
+static const int ALMANAC_FIRST_TIMEOUT = 10000;
+static const int ALMANAC_NEXT_TIMEOUT  = 1000;
+
+bool MB500::getAlmanac(std::vector<std::string>& sentences)
+{
+    sentences.clear();
     write("$PASHQ,ALM\r\n", 1000);
+
+    // The board sends one sentence per satellite, without any end marker
+    base::Time deadline = base::Time::now() + base::Time::fromMilliseconds(ALMANAC_FIRST_TIMEOUT);
     while(true)
     {
-        string msg = read(10000);
-        if (msg.find("ALM") != string::npos)
-            cout << msg << endl;
+        base::Time now = base::Time::now();
+        if (now >= deadline)
+            break;
+
+        string_ref msg;
+        if (tryRead(msg, (deadline - now).toMilliseconds()) != READ_PACKET)
+            break;
+
+        if (msg.starts_with("$PASHR,ALM,"))
+        {
+            size_t end = msg.find_last_not_of("\r\n");
+            sentences.push_back(string(msg.begin(), msg.begin() + end + 1));
+            deadline = base::Time::now() + base::Time::fromMilliseconds(ALMANAC_NEXT_TIMEOUT);
+        }
         else
-            throw std::runtime_error("wrong reply in dumpAlmanac");
+            interpretPeriodicData(msg);
     }
+    return !sentences.empty();
 }
 
 void MB500::dumpSatellites()
@@ -251,6 +1219,12 @@ void MB500::dumpSatellites()
 
 void MB500::writeCorrectionData(char const* data, size_t size, int timeout)
 {
+    if (m_port_fds[PORT_CORRECTIONS] != -1)
+    {
+        write(m_port_fds[PORT_CORRECTIONS], string(data, size), timeout);
+        return;
+    }
+
     try {
         iodrivers_base::Driver::writePacket(reinterpret_cast <uint8_t const*>(data), size, timeout);
     }
@@ -258,8 +1232,161 @@ void MB500::writeCorrectionData(char const* data, size_t size, int timeout)
     { throw std::runtime_error("dgps/mb500: error writing correction data"); }
 }
 
+void MB500::queueCorrectionData(char const* data, size_t size)
+{
+    // Frames may be split between calls, resume from the incomplete one
+    m_correction_partial.append(data, size);
+    uint8_t const* buffer = reinterpret_cast<uint8_t const*>(m_correction_partial.data());
+    size_t buffer_size = m_correction_partial.size();
+
+    size_t start = 0;
+    while (start < buffer_size)
+    {
+        int frame_size = RawObservationDecoder::extractFrame(buffer + start, buffer_size - start);
+        if (frame_size > 0)
+        {
+            pushCorrectionFrame(m_correction_partial.data() + start, frame_size);
+            start += frame_size;
+        }
+        else if (frame_size == 0)
+            break;
+        else
+        {
+            size_t next = start + 1;
+            while (next < buffer_size && buffer[next] != 0xD3)
+                ++next;
+            m_correction_status.invalidBytes += next - start;
+            start = next;
+        }
+    }
+    m_correction_partial.erase(0, start);
+}
+
+void MB500::pushCorrectionFrame(char const* frame, size_t size)
+{
+    CorrectionQueueStatus& status = m_correction_status;
+
+    // Make room by dropping the oldest frames, but not one that has
+    // started to be written: the board would get a truncated frame
+    size_t first_droppable = (m_correction_written > 0) ? 1 : 0;
+    while (status.queuedBytes + size > m_correction_queue_size &&
+            m_correction_queue.size() > first_droppable)
+    {
+        std::deque<string>::iterator oldest = m_correction_queue.begin() + first_droppable;
+        ++status.droppedFrames;
+        status.droppedBytes += oldest->size();
+        status.queuedBytes  -= oldest->size();
+        m_correction_queue.erase(oldest);
+    }
+
+    if (status.queuedBytes + size > m_correction_queue_size)
+    {
+        ++status.droppedFrames;
+        status.droppedBytes += size;
+    }
+    else
+    {
+        m_correction_queue.push_back(string(frame, size));
+        status.queuedBytes += size;
+        if (status.queuedBytes > status.maxQueuedBytes)
+            status.maxQueuedBytes = status.queuedBytes;
+    }
+    status.queuedFrames = m_correction_queue.size();
+}
+
+/** Number of frames given to one writev() call */
+static const int MAX_CORRECTION_WRITE = 16;
+
+bool MB500::writeCorrectionQueue()
+{
+    int fd = getPortFileDescriptor(PORT_CORRECTIONS);
+    // Corrections and commands must not interleave on the command
+    // device. A pending command goes first: only finish the frame that
+    // is being written
+    bool finish_only = (fd == getFileDescriptor() && hasPendingOutput());
+    int max_frames = MAX_CORRECTION_WRITE;
+    if (finish_only)
+        max_frames = (m_correction_written > 0) ? 1 : 0;
+
+    CorrectionQueueStatus& status = m_correction_status;
+    while (!m_correction_queue.empty() && max_frames > 0)
+    {
+        iovec iov[MAX_CORRECTION_WRITE];
+        int count = 0;
+        for (std::deque<string>::const_iterator it = m_correction_queue.begin();
+                it != m_correction_queue.end() && count < max_frames; ++it, ++count)
+        {
+            size_t offset = (count == 0) ? m_correction_written : 0;
+            iov[count].iov_base = const_cast<char*>(it->data() + offset);
+            iov[count].iov_len  = it->size() - offset;
+        }
+
+        ssize_t wr = ::writev(fd, iov, count);
+        if (wr < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN)
+                break;
+            m_process_error = errno;
+            return false;
+        }
+
+        status.writtenBytes += wr;
+        status.queuedBytes  -= wr;
+        size_t remaining = wr;
+        while (remaining > 0)
+        {
+            size_t frame_rest = m_correction_queue.front().size() - m_correction_written;
+            if (remaining < frame_rest)
+            {
+                m_correction_written += remaining;
+                break;
+            }
+            remaining -= frame_rest;
+            m_correction_queue.pop_front();
+            m_correction_written = 0;
+            ++status.writtenFrames;
+            if (finish_only)
+                max_frames = 0;
+        }
+    }
+    status.queuedFrames = m_correction_queue.size();
+    return true;
+}
+
+void MB500::finishCorrectionFrame(int timeout)
+{
+    string rest = m_correction_queue.front().substr(m_correction_written);
+    m_correction_queue.pop_front();
+    m_correction_written = 0;
+    m_correction_status.queuedBytes -= rest.size();
+    m_correction_status.queuedFrames = m_correction_queue.size();
+    m_correction_status.writtenBytes += rest.size();
+    ++m_correction_status.writtenFrames;
+    write(getPortFileDescriptor(PORT_CORRECTIONS), rest, timeout);
+}
+
+bool MB500::hasPendingCorrections() const
+{
+    return !m_correction_queue.empty();
+}
+
+void MB500::setCorrectionQueueSize(size_t size)
+{
+    m_correction_queue_size = size;
+}
+
+MB500::CorrectionQueueStatus const& MB500::getCorrectionQueueStatus() const
+{
+    return m_correction_status;
+}
+
 void MB500::write(const string& command, int timeout)
 {
+    if (m_correction_written > 0 && getPortFileDescriptor(PORT_CORRECTIONS) == getFileDescriptor())
+        finishCorrectionFrame(timeout);
+
     size_t cmd_size = command.length();
     try {
         iodrivers_base::Driver::writePacket(reinterpret_cast <uint8_t const*>(command.c_str()), cmd_size, timeout);
@@ -269,8 +1396,53 @@ void MB500::write(const string& command, int timeout)
 }
 
 
+void MB500::write(int fd, std::string const& command, int timeout)
+{
+    if (fd == getFileDescriptor())
+        return write(command, timeout);
+    if (m_correction_written > 0 && fd == m_port_fds[PORT_CORRECTIONS])
+        finishCorrectionFrame(timeout);
+
+    base::Time deadline = base::Time::now() + base::Time::fromMilliseconds(timeout);
+    size_t written = 0;
+    while (written < command.size())
+    {
+        int wr = ::write(fd, command.data() + written, command.size() - written);
+        if (wr > 0)
+        {
+            written += wr;
+            continue;
+        }
+        else if (wr == -1 && errno != EAGAIN && errno != EINTR)
+            throw std::runtime_error("dgps/mb500: error writing to the board");
+
+        int remaining = (deadline - base::Time::now()).toMilliseconds();
+        if (remaining <= 0)
+            throw std::runtime_error("dgps/mb500: timeout writing to the board");
+        pollfd poll_fd = { fd, POLLOUT, 0 };
+        poll(&poll_fd, 1, remaining);
+    }
+}
+
+static int hexValue(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
 int MB500::extractPacket(uint8_t const* buffer, size_t buffer_size) const {
-    if(buffer[0] == '$')
+    if(buffer[0] == 0xD3)
+    {
+        int size = RawObservationDecoder::extractFrame(buffer, buffer_size);
+        if (size >= 0)
+            return size;
+    }
+    else if(buffer[0] == '$')
     {
         for(size_t i = 1; i < buffer_size; ++i)
         {
@@ -285,10 +1457,15 @@ int MB500::extractPacket(uint8_t const* buffer, size_t buffer_size) const {
                 else if (buffer[i - 4] != '*')
                     return -(i + 1);
 
-                // TODO: verify the checksum
+                uint8_t checksum = 0;
+                for (size_t j = 1; j < i - 4; ++j)
+                    checksum ^= buffer[j];
+                int high = hexValue(buffer[i - 3]), low = hexValue(buffer[i - 2]);
+                if (high < 0 || low < 0 || checksum != high * 16 + low)
+                    return -(i + 1);
                 return i + 1;
             }
-            else if (buffer[i] == '$')
+            else if (buffer[i] == '$' || buffer[i] == 0xD3)
             {
                 // there seem to be a truncated packet, drop it
                 return -i;
@@ -300,7 +1477,7 @@ int MB500::extractPacket(uint8_t const* buffer, size_t buffer_size) const {
 
     for(size_t i = 1; i < buffer_size; ++i)
     {
-        if( buffer[i] == '$') return -i;
+        if( buffer[i] == '$' || buffer[i] == 0xD3) return -i;
     }
     return -buffer_size;
 }
@@ -309,7 +1486,10 @@ bool MB500::setFastRTK(bool setting)
 {
     if(setting) write("$PASHS,CPD,FST,ON\r\n", 1000);
     else write("$PASHS,CPD,FST,OFF\r\n", 1000);
-    return verifyAcknowledge();
+    if (!verifyAcknowledge())
+        return false;
+    m_configuration.fastRTK = setting;
+    return true;
 }
 
 int setRTKBaseRTCM2(std::ostream& io, string const& port_name)
@@ -337,6 +1517,12 @@ int setRTKBaseATOM(std::ostream& io, string const& port_name)
     return 4;
 }
 
+bool MB500::setRTKBase()
+{
+    string port = getPortName(PORT_CORRECTIONS);
+    return checkPortName(port) && setRTKBase(port);
+}
+
 bool MB500::setRTKBase(string port_name)
 {
     stringstream aux;
@@ -347,11 +1533,13 @@ bool MB500::setRTKBase(string port_name)
         if (!  verifyAcknowledge())
             return false;
     }
+    m_configuration.rtkBasePort = port_name;
     return true;
 }
 
 void MB500::stopRTKBase()
 {
+    m_configuration.rtkBasePort.clear();
     write("$PASHS,RT2,ALL,A,OFF\r\n", 1000);
     verifyAcknowledge("RT2,A,OFF");
     write("$PASHS,RT2,ALL,B,OFF\r\n", 1000);
@@ -389,26 +1577,28 @@ bool MB500::setReceiverDynamics(MB500_DYNAMICS_MODEL setting)
     stringstream aux;
     aux << setting;
     write("$PASHS,DYN," + aux.str() + "\r\n", 1000);
-    return verifyAcknowledge("RECEIVER DYNAMICS " + setting);
+    if (!verifyAcknowledge("RECEIVER DYNAMICS " + aux.str()))
+        return false;
+    m_configuration.dynamics = setting;
+    return true;
 }
 
 bool MB500::resetStoredPosition()
 {
     write("$PASHS,POS,MOV\r\n", 1000);
-    return verifyAcknowledge("RESET STORED POSITION");
+    if (!verifyAcknowledge("RESET STORED POSITION"))
+        return false;
+    m_configuration.hasBasePosition = false;
+    return true;
 }
 
 bool MB500::setPositionFromCurrent()
 {
     write("$PASHS,POS,CUR\r\n", 1000);
-    return verifyAcknowledge("SET POSITION FROM CURRENT");
-}
-
-static double deg2magellan(double value)
-{
-    double deg     = static_cast<int>(value);
-    double decimal = value - deg;
-    return deg * 100 + decimal * 60;
+    if (!verifyAcknowledge("SET POSITION FROM CURRENT"))
+        return false;
+    m_configuration.hasBasePosition = false;
+    return true;
 }
 
 bool MB500::setPosition(double latitude, double longitude, double height)
@@ -420,13 +1610,20 @@ bool MB500::setPosition(double latitude, double longitude, double height)
 	<< setprecision(4) << fixed << height
 	<< "\r\n";
     write(aux.str(), 1000);
-    return verifyAcknowledge("SET CURRENT POSITION");
+    if (!verifyAcknowledge("SET CURRENT POSITION"))
+        return false;
+    m_configuration.hasBasePosition = true;
+    m_configuration.basePosition[0] = latitude;
+    m_configuration.basePosition[1] = longitude;
+    m_configuration.basePosition[2] = height;
+    return true;
 }
 
 bool MB500::setKnownPointInit(double latitude, string NorS, double longitude, string EorW, double height, double accLat, double accLon, double accAlt, string posAttribute)
 {
     stringstream aux;
-    aux << latitude << "," << NorS << "," << longitude << "," << EorW << "," << height << "," << accLat << "," << accLon << "," << accAlt << "," << posAttribute;
+    aux << setprecision(7) << fixed << latitude << "," << NorS << "," << longitude << "," << EorW << ","
+        << setprecision(4) << height << "," << accLat << "," << accLon << "," << accAlt << "," << posAttribute;
     write("$PASHS,KPI," + aux.str() + "\r\n", 1000);
     return verifyAcknowledge("SET INITIAL POSITION");
 }
@@ -471,72 +1668,335 @@ bool MB500::setCodeMeasurementSmoothing(int d1, int d2, int d3)
         write("$PASHS,SMI," + aux.str() + "\r\n", 1000);
     }
 
-    else if(d1 >= 0 && d1 <= 100 && d2 == NONE && d3 >= 0 && d3 <= 3600) {
-        aux << d1 << ",," << d3;
-        write("$PASHS,SMI," + aux.str() + "\r\n", 1000);
-    }
+    else if(d1 >= 0 && d1 <= 100 && d2 == NONE && d3 >= 0 && d3 <= 3600) {
+        aux << d1 << ",," << d3;
+        write("$PASHS,SMI," + aux.str() + "\r\n", 1000);
+    }
+
+    else if(d1 == NONE && d2 == NONE && d3 >= 0 && d3 <= 3600) {
+        aux << ",," << d3;
+        write("$PASHS,SMI," + aux.str() + "\r\n", 1000);
+    }
+    else {
+        cerr<<"Arguments invalid"<<endl;
+        return false;
+    }
+
+    return verifyAcknowledge("CODE SMOOTHING");
+}
+
+string MB500::formatNMEA(string const& command, string const& port, bool onOff, double outputRate, string& description)
+{
+    string rate;
+    if (fabs(outputRate - 0.1) < 0.01)
+        rate = "0.1";
+    else if (fabs(outputRate - 0.2) < 0.01)
+        rate = "0.2";
+    else if (fabs(outputRate - 0.5) < 0.01)
+        rate = "0.5";
+    else
+        rate = boost::lexical_cast<string>(static_cast<int>(outputRate));
+
+    description = "NMEA OUTPUT " + command + " " + (onOff ? "ON" : "OFF") + " " + rate;
+    return "$PASHS,NME," + command + "," + port + (onOff ? ",ON," : ",OFF,") + rate + "\r\n";
+}
+
+bool MB500::setNMEA(string command, string port, bool onOff, double outputRate)
+{
+    string description;
+    write(formatNMEA(command, port, onOff, outputRate, description), 1000);
+    return verifyAcknowledge(description);
+}
+
+bool MB500::setFixThreshold(MB500_AMBIGUITY_THRESHOLD threshold)
+{
+    std::string value;
+    switch(threshold)
+    {
+        case MB500_NO_FIX: value = "0"; break;
+        case MB500_FIX_95_0: value = "95.0"; break;
+        case MB500_FIX_99_0: value = "99.0"; break;
+        case MB500_FIX_99_9: value = "99.9"; break;
+    };
+    write("$PASHS,CPD,AFP," + value + "\r\n", 1000);
+    if (!verifyAcknowledge("FIX THRESHOLD " + value))
+        return false;
+    m_configuration.fixThreshold = threshold;
+    return true;
+}
+
+vector< pair<string, double> > MB500::getPeriodicSentences(double period, MB500_OUTPUT_PROFILE profile)
+{
+    int stats_period = period;
+    if (stats_period < 5)
+	stats_period = 5;
+
+    vector< pair<string, double> > sentences;
+    if (profile == MB500_POS_OUTPUT)
+    {
+        // POS carries the position, DOPs and time of the solution in one
+        // sentence. The errors and latency change slowly, so get them at
+        // the statistics rate.
+        sentences.push_back(make_pair("POS", period));
+        sentences.push_back(make_pair("GST", double(stats_period)));
+        sentences.push_back(make_pair("LTN", double(stats_period)));
+    }
+    else
+    {
+        sentences.push_back(make_pair("GGA", period));
+        sentences.push_back(make_pair("GST", period));
+        sentences.push_back(make_pair("ZDA", period));
+        sentences.push_back(make_pair("VTG", period));
+        sentences.push_back(make_pair("LTN", period));
+    }
+    sentences.push_back(make_pair("GSA", double(stats_period)));
+    sentences.push_back(make_pair("GSV", double(stats_period)));
+    return sentences;
+}
+
+bool MB500::setPeriodicData(double period, MB500_OUTPUT_PROFILE profile)
+{
+    string port = getPortName(PORT_DATA);
+    return checkPortName(port) && setPeriodicData(port, period, profile);
+}
+
+bool MB500::setPeriodicData(std::string const& port, double period, MB500_OUTPUT_PROFILE profile)
+{
+    m_period = period * 1000;
+    m_output_profile = profile;
+
+    vector< pair<string, double> > sentences = getPeriodicSentences(period, profile);
+    for (size_t i = 0; i < sentences.size(); ++i)
+    {
+        if(! setNMEA(sentences[i].first, port, true, sentences[i].second)) return 0;
+    }
+    applyPeriodicSettings(port, period, profile);
+    return 1;
+}
+
+void MB500::applyPeriodicSettings(std::string const& port, double period, MB500_OUTPUT_PROFILE profile)
+{
+    m_period = period * 1000;
+    m_output_profile = profile;
+    m_configuration.periodicPort    = port;
+    m_configuration.periodicPeriod  = period;
+    m_configuration.periodicProfile = profile;
+    m_last_solution_reception = getMonotonicTime();
+}
+
+int MB500::queueCommand(std::string const& command, std::string const& description)
+{
+    int operation = ++m_last_operation;
+    pushCommand(operation, command, description);
+    return operation;
+}
+
+int MB500::queueNMEA(std::string const& command, std::string const& port, bool onOff, double outputRate)
+{
+    string description;
+    string nmea = formatNMEA(command, port, onOff, outputRate, description);
+    return queueCommand(nmea, description);
+}
+
+int MB500::queuePeriodicData(std::string const& port, double period, MB500_OUTPUT_PROFILE profile)
+{
+    int operation = ++m_last_operation;
+    vector< pair<string, double> > sentences = getPeriodicSentences(period, profile);
+    for (size_t i = 0; i < sentences.size(); ++i)
+    {
+        string description;
+        string nmea = formatNMEA(sentences[i].first, port, true, sentences[i].second, description);
+        pushCommand(operation, nmea, description);
+    }
+
+    QueuedCommand& last = m_command_queue.back();
+    last.periodic        = true;
+    last.periodicPort    = port;
+    last.periodicPeriod  = period;
+    last.periodicProfile = profile;
+    return operation;
+}
+
+void MB500::pushCommand(int operation, std::string const& command, std::string const& description)
+{
+    QueuedCommand queued;
+    queued.operation   = operation;
+    queued.command     = command;
+    queued.description = description;
+    m_command_queue.push_back(queued);
+}
+
+bool MB500::hasPendingCommands() const
+{
+    return !m_command_queue.empty();
+}
 
-    else if(d1 == NONE && d2 == NONE && d3 >= 0 && d3 <= 3600) {
-        aux << ",," << d3;
-        write("$PASHS,SMI," + aux.str() + "\r\n", 1000);
-    }
-    else {
-        cerr<<"Arguments invalid"<<endl;
+bool MB500::hasPendingOutput() const
+{
+    return !m_command_queue.empty() && m_command_deadline.isNull();
+}
+
+bool MB500::popCommandResult(CommandResult& result)
+{
+    if (m_command_results.empty())
         return false;
-    }
+    result = m_command_results.front();
+    m_command_results.pop_front();
+    return true;
+}
 
-    return verifyAcknowledge("CODE SMOOTHING");
+int MB500::getNextTimeout() const
+{
+    if (m_command_deadline.isNull())
+        return -1;
+    int64_t remaining = (m_command_deadline - base::Time::now()).toMicroseconds();
+    if (remaining <= 0)
+        return 0;
+    // Round up, so that the command has timed out when the caller wakes up
+    return (remaining + 999) / 1000;
 }
 
-bool MB500::setNMEA(string command, string port, bool onOff, double outputRate)
+int MB500::getProcessError() const
 {
-    stringstream aux;
+    return m_process_error;
+}
 
-    string rate;
-    if (fabs(outputRate - 0.1) < 0.01)
-        rate = "0.1";
-    else if (fabs(outputRate - 0.2) < 0.01)
-        rate = "0.2";
-    else if (fabs(outputRate - 0.5) < 0.01)
-        rate = "0.5";
-    else
-        rate = boost::lexical_cast<string>(static_cast<int>(outputRate));
+bool MB500::writeQueuedCommand()
+{
+    if (m_command_queue.empty() || !m_command_deadline.isNull())
+        return true;
+    // Wait for the correction frame being written on the same device
+    if (m_command_written == 0 && m_correction_written > 0 &&
+            getPortFileDescriptor(PORT_CORRECTIONS) == getFileDescriptor())
+        return true;
 
-    if(onOff) 	aux << command << "," << port << ",ON," << rate;
-    else 	aux << command << "," << port << ",OFF," << rate;
-    write("$PASHS,NME," + aux.str() + "\r\n", 1000);
-    return verifyAcknowledge("NMEA OUTPUT " + command + " " + (onOff ? "ON" : "OFF") + " " + rate);
+    string const& command = m_command_queue.front().command;
+    while (m_command_written < command.size())
+    {
+        int wr = ::write(getFileDescriptor(), command.data() + m_command_written, command.size() - m_command_written);
+        if (wr < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN)
+                return true;
+            m_process_error = errno;
+            return false;
+        }
+        m_command_written += wr;
+    }
+    m_command_deadline = base::Time::now() + base::Time::fromMilliseconds(m_acq_timeout);
+    return true;
 }
 
-bool MB500::setFixThreshold(MB500_AMBIGUITY_THRESHOLD threshold)
+void MB500::completeCommand(COMMAND_STATUS status)
 {
-    std::string value;
-    switch(threshold)
+    QueuedCommand command = m_command_queue.front();
+    m_command_queue.pop_front();
+    m_command_written  = 0;
+    m_command_deadline = base::Time();
+
+    if (status == COMMAND_REJECTED)
+        cerr << "dgps/mb500: command " << command.description << " not acknowledged" << endl;
+    else if (status == COMMAND_TIMED_OUT)
+        cerr << "dgps/mb500: command " << command.description << " timed out waiting for acknowledgement" << endl;
+
+    // A failure aborts the rest of the operation
+    if (status != COMMAND_ACKNOWLEDGED)
     {
-        case MB500_NO_FIX: value = "0"; break;
-        case MB500_FIX_95_0: value = "95.0"; break;
-        case MB500_FIX_99_0: value = "99.0"; break;
-        case MB500_FIX_99_9: value = "99.9"; break;
-    };
-    write("$PASHS,CPD,AFP," + value + "\r\n", 1000);
-    return verifyAcknowledge("FIX THRESHOLD " + value);
+        while (!m_command_queue.empty() && m_command_queue.front().operation == command.operation)
+            m_command_queue.pop_front();
+    }
+    else if (!m_command_queue.empty() && m_command_queue.front().operation == command.operation)
+        return;
+    else if (command.periodic)
+        applyPeriodicSettings(command.periodicPort, command.periodicPeriod, command.periodicProfile);
+
+    CommandResult result;
+    result.operation   = command.operation;
+    result.status      = status;
+    result.description = command.description;
+    m_command_results.push_back(result);
 }
 
-bool MB500::setPeriodicData(std::string const& port, double period)
+int MB500::processAvailable()
 {
-    m_period = period * 1000;
+    int status = PROCESS_IDLE;
+    base::Time solution_time = m_solution_time;
+    base::Time raw_epoch_time = m_raw_decoder.getEpoch().time;
+    Heading heading = m_heading;
+    uint64_t marker_event_count = m_marker_event_count;
+    size_t result_count = m_command_results.size();
+
+    if (!writeQueuedCommand())
+        status |= PROCESS_ERROR;
+
+    if (!(status & PROCESS_ERROR))
+        status |= processDevice(getFileDescriptor(), m_command_buffer);
+    if (!(status & PROCESS_ERROR) && m_port_fds[PORT_DATA] != -1)
+        status |= processDevice(m_port_fds[PORT_DATA], m_data_buffer);
+
+    if (!m_command_deadline.isNull() && base::Time::now() >= m_command_deadline)
+    {
+        completeCommand(COMMAND_TIMED_OUT);
+        if (!writeQueuedCommand())
+            status |= PROCESS_ERROR;
+    }
 
-    int stats_period = period;
-    if (stats_period < 5)
-	stats_period = 5;
+    // Corrections last, the solutions are more urgent. A command may
+    // have waited for the end of a correction frame
+    if (!(status & PROCESS_ERROR) && (!writeCorrectionQueue() || !writeQueuedCommand()))
+        status |= PROCESS_ERROR;
+
+    if (m_solution_time != solution_time)
+        status |= PROCESS_NEW_SOLUTION;
+    if (m_raw_decoder.getEpoch().time != raw_epoch_time)
+        status |= PROCESS_NEW_RAW_EPOCH;
+    if (m_heading.time != heading.time || m_heading.heading != heading.heading)
+        status |= PROCESS_NEW_HEADING;
+    if (m_marker_event_count != marker_event_count)
+        status |= PROCESS_NEW_MARKER_EVENT;
+    if (m_command_results.size() != result_count)
+        status |= PROCESS_COMMAND_DONE;
+    return status;
+}
 
-    if(! setNMEA("GGA", port, true, period)) return 0;
-    if(! setNMEA("GST", port, true, period)) return 0;
-    if(! setNMEA("ZDA", port, true, period)) return 0;
-    if(! setNMEA("LTN", port, true, period)) return 0;
-    if(! setNMEA("GSA", port, true, stats_period)) return 0;
-    if(! setNMEA("GSV", port, true, stats_period)) return 0;
-    return 1;
+int MB500::processDevice(int fd, ReadBuffer& buffer)
+{
+    int status = PROCESS_IDLE;
+    while (!(status & PROCESS_ERROR))
+    {
+        string_ref packet;
+        while (extractBufferedPacket(buffer, packet))
+        {
+            status |= PROCESS_DATA;
+            bool ack = packet.starts_with("$PASHR,ACK");
+            if (!m_command_deadline.isNull() && (ack || packet.starts_with("$PASHR,NAK")))
+            {
+                completeCommand(ack ? COMMAND_ACKNOWLEDGED : COMMAND_REJECTED);
+                if (!writeQueuedCommand())
+                    status |= PROCESS_ERROR;
+            }
+            else
+            {
+                // A sentence with a valid checksum may still be malformed.
+                // Drop it, one bad line must not stop the caller's loop
+                try { interpretPeriodicData(packet); }
+                catch(std::runtime_error& e)
+                { ++m_stream_statistics.invalidSentences; }
+            }
+        }
+
+        int rd = readDevice(fd, buffer);
+        if (rd == 0)
+            break;
+        else if (rd < 0)
+        {
+            m_process_error = (rd == -1) ? errno : 0;
+            status |= PROCESS_ERROR;
+        }
+    }
+    return status;
 }
 
 bool MB500::enableNtpdShm(int unit) {
@@ -580,39 +2040,255 @@ void MB500::updateNtpdShm()
 
 void MB500::collectPeriodicData()
 {
-    string message;
-    try { message = read(100); }
-    catch(iodrivers_base::TimeoutError)
-    { return; }
+    string_ref message;
+    if (tryReadData(message, 100) != READ_PACKET)
+        return;
+
+    // As in processAvailable(), a malformed sentence is only counted
+    try { interpretPeriodicData(message); }
+    catch(std::runtime_error& e)
+    { ++m_stream_statistics.invalidSentences; }
+}
+
+bool MB500::collectAvailableData()
+{
+    string_ref message;
+    if (tryReadData(message, 0, 0) != READ_PACKET)
+        return false;
+
+    interpretPeriodicData(message);
+    return true;
+}
+
+/** Replies to the commands and queries the driver sends. They reach
+ * interpretPeriodicData() when they come late or unsolicited, or when a
+ * blocking query forwards what it does not wait for */
+static const char* const COMMAND_REPLIES[] = { "ACK", "NAK", "RID", "PRT", "ALM", "PAR" };
+static const int COMMAND_REPLIES_COUNT = sizeof(COMMAND_REPLIES) / sizeof(COMMAND_REPLIES[0]);
+
+static bool isCommandReply(string_ref message)
+{
+    if (!message.starts_with("$PASHR,") || message.size() < 11 || (message[10] != ',' && message[10] != '*'))
+        return false;
+
+    string_ref type = message.substr(7, 3);
+    for (int i = 0; i < COMMAND_REPLIES_COUNT; ++i)
+    {
+        if (type == COMMAND_REPLIES[i])
+            return true;
+    }
+    return false;
+}
 
-    if( message.find("$GPZDA,") == 0 )
+void MB500::interpretPeriodicData(string_ref message)
+{
+    if( !message.empty() && static_cast<uint8_t>(message[0]) == 0xD3 )
+        m_raw_decoder.decode(reinterpret_cast<uint8_t const*>(message.data()), message.size(), base::Time::now());
+    else if( message.starts_with("$GPZDA,") )
     {
-        pair<base::Time, base::Time> times = interpretDateTime(message);
+        bool dated;
+        pair<base::Time, base::Time> times = interpretDateTime(message, dated);
 	//cpu_time adjusted for processing latency in the dgps board
 	//there is still some latency on the pc side, which is much
 	//noisier, but the baseline is constant after this.
         cpu_time  = times.first - base::Time::fromSeconds(processing_latency);
         real_time = times.second;
+        if (dated)
+        {
+            m_utc_day = real_time.toMicroseconds() / USECS_PER_DAY;
+            m_utc_time_of_day = real_time.toMicroseconds() % USECS_PER_DAY;
+        }
+        if (m_clock_model.isValid())
+            cpu_time = getHostTime(real_time);
+
+	updateNtpdShm();
+    }
+    else if( message.starts_with("$PASHR,POS,") )
+    {
+        this->position = interpretPOS(message, solutionQuality, velocity);
+        position.time = applyUTCDay(position.time);
+        velocity.time = position.time;
+        addClockSample(position.time);
+        // POS is the only sentence of the epoch, it gives the timing as well
+        cpu_time  = base::Time::now() - base::Time::fromSeconds(processing_latency);
+        real_time = position.time;
+        if (m_clock_model.isValid())
+            cpu_time = getHostTime(real_time);
+        setSolutionTime(position.time);
 
 	updateNtpdShm();
     }
-    else if( message.find("$GPGGA,") == 0 )
+    else if( message.starts_with("$GPGGA,") )
+    {
         this->position = interpretInfo(message);
-    else if( message.find("$PASHR,VEC,") == 0 )
-        cerr << message << endl;
-    else if( message.find("$GPGST,") == 0 || message.find("$GLGST,") == 0 || message.find("$GNGST,") == 0)
+        position.time = applyUTCDay(position.time);
+        addClockSample(position.time);
+        if (position.time == errors.time)
+            setSolutionTime(position.time);
+    }
+    else if( message.starts_with("$GPVTG,") || message.starts_with("$GNVTG,") )
+    {
+        // VTG has no time, it belongs to the epoch of the last GGA
+        velocity = interpretVTG(message);
+        velocity.time = position.time;
+        m_predictor.updateVelocity(velocity);
+    }
+    else if( message.starts_with("$GPRMC,") || message.starts_with("$GNRMC,") )
+    {
+        if (interpretRMC(message, velocity))
+        {
+            velocity.time = applyUTCDay(velocity.time);
+            m_predictor.updateVelocity(velocity);
+        }
+    }
+    else if( message.starts_with("$PASHR,VEC,") )
+    {
+        m_baseline = interpretVEC(message);
+        m_baseline.time = applyUTCDay(m_baseline.time);
+        m_heading  = computeHeading(m_baseline, position.latitude, position.longitude);
+    }
+    else if( message.starts_with("$PASHR,TTT,") )
+    {
+        m_pending_events.push_back(interpretTTT(message, position.time));
+        if (m_pending_events.size() > MAX_PENDING_MARKER_EVENTS)
+            matchMarkerEvents(false);
+    }
+    else if( message.starts_with("$GPHDT,") || message.starts_with("$GNHDT,") )
+    {
+        // HDT has no time, it belongs to the epoch of the last GGA. VEC
+        // gives the same heading with its accuracy, keep the latter if
+        // the epoch had both
+        double heading = interpretHDT(message);
+        if (m_heading.time != position.time)
+        {
+            m_heading = Heading();
+            m_heading.time = position.time;
+            m_heading.solutionType = position.positionType;
+            m_heading.pitch = m_heading.deviationHeading = m_heading.deviationPitch =
+                m_heading.baselineLength = NAN;
+        }
+        m_heading.heading = heading;
+    }
+    else if( message.starts_with("$GPGST,") || message.starts_with("$GLGST,") || message.starts_with("$GNGST,"))
+    {
         this->errors = interpretErrors(message);
-    else if( message.find("$GPGSA,") == 0 || message.find("$GLGSA,") == 0 || message.find("$GNGSA,") == 0 )
-        interpretQuality(message);
-    else if( message.find("$GPGSV,") == 0 || message.find("$GLGSV,") == 0)
+        errors.time = applyUTCDay(errors.time);
+        if (m_output_profile == MB500_NMEA_OUTPUT && position.time == errors.time)
+            setSolutionTime(position.time);
+    }
+    else if( message.starts_with("$GPGSA,") || message.starts_with("$GLGSA,") || message.starts_with("$GNGSA,") )
+    {
+        // GSA has no sentence count. Assume that the cycle is incomplete
+        // if a packet got dropped between two of its sentences
+        uint64_t dropped = getDroppedPacketCount();
+        bool first = tempSolutionQuality.usedSatellites.empty();
+        if (interpretQuality(message))
+        {
+            if (m_gsa_broken)
+                ++m_stream_statistics.incompleteGSACycles;
+            m_gsa_broken = false;
+        }
+        else if (!first && dropped != m_gsa_dropped_packets)
+            m_gsa_broken = true;
+        m_gsa_dropped_packets = dropped;
+    }
+    else if( message.starts_with("$GPGSV,") || message.starts_with("$GLGSV,"))
     {
+        checkGSVSequence(message);
         if (interpretSatelliteInfo(tempSatellites, message))
+        {
             satellites = tempSatellites;
+            if (m_clock_model.isValid())
+                satellites.time = getEpochHostTime();
+        }
     }
-    else if ( message.find("$PASHR,LTN,") == 0 )
+    else if ( message.starts_with("$PASHR,LTN,") )
     {
         processing_latency = interpretLatency(message);
     }
+    else if (!isCommandReply(message))
+        ++m_stream_statistics.unknownSentences;
+}
+
+void MB500::checkGSVSequence(string_ref message)
+{
+    // $GxGSV,count,number,...
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 3)
+        return;
+    int count  = atoi(fields[1].c_str());
+    int number = atoi(fields[2].c_str());
+    char talker = message[2];
+
+    bool continued = (m_gsv_next != 0 && talker == m_gsv_talker && number == m_gsv_next);
+    if (!continued)
+    {
+        // Either the cycle in progress lost sentences, or this one lost its
+        // start. A sentence that does not start a cycle after a gap is
+        // most likely from the same cycle, count it once
+        bool in_progress = (m_gsv_next != 0 && !m_gsv_broken);
+        if (in_progress || number != 1)
+            ++m_stream_statistics.incompleteGSVCycles;
+        m_gsv_broken = (number != 1);
+    }
+    m_gsv_talker = talker;
+    m_gsv_next = (number < count) ? number + 1 : 0;
+}
+
+base::Time MB500::getSolutionTime() const
+{
+    return m_solution_time;
+}
+
+RawEpoch const& MB500::getRawEpoch() const
+{
+    return m_raw_decoder.getEpoch();
+}
+
+Baseline const& MB500::getBaseline() const
+{
+    return m_baseline;
+}
+
+Heading const& MB500::getHeading() const
+{
+    return m_heading;
+}
+
+void MB500::addClockSample(base::Time const& gps_time)
+{
+    // Packets that did not come from the device, e.g. when a log is
+    // replayed, have no arrival time
+    if (m_read_time.isNull())
+        return;
+
+    m_clock_model.addSample(gps_time, m_read_time - base::Time::fromSeconds(processing_latency));
+    m_realtime_offset = base::Time::now() - getMonotonicTime();
+}
+
+ClockModel const& MB500::getClockModel() const
+{
+    return m_clock_model;
+}
+
+base::Time MB500::getHostTime(base::Time const& gps_time) const
+{
+    if (!m_clock_model.isValid())
+        return base::Time();
+    return m_clock_model.toHostTime(gps_time) + m_realtime_offset;
+}
+
+PositionPredictor const& MB500::getPredictor() const
+{
+    return m_predictor;
+}
+
+base::Time MB500::getEpochHostTime() const
+{
+    if (m_clock_model.isValid())
+        return getHostTime(position.time);
+    return base::Time::now();
 }
 
 bool MB500::setNMEALL(string port, bool onOff)
@@ -626,26 +2302,32 @@ bool MB500::setNMEALL(string port, bool onOff)
 
 bool MB500::verifyAcknowledge(std::string const& cmd)
 {
-    string message;
+    // The board keeps sending periodic data while we wait for the reply.
+    // Don't lose it: everything that is not the acknowledgement goes
+    // through the normal periodic data processing.
+    base::Time deadline = base::Time::now() + base::Time::fromMilliseconds(m_acq_timeout);
+    while(true)
+    {
+        int remaining = (deadline - base::Time::now()).toMilliseconds();
+        string_ref message;
+        if (remaining > 0)
+            tryRead(message, remaining, remaining);
 
-    base::Time start = base::Time::now();
-    do {
-        if ((base::Time::now() - start).toMilliseconds() > m_acq_timeout)
+        if (message.empty())
         {
             cerr << "dpgs/mb500: command " << cmd << " timed out waiting for acknowledgement" << endl;
             return false;
         }
 
-        message = read(m_acq_timeout);
-    }
-    while( message.find("$PASHR,NAK") != 0 && message.find("$PASHR,ACK") != 0);
+        if( message.starts_with("$PASHR,NAK")) {
+            cerr << "dpgs/mb500: command " << cmd << " not acknowledged" << endl;
+            return false;
+        }
+        else if(message.starts_with("$PASHR,ACK"))
+            return true;
 
-    if( message.find("$PASHR,NAK") == 0) {
-        cerr << "dpgs/mb500: command " << cmd << " not acknowledged" << endl;
-        return false;
+        interpretPeriodicData(message);
     }
-    else if(message.find("$PASHR,ACK") == 0) return true;
-    return false;
 }
 
 
@@ -654,8 +2336,8 @@ Errors MB500::getGST(string port)
     if (port!= "") port = "," + port;
     write("$PASHQ,GST" + port + "\r\n", 1000);
 
-    string result = read(m_acq_timeout);
-    if( result.find("$PASHR,NAK") == 0) {
+    string_ref result = read(m_acq_timeout);
+    if( result.starts_with("$PASHR,NAK")) {
         cerr<<"Command not acknowledged"<<endl;
         throw runtime_error("Command not acknowledged");
     }
@@ -664,12 +2346,12 @@ Errors MB500::getGST(string port)
 
 Position MB500::getGGA(string port)
 {
-    string result;
+    string_ref result;
     if (port!= "") port = "," + port;
     write("$PASHQ,GGA" + port + "\r\n", 1000);
 
     result = read(m_acq_timeout);
-    if( result.find("$PASHR,NAK") == 0) {
+    if( result.starts_with("$PASHR,NAK")) {
         cerr<<"Command not acknowledged"<<endl;
         throw runtime_error("Command not acknowledged");
     }
@@ -679,7 +2361,7 @@ Position MB500::getGGA(string port)
 
 SatelliteInfo MB500::getGSV(string port)
 {
-    string msg;
+    string_ref msg;
     if (port!= "") port = "," + port;
     write("$PASHQ,GSV" + port + "\r\n", 1000);
 
@@ -687,35 +2369,53 @@ SatelliteInfo MB500::getGSV(string port)
     while(true)
     {
         msg = read(m_acq_timeout);
-        if( msg.find("$PASHR,NAK") == 0) {
+        if( msg.starts_with("$PASHR,NAK")) {
             cerr<<"Command not acknowledged"<<endl;
             throw runtime_error("Command not acknowledged");
         }
-        else if( msg.find("$GPGSV,") != 0 && msg.find("$GLGSV,") != 0)
+        else if( msg.starts_with("$GPGSV,") || msg.starts_with("$GLGSV,"))
         {
             if (interpretSatelliteInfo(data, msg))
                 return data;
         }
+        else
+            interpretPeriodicData(msg);
     }
 }
 
-pair<base::Time, base::Time> MB500::interpretDateTime(string const& message)
+pair<base::Time, base::Time> MB500::interpretDateTime(string_ref message, bool& dated)
 {
     base::Time cpu_time = base::Time::now();
 
-    if( message.find("$GPZDA,"))
+    if( !message.starts_with("$GPZDA,"))
         throw std::runtime_error("wrong message given to interpretErrors");
 
     vector<string> fields;
     split( fields, message, is_any_of(",*") );
 
+    // $GPZDA,hhmmss.ss,dd,mm,yyyy,... The date is empty until the board
+    // knows it
     base::Time utc = interpretTime(fields[1]);
+    int day = 0, month = 0, year = 0;
+    dated = fields.size() > 4;
+    if (dated)
+    {
+        day   = atoi(fields[2].c_str());
+        month = atoi(fields[3].c_str());
+        year  = atoi(fields[4].c_str());
+        dated = year >= 1970 && month >= 1 && month <= 12 && day >= 1 && day <= 31;
+    }
+    if (dated)
+    {
+        int64_t time_of_day = utc.toMicroseconds() % USECS_PER_DAY;
+        utc = base::Time::fromMicroseconds(daysFromCivil(year, month, day) * USECS_PER_DAY + time_of_day);
+    }
     return make_pair(cpu_time, utc);
 }
 
-bool MB500::interpretQuality(string const& message)
+bool MB500::interpretQuality(string_ref message)
 {
-    if( message.find("$GPGSA,") != 0 && message.find("$GLGSA,") != 0 && message.find("$GNGSA,") != 0)
+    if( !message.starts_with("$GPGSA,") && !message.starts_with("$GLGSA,") && !message.starts_with("$GNGSA,"))
         throw std::runtime_error("wrong message given to interpretErrors");
 
     vector<string> fields;
@@ -738,7 +2438,7 @@ bool MB500::interpretQuality(string const& message)
     {
         solutionQuality     = tempSolutionQuality;
         tempSolutionQuality = SolutionQuality();
-        tempSolutionQuality.time = base::Time::now();
+        tempSolutionQuality.time = getEpochHostTime();
         ret = true;
     }
 
@@ -750,9 +2450,9 @@ bool MB500::interpretQuality(string const& message)
     return ret;
 }
 
-Errors MB500::interpretErrors(string const& message)
+Errors MB500::interpretErrors(string_ref message)
 {
-    if( message.find("$GPGST,") != 0 && message.find("$GLGST,") != 0 && message.find("$GNGST,") != 0)
+    if( !message.starts_with("$GPGST,") && !message.starts_with("$GLGST,") && !message.starts_with("$GNGST,"))
         throw std::runtime_error("wrong message given to interpretErrors");
 
     vector<string> fields;
@@ -766,9 +2466,9 @@ Errors MB500::interpretErrors(string const& message)
     return data;
 }
 
-bool MB500::interpretSatelliteInfo(SatelliteInfo& data, string const& message)
+bool MB500::interpretSatelliteInfo(SatelliteInfo& data, string_ref message)
 {
-    if( message.find("$GPGSV,") != 0 && message.find("$GLGSV,") != 0)
+    if( !message.starts_with("$GPGSV,") && !message.starts_with("$GLGSV,"))
         throw std::runtime_error("wrong message given to interpretSatelliteInfo");
 
     vector<string> fields;
@@ -780,7 +2480,7 @@ bool MB500::interpretSatelliteInfo(SatelliteInfo& data, string const& message)
     // interpretSatelliteInfo() accumulates information, since the information
     // is spanned over multiple messages. We clear data if this is the first
     // message of a series.
-    if (msg_number == 1 && message.find("$GPGSV") == 0)
+    if (msg_number == 1 && message.starts_with("$GPGSV"))
     {
         data.knownSatellites.clear();
         data.time = base::Time::now();
@@ -802,12 +2502,12 @@ bool MB500::interpretSatelliteInfo(SatelliteInfo& data, string const& message)
 
         data.knownSatellites.push_back(sat);
     }
-    return (msg_number == msg_count && message.find("$GLGSV") == 0);
+    return (msg_number == msg_count && message.starts_with("$GLGSV"));
 }
 
-Position MB500::interpretInfo(string const& message)
+Position MB500::interpretInfo(string_ref message)
 {
-    if( !message.find("$GPGGA,") == 0)
+    if( !message.starts_with("$GPGGA,"))
         throw std::runtime_error("invalid message in interpretInfo");
 
     vector<string> fields;
@@ -837,9 +2537,261 @@ Position MB500::interpretInfo(string const& message)
     return data;
 }
 
-double MB500::interpretLatency(std::string const& message)
+Position MB500::interpretPOS(string_ref message, SolutionQuality& quality, Velocity& velocity)
+{
+    if( !message.starts_with("$PASHR,POS,"))
+        throw std::runtime_error("invalid message in interpretPOS");
+
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 18)
+        throw std::runtime_error("truncated message in interpretPOS");
+
+    Position data;
+    data.time = interpretTime(fields[4]);
+    if (fields[5].empty())
+        data.positionType = NO_SOLUTION;
+    else
+    {
+        data.latitude  = interpretAngle(fields[5], fields[6] == "N");
+        data.longitude = interpretAngle(fields[7], fields[8] == "E");
+        int position_type = atoi(fields[2].c_str());
+        switch(position_type)
+        {
+            case 0: data.positionType = AUTONOMOUS; break;
+            case 1: data.positionType = DIFFERENTIAL; break;
+            case 2: data.positionType = RTK_FLOAT; break;
+            case 3: data.positionType = RTK_FIXED; break;
+            case 9: data.positionType = DIFFERENTIAL; break;
+            default: data.positionType = INVALID; break;
+        };
+    }
+
+    data.noOfSatellites = atoi(fields[3].c_str());
+    // POS gives the height above the ellipsoid. Report it with a null
+    // geoidal separation so that altitude + geoidalSeparation keeps the
+    // same meaning than with GGA
+    data.altitude          = atof(fields[9].c_str());
+    data.geoidalSeparation = 0;
+    data.ageOfDifferentialCorrections = atof(fields[10].c_str());
+
+    // The list of used satellites is only given by GSA, keep it
+    quality.time = data.time;
+    quality.pdop = atof(fields[14].c_str());
+    quality.hdop = atof(fields[15].c_str());
+    quality.vdop = atof(fields[16].c_str());
+
+    velocity.time = data.time;
+    velocity.course = atof(fields[11].c_str());
+    velocity.speed  = atof(fields[12].c_str()) * KNOTS_TO_MS;
+    velocity.verticalSpeed = atof(fields[13].c_str());
+    return data;
+}
+
+Velocity MB500::interpretVTG(string_ref message)
+{
+    if( !message.starts_with("$GPVTG,") && !message.starts_with("$GNVTG,"))
+        throw std::runtime_error("invalid message in interpretVTG");
+
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 9)
+        throw std::runtime_error("truncated message in interpretVTG");
+
+    Velocity data;
+    data.course = atof(fields[1].c_str());
+    data.speed  = atof(fields[7].c_str()) / 3.6;
+    return data;
+}
+
+bool MB500::interpretRMC(string_ref message, Velocity& velocity)
+{
+    if( !message.starts_with("$GPRMC,") && !message.starts_with("$GNRMC,"))
+        throw std::runtime_error("invalid message in interpretRMC");
+
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 10)
+        throw std::runtime_error("truncated message in interpretRMC");
+    if (fields[2] != "A")
+        return false;
+
+    velocity.time   = interpretTime(fields[1]);
+    velocity.speed  = atof(fields[7].c_str()) * KNOTS_TO_MS;
+    velocity.course = atof(fields[8].c_str());
+    velocity.verticalSpeed = 0;
+    return true;
+}
+
+Baseline MB500::interpretVEC(string_ref message)
+{
+    if( !message.starts_with("$PASHR,VEC,"))
+        throw std::runtime_error("invalid message in interpretVEC");
+
+    // $PASHR,VEC,mode,count,time,x,y,z,sx,sy,sz,rxy,rxz,ryz,base*cc
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 15)
+        throw std::runtime_error("truncated message in interpretVEC");
+
+    Baseline data;
+    switch(atoi(fields[2].c_str()))
+    {
+        case 0: data.solutionType = AUTONOMOUS; break;
+        case 1: data.solutionType = DIFFERENTIAL; break;
+        case 2: data.solutionType = RTK_FLOAT; break;
+        case 3: data.solutionType = RTK_FIXED; break;
+        default: data.solutionType = INVALID; break;
+    };
+    data.satelliteCount = atoi(fields[3].c_str());
+    data.time = interpretTime(fields[4]);
+    data.x = atof(fields[5].c_str());
+    data.y = atof(fields[6].c_str());
+    data.z = atof(fields[7].c_str());
+    data.deviationX = atof(fields[8].c_str());
+    data.deviationY = atof(fields[9].c_str());
+    data.deviationZ = atof(fields[10].c_str());
+    data.correlationXY = atof(fields[11].c_str());
+    data.correlationXZ = atof(fields[12].c_str());
+    data.correlationYZ = atof(fields[13].c_str());
+    data.baseStationID = atoi(fields[14].c_str());
+    return data;
+}
+
+double MB500::interpretHDT(string_ref message)
+{
+    if( !message.starts_with("$GPHDT,") && !message.starts_with("$GNHDT,"))
+        throw std::runtime_error("invalid message in interpretHDT");
+
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 3)
+        throw std::runtime_error("truncated message in interpretHDT");
+    return atof(fields[1].c_str());
+}
+
+MarkerEvent MB500::interpretTTT(string_ref message, base::Time const& reference)
+{
+    if( !message.starts_with("$PASHR,TTT,"))
+        throw std::runtime_error("invalid message in interpretTTT");
+
+    // $PASHR,TTT,day,hh:mm:ss.sssssss*cc, the day of week being 1 for
+    // Sunday, and the time in the GPS time scale
+    vector<string> fields;
+    split( fields, message, is_any_of(",*") );
+    if (fields.size() < 4)
+        throw std::runtime_error("truncated message in interpretTTT");
+    string const& value = fields[3];
+    if (value.size() < 8 || value[2] != ':' || value[5] != ':')
+        throw std::runtime_error("invalid time in interpretTTT");
+
+    int seconds = atoi(value.substr(0, 2).c_str()) * 3600
+        + atoi(value.substr(3, 2).c_str()) * 60
+        + atoi(value.substr(6, 2).c_str());
+    // A double would lose the last digits, read the fraction as an integer
+    int64_t nanoseconds = 0;
+    int digits = 0;
+    for (size_t i = 9; value.size() > 8 && value[8] == '.' && i < value.size() && digits < 9; ++i, ++digits)
+    {
+        if (value[i] < '0' || value[i] > '9')
+            break;
+        nanoseconds = nanoseconds * 10 + (value[i] - '0');
+    }
+    for (; digits < 9; ++digits)
+        nanoseconds *= 10;
+
+    MarkerEvent event;
+    event.gpsTimeOfWeek = (atoi(fields[2].c_str()) - 1) * 86400 + seconds + nanoseconds / 1e9;
+    event.nanoseconds   = nanoseconds % 1000;
+
+    // The solutions are in UTC, on the day of the reference
+    const int64_t DAY = 86400LL * 1000000;
+    int64_t reference_us = (reference.isNull() ? base::Time::now() : reference).toMicroseconds();
+    int64_t time = reference_us - reference_us % DAY
+        + (seconds - RawObservationDecoder::GPS_LEAP_SECONDS) * 1000000LL
+        + nanoseconds / 1000;
+    if (time - reference_us > DAY / 2)
+        time -= DAY;
+    else if (reference_us - time > DAY / 2)
+        time += DAY;
+    event.time = base::Time::fromMicroseconds(time);
+    return event;
+}
+
+Heading MB500::computeHeading(Baseline& baseline, double latitude, double longitude)
 {
-    if( !message.find("$PASHR,LTN,") == 0)
+    double rotation[3][3];
+    getLocalRotation(latitude, longitude, rotation);
+
+    double const ecef[3] = { baseline.x, baseline.y, baseline.z };
+    double const sigma[3] = { baseline.deviationX, baseline.deviationY, baseline.deviationZ };
+    double ecef_cov[3][3];
+    ecef_cov[0][0] = sigma[0] * sigma[0];
+    ecef_cov[1][1] = sigma[1] * sigma[1];
+    ecef_cov[2][2] = sigma[2] * sigma[2];
+    ecef_cov[0][1] = ecef_cov[1][0] = baseline.correlationXY * sigma[0] * sigma[1];
+    ecef_cov[0][2] = ecef_cov[2][0] = baseline.correlationXZ * sigma[0] * sigma[2];
+    ecef_cov[1][2] = ecef_cov[2][1] = baseline.correlationYZ * sigma[1] * sigma[2];
+
+    // enu = R ecef and cov(enu) = R cov(ecef) R'
+    double enu[3], enu_cov[3][3];
+    for (int i = 0; i < 3; ++i)
+    {
+        enu[i] = 0;
+        for (int k = 0; k < 3; ++k)
+            enu[i] += rotation[i][k] * ecef[k];
+        for (int j = 0; j < 3; ++j)
+        {
+            enu_cov[i][j] = 0;
+            for (int k = 0; k < 3; ++k)
+                for (int l = 0; l < 3; ++l)
+                    enu_cov[i][j] += rotation[i][k] * ecef_cov[k][l] * rotation[j][l];
+        }
+    }
+    baseline.east  = enu[0];
+    baseline.north = enu[1];
+    baseline.up    = enu[2];
+
+    Heading heading;
+    heading.time = baseline.time;
+    heading.solutionType = baseline.solutionType;
+
+    double e = enu[0], n = enu[1], u = enu[2];
+    double horizontal2 = e * e + n * n;
+    double length2 = horizontal2 + u * u;
+    double horizontal = sqrt(horizontal2);
+    heading.baselineLength = sqrt(length2);
+    heading.heading = atan2(e, n) * 180 / M_PI;
+    if (heading.heading < 0)
+        heading.heading += 360;
+    heading.pitch = atan2(u, horizontal) * 180 / M_PI;
+    if (horizontal2 == 0)
+    {
+        heading.deviationHeading = heading.deviationPitch = NAN;
+        return heading;
+    }
+
+    // First order propagation, with the gradients of atan2(e, n) and
+    // atan2(u, horizontal) with respect to (e, n, u)
+    double const dh[3] = { n / horizontal2, -e / horizontal2, 0 };
+    double const dp[3] = { -u * e / (horizontal * length2), -u * n / (horizontal * length2), horizontal / length2 };
+    double var_heading = 0, var_pitch = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            var_heading += dh[i] * enu_cov[i][j] * dh[j];
+            var_pitch   += dp[i] * enu_cov[i][j] * dp[j];
+        }
+    }
+    heading.deviationHeading = sqrt(var_heading) * 180 / M_PI;
+    heading.deviationPitch   = sqrt(var_pitch) * 180 / M_PI;
+    return heading;
+}
+
+double MB500::interpretLatency(string_ref message)
+{
+    if( !message.starts_with("$PASHR,LTN,"))
         throw std::runtime_error("invalid message in interpretInfo");
 
     vector<string> fields;
@@ -859,36 +2811,53 @@ double MB500::interpretAngle(std::string const& value, bool positive)
 
 base::Time MB500::interpretTime(std::string const& time)
 {
-    float gps_time   = atof(time.c_str());
+    // A float does not have enough digits for hhmmss.ss
+    double gps_time  = atof(time.c_str());
     int integer_part = gps_time;
-    int microsecs = (gps_time - integer_part) * 1000000;
+    int microsecs = floor((gps_time - integer_part) * 1000000 + 0.5);
 
-    // Get current UTC time broken down in day, h, m, s
+    // Take the current UTC day, and replace hours minutes and seconds by
+    // the GPS values. This is done with plain arithmetic, as UTC days have
+    // a fixed length in time_t, while gmtime_r() takes a process-wide
+    // lock that serializes the threads of NMEALogParser
     time_t utc_epoch = ::time(NULL);
-    tm utc_hms;
-    gmtime_r(&utc_epoch, &utc_hms);
-
-    // Replace hours minutes and seconds by the GPS values
-    utc_hms.tm_hour = integer_part / 10000;
-    utc_hms.tm_min  = (integer_part / 100) % 100;
-    utc_hms.tm_sec  = (integer_part % 100);
-
-    // And convert it back to seconds since epoch
-    time_t gps_epoch = timegm(&utc_hms);
+    time_t gps_epoch = utc_epoch - utc_epoch % 86400
+        + (integer_part / 10000) * 3600
+        + ((integer_part / 100) % 100) * 60
+        + (integer_part % 100);
     base::Time result = base::Time::fromSeconds(gps_epoch, microsecs);
     return result;
 }
 
-char const* solutionNames[] = {
-    "NONE",
-    "AUTONOMOUS",
-    "DIFFERENTIAL",
-    "UNUSED",
-    "RTK_FIXED",
-    "RTK_FLOAT"
-};
-static const int MAX_SOLUTION_ID = 5;
+base::Time MB500::applyUTCDay(base::Time const& time)
+{
+    if (m_utc_day < 0)
+        return time;
+
+    int64_t time_of_day = time.toMicroseconds() % USECS_PER_DAY;
+    if (m_utc_time_of_day >= 0)
+    {
+        // A time of day far behind the last one is on the next day, and
+        // one far ahead is a late sentence from before midnight
+        if (time_of_day < m_utc_time_of_day - USECS_PER_DAY / 2)
+            ++m_utc_day;
+        else if (time_of_day > m_utc_time_of_day + USECS_PER_DAY / 2)
+            return base::Time::fromMicroseconds((m_utc_day - 1) * USECS_PER_DAY + time_of_day);
+    }
+    m_utc_time_of_day = time_of_day;
+    return base::Time::fromMicroseconds(m_utc_day * USECS_PER_DAY + time_of_day);
+}
 
+int64_t gps::daysFromCivil(int year, int month, int day)
+{
+    // H. Hinnant's days_from_civil
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era  = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
 
 std::ostream& MB500::display(std::ostream& io, MB500 const& driver)
 {
@@ -897,8 +2866,10 @@ std::ostream& MB500::display(std::ostream& io, MB500 const& driver)
 
 std::ostream& MB500::displayHeader(std::ostream& io)
 {
-    cout << "Time                          | Latitude      Longitude         Alt (MSL+geoid)  | dLat   dLong  dAlt | Mode           PDOP    Used (Sum,GP/S/GL)   Tracked (Sum,GP/S/GL) | DiffAge" << std::endl;
-    return io;
+    SolutionFormatter formatter;
+    formatter.formatHeader();
+    io.write(formatter.data(), formatter.size());
+    return io << std::endl;
 }
 
 std::ostream& MB500::display(std::ostream& io,
@@ -906,52 +2877,7 @@ std::ostream& MB500::display(std::ostream& io,
 	gps::SatelliteInfo const& satellites,
 	gps::SolutionQuality const& quality)
 {
-    time_t time_secs = pos.time.toSeconds();
-    int time_msecs   = pos.time.microseconds / 1000;
-
-    char* time_string = ctime(&time_secs);
-    io
-        << setw(10) << string(time_string, time_string + strlen(time_string) - 1) << "." << setw(3) << setfill('0') << time_msecs << " "
-	<< setfill(' ')
-	<< " | "
-        << setprecision(10) << fixed << setw(13) << pos.latitude << " "
-        << setprecision(10) << fixed << setw(13) << pos.longitude << " "
-        << setprecision(2) << setw(7) << pos.altitude << "+" << setprecision(2) << setw(7) << pos.geoidalSeparation << " "
-	<< " | "
-        << setprecision(2) << setw(5) << errors.deviationLatitude << " "
-        << setprecision(2) << setw(5) << errors.deviationLongitude << " "
-        << setprecision(2) << setw(5) << errors.deviationAltitude << " "
-	<< " | ";
-
-    if (pos.positionType > MAX_SOLUTION_ID)
-        io << setw(12) << "UNDEFINED=" << (int)pos.positionType << " ";
-    else
-        io << setw(12) << solutionNames[pos.positionType] << " ";
-
-    io << setw(5) << setprecision(1) << quality.hdop << " ";
-    io << setw(5) << pos.noOfSatellites << ",";
-    { // count the number of satellites in use, per constellation
-	int sat_count = quality.usedSatellites.size();
-	int counts[3] = { 0, 0, 0 };
-	for (int i = 0; i < sat_count; ++i)
-	    counts[Satellite::getConstellationFromPRN(quality.usedSatellites[i])]++;
-	io << setw(2) << counts[0] << "/" << setw(2) << counts[1] << "/" << setw(2) << counts[2] << setw(3) << " ";
-    }
-
-    { // count the number of satellites in view, per constellation
-	int sat_count = satellites.knownSatellites.size();
-	int counts[3] = { 0, 0, 0 };
-	for (int i = 0; i < sat_count; ++i)
-	{
-            Satellite const& sat = satellites.knownSatellites[i];
-	    if (sat.SNR > 0)
-		counts[sat.getConstellation()]++;
-	}
-	io << setw(2) << counts[0] << "/" << setw(2) << counts[1] << "/" << setw(2) << counts[2] << " ";
-    }
-
-    io << " | " << pos.ageOfDifferentialCorrections;
-
-    return io;
+    SolutionFormatter formatter;
+    formatter.format(pos, errors, satellites, quality);
+    return io.write(formatter.data(), formatter.size());
 }
-
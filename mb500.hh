@@ -2,22 +2,41 @@
 #define MAGELLAN_MB500_H
 
 #include <map>
+#include <deque>
 #include <string>
 #include <iosfwd>
 #include <sys/types.h>
 #include <iodrivers_base/Driver.hpp>
 #include <vector>
+#include <boost/utility/string_ref.hpp>
 
 #include "gps_types.hh"
 #include "mb500_types.hh"
+#include "mb500_warmstart.hh"
+#include "mb500_kpi.hh"
+#include "mb500_bus.hh"
+#include "mb500_clock.hh"
+#include "mb500_predictor.hh"
+#include "mb500_raw.hh"
+#include "mb500_events.hh"
 
 namespace gps {
+    /** Days since 1970-01-01 of a date of the proleptic Gregorian
+     * calendar */
+    int64_t daysFromCivil(int year, int month, int day);
+
     /** Driver for the MB500 Magellan differential GPS */
     class MB500 : public iodrivers_base::Driver {
     public:
         MB500();
         ~MB500();
 
+        /** Baud rate at which the serial line is opened */
+        static const int DEFAULT_BAUDRATE = 115200;
+
+        /** Opens the serial line and finds the rate at which the board
+         * currently talks (see probeBaudrate())
+         */
         bool openSerial(std::string const& device_name);
         bool open(const std::string& device_name);
         bool openBase(const std::string& device_name);
@@ -25,8 +44,58 @@ namespace gps {
 
         void close();
 
+        /** How the driver uses the board's ports */
+        enum PORT_ROLE
+        {
+            /** Commands and their acknowledgements. This is the device
+             * given to open() */
+            PORT_COMMAND     = 0,
+            /** Periodic NMEA sentences and raw data */
+            PORT_DATA        = 1,
+            /** RTK corrections: input on a rover, output on a base */
+            PORT_CORRECTIONS = 2
+        };
+        static const int PORT_ROLE_COUNT = 3;
+
+        /** Dedicates another serial device, connected to another port of
+         * the board, to \c role, so that e.g. the command round trips do
+         * not wait behind the periodic data. Call it after open().
+         *
+         * The rate of the device is probed like with probeBaudrate(),
+         * which also gives the board's name of the port. Roles without a
+         * device of their own are served by the command device.
+         */
+        bool openPort(PORT_ROLE role, std::string const& device_name);
+        /** The board's name of the port serving \c role (A, B, ...), or
+         * an empty string if it is not known */
+        std::string getPortName(PORT_ROLE role) const;
+        /** The file descriptor of the device serving \c role. Event loops
+         * have to watch the PORT_DATA one as well as getFileDescriptor() */
+        int getPortFileDescriptor(PORT_ROLE role) const;
+
+        /** Finds the baud rate of the board by querying its port settings
+         * at the usual rates, and sets the host side to it.
+         *
+         * @returns the rate found, or zero if the board did not reply at any
+         * rate (the host is then set back to DEFAULT_BAUDRATE)
+         */
+        int probeBaudrate();
+        /** Switches the board's port and the host side to the highest
+         * rate not greater than \c max_rate. Each switch is confirmed by
+         * a query at the new rate, and the driver falls back to the rate
+         * at which the board replies if the confirmation fails.
+         *
+         * @returns the rate in use afterwards, or zero if the board could
+         * not be reached or could not be switched down to \c max_rate
+         */
+        int negotiateBaudrate(int max_rate = 921600);
+        /** The host-side baud rate currently in use */
+        int getBaudrate() const;
+
         /** Make the base output RTCM 3.0 correction messages on the provided port */
         bool setRTKBase(std::string port_name);
+        /** setRTKBase() on the PORT_CORRECTIONS port */
+        bool setRTKBase();
         /** Stop the output of any RTCM 3.0 messages */
         void stopRTKBase();
         /** Enables or disables Fast-RTK */
@@ -36,6 +105,8 @@ namespace gps {
         /** Sets the port on which the RTK corrections will be received
         */
         bool setRTKInputPort(std::string const& port);
+        /** setRTKInputPort() on the PORT_CORRECTIONS port */
+        bool setRTKInputPort();
 
         enum CORRELATOR_MODE {
             EDGE_CORRELATOR,
@@ -49,11 +120,110 @@ namespace gps {
          */
         void reset(bool cold_start);
 
+        /** Re-establishes the link after a disconnection of the device or
+         * a reset of the board
+         *
+         * Call it when processAvailable() reports PROCESS_ERROR, when the
+         * blocking methods throw an I/O error, or when isStalled(). The
+         * devices are reopened until the board answers a query, with a
+         * backoff between the attempts, and the configuration set through
+         * the driver is applied again: the ports given to openPort(), the
+         * baud rate, dynamics, fix threshold, fast RTK, moving base, base
+         * position, RTK input port and output, periodic data, raw data,
+         * heading output and event marker. A
+         * base position set with setPositionFromCurrent() is not restored.
+         *
+         * If the board got reset, the warm-start cache is applied as well.
+         * The queued commands complete with COMMAND_ABORTED, and the file
+         * descriptors change: use MB500Manager::recoverDevice() for the
+         * devices of a manager.
+         *
+         * @returns false if the board could not be reached within \c
+         *      timeout. The driver is closed then, and recover() can be
+         *      called again
+         */
+        bool recover(base::Time const& timeout = base::Time::fromSeconds(30));
+        /** True if the periodic data is enabled but no solution came for
+         * the stall timeout. The board has most likely been reset */
+        bool isStalled() const;
+        /** Sets the stall timeout of isStalled(). The default, a null
+         * time, is twice the periodic data period plus 500ms */
+        void setStallTimeout(base::Time const& timeout);
+        RecoveryStatistics const& getRecoveryStatistics() const;
+
+        /** Framing counters of the device serving \c role. Roles served
+         * by the command device, and the PORT_CORRECTIONS device which the
+         * driver does not read, report the command device's counters */
+        LinkStatistics const& getLinkStatistics(PORT_ROLE role) const;
+        /** Counters of the sentences and epochs that went missing or could
+         * not be interpreted */
+        StreamStatistics const& getStreamStatistics() const;
+
         /** Dumps the almanac on stdout.
          *
          * Do it right after open()
          */
         void dumpAlmanac();
+        /** Queries the almanac with $PASHQ,ALM and returns the
+         * $PASHR,ALM sentences of the reply. Other packets received in the
+         * meantime are processed as with collectPeriodicData()
+         *
+         * @returns false if the board did not reply
+         */
+        bool getAlmanac(std::vector<std::string>& sentences);
+
+        /** Enables the warm-start cache. Must be called before open()
+         *
+         * While a fix is available, the position is recorded at most
+         * every \c save_period, and saveWarmStart() writes it in \c path.
+         * On open() and reset(false), the saved position is given to the
+         * board with setKnownPointInit() if it is younger than \c max_age.
+         */
+        void setWarmStartCache(std::string const& path,
+                base::Time const& max_age = base::Time::fromSeconds(4 * 3600),
+                base::Time const& save_period = base::Time::fromSeconds(60));
+        /** Captures the almanac with getAlmanac() and saves it in the
+         * warm-start cache. The board needs about 12.5 minutes of
+         * tracking to get a complete almanac */
+        bool saveAlmanac();
+        /** True if a position has been recorded since the last
+         * saveWarmStart() */
+        bool hasWarmStartUpdate() const;
+        /** Writes the recorded position in the warm-start cache. The data
+         * processing never writes the file itself, as this may block: the
+         * application calls this from its loop, or from a thread of its
+         * own, when hasWarmStartUpdate() is true
+         *
+         * @returns false if the file could not be written. The position
+         * stays pending then
+         */
+        bool saveWarmStart();
+        /** Initializes the board with a saved position
+         *
+         * @returns false if the data has no position or the board refused it
+         */
+        bool applyWarmStart(WarmStartData const& data);
+
+        /** Time between the last open() or reset() and the first
+         * solution with a fix. Null if there has been no fix yet */
+        base::Time getTimeToFirstFix() const;
+        /** Time between the last open() or reset() and the first RTK
+         * fixed solution. Null if there has been none yet */
+        base::Time getTimeToRTKFix() const;
+
+        /** The RTK quality indicators, updated at each solution */
+        RTKMonitor const& getRTKMonitor() const;
+        /** Publishes the RTK quality indicators in the POSIX shared
+         * memory segment \c name, for RTKStatisticsReader */
+        bool publishRTKStatistics(std::string const& name);
+        /** Publishes each solution in the POSIX shared memory segment \c
+         * name, for SolutionBusReader
+         *
+         * @arg capacity the number of solutions the segment holds. Readers
+         *      that fall further behind lose solutions
+         */
+        bool publishSolutions(std::string const& name,
+                uint32_t capacity = SolutionBus::DEFAULT_CAPACITY);
 
         /** Dumps the receiver status on stdout
          *
@@ -73,7 +243,8 @@ namespace gps {
 
         /** Forces the receiver to perform PVT initialization on a point
          * with known geographical coordinates (expressed in the ITRF
-         * model used).
+         * model used). Latitude and longitude are in the board's
+         * ddmm.mmmm format, the accuracies in meters.
          */
         bool setKnownPointInit(double, std::string, double, std::string, double, double, double, double, std::string);
 
@@ -107,8 +278,15 @@ namespace gps {
         bool setCodeMeasurementSmoothing(int, int, int);
         bool setNMEA(std::string, std::string, bool, double = 1);
         bool setNMEALL(std::string, bool);
+        /** Waits at most m_acq_timeout milliseconds for the ACK or NAK
+         * reply of the last command. The other packets received in the
+         * meantime are processed as with collectPeriodicData(), so that
+         * no data is lost while the board gets reconfigured.
+         */
         bool verifyAcknowledge(std::string const& cmd = "");
 
+        /** Returns the content of the board's $PASHR,RID reply (receiver
+         * type, firmware version and options) */
         std::string getBoardID();
 
         /** Interprets a NMEA GST message and returns the unmarshalled
@@ -129,16 +307,179 @@ namespace gps {
          *
          * @arg period { the update frequency in seconds. Can be one of
          *             0.1, 0.2, 0.5, 1 and any integer greater than 1 }
+         * @arg profile { the set of sentences used to build the solution.
+         *             With MB500_POS_OUTPUT, the errors are only updated at
+         *             the statistics rate, and the altitude is the
+         *             ellipsoidal height (geoidalSeparation is zero) }
          *
          * @see collectPeriodicData
          */
-        bool setPeriodicData(std::string const& port, double rate);
+        bool setPeriodicData(std::string const& port, double rate, MB500_OUTPUT_PROFILE profile = MB500_NMEA_OUTPUT);
+        /** setPeriodicData() on the PORT_DATA port */
+        bool setPeriodicData(double rate, MB500_OUTPUT_PROFILE profile = MB500_NMEA_OUTPUT);
+        /** Makes the board send its raw code and carrier phase
+         * measurements on \c port, as RTCM 3 messages 1004 and 1012, every
+         * \c period seconds. They get decoded along with the periodic
+         * data, see getRawEpoch(). A zero period stops them.
+         */
+        bool setRawDataOutput(std::string const& port, double period);
+        /** setRawDataOutput() on the PORT_DATA port */
+        bool setRawDataOutput(double period);
+        /** Tells the RTK engine that the corrections come from a moving
+         * base, e.g. a second receiver on the same vehicle
+         * ($PASHS,CPD,MOV). Needs the MB500_RTK_MOVING_BASE firmware
+         * option */
+        bool setMovingBase(bool enable);
+        /** Makes the board send the baseline vector to the base
+         * ($PASHR,VEC) and the heading (HDT) on \c port every \c period
+         * seconds, usually the period of the periodic data. They get
+         * interpreted along with the periodic data, see getBaseline() and
+         * getHeading(). A zero period stops them. HDT needs the
+         * MB500_HEADING firmware option, VEC alone gives the heading as
+         * well.
+         */
+        bool setHeadingOutput(std::string const& port, double period);
+        /** setHeadingOutput() on the PORT_DATA port */
+        bool setHeadingOutput(double period);
+        /** Enables or disables the event marker input. Needs the
+         * MB500_EVENT_MARKER firmware option
+         *
+         * The board timestamps the rising (or falling) edges of its marker
+         * input and reports them on \c port with $PASHR,TTT. Each event is
+         * held until the epoch that follows it, matched to the position
+         * interpolated at its time, and then pushed in the queue returned
+         * by getMarkerEvents().
+         */
+        bool setEventMarker(std::string const& port, bool enable, bool rising_edge = true);
+        /** setEventMarker() on the PORT_DATA port */
+        bool setEventMarker(bool enable, bool rising_edge = true);
+        /** The events of the marker input. One thread, e.g. the one that
+         * handles the camera, may pop() them while the driver processes
+         * data */
+        MarkerEventQueue& getMarkerEvents();
         /** Reads available data and update the \c data structure. If
          * this method returns true, then \c data has been updated with
          * a new, synchronized set of information. Otherwise, call
-         * collectPeriodicData again.
+         * collectPeriodicData again. It waits at most 100ms, and counts
+         * malformed sentences in StreamStatistics::invalidSentences
+         * instead of throwing.
          */
         void collectPeriodicData();
+        /** Processes one packet if a full one can be read without
+         * blocking, and updates the data structures accordingly.
+         *
+         * @returns false if no full packet was available
+         */
+        bool collectAvailableData();
+        /** Updates the data structures from one periodic message, as
+         * read by collectPeriodicData()
+         */
+        void interpretPeriodicData(boost::string_ref message);
+        /** Flags returned by processAvailable() */
+        enum PROCESS_STATUS
+        {
+            /** Nothing happened */
+            PROCESS_IDLE         = 0,
+            /** At least one packet has been processed */
+            PROCESS_DATA         = 1,
+            /** getSolutionTime() changed */
+            PROCESS_NEW_SOLUTION = 2,
+            /** At least one queued command operation completed, see
+             * popCommandResult() */
+            PROCESS_COMMAND_DONE = 4,
+            /** Reading from or writing to the device failed, see
+             * getProcessError(). The driver should be closed */
+            PROCESS_ERROR        = 8,
+            /** getRawEpoch() changed */
+            PROCESS_NEW_RAW_EPOCH = 16,
+            /** getHeading() changed */
+            PROCESS_NEW_HEADING  = 32,
+            /** At least one event got pushed in getMarkerEvents() */
+            PROCESS_NEW_MARKER_EVENT = 64
+        };
+        /** Non-blocking processing, for use in an external event loop
+         *
+         * Call it whenever getFileDescriptor() or
+         * getPortFileDescriptor(PORT_DATA) is readable, or the former is
+         * writable if hasPendingOutput() is true, or
+         * getPortFileDescriptor(PORT_CORRECTIONS) is writable if
+         * hasPendingCorrections() is true, and at the latest
+         * getNextTimeout() milliseconds after the last call. It reads
+         * everything available on the devices, processes all the complete packets, writes the
+         * queued commands and completes them on the board's ACK or NAK.
+         * The queued corrections are written last, so that they never
+         * delay the solutions. It never blocks and never throws.
+         *
+         * Do not mix it with the blocking methods while queued commands
+         * are pending, as these would consume the acknowledgements.
+         *
+         * @returns a combination of PROCESS_STATUS flags
+         */
+        int processAvailable();
+        /** errno of the failure reported by PROCESS_ERROR, or zero if the
+         * device reached end of file */
+        int getProcessError() const;
+
+        enum COMMAND_STATUS
+        {
+            COMMAND_ACKNOWLEDGED,
+            COMMAND_REJECTED,
+            COMMAND_TIMED_OUT,
+            /** The driver got closed, e.g. by recover(), before the board
+             * replied */
+            COMMAND_ABORTED
+        };
+        /** Completion of an operation queued with queueCommand(),
+         * queueNMEA() or queuePeriodicData() */
+        struct CommandResult
+        {
+            int operation;
+            COMMAND_STATUS status;
+            /** Description of the command that failed, or of the last one
+             * if all of them have been acknowledged */
+            std::string description;
+        };
+        /** Queues a $PASHS command, processed by processAvailable()
+         *
+         * @arg command the full command, including the trailing CRLF
+         * @returns the operation ID reported in the CommandResult
+         */
+        int queueCommand(std::string const& command, std::string const& description);
+        /** Queued version of setNMEA() */
+        int queueNMEA(std::string const& command, std::string const& port, bool onOff, double outputRate = 1);
+        /** Queued version of setPeriodicData(). The NMEA commands form a
+         * single operation, which stops at the first command the board
+         * refuses. The driver uses the new period and profile only once
+         * the operation got acknowledged */
+        int queuePeriodicData(std::string const& port, double period, MB500_OUTPUT_PROFILE profile = MB500_NMEA_OUTPUT);
+        /** True while queued commands have not been completed */
+        bool hasPendingCommands() const;
+        /** Gets the next completed operation, returns false if there is
+         * none */
+        bool popCommandResult(CommandResult& result);
+        /** True if queued command bytes wait for the device to be writable */
+        bool hasPendingOutput() const;
+        /** Milliseconds until processAvailable() has to be called to time
+         * out the current command, or -1 if no command is waiting */
+        int getNextTimeout() const;
+
+        /** Returns the time of the last complete solution, i.e. of the
+         * last epoch for which all the per-epoch sentences of the output
+         * profile have been received
+         */
+        base::Time getSolutionTime() const;
+        /** The last complete epoch of raw measurements, see
+         * setRawDataOutput() */
+        RawEpoch const& getRawEpoch() const;
+        /** The last baseline vector, see setHeadingOutput() */
+        Baseline const& getBaseline() const;
+        /** The last heading, see setHeadingOutput(). It is updated at each
+         * VEC or HDT sentence */
+        Heading const& getHeading() const;
+        /** Computes the heading and pitch of a baseline, and fills its
+         * east-north-up components, given the rover position in degrees
+         */
+        static Heading computeHeading(Baseline& baseline, double latitude, double longitude);
         /** Make the receiver stop sending periodic data */
         bool stopPeriodicData();
 
@@ -146,13 +487,77 @@ namespace gps {
         gps::Errors   errors;
         gps::SatelliteInfo satellites;
         gps::SolutionQuality solutionQuality;
+        /** Velocity of the last epoch, from VTG, RMC or POS */
+        gps::Velocity velocity;
 
+        /** Host time of the last epoch, corrected for the board's
+         * processing latency. It comes from the clock model once it is
+         * valid, see getHostTime() */
         base::Time cpu_time;
         base::Time real_time;
         double processing_latency;
 
+        /** Model of the host clock with respect to GPS time. It is fitted
+         * on the arrival times of the GGA or POS sentences, corrected for
+         * the processing latency reported by LTN */
+        ClockModel const& getClockModel() const;
+        /** Host time (in the time base of base::Time::now()) of an event
+         * given its GPS time, e.g. position.time or errors.time. The host
+         * jitter is removed by the clock model. Null until the model is
+         * valid */
+        base::Time getHostTime(base::Time const& gps_time) const;
+
+        /** Position at arbitrary host times, interpolated or extrapolated
+         * from the last epochs. predict() can be called from other
+         * threads while the driver processes data */
+        PositionPredictor const& getPredictor() const;
+
+        /** Writes correction data to the board, blocking until it is
+         * written or \c timeout expires. See queueCorrectionData() for the
+         * non-blocking version */
         void writeCorrectionData(char const* data, size_t size, int timeout);
 
+        /** Default bound of the correction queue, in bytes. About one
+         * second of RTCM 3 data at 115200 bauds */
+        static const size_t DEFAULT_CORRECTION_QUEUE_SIZE = 12 * 1024;
+        /** Counters of the correction queue */
+        struct CorrectionQueueStatus
+        {
+            /** Bytes and RTCM 3 frames waiting to be written */
+            size_t queuedBytes;
+            size_t queuedFrames;
+            /** Largest value of queuedBytes so far */
+            size_t maxQueuedBytes;
+            uint64_t writtenFrames;
+            uint64_t writtenBytes;
+            /** Frames dropped to keep the queue within its bound */
+            uint64_t droppedFrames;
+            uint64_t droppedBytes;
+            /** Bytes that were not part of a valid RTCM 3 frame */
+            uint64_t invalidBytes;
+        };
+        /** Queues RTCM 3 correction data for the board
+         *
+         * The data does not need to be aligned on frames: it is split into
+         * RTCM 3 frames, and incomplete frames are kept until the rest
+         * arrives. The frames are written by writeCorrectionQueue() and
+         * processAvailable() as the correction device accepts them. When
+         * the queue would exceed its bound, the oldest frames are dropped,
+         * which keeps the corrections the board gets recent. It never
+         * blocks.
+         */
+        void queueCorrectionData(char const* data, size_t size);
+        /** Writes as much of the queued corrections as the correction
+         * device accepts, without blocking. Returns false on error, see
+         * getProcessError() */
+        bool writeCorrectionQueue();
+        /** True if queued corrections wait for
+         * getPortFileDescriptor(PORT_CORRECTIONS) to be writable */
+        bool hasPendingCorrections() const;
+        /** Sets the bound of the correction queue, in bytes */
+        void setCorrectionQueueSize(size_t size);
+        CorrectionQueueStatus const& getCorrectionQueueStatus() const;
+
         /** Enable ntpd updates through its shm reference clock driver
          * this needs a line like this in ntp.conf:
          * server 127.127.28.unit
@@ -177,18 +582,308 @@ namespace gps {
         gps::SolutionQuality tempSolutionQuality;
 
         bool waitForBoardReset();
-        bool interpretQuality(std::string const& message);
-        static std::pair<base::Time, base::Time> interpretDateTime(std::string const& msg);
-        static gps::Errors interpretErrors(std::string const& msg);
-        static gps::Position interpretInfo(std::string const& msg);
-        static double interpretLatency(std::string const& message);
-        static bool interpretSatelliteInfo(gps::SatelliteInfo& data, std::string const& msg);
+        bool interpretQuality(boost::string_ref message);
+        /** Interprets a ZDA message. \c dated is set if the message had
+         * a date, otherwise the UTC time has the host's current day */
+        static std::pair<base::Time, base::Time> interpretDateTime(boost::string_ref msg, bool& dated);
+        static gps::Errors interpretErrors(boost::string_ref msg);
+        static gps::Position interpretInfo(boost::string_ref msg);
+        /** Interprets a $PASHR,POS message. The DOPs are written in \c
+         * quality */
+        static gps::Position interpretPOS(boost::string_ref msg, gps::SolutionQuality& quality,
+                gps::Velocity& velocity);
+        /** Interprets a VTG message. It has no time, the returned
+         * velocity's time is null */
+        static gps::Velocity interpretVTG(boost::string_ref msg);
+        /** Interprets a RMC message. Returns false if the receiver flags
+         * the data as invalid */
+        static bool interpretRMC(boost::string_ref msg, gps::Velocity& velocity);
+        /** Interprets a $PASHR,VEC message. The east-north-up components
+         * are left to computeHeading() */
+        static Baseline interpretVEC(boost::string_ref msg);
+        /** Interprets a HDT message and returns the heading in degrees. It
+         * has no time, it belongs to the epoch of the last GGA */
+        static double interpretHDT(boost::string_ref msg);
+        /** Interprets a $PASHR,TTT message. The event's date is the one of
+         * \c reference, e.g. the time of the last epoch, shifted by at
+         * most half a day */
+        static MarkerEvent interpretTTT(boost::string_ref msg, base::Time const& reference);
+        static double interpretLatency(boost::string_ref message);
+        static bool interpretSatelliteInfo(gps::SatelliteInfo& data, boost::string_ref msg);
         static double interpretAngle(std::string const& value, bool positive);
         static base::Time  interpretTime(std::string const& time);
 
+        /** UTC day of the epochs, in days since 1970-01-01, as given by
+         * the last ZDA. Negative until then, the times keep the host's
+         * current day that interpretTime() gives them */
+        int64_t m_utc_day;
+        /** Time of day of the last dated epoch, in microseconds, or -1 */
+        int64_t m_utc_time_of_day;
+        /** Replaces the day of a time given by interpretTime() by
+         * m_utc_day. The day moves on when the time of day wraps at
+         * midnight */
+        base::Time applyUTCDay(base::Time const& time);
+
         void updateNtpdShm();
 
-        std::string read(int timeout);
+        /** Size of the buffer in which the data is read from the board */
+        static const size_t READ_BUFFER_SIZE = 8192;
+        /** Data read from one of the devices, not processed yet */
+        struct ReadBuffer
+        {
+            std::vector<char> data;
+            size_t start;
+            size_t end;
+            /** Size of the packet last returned by extractBufferedPacket() */
+            size_t packetSize;
+            /** Monotonic time of the last read, i.e. arrival time of the
+             * packets framed since then */
+            base::Time readTime;
+            /** Not reset by clear() */
+            LinkStatistics statistics;
+
+            ReadBuffer();
+            void clear();
+        };
+        ReadBuffer m_command_buffer;
+        ReadBuffer m_data_buffer;
+
+        /** Devices opened by openPort(), -1 for the roles served by the
+         * command device. Index PORT_COMMAND is unused */
+        int m_port_fds[PORT_ROLE_COUNT];
+        /** The board's name of the ports */
+        std::string m_port_names[PORT_ROLE_COUNT];
+
+        enum READ_STATUS
+        {
+            READ_PACKET,
+            READ_FIRST_BYTE_TIMEOUT,
+            READ_PACKET_TIMEOUT
+        };
+        /** Reads one packet from the board
+         *
+         * The packet is framed in place in the driver's read buffer. The
+         * returned view is therefore valid only until the next call to
+         * read()
+         */
+        boost::string_ref read(int timeout, int packet_timeout = 5000);
+        /** Same as read(), but reports timeouts with the return value
+         * instead of a TimeoutError. I/O errors still throw
+         *
+         * While it waits on the command device, the data device opened by
+         * openPort() is drained through interpretPeriodicData(), so that
+         * the blocking commands do not let the periodic data pile up */
+        READ_STATUS tryRead(boost::string_ref& packet, int timeout, int packet_timeout = 5000);
+        /** tryRead() on another device than the command one */
+        READ_STATUS tryRead(int fd, ReadBuffer& buffer, boost::string_ref& packet,
+                int timeout, int packet_timeout = 5000);
+        /** Frames the next packet that is already in the read buffer, and
+         * releases the one returned by the previous call. When there is
+         * none, makes room in the buffer for readDevice() */
+        bool extractBufferedPacket(boost::string_ref& packet);
+        bool extractBufferedPacket(ReadBuffer& buffer, boost::string_ref& packet);
+        /** Reads the data the device has available, without waiting
+         *
+         * @returns the number of bytes read, zero if there was none, -1 on
+         * error (errno is set) and -2 at end of file
+         */
+        int readDevice();
+        int readDevice(int fd, ReadBuffer& buffer);
+        /** Processes everything available on a device, for
+         * processAvailable(). Returns PROCESS_STATUS flags */
+        int processDevice(int fd, ReadBuffer& buffer);
+        /** Interprets the packets available on the PORT_DATA device
+         * without waiting. Throws on I/O errors */
+        void drainDataDevice();
+        /** Reads the next periodic packet, from the data device if there
+         * is one */
+        READ_STATUS tryReadData(boost::string_ref& packet, int timeout, int packet_timeout = 5000);
+
+        struct QueuedCommand
+        {
+            int operation;
+            std::string command;
+            std::string description;
+            /** Set on the last command of a queuePeriodicData()
+             * operation. The settings are applied once the board
+             * acknowledged it */
+            bool periodic;
+            std::string periodicPort;
+            double periodicPeriod;
+            MB500_OUTPUT_PROFILE periodicProfile;
+
+            QueuedCommand()
+                : operation(0), periodic(false), periodicPeriod(0), periodicProfile(MB500_NMEA_OUTPUT) {}
+        };
+        std::deque<QueuedCommand> m_command_queue;
+        std::deque<CommandResult> m_command_results;
+        int m_last_operation;
+        /** Part of the front command that has been written */
+        size_t m_command_written;
+        /** Set while the front command waits for its acknowledgement */
+        base::Time m_command_deadline;
+        int m_process_error;
+        void pushCommand(int operation, std::string const& command, std::string const& description);
+        /** Records the periodic data settings once the board accepted
+         * them */
+        void applyPeriodicSettings(std::string const& port, double period, MB500_OUTPUT_PROFILE profile);
+        /** Completes the front command, and the operation it is part of if
+         * it failed or was its last command */
+        void completeCommand(COMMAND_STATUS status);
+        /** Writes the front command without blocking. Returns false on
+         * error */
+        bool writeQueuedCommand();
+
+        /** RTCM 3 frames waiting to be written, oldest first */
+        std::deque<std::string> m_correction_queue;
+        /** Part of the front frame that has been written. A frame that
+         * started to be written is never dropped */
+        size_t m_correction_written;
+        /** Start of a frame whose end has not been queued yet */
+        std::string m_correction_partial;
+        size_t m_correction_queue_size;
+        CorrectionQueueStatus m_correction_status;
+        /** Adds a complete frame to m_correction_queue, dropping the
+         * oldest ones if needed */
+        void pushCorrectionFrame(char const* frame, size_t size);
+        /** Writes the rest of the partially written front frame, blocking.
+         * Called by the blocking write methods before they use the
+         * correction device */
+        void finishCorrectionFrame(int timeout);
+
+        static std::string formatNMEA(std::string const& command, std::string const& port,
+                bool onOff, double outputRate, std::string& description);
+        /** The NMEA sentences enabled by setPeriodicData(), with their
+         * period */
+        static std::vector< std::pair<std::string, double> > getPeriodicSentences(
+                double period, MB500_OUTPUT_PROFILE profile);
+
+        MB500_OUTPUT_PROFILE m_output_profile;
+        int m_baudrate;
+
+        /** The settings recover() applies again, as recorded by the
+         * methods that change them. Zero, negative and empty values are
+         * the settings that have not been changed */
+        struct Configuration
+        {
+            std::string device;
+            std::string portDevices[PORT_ROLE_COUNT];
+            int maxBaudrate;
+            int processingRate;
+            int dynamics;
+            bool hasUserDynamics;
+            int userDynamics[4];
+            int fixThreshold;
+            int fastRTK;
+            bool hasBasePosition;
+            double basePosition[3];
+            std::string rtkInputPort;
+            std::string rtkBasePort;
+            std::string periodicPort;
+            double periodicPeriod;
+            MB500_OUTPUT_PROFILE periodicProfile;
+            std::string rawPort;
+            double rawPeriod;
+            int movingBase;
+            std::string headingPort;
+            double headingPeriod;
+            std::string markerPort;
+            bool markerEnabled;
+            bool markerRisingEdge;
+
+            Configuration();
+        };
+        Configuration m_configuration;
+        base::Time m_stall_timeout;
+        /** Monotonic times of the last data received, and of the last
+         * solution or the last change of the periodic data */
+        base::Time m_last_reception;
+        base::Time m_last_solution_reception;
+        RecoveryStatistics m_recovery_statistics;
+        /** Queries the board until it answers, at the current rate and at
+         * DEFAULT_BAUDRATE, which the board falls back to on reset.
+         * Returns false right away if the host rate cannot be changed */
+        bool waitForBoard(base::Time const& timeout);
+        /** One attempt of recover(). Sets \c board_reset if the board
+         * turns out to have been reset */
+        bool reconnect(bool& board_reset);
+        bool applyConfiguration();
+
+        /** Drops all received data, both in the kernel and in the driver */
+        void clearReadBuffer();
+        bool setHostBaudrate(int rate);
+        /** Sends a $PASHQ,PRT query and returns the name and baud rate of
+         * the port we are connected to */
+        bool queryPortSetting(int timeout, std::string& port, int& baudrate);
+        bool queryPortSetting(int fd, ReadBuffer& buffer, int timeout, std::string& port, int& baudrate);
+        /** Writes \c command to a device other than the command one */
+        void write(int fd, std::string const& command, int timeout);
+        base::Time m_solution_time;
+        /** Called when all the sentences of an epoch have been received */
+        void setSolutionTime(base::Time const& time);
+
+        std::string m_warm_start_path;
+        base::Time m_warm_start_max_age;
+        base::Time m_warm_start_period;
+        WarmStartData m_warm_start;
+        base::Time m_warm_start_last_update;
+        /** Set when m_warm_start has a position not saved yet */
+        bool m_warm_start_dirty;
+        /** Records the current position in m_warm_start */
+        void updateWarmStart();
+
+        base::Time m_acquisition_start;
+        base::Time m_time_to_first_fix;
+        base::Time m_time_to_rtk_fix;
+        RTKMonitor m_rtk_monitor;
+        SolutionBus m_solution_bus;
+
+        ClockModel m_clock_model;
+        /** Arrival time of the packet being processed, see
+         * ReadBuffer::readTime */
+        base::Time m_read_time;
+        /** Offset between base::Time::now() and the monotonic clock, at
+         * the last clock sample */
+        base::Time m_realtime_offset;
+        /** Adds the arrival of the first sentence of the epoch at \c
+         * gps_time to the clock model */
+        void addClockSample(base::Time const& gps_time);
+        /** Host time of the current epoch, for the sentences that do not
+         * have a time of their own */
+        base::Time getEpochHostTime() const;
+        PositionPredictor m_predictor;
+        RawObservationDecoder m_raw_decoder;
+        Baseline m_baseline;
+        Heading m_heading;
+        MarkerEventQueue m_marker_events;
+        /** Events waiting for the epoch that follows them */
+        std::deque<MarkerEvent> m_pending_events;
+        uint64_t m_marker_event_count;
+        StreamStatistics m_stream_statistics;
+        /** Next GSV sentence number expected in the current cycle, zero
+         * between cycles, and the talker of the cycle */
+        int m_gsv_next;
+        char m_gsv_talker;
+        /** Set once the current GSV or GSA cycle has been counted as
+         * incomplete */
+        bool m_gsv_broken;
+        bool m_gsa_broken;
+        /** Packets dropped on all links at the last GSA sentence */
+        uint64_t m_gsa_dropped_packets;
+        /** Updates the GSV cycle counters with a GSV sentence */
+        void checkGSVSequence(boost::string_ref message);
+        /** Truncated packets and checksum failures on all links */
+        uint64_t getDroppedPacketCount() const;
+        /** Counts a packet discarded by the framing */
+        static void countDroppedPacket(LinkStatistics& statistics, char const* data, size_t size);
+
+        /** Matches the pending events that are before the current epoch,
+         * or all of them if \c flush is set, and queues them */
+        void matchMarkerEvents(bool flush);
+        /** Restarts the TTFF measurements and applies the warm-start
+         * cache, if any */
+        void startAcquisition(bool warm_start);
+
         void write(const std::string&, int timeout);
         int extractPacket(uint8_t const* buffer, size_t buffer_size) const;
 
@@ -0,0 +1,477 @@
+#include "mb500_archive.hh"
+
+#include <iostream>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/crc.hpp>
+
+using namespace std;
+using namespace gps;
+using namespace gps_base;
+
+static const uint32_t ARCHIVE_MAGIC   = 0x41354d42; // "BM5A"
+static const uint16_t ARCHIVE_VERSION = 1;
+
+struct ArchiveBlockHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t solution_count;
+    uint32_t payload_size;
+    /** CRC32 of the header (with crc set to zero) and of the payload */
+    uint32_t crc;
+    int64_t  start_time;
+    int64_t  end_time;
+    /** Offset of each column, relative to the start of the payload */
+    uint32_t column_offsets[ARCHIVE_COLUMN_COUNT];
+};
+
+/** Scale applied to each column before rounding to integers */
+static const double COLUMN_SCALES[ARCHIVE_COLUMN_COUNT] = {
+    1e6,  // time, microseconds
+    1e9,  // latitude, 1e-9 degrees
+    1e9,  // longitude
+    1e3,  // altitude, mm
+    1e3,  // geoidal separation
+    1,    // position type
+    1,    // satellite count
+    10,   // correction age, 0.1s
+    1e3,  // deviations, mm
+    1e3,
+    1e3,
+    100,  // DOPs
+    100,
+    100
+};
+
+/** Quantised value of the unknown (NaN) and out of range values. It is
+ * what llround() returns for them, so archives written before it was
+ * reserved read back the same */
+static const int64_t ARCHIVE_UNKNOWN = INT64_MIN;
+
+static int64_t quantize(double value, int column)
+{
+    double scaled = value * COLUMN_SCALES[column];
+    if (!(fabs(scaled) < 9e18))
+        return ARCHIVE_UNKNOWN;
+    return llround(scaled);
+}
+
+static double dequantize(int64_t value, int column)
+{
+    if (value == ARCHIVE_UNKNOWN)
+        return NAN;
+    return value / COLUMN_SCALES[column];
+}
+
+static int64_t quantize(ArchivedSolution const& solution, int column)
+{
+    switch(column)
+    {
+        case ARCHIVE_TIME:                return solution.position.time.microseconds;
+        case ARCHIVE_LATITUDE:            return quantize(solution.position.latitude, column);
+        case ARCHIVE_LONGITUDE:           return quantize(solution.position.longitude, column);
+        case ARCHIVE_ALTITUDE:            return quantize(solution.position.altitude, column);
+        case ARCHIVE_GEOIDAL_SEPARATION:  return quantize(solution.position.geoidalSeparation, column);
+        case ARCHIVE_POSITION_TYPE:       return solution.position.positionType;
+        case ARCHIVE_SATELLITE_COUNT:     return solution.position.noOfSatellites;
+        case ARCHIVE_CORRECTION_AGE:      return quantize(solution.position.ageOfDifferentialCorrections, column);
+        case ARCHIVE_DEVIATION_LATITUDE:  return quantize(solution.errors.deviationLatitude, column);
+        case ARCHIVE_DEVIATION_LONGITUDE: return quantize(solution.errors.deviationLongitude, column);
+        case ARCHIVE_DEVIATION_ALTITUDE:  return quantize(solution.errors.deviationAltitude, column);
+        case ARCHIVE_PDOP:                return quantize(solution.pdop, column);
+        case ARCHIVE_HDOP:                return quantize(solution.hdop, column);
+        case ARCHIVE_VDOP:                return quantize(solution.vdop, column);
+    }
+    return 0;
+}
+
+/** Difference and sum modulo 2^64. The zig-zag encoding is a bijection on
+ * 64 bits, so the deltas of any two values round-trip without a signed
+ * overflow */
+static int64_t wrappingSub(int64_t a, int64_t b)
+{ return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b)); }
+static int64_t wrappingAdd(int64_t a, int64_t b)
+{ return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b)); }
+
+static void writeVarint(std::vector<uint8_t>& buffer, int64_t value)
+{
+    // zig-zag encoding so that small negative deltas stay small
+    uint64_t encoded = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    while (encoded >= 0x80)
+    {
+        buffer.push_back(static_cast<uint8_t>(encoded) | 0x80);
+        encoded >>= 7;
+    }
+    buffer.push_back(static_cast<uint8_t>(encoded));
+}
+
+static int64_t readVarint(uint8_t const*& it, uint8_t const* end)
+{
+    uint64_t encoded = 0;
+    for (int shift = 0; it != end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *it++;
+        encoded |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return static_cast<int64_t>(encoded >> 1) ^ -static_cast<int64_t>(encoded & 1);
+}
+
+static uint32_t computeCRC(ArchiveBlockHeader header, uint8_t const* payload)
+{
+    header.crc = 0;
+    boost::crc_32_type crc;
+    crc.process_bytes(&header, sizeof(header));
+    crc.process_bytes(payload, header.payload_size);
+    return crc.checksum();
+}
+
+/** Returns the size of the block starting at \c offset, or zero if there
+ * is no complete and valid block there
+ */
+static size_t validateBlock(uint8_t const* data, size_t size, size_t offset)
+{
+    if (size - offset < sizeof(ArchiveBlockHeader))
+        return 0;
+
+    ArchiveBlockHeader header;
+    memcpy(&header, data + offset, sizeof(header));
+    if (header.magic != ARCHIVE_MAGIC || header.version != ARCHIVE_VERSION)
+        return 0;
+    if (size - offset - sizeof(header) < header.payload_size)
+        return 0;
+    for (int i = 0; i < ARCHIVE_COLUMN_COUNT; ++i)
+    {
+        if (header.column_offsets[i] > header.payload_size)
+            return 0;
+    }
+    if (computeCRC(header, data + offset + sizeof(header)) != header.crc)
+        return 0;
+    return sizeof(header) + header.payload_size;
+}
+
+SolutionArchiveWriter::SolutionArchiveWriter()
+    : m_fd(-1), m_sync(false), m_failing(false)
+{
+    m_pending.reserve(ARCHIVE_BLOCK_SIZE);
+}
+
+SolutionArchiveWriter::~SolutionArchiveWriter()
+{
+    close();
+}
+
+bool SolutionArchiveWriter::open(std::string const& path, bool sync)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open archive " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    // Find the end of the last valid block, and drop whatever a crash
+    // could have left after it
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    size_t valid_end = 0;
+    if (file_stat.st_size > 0)
+    {
+        void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            cerr << "dgps/mb500: cannot map archive " << path << ": " << strerror(errno) << endl;
+            ::close(fd);
+            return false;
+        }
+        while (size_t block_size = validateBlock(static_cast<uint8_t const*>(data), file_stat.st_size, valid_end))
+            valid_end += block_size;
+        munmap(data, file_stat.st_size);
+    }
+
+    if (valid_end != static_cast<size_t>(file_stat.st_size))
+    {
+        cerr << "dgps/mb500: dropping " << file_stat.st_size - valid_end << " bytes of incomplete data at the end of " << path << endl;
+        if (ftruncate(fd, valid_end) == -1)
+        {
+            ::close(fd);
+            return false;
+        }
+    }
+    lseek(fd, valid_end, SEEK_SET);
+
+    m_fd   = fd;
+    m_sync = sync;
+    return true;
+}
+
+void SolutionArchiveWriter::close()
+{
+    flush();
+    if (m_fd != -1)
+        ::close(m_fd);
+    m_fd = -1;
+    m_pending.clear();
+    m_failing = false;
+}
+
+void SolutionArchiveWriter::append(Position const& position, Errors const& errors, SolutionQuality const& quality)
+{
+    ArchivedSolution solution;
+    solution.position = position;
+    solution.errors   = errors;
+    solution.pdop     = quality.pdop;
+    solution.hdop     = quality.hdop;
+    solution.vdop     = quality.vdop;
+
+    // Epochs are kept while the writes fail, up to a limit
+    if (m_pending.size() >= static_cast<size_t>(MAX_PENDING_BLOCKS * ARCHIVE_BLOCK_SIZE))
+    {
+        cerr << "dgps/mb500: dropping " << ARCHIVE_BLOCK_SIZE << " epochs that could not be archived" << endl;
+        m_pending.erase(m_pending.begin(), m_pending.begin() + ARCHIVE_BLOCK_SIZE);
+    }
+    m_pending.push_back(solution);
+
+    // Retry failed writes only once a new block is complete
+    if (m_pending.size() % ARCHIVE_BLOCK_SIZE == 0)
+        flush();
+}
+
+bool SolutionArchiveWriter::flush()
+{
+    while (!m_pending.empty() && m_fd != -1)
+    {
+        size_t count = std::min<size_t>(m_pending.size(), ARCHIVE_BLOCK_SIZE);
+        if (!writeBlock(count))
+            return false;
+        m_pending.erase(m_pending.begin(), m_pending.begin() + count);
+        m_failing = false;
+    }
+    return true;
+}
+
+bool SolutionArchiveWriter::writeBlock(size_t count)
+{
+    ArchiveBlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic          = ARCHIVE_MAGIC;
+    header.version        = ARCHIVE_VERSION;
+    header.solution_count = count;
+    header.start_time     = m_pending.front().position.time.microseconds;
+    header.end_time       = m_pending[count - 1].position.time.microseconds;
+
+    m_block.resize(sizeof(header));
+    for (int column = 0; column < ARCHIVE_COLUMN_COUNT; ++column)
+    {
+        header.column_offsets[column] = m_block.size() - sizeof(header);
+
+        int64_t last = 0, last_delta = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            int64_t value = quantize(m_pending[i], column);
+            int64_t delta = wrappingSub(value, last);
+            if (column == ARCHIVE_TIME)
+                writeVarint(m_block, wrappingSub(delta, last_delta));
+            else
+                writeVarint(m_block, delta);
+            last = value;
+            last_delta = delta;
+        }
+    }
+    header.payload_size = m_block.size() - sizeof(header);
+    header.crc = computeCRC(header, &m_block[sizeof(header)]);
+    memcpy(&m_block[0], &header, sizeof(header));
+
+    // Write the block in one go. If it fails midway, remove the partial
+    // block: the readers stop at the first invalid one, and would miss
+    // the blocks appended after it
+    off_t block_start = lseek(m_fd, 0, SEEK_CUR);
+    size_t written = 0;
+    while (written < m_block.size())
+    {
+        int ret = ::write(m_fd, &m_block[written], m_block.size() - written);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!m_failing)
+                cerr << "dgps/mb500: error writing archive: " << strerror(errno) << endl;
+            m_failing = true;
+            if (written > 0 && (ftruncate(m_fd, block_start) == -1 || lseek(m_fd, block_start, SEEK_SET) == -1))
+            {
+                cerr << "dgps/mb500: cannot remove the partial block, closing the archive: " << strerror(errno) << endl;
+                ::close(m_fd);
+                m_fd = -1;
+            }
+            return false;
+        }
+        written += ret;
+    }
+
+    if (m_sync)
+        fsync(m_fd);
+    return true;
+}
+
+SolutionArchiveReader::SolutionArchiveReader()
+    : m_data(NULL), m_size(0), m_solution_count(0)
+{
+}
+
+SolutionArchiveReader::~SolutionArchiveReader()
+{
+    close();
+}
+
+bool SolutionArchiveReader::open(std::string const& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open archive " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    if (file_stat.st_size == 0)
+    {
+        ::close(fd);
+        return true;
+    }
+
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "dgps/mb500: cannot map archive " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    m_data = static_cast<uint8_t const*>(data);
+    m_size = file_stat.st_size;
+
+    size_t offset = 0;
+    while (size_t block_size = validateBlock(m_data, m_size, offset))
+    {
+        m_blocks.push_back(offset);
+        m_solution_count += getBlockSize(m_blocks.size() - 1);
+        offset += block_size;
+    }
+    return true;
+}
+
+void SolutionArchiveReader::close()
+{
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    m_data = NULL;
+    m_size = 0;
+    m_blocks.clear();
+    m_solution_count = 0;
+}
+
+size_t SolutionArchiveReader::getBlockCount() const
+{ return m_blocks.size(); }
+size_t SolutionArchiveReader::getSolutionCount() const
+{ return m_solution_count; }
+
+static ArchiveBlockHeader getHeader(uint8_t const* data, size_t offset)
+{
+    ArchiveBlockHeader header;
+    memcpy(&header, data + offset, sizeof(header));
+    return header;
+}
+
+size_t SolutionArchiveReader::getBlockSize(size_t block) const
+{ return getHeader(m_data, m_blocks[block]).solution_count; }
+base::Time SolutionArchiveReader::getBlockStartTime(size_t block) const
+{ return base::Time::fromMicroseconds(getHeader(m_data, m_blocks[block]).start_time); }
+base::Time SolutionArchiveReader::getBlockEndTime(size_t block) const
+{ return base::Time::fromMicroseconds(getHeader(m_data, m_blocks[block]).end_time); }
+
+void SolutionArchiveReader::readRawColumn(size_t block, ARCHIVE_COLUMN column, std::vector<int64_t>& values) const
+{
+    ArchiveBlockHeader header = getHeader(m_data, m_blocks[block]);
+    uint8_t const* payload = m_data + m_blocks[block] + sizeof(header);
+    uint8_t const* it  = payload + header.column_offsets[column];
+    uint8_t const* end = payload + (column + 1 < ARCHIVE_COLUMN_COUNT ? header.column_offsets[column + 1] : header.payload_size);
+
+    values.resize(header.solution_count);
+    int64_t last = 0, last_delta = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        int64_t delta = readVarint(it, end);
+        if (column == ARCHIVE_TIME)
+            delta = wrappingAdd(delta, last_delta);
+        last = wrappingAdd(last, delta);
+        last_delta = delta;
+        values[i] = last;
+    }
+}
+
+void SolutionArchiveReader::readColumn(size_t block, ARCHIVE_COLUMN column, std::vector<double>& values) const
+{
+    std::vector<int64_t> raw;
+    readRawColumn(block, column, raw);
+    values.resize(raw.size());
+    for (size_t i = 0; i < raw.size(); ++i)
+        values[i] = dequantize(raw[i], column);
+}
+
+void SolutionArchiveReader::readTimes(size_t block, std::vector<base::Time>& times) const
+{
+    std::vector<int64_t> raw;
+    readRawColumn(block, ARCHIVE_TIME, raw);
+    times.resize(raw.size());
+    for (size_t i = 0; i < raw.size(); ++i)
+        times[i] = base::Time::fromMicroseconds(raw[i]);
+}
+
+void SolutionArchiveReader::readBlock(size_t block, std::vector<ArchivedSolution>& solutions) const
+{
+    solutions.resize(getBlockSize(block));
+
+    std::vector<int64_t> raw;
+    for (int column = 0; column < ARCHIVE_COLUMN_COUNT; ++column)
+    {
+        readRawColumn(block, static_cast<ARCHIVE_COLUMN>(column), raw);
+        for (size_t i = 0; i < raw.size(); ++i)
+        {
+            ArchivedSolution& s = solutions[i];
+            switch(column)
+            {
+                case ARCHIVE_TIME:
+                    s.position.time = base::Time::fromMicroseconds(raw[i]);
+                    s.errors.time   = s.position.time;
+                    break;
+                case ARCHIVE_LATITUDE:            s.position.latitude = dequantize(raw[i], column); break;
+                case ARCHIVE_LONGITUDE:           s.position.longitude = dequantize(raw[i], column); break;
+                case ARCHIVE_ALTITUDE:            s.position.altitude = dequantize(raw[i], column); break;
+                case ARCHIVE_GEOIDAL_SEPARATION:  s.position.geoidalSeparation = dequantize(raw[i], column); break;
+                case ARCHIVE_POSITION_TYPE:       s.position.positionType = static_cast<GPS_SOLUTION_TYPES>(raw[i]); break;
+                case ARCHIVE_SATELLITE_COUNT:     s.position.noOfSatellites = raw[i]; break;
+                case ARCHIVE_CORRECTION_AGE:      s.position.ageOfDifferentialCorrections = dequantize(raw[i], column); break;
+                case ARCHIVE_DEVIATION_LATITUDE:  s.errors.deviationLatitude = dequantize(raw[i], column); break;
+                case ARCHIVE_DEVIATION_LONGITUDE: s.errors.deviationLongitude = dequantize(raw[i], column); break;
+                case ARCHIVE_DEVIATION_ALTITUDE:  s.errors.deviationAltitude = dequantize(raw[i], column); break;
+                case ARCHIVE_PDOP:                s.pdop = dequantize(raw[i], column); break;
+                case ARCHIVE_HDOP:                s.hdop = dequantize(raw[i], column); break;
+                case ARCHIVE_VDOP:                s.vdop = dequantize(raw[i], column); break;
+            }
+        }
+    }
+}
+
@@ -0,0 +1,143 @@
+#ifndef MAGELLAN_MB500_ARCHIVE_H
+#define MAGELLAN_MB500_ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "gps_types.hh"
+
+namespace gps {
+    /** Columns stored in a solution archive */
+    enum ARCHIVE_COLUMN
+    {
+        ARCHIVE_TIME = 0,
+        ARCHIVE_LATITUDE,
+        ARCHIVE_LONGITUDE,
+        ARCHIVE_ALTITUDE,
+        ARCHIVE_GEOIDAL_SEPARATION,
+        ARCHIVE_POSITION_TYPE,
+        ARCHIVE_SATELLITE_COUNT,
+        ARCHIVE_CORRECTION_AGE,
+        ARCHIVE_DEVIATION_LATITUDE,
+        ARCHIVE_DEVIATION_LONGITUDE,
+        ARCHIVE_DEVIATION_ALTITUDE,
+        ARCHIVE_PDOP,
+        ARCHIVE_HDOP,
+        ARCHIVE_VDOP,
+        ARCHIVE_COLUMN_COUNT
+    };
+
+    /** One epoch, as stored in a solution archive. The values are
+     * quantised: 1e-9 degrees for latitude and longitude, millimeters for
+     * altitudes and deviations, 0.01 for the DOPs and 0.1 s for the age of
+     * corrections.
+     */
+    struct ArchivedSolution
+    {
+        gps::Position position;
+        gps::Errors   errors;
+        double pdop;
+        double hdop;
+        double vdop;
+    };
+
+    /** Writes solutions in a compact, append-only archive
+     *
+     * Solutions are accumulated in memory and written by blocks of
+     * ARCHIVE_BLOCK_SIZE epochs. Inside a block, each column is stored
+     * separately as zig-zag varint-encoded deltas of the quantised values
+     * (second order deltas for the time). Each block is written with a
+     * single write() and carries its size and a CRC, so a crash can at
+     * worst leave a partial block at the end of the file, which readers
+     * ignore and which open() truncates before appending. A block whose
+     * write fails is removed from the file, and its epochs are kept in
+     * memory for the next flush(), up to MAX_PENDING_BLOCKS blocks.
+     *
+     * Unknown (NaN) values are stored as a reserved quantised value, and
+     * read back as NaN.
+     *
+     * The archive uses the host byte order.
+     */
+    class SolutionArchiveWriter
+    {
+    public:
+        /** Number of epochs in a full block */
+        static const int ARCHIVE_BLOCK_SIZE = 1024;
+        /** Number of blocks kept in memory while the writes fail. The
+         * oldest epochs are dropped beyond that */
+        static const int MAX_PENDING_BLOCKS = 16;
+
+        SolutionArchiveWriter();
+        ~SolutionArchiveWriter();
+
+        /** Opens an archive for appending, creating it if needed
+         *
+         * @arg sync if true, fsync() is called after each block
+         */
+        bool open(std::string const& path, bool sync = false);
+        /** Writes the pending epochs and closes the file */
+        void close();
+
+        void append(gps::Position const& position, gps::Errors const& errors, gps::SolutionQuality const& quality);
+        /** Writes the pending epochs as blocks, the last one possibly
+         * partial. On error, the epochs that could not be written stay
+         * pending */
+        bool flush();
+
+    private:
+        int  m_fd;
+        bool m_sync;
+        /** Set after a failed write, until the next successful one */
+        bool m_failing;
+        std::vector<ArchivedSolution> m_pending;
+        std::vector<uint8_t> m_block;
+
+        /** Writes the first \c count pending epochs as one block */
+        bool writeBlock(size_t count);
+    };
+
+    /** Reads an archive written by SolutionArchiveWriter
+     *
+     * The file is memory-mapped. Blocks are indexed at open(), and each
+     * column of a block can be decoded independently of the others.
+     */
+    class SolutionArchiveReader
+    {
+    public:
+        SolutionArchiveReader();
+        ~SolutionArchiveReader();
+
+        bool open(std::string const& path);
+        void close();
+
+        size_t getBlockCount() const;
+        size_t getSolutionCount() const;
+        /** Number of epochs in the given block */
+        size_t getBlockSize(size_t block) const;
+        /** Time of the first and last epoch of a block, read from the
+         * block header */
+        base::Time getBlockStartTime(size_t block) const;
+        base::Time getBlockEndTime(size_t block) const;
+
+        /** Decodes one column of a block, in physical units. The time is
+         * returned in seconds since the epoch.
+         */
+        void readColumn(size_t block, ARCHIVE_COLUMN column, std::vector<double>& values) const;
+        /** Decodes the time column of a block */
+        void readTimes(size_t block, std::vector<base::Time>& times) const;
+        /** Decodes all columns of a block */
+        void readBlock(size_t block, std::vector<ArchivedSolution>& solutions) const;
+
+    private:
+        uint8_t const* m_data;
+        size_t m_size;
+        std::vector<size_t> m_blocks;
+        size_t m_solution_count;
+
+        void readRawColumn(size_t block, ARCHIVE_COLUMN column, std::vector<int64_t>& values) const;
+    };
+}
+
+#endif
+
@@ -1,4 +1,5 @@
 #include "mb500.hh"
+#include "mb500_survey.hh"
 #include <iostream>
 #include <sys/time.h>
 #include <time.h>
@@ -14,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <math.h>
 
 using namespace std;
 using namespace gps_base;
@@ -58,8 +60,61 @@ int openSocket(std::string const& hostname, std::string const& port)
     return sfd;
 }
 
-static const int AVERAGING_TIME     = 10;
 static const int AVERAGING_SAMPLING = 1;
+/** Survey-in stops when the standard error of the position falls below
+ * SURVEY_TARGET_ERROR (in meters), but not before SURVEY_MIN_DURATION and
+ * at most after SURVEY_MAX_DURATION seconds */
+static const double SURVEY_TARGET_ERROR = 0.5;
+static const double SURVEY_MIN_DURATION = 10;
+static const double SURVEY_MAX_DURATION = 600;
+/** The cached base position is used if the current fix is within
+ * CACHE_TOLERANCE_SIGMA times its GST deviation of it, with a minimum of
+ * CACHE_MIN_TOLERANCE meters. The check waits at most CACHE_CHECK_TIMEOUT
+ * seconds for a fix. */
+static const double CACHE_TOLERANCE_SIGMA = 3;
+static const double CACHE_MIN_TOLERANCE   = 5;
+static const double CACHE_CHECK_TIMEOUT   = 30;
+/** The board gets reconnected if no correction data came for that many
+ * seconds */
+static const double CORRECTION_TIMEOUT    = 3;
+
+/** Returns where the base position gets cached between runs */
+static string getCachePath()
+{
+    char const* path = getenv("MB500_BASE_CACHE");
+    if (path)
+        return path;
+    char const* home = getenv("HOME");
+    return string(home ? home : ".") + "/.mb500_base_position";
+}
+
+/** Checks that the board is still where the cached position says */
+static bool checkCachedPosition(gps::MB500& gps, gps::SurveyedPosition const& cached)
+{
+    base::Time start = base::Time::now();
+    base::Time last_update;
+    while ((base::Time::now() - start).toSeconds() < CACHE_CHECK_TIMEOUT)
+    {
+        gps.collectPeriodicData();
+        if (gps.getSolutionTime() <= last_update)
+            continue;
+        last_update = gps.getSolutionTime();
+
+        gps::Position const& pos = gps.position;
+        if (pos.positionType == NO_SOLUTION || pos.positionType == INVALID)
+            continue;
+
+        double distance = cached.distanceTo(pos.latitude, pos.longitude, pos.altitude + pos.geoidalSeparation);
+        double deviation = sqrt(gps.errors.deviationLatitude * gps.errors.deviationLatitude +
+                gps.errors.deviationLongitude * gps.errors.deviationLongitude +
+                gps.errors.deviationAltitude * gps.errors.deviationAltitude);
+        double tolerance = max(CACHE_MIN_TOLERANCE, CACHE_TOLERANCE_SIGMA * deviation);
+        cerr << "current fix is " << setprecision(2) << fixed << distance << "m away from the cached position (tolerance: " << tolerance << "m)" << endl;
+        return distance < tolerance;
+    }
+    cerr << "no fix within " << CACHE_CHECK_TIMEOUT << " seconds" << endl;
+    return false;
+}
 int main (int argc, const char** argv){
     gps::MB500 gps;
 
@@ -108,6 +163,12 @@ int main (int argc, const char** argv){
     }
 
 
+    string board_id;
+    try { board_id = gps.getBoardID(); }
+    catch(std::runtime_error& e)
+    { cerr << "cannot get the board ID, the base position cache is disabled" << endl; }
+    string cache_path = getCachePath();
+
     gps.setPeriodicData(current_port, AVERAGING_SAMPLING);
     cerr << "MB500 board initialized" << endl;
     gps::MB500::displayHeader(cerr);
@@ -138,55 +199,124 @@ int main (int argc, const char** argv){
             << "alt  " << setprecision(2)  << fixed << gps.position.altitude + gps.position.geoidalSeparation << endl;
 
         gps::MB500::display(cout, gps);
+
+        gps::SurveyedPosition given;
+        given.board_id  = board_id;
+        given.latitude  = pos[0];
+        given.longitude = pos[1];
+        given.height    = pos[2];
+        given.time      = base::Time::now();
+        if (!board_id.empty() && !given.save(cache_path))
+            cerr << "cannot save the base position in " << cache_path << endl;
     } else {
-	size_t count = 0;
-	double pos[3] = { 0, 0, 0 };
-	while(true)
+	bool position_set = false;
+	gps::SurveyedPosition cached;
+	if (!board_id.empty() && cached.load(cache_path) && cached.board_id == board_id)
+	{
+	    cerr << "found a cached base position in " << cache_path << ", checking it against the current fix" << endl;
+	    if (checkCachedPosition(gps, cached))
+	    {
+		cerr << "the board did not move, using the cached position" << endl;
+		gps.stopPeriodicData();
+		if (gps.setPosition(cached.latitude, cached.longitude, cached.height))
+		    position_set = true;
+		else
+		{
+		    cerr << "failed to set the cached position" << endl;
+		    gps.setPeriodicData(current_port, AVERAGING_SAMPLING);
+		}
+	    }
+	    else
+		cerr << "the board moved, surveying again" << endl;
+	}
+
+	if (!position_set)
 	{
-	    gps.collectPeriodicData();
-	    if (gps.position.time == gps.errors.time && (gps.position.time > last_update || last_update == base::Time()))
+	    gps::SurveyIn survey(SURVEY_TARGET_ERROR, SURVEY_MIN_DURATION, SURVEY_MAX_DURATION);
+	    while(true)
 	    {
-		if (gps.position.positionType != NO_SOLUTION && gps.position.positionType != INVALID)
+		gps.collectPeriodicData();
+		if (gps.getSolutionTime() > last_update)
 		{
-		    if (first_solution.isNull())
+		    GPS_SOLUTION_TYPES old_fix = survey.getFixType();
+		    bool complete = survey.update(gps.position, gps.errors);
+		    if (survey.getFixType() != old_fix)
+			cerr << "surveying with fix type " << survey.getFixType() << endl;
+
+		    last_update = gps.getSolutionTime();
+		    gps::MB500::display(cerr, gps)
+			<< " | " << survey.getSampleCount() << " samples, error=" << setprecision(3) << survey.getStandardError() << endl;
+
+		    if (complete)
 		    {
-			first_solution = gps.position.time;
-			cerr << "first solution found, now waiting " << AVERAGING_TIME << " seconds." << endl;
+			cerr << "survey done in " << survey.getDuration().toSeconds() << " seconds, now setting base station position" << endl;
+			break;
 		    }
-		    pos[0] += gps.position.latitude;
-		    pos[1] += gps.position.longitude;
-		    pos[2] += gps.position.altitude;
-		    ++count;
 		}
-
-		last_update = gps.position.time;
-                gps::MB500::display(cerr, gps) << endl;
 	    }
 
-	    if (!first_solution.isNull() && (gps.position.time - first_solution) > base::Time::fromSeconds(AVERAGING_TIME))
+	    gps.stopPeriodicData();
+	    double pos[3];
+	    survey.getPosition(pos[0], pos[1], pos[2]);
+	    cerr << "setting position to: "
+		<< "lat  " << setprecision(10) << fixed << pos[0] << endl
+		<< "long " << setprecision(10) << fixed << pos[1] << endl
+		<< "alt  " << setprecision(2)  << fixed << pos[2] << endl;
+	    if (!gps.setPosition(pos[0], pos[1], pos[2]))
+	    {
+		cerr << "failed to set the surveyed position, falling back to the current one" << endl;
+		gps.setPositionFromCurrent();
+	    }
+	    else if (!board_id.empty())
 	    {
-		cerr << "now setting base station position" << endl;
-		break;
+		gps::SurveyedPosition surveyed;
+		surveyed.board_id  = board_id;
+		survey.getPosition(surveyed.latitude, surveyed.longitude, surveyed.height);
+		surveyed.standard_error = survey.getStandardError();
+		surveyed.time = base::Time::now();
+		if (!surveyed.save(cache_path))
+		    cerr << "cannot save the base position in " << cache_path << endl;
 	    }
 	}
-
-	gps.stopPeriodicData();
-	pos[0] /= count; pos[1] /= count; pos[2] /= count;
-	cerr << "setting fixed position to current position." << endl;
-	//cerr << "setting position to: lat=" << pos[0] << ", long=" << pos[1] << ", alt=" << pos[2] << endl;
-	//gps.setPosition(pos[0], pos[1], pos[2]);
-	gps.setPositionFromCurrent();
     }
-    gps.setRTKBase(current_port);
+    // The corrections can go out through a device of their own, so that
+    // they do not share the line with the commands
+    int correction_fd = gps.getFileDescriptor();
+    char const* correction_device = getenv("MB500_CORRECTION_DEVICE");
+    if (correction_device && gps.openPort(gps::MB500::PORT_CORRECTIONS, correction_device))
+    {
+        cerr << "reading the corrections from " << correction_device << endl;
+        gps.setRTKBase();
+        correction_fd = gps.getPortFileDescriptor(gps::MB500::PORT_CORRECTIONS);
+    }
+    else
+        gps.setRTKBase(current_port);
     char buffer[1024];
 
     last_update = base::Time::now();
+    base::Time last_correction = last_update;
     int bytes_tx = 0;
     while(true)
     {
-	int rd = read(gps.getFileDescriptor(), buffer, 1024);
-        if (rd > 0)
+	int rd = read(correction_fd, buffer, 1024);
+        // The board sends its corrections every second. Either no longer
+        // getting them or losing the device means that we have to reconnect
+        bool link_lost = (rd == 0 || (rd < 0 && errno != EAGAIN) ||
+                (base::Time::now() - last_correction).toSeconds() > CORRECTION_TIMEOUT);
+        if (link_lost)
+        {
+            cerr << "lost the corrections, reconnecting to the board" << endl;
+            while (!gps.recover())
+                cerr << "still trying to reach the board" << endl;
+            cerr << "board recovered after " << gps.getRecoveryStatistics().lastDowntime.toSeconds() << " s" << endl;
+
+            correction_fd = gps.getPortFileDescriptor(gps::MB500::PORT_CORRECTIONS);
+            last_correction = base::Time::now();
+            continue;
+        }
+        else if (rd > 0)
         {
+            last_correction = base::Time::now();
 	    int written = 0;
 	    while( written < rd )
 	    {
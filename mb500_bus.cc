@@ -0,0 +1,365 @@
+#include "mb500_bus.hh"
+
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace gps;
+
+// "MB5B", and the version of the SolutionRecord layout. Bump the version
+// whenever SolutionRecord changes
+static const uint32_t BUS_MAGIC   = 0x4d423542;
+static const uint32_t BUS_VERSION = 1;
+
+/** Slots are aligned on cache lines, so that the writer's update of one
+ * slot does not slow down the readers of the others */
+static const size_t CACHE_LINE = 64;
+
+struct gps::SolutionBusSegment
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t capacity;
+    /** Number of records published so far. Record i is in slot i %
+     * capacity */
+    uint64_t head;
+};
+
+/** The slot of record i has the sequence 2 * i + 1 while the record is
+ * being written, and 2 * i + 2 afterwards */
+struct SolutionBusSlot
+{
+    uint64_t sequence;
+    SolutionRecord record;
+};
+
+static size_t getHeaderSize()
+{
+    return (sizeof(SolutionBusSegment) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static size_t getSlotSize()
+{
+    return (sizeof(SolutionBusSlot) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static size_t getSegmentSize(uint32_t capacity)
+{
+    return getHeaderSize() + capacity * getSlotSize();
+}
+
+static SolutionBusSlot* getSlot(SolutionBusSegment* segment, uint64_t index)
+{
+    uint8_t* slots = reinterpret_cast<uint8_t*>(segment) + getHeaderSize();
+    return reinterpret_cast<SolutionBusSlot*>(slots + (index % segment->capacity) * getSlotSize());
+}
+
+static SolutionBusSlot const* getSlot(SolutionBusSegment const* segment, uint64_t index)
+{
+    return getSlot(const_cast<SolutionBusSegment*>(segment), index);
+}
+
+SolutionBus::SolutionBus()
+    : m_segment(NULL)
+    , m_segment_size(0)
+{
+}
+
+SolutionBus::~SolutionBus()
+{
+    unpublish();
+}
+
+bool SolutionBus::publish(std::string const& name, uint32_t capacity)
+{
+    unpublish();
+    if (capacity == 0)
+        capacity = 1;
+
+    // Readers of a previous segment of that name keep their mapping and
+    // would never see it change, so create a new one instead of reusing it
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot create the shared memory segment " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    size_t size = getSegmentSize(capacity);
+    if (ftruncate(fd, size) == -1)
+    {
+        cerr << "dgps/mb500: cannot resize the shared memory segment " << name << ": " << strerror(errno) << endl;
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "dgps/mb500: cannot map the shared memory segment " << name << ": " << strerror(errno) << endl;
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // The segment is zero-filled, which is a valid empty ring
+    m_shm_name = name;
+    m_segment  = static_cast<SolutionBusSegment*>(data);
+    m_segment_size = size;
+    m_segment->version    = BUS_VERSION;
+    m_segment->recordSize = sizeof(SolutionRecord);
+    m_segment->capacity   = capacity;
+    __atomic_store_n(&m_segment->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+void SolutionBus::unpublish()
+{
+    if (!m_segment)
+        return;
+
+    // Tell the readers that still have it mapped
+    __atomic_store_n(&m_segment->magic, 0, __ATOMIC_RELEASE);
+    munmap(m_segment, m_segment_size);
+    shm_unlink(m_shm_name.c_str());
+    m_segment = NULL;
+    m_shm_name.clear();
+}
+
+bool SolutionBus::isPublished() const
+{
+    return m_segment;
+}
+
+void SolutionBus::push(base::Time const& host_time, Position const& position,
+        Errors const& errors, SolutionQuality const& quality,
+        SatelliteInfo const& satellites)
+{
+    if (!m_segment)
+        return;
+
+    // We are the only writer, so there is no need for atomic increments
+    uint64_t index = m_segment->head;
+    SolutionBusSlot* slot = getSlot(m_segment, index);
+    __atomic_store_n(&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    SolutionRecord& record = slot->record;
+    record.time      = position.time.toMicroseconds();
+    record.hostTime  = host_time.toMicroseconds();
+    record.latitude  = position.latitude;
+    record.longitude = position.longitude;
+    record.altitude  = position.altitude;
+    record.geoidalSeparation = position.geoidalSeparation;
+    record.ageOfDifferentialCorrections = position.ageOfDifferentialCorrections;
+    record.positionType   = position.positionType;
+    record.noOfSatellites = position.noOfSatellites;
+    record.deviationLatitude  = errors.deviationLatitude;
+    record.deviationLongitude = errors.deviationLongitude;
+    record.deviationAltitude  = errors.deviationAltitude;
+    record.pdop = quality.pdop;
+    record.hdop = quality.hdop;
+    record.vdop = quality.vdop;
+
+    size_t used = quality.usedSatellites.size();
+    if (used > static_cast<size_t>(SolutionRecord::MAX_SATELLITES))
+        used = SolutionRecord::MAX_SATELLITES;
+    record.usedSatelliteCount = used;
+    for (size_t i = 0; i < used; ++i)
+        record.usedSatellites[i] = quality.usedSatellites[i];
+
+    size_t known = satellites.knownSatellites.size();
+    if (known > static_cast<size_t>(SolutionRecord::MAX_SATELLITES))
+        known = SolutionRecord::MAX_SATELLITES;
+    record.knownSatelliteCount = known;
+    for (size_t i = 0; i < known; ++i)
+    {
+        Satellite const& sat = satellites.knownSatellites[i];
+        SolutionRecordSatellite& out = record.knownSatellites[i];
+        out.PRN       = sat.PRN;
+        out.elevation = sat.elevation;
+        out.azimuth   = sat.azimuth;
+        out.padding   = 0;
+        out.SNR       = sat.SNR;
+    }
+
+    __atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_segment->head, index + 1, __ATOMIC_RELEASE);
+}
+
+SolutionBusReader::SolutionBusReader()
+    : m_segment(NULL)
+    , m_segment_size(0)
+    , m_next(0)
+    , m_lost(0)
+    , m_acquired(false)
+{
+}
+
+SolutionBusReader::~SolutionBusReader()
+{
+    close();
+}
+
+bool SolutionBusReader::open(std::string const& name)
+{
+    close();
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+
+    struct stat segment_stat;
+    if (fstat(fd, &segment_stat) == -1 ||
+            segment_stat.st_size < static_cast<off_t>(getHeaderSize()))
+    {
+        ::close(fd);
+        return false;
+    }
+    size_t size = segment_stat.st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    SolutionBusSegment const* segment = static_cast<SolutionBusSegment const*>(data);
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != BUS_MAGIC ||
+            segment->version != BUS_VERSION || segment->recordSize != sizeof(SolutionRecord) ||
+            segment->capacity == 0 || size < getSegmentSize(segment->capacity))
+    {
+        cerr << "dgps/mb500: the shared memory segment " << name << " has an incompatible format" << endl;
+        munmap(data, size);
+        return false;
+    }
+    m_segment = segment;
+    m_segment_size = size;
+    m_next = __atomic_load_n(&segment->head, __ATOMIC_ACQUIRE);
+    m_lost = 0;
+    m_acquired = false;
+    return true;
+}
+
+void SolutionBusReader::close()
+{
+    if (m_segment)
+        munmap(const_cast<SolutionBusSegment*>(m_segment), m_segment_size);
+    m_segment = NULL;
+    m_acquired = false;
+}
+
+bool SolutionBusReader::isValid() const
+{
+    return m_segment && __atomic_load_n(&m_segment->magic, __ATOMIC_ACQUIRE) == BUS_MAGIC;
+}
+
+SolutionRecord const* SolutionBusReader::findNext()
+{
+    uint64_t capacity = m_segment->capacity;
+    while (true)
+    {
+        uint64_t head = __atomic_load_n(&m_segment->head, __ATOMIC_ACQUIRE);
+        if (m_next >= head)
+            return NULL;
+        if (head - m_next > capacity)
+        {
+            m_lost += head - capacity - m_next;
+            m_next = head - capacity;
+        }
+
+        SolutionBusSlot const* slot = getSlot(m_segment, m_next);
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == 2 * m_next + 2)
+            return &slot->record;
+        if (sequence < 2 * m_next + 2)
+            return NULL;
+        // The writer has started to overwrite it since we read head
+        ++m_lost;
+        ++m_next;
+    }
+}
+
+SolutionRecord const* SolutionBusReader::acquire()
+{
+    if (!m_segment)
+        return NULL;
+
+    SolutionRecord const* record = findNext();
+    m_acquired = (record != NULL);
+    return record;
+}
+
+bool SolutionBusReader::release()
+{
+    if (!m_acquired)
+        return false;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    SolutionBusSlot const* slot = getSlot(m_segment, m_next);
+    bool valid = (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == 2 * m_next + 2);
+    if (!valid)
+        ++m_lost;
+    ++m_next;
+    m_acquired = false;
+    return valid;
+}
+
+bool SolutionBusReader::read(SolutionRecord& record)
+{
+    while (SolutionRecord const* next = acquire())
+    {
+        memcpy(&record, next, sizeof(record));
+        if (release())
+            return true;
+    }
+    return false;
+}
+
+uint64_t SolutionBusReader::getLostCount() const
+{
+    return m_lost;
+}
+
+void SolutionBusReader::unpack(SolutionRecord const& record, Position& position,
+        Errors& errors, SolutionQuality& quality, SatelliteInfo& satellites)
+{
+    base::Time time = base::Time::fromMicroseconds(record.time);
+    position.time      = time;
+    position.latitude  = record.latitude;
+    position.longitude = record.longitude;
+    position.altitude  = record.altitude;
+    position.geoidalSeparation = record.geoidalSeparation;
+    position.ageOfDifferentialCorrections = record.ageOfDifferentialCorrections;
+    position.positionType   = static_cast<gps_base::GPS_SOLUTION_TYPES>(record.positionType);
+    position.noOfSatellites = record.noOfSatellites;
+
+    errors.time = time;
+    errors.deviationLatitude  = record.deviationLatitude;
+    errors.deviationLongitude = record.deviationLongitude;
+    errors.deviationAltitude  = record.deviationAltitude;
+
+    quality.time = time;
+    quality.pdop = record.pdop;
+    quality.hdop = record.hdop;
+    quality.vdop = record.vdop;
+    quality.usedSatellites.assign(record.usedSatellites,
+            record.usedSatellites + record.usedSatelliteCount);
+
+    satellites.time = time;
+    satellites.knownSatellites.resize(record.knownSatelliteCount);
+    for (int i = 0; i < record.knownSatelliteCount; ++i)
+    {
+        SolutionRecordSatellite const& sat = record.knownSatellites[i];
+        Satellite& out = satellites.knownSatellites[i];
+        out.PRN       = sat.PRN;
+        out.elevation = sat.elevation;
+        out.azimuth   = sat.azimuth;
+        out.SNR       = sat.SNR;
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef MAGELLAN_MB500_BUS_H
+#define MAGELLAN_MB500_BUS_H
+
+#include <string>
+#include <stdint.h>
+
+#include "gps_types.hh"
+
+namespace gps {
+    /** One satellite of a SolutionRecord */
+    struct SolutionRecordSatellite
+    {
+        int16_t PRN;
+        int16_t elevation;
+        int16_t azimuth;
+        int16_t padding;
+        float SNR;
+    };
+
+    /** One solution epoch, as published by a SolutionBus
+     *
+     * This is also the layout of the shared memory segment, so it only
+     * has fixed-size fields. Times are in microseconds. The fields have
+     * the names and units of gps::Position, gps::Errors,
+     * gps::SolutionQuality and gps::SatelliteInfo.
+     */
+    struct SolutionRecord
+    {
+        static const int MAX_SATELLITES = 48;
+
+        /** GPS time of the epoch */
+        int64_t time;
+        /** Host time at which the board computed the epoch */
+        int64_t hostTime;
+
+        double latitude;
+        double longitude;
+        double altitude;
+        double geoidalSeparation;
+        double ageOfDifferentialCorrections;
+        int32_t positionType;
+        int32_t noOfSatellites;
+
+        double deviationLatitude;
+        double deviationLongitude;
+        double deviationAltitude;
+
+        double pdop;
+        double hdop;
+        double vdop;
+        int32_t usedSatelliteCount;
+        int32_t knownSatelliteCount;
+        int16_t usedSatellites[MAX_SATELLITES];
+        SolutionRecordSatellite knownSatellites[MAX_SATELLITES];
+    };
+
+    struct SolutionBusSegment;
+
+    /** Publishes the solutions in a ring of SolutionRecord in a POSIX
+     * shared memory segment, for any number of SolutionBusReader
+     *
+     * There is a single writer, which never waits for the readers: each
+     * slot of the ring has its own sequence lock, and the oldest record
+     * gets overwritten when the ring is full. Readers that fall more than
+     * the ring's capacity behind lose records, and know how many.
+     */
+    class SolutionBus
+    {
+    public:
+        /** Default capacity, in records. That is 25 seconds at 10 Hz */
+        static const uint32_t DEFAULT_CAPACITY = 256;
+
+        SolutionBus();
+        ~SolutionBus();
+
+        /** Creates the segment \c name, e.g. "/mb500_solutions", and
+         * publishes the solutions there from now on. An existing segment
+         * is replaced */
+        bool publish(std::string const& name, uint32_t capacity = DEFAULT_CAPACITY);
+        /** Stops publishing and removes the segment */
+        void unpublish();
+        bool isPublished() const;
+
+        void push(base::Time const& host_time, gps::Position const& position,
+                gps::Errors const& errors, gps::SolutionQuality const& quality,
+                gps::SatelliteInfo const& satellites);
+
+    private:
+        std::string m_shm_name;
+        SolutionBusSegment* m_segment;
+        size_t m_segment_size;
+    };
+
+    /** Reads the solutions published by a SolutionBus
+     *
+     * The reader gets the records published after open(), in order.
+     * acquire() gives direct access to the record in the segment; as the
+     * writer may overwrite it meanwhile, release() tells whether it was
+     * still valid once the caller is done with it. read() copies the
+     * record instead.
+     */
+    class SolutionBusReader
+    {
+    public:
+        SolutionBusReader();
+        ~SolutionBusReader();
+
+        /** Maps the segment. Fails if it does not exist or has been
+         * created by an incompatible version */
+        bool open(std::string const& name);
+        void close();
+        /** False once the writer stopped publishing in the segment. The
+         * reader must then be reopened to follow a new writer */
+        bool isValid() const;
+
+        /** Returns the next record, or NULL if there is none yet. The
+         * record stays in the segment, and must be released with
+         * release() before the next call */
+        SolutionRecord const* acquire();
+        /** Moves on to the next record. Returns false if the writer
+         * overwrote the acquired record while it was in use, in which case
+         * its contents must be discarded */
+        bool release();
+        /** Copies the next record. Returns false if there is none yet */
+        bool read(SolutionRecord& record);
+
+        /** Number of records the reader missed because the writer
+         * overwrote them first */
+        uint64_t getLostCount() const;
+
+        /** Converts a record back to the types of the driver */
+        static void unpack(SolutionRecord const& record, gps::Position& position,
+                gps::Errors& errors, gps::SolutionQuality& quality,
+                gps::SatelliteInfo& satellites);
+
+    private:
+        SolutionBusSegment const* m_segment;
+        size_t m_segment_size;
+        /** Index of the next record to read */
+        uint64_t m_next;
+        uint64_t m_lost;
+        bool m_acquired;
+
+        /** Finds record m_next, skipping the records that have been lost.
+         * Returns NULL if it has not been published yet */
+        SolutionRecord const* findNext();
+    };
+}
+
+#endif
+
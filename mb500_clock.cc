@@ -0,0 +1,242 @@
+#include "mb500_clock.hh"
+
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+using namespace std;
+using namespace gps;
+
+// Lower bound on the residual scale, in microseconds, so that a window of
+// perfect samples does not reject everything else
+static const double MIN_RESIDUAL_SCALE = 1;
+// Number of rejection / fit iterations
+static const int FIT_ITERATIONS = 3;
+// Number of refits of the lower envelope, each on the half of the
+// previous samples that are below the line
+static const int ENVELOPE_ITERATIONS = 2;
+// Quantile of the residuals through which the envelope goes
+static const double ENVELOPE_QUANTILE = 0.05;
+
+base::Time gps::getMonotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return base::Time::fromMicroseconds(static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000);
+}
+
+ClockModelStatistics::ClockModelStatistics()
+    : samples(0), outliers(0), drift_ppm(0)
+    , residual_rms(0), residual_max(0), last_residual(0)
+{
+}
+
+ClockModel::ClockModel(size_t window, double threshold)
+    : m_window(window < MIN_SAMPLES ? MIN_SAMPLES : window)
+    , m_threshold(threshold)
+{
+    m_samples.reserve(m_window);
+    m_inliers.reserve(m_window);
+    m_residuals.reserve(m_window);
+    m_scratch.reserve(m_window);
+    reset();
+}
+
+void ClockModel::reset()
+{
+    m_samples.clear();
+    m_next = 0;
+    m_has_reference = false;
+    m_reference_gps = 0;
+    m_reference_offset = 0;
+    m_valid = false;
+    m_intercept = 0;
+    m_slope = 0;
+    m_envelope_intercept = 0;
+    m_envelope_slope = 0;
+    m_statistics = ClockModelStatistics();
+}
+
+void ClockModel::addSample(base::Time const& gps_time, base::Time const& host_time)
+{
+    int64_t gps    = gps_time.toMicroseconds();
+    int64_t offset = (host_time - gps_time).toMicroseconds();
+    if (!m_has_reference)
+    {
+        m_has_reference = true;
+        m_reference_gps = gps;
+        m_reference_offset = offset;
+    }
+
+    Sample sample = { gps - m_reference_gps, offset - m_reference_offset };
+    if (m_samples.size() < m_window)
+        m_samples.push_back(sample);
+    else
+        m_samples[m_next] = sample;
+    m_next = (m_next + 1) % m_window;
+
+    fit();
+
+    double x = sample.gps_time;
+    m_statistics.last_residual = (sample.offset - (m_intercept + m_slope * x)) / 1e6;
+}
+
+void ClockModel::fit()
+{
+    size_t count = m_samples.size();
+    m_inliers.assign(count, 1);
+
+    // Start from the previous model, which is robust already. The first
+    // time, take a flat line through the median offset
+    double intercept = m_intercept, slope = m_slope;
+    if (!m_valid)
+    {
+        m_residuals.clear();
+        for (size_t i = 0; i < count; ++i)
+            m_residuals.push_back(m_samples[i].offset);
+        nth_element(m_residuals.begin(), m_residuals.begin() + count / 2, m_residuals.end());
+        intercept = m_residuals[count / 2];
+        slope = 0;
+    }
+
+    size_t inlier_count = count;
+    for (int iteration = 0; iteration < FIT_ITERATIONS; ++iteration)
+    {
+        m_residuals.clear();
+        for (size_t i = 0; i < count; ++i)
+            m_residuals.push_back(fabs(m_samples[i].offset - (intercept + slope * m_samples[i].gps_time)));
+
+        // Residuals are centered on the line, so the MAD is the median of
+        // their absolute values
+        m_scratch = m_residuals;
+        nth_element(m_scratch.begin(), m_scratch.begin() + count / 2, m_scratch.end());
+        double scale = max(1.4826 * m_scratch[count / 2], MIN_RESIDUAL_SCALE);
+
+        inlier_count = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_inliers[i] = (m_residuals[i] <= m_threshold * scale);
+            inlier_count += m_inliers[i];
+        }
+        if (!fitInliers(intercept, slope, 1))
+            break;
+    }
+
+    m_valid = (inlier_count >= MIN_SAMPLES);
+    m_intercept = intercept;
+    m_slope = slope;
+
+    double sum2 = 0, max_residual = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!m_inliers[i])
+            continue;
+        double residual = fabs(m_samples[i].offset - (intercept + slope * m_samples[i].gps_time));
+        sum2 += residual * residual;
+        max_residual = max(max_residual, residual);
+    }
+    m_statistics.samples  = count;
+    m_statistics.outliers = count - inlier_count;
+    m_statistics.residual_rms = inlier_count ? sqrt(sum2 / inlier_count) / 1e6 : 0;
+    m_statistics.residual_max = max_residual / 1e6;
+
+    // Lower envelope: refit on the samples below the current line
+    for (uint8_t level = 1; level <= ENVELOPE_ITERATIONS; ++level)
+    {
+        m_scratch.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (m_inliers[i] == level)
+                m_scratch.push_back(m_samples[i].offset - (intercept + slope * m_samples[i].gps_time));
+        }
+        if (m_scratch.size() < 2 * MIN_SAMPLES)
+            break;
+        nth_element(m_scratch.begin(), m_scratch.begin() + m_scratch.size() / 2, m_scratch.end());
+        double median = m_scratch[m_scratch.size() / 2];
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (m_inliers[i] == level &&
+                    m_samples[i].offset - (intercept + slope * m_samples[i].gps_time) <= median)
+                m_inliers[i] = level + 1;
+        }
+        fitInliers(intercept, slope, level + 1);
+    }
+
+    // And shift it to a low quantile of the inliers
+    m_scratch.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (m_inliers[i])
+            m_scratch.push_back(m_samples[i].offset - (intercept + slope * m_samples[i].gps_time));
+    }
+    if (!m_scratch.empty())
+    {
+        size_t index = static_cast<size_t>(ENVELOPE_QUANTILE * (m_scratch.size() - 1));
+        nth_element(m_scratch.begin(), m_scratch.begin() + index, m_scratch.end());
+        intercept += m_scratch[index];
+    }
+    m_envelope_intercept = intercept;
+    m_envelope_slope = slope;
+    m_statistics.drift_ppm = slope * 1e6;
+}
+
+bool ClockModel::fitInliers(double& intercept, double& slope, uint8_t level) const
+{
+    // Least squares on centered coordinates, the GPS times being large
+    // after a few hours
+    size_t count = 0;
+    double mean_x = 0, mean_y = 0;
+    for (size_t i = 0; i < m_samples.size(); ++i)
+    {
+        if (m_inliers[i] < level)
+            continue;
+        mean_x += m_samples[i].gps_time;
+        mean_y += m_samples[i].offset;
+        ++count;
+    }
+    if (count < 2)
+        return false;
+    mean_x /= count;
+    mean_y /= count;
+
+    double sxx = 0, sxy = 0;
+    for (size_t i = 0; i < m_samples.size(); ++i)
+    {
+        if (m_inliers[i] < level)
+            continue;
+        double dx = m_samples[i].gps_time - mean_x;
+        sxx += dx * dx;
+        sxy += dx * (m_samples[i].offset - mean_y);
+    }
+    if (sxx <= 0)
+        return false;
+
+    slope = sxy / sxx;
+    intercept = mean_y - slope * mean_x;
+    return true;
+}
+
+bool ClockModel::isValid() const
+{
+    return m_valid;
+}
+
+base::Time ClockModel::toHostTime(base::Time const& gps_time) const
+{
+    int64_t gps = gps_time.toMicroseconds();
+    double offset = m_envelope_intercept + m_envelope_slope * (gps - m_reference_gps);
+    return base::Time::fromMicroseconds(gps + m_reference_offset + static_cast<int64_t>(floor(offset + 0.5)));
+}
+
+base::Time ClockModel::toGPSTime(base::Time const& host_time) const
+{
+    // host = gps + ref_offset + intercept + slope * (gps - ref_gps)
+    double host = (host_time.toMicroseconds() - m_reference_offset - m_reference_gps) - m_envelope_intercept;
+    double gps  = host / (1 + m_envelope_slope);
+    return base::Time::fromMicroseconds(m_reference_gps + static_cast<int64_t>(floor(gps + 0.5)));
+}
+
+ClockModelStatistics const& ClockModel::getStatistics() const
+{
+    return m_statistics;
+}
@@ -0,0 +1,116 @@
+#ifndef MAGELLAN_MB500_CLOCK_H
+#define MAGELLAN_MB500_CLOCK_H
+
+#include <stddef.h>
+#include <vector>
+#include <stdint.h>
+#include <base/Time.hpp>
+
+namespace gps {
+    /** Current time of the host's monotonic clock */
+    base::Time getMonotonicTime();
+
+    /** Residual statistics of a ClockModel, in seconds */
+    struct ClockModelStatistics
+    {
+        /** Samples in the window, and how many were rejected as outliers */
+        size_t samples;
+        size_t outliers;
+        /** Drift of the host clock with respect to GPS time, in parts per
+         * million. Positive if the host clock runs fast */
+        double drift_ppm;
+        /** RMS and maximum absolute residual of the inliers, with respect
+         * to the least-squares line */
+        double residual_rms;
+        double residual_max;
+        /** Residual of the last sample, outlier or not */
+        double last_residual;
+
+        ClockModelStatistics();
+    };
+
+    /** Online model of the host clock with respect to GPS time
+     *
+     * The samples are pairs of a GPS time and of the host time at which
+     * the corresponding event was observed. The model fits a line (offset
+     * and drift) on the last samples, with an iterative outlier rejection:
+     * after a least-squares fit, samples whose residual is larger than
+     * \c threshold times the robust standard deviation of the residuals
+     * (1.4826 MAD) are dropped and the line fitted again.
+     *
+     * Host times are expected from the monotonic clock, so that NTP steps
+     * do not end up in the model.
+     *
+     * The host-side latency is a minimum delay plus a positive jitter, so
+     * the conversions do not use the least-squares line itself but the
+     * lower envelope of the inliers: the line is fitted again on the
+     * samples below it, twice, and then shifted to a low quantile of the
+     * residuals. This is much less noisy than the mean of the arrival
+     * times. The minimum delay (mostly the transmission time of the
+     * sentence) is not observable and remains in the offset.
+     */
+    class ClockModel
+    {
+    public:
+        static const size_t DEFAULT_WINDOW = 300;
+        /** Minimum number of inliers before the model is valid */
+        static const size_t MIN_SAMPLES = 5;
+
+        ClockModel(size_t window = DEFAULT_WINDOW, double threshold = 3.0);
+
+        void reset();
+        void addSample(base::Time const& gps_time, base::Time const& host_time);
+
+        bool isValid() const;
+        /** Host time of an event given its GPS time. Only meaningful if
+         * isValid() */
+        base::Time toHostTime(base::Time const& gps_time) const;
+        /** GPS time of an event given its host time. Only meaningful if
+         * isValid() */
+        base::Time toGPSTime(base::Time const& host_time) const;
+
+        ClockModelStatistics const& getStatistics() const;
+
+    private:
+        size_t m_window;
+        double m_threshold;
+
+        /** The samples, as GPS times and host - GPS offsets, in
+         * microseconds relative to the first sample. This keeps the
+         * regression well-conditioned */
+        struct Sample
+        {
+            int64_t gps_time;
+            int64_t offset;
+        };
+        std::vector<Sample> m_samples;
+        size_t m_next;
+        bool m_has_reference;
+        int64_t m_reference_gps;
+        int64_t m_reference_offset;
+
+        /** The robust least-squares line, offset = m_intercept + m_slope *
+         * (gps_time - m_reference_gps) in microseconds, and the lower
+         * envelope used for the conversions */
+        bool m_valid;
+        double m_intercept;
+        double m_slope;
+        double m_envelope_intercept;
+        double m_envelope_slope;
+        ClockModelStatistics m_statistics;
+
+        /** 0 for outliers, 1 for inliers, and higher for the samples
+         * selected by the envelope iterations */
+        std::vector<uint8_t> m_inliers;
+        std::vector<double> m_residuals;
+        std::vector<double> m_scratch;
+
+        void fit();
+        /** Least-squares fit of the samples whose m_inliers value is at
+         * least \c level */
+        bool fitInliers(double& intercept, double& slope, uint8_t level) const;
+    };
+}
+
+#endif
+
@@ -0,0 +1,53 @@
+#include "mb500_events.hh"
+
+using namespace gps;
+
+MarkerEventQueue::MarkerEventQueue(size_t capacity)
+    : m_events(capacity ? capacity : 1)
+    , m_head(0)
+    , m_tail(0)
+    , m_dropped(0)
+{
+}
+
+bool MarkerEventQueue::push(MarkerEvent const& event)
+{
+    // Only the producer writes m_head, the consumer publishes m_tail once
+    // it is done with the slot
+    uint64_t head = m_head;
+    if (head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) >= m_events.size())
+    {
+        __atomic_store_n(&m_dropped, m_dropped + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    m_events[head % m_events.size()] = event;
+    __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool MarkerEventQueue::pop(MarkerEvent& event)
+{
+    uint64_t tail = m_tail;
+    if (tail == __atomic_load_n(&m_head, __ATOMIC_ACQUIRE))
+        return false;
+    event = m_events[tail % m_events.size()];
+    __atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t MarkerEventQueue::size() const
+{
+    uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) - tail;
+}
+
+size_t MarkerEventQueue::getCapacity() const
+{
+    return m_events.size();
+}
+
+uint64_t MarkerEventQueue::getDroppedCount() const
+{
+    return __atomic_load_n(&m_dropped, __ATOMIC_RELAXED);
+}
+
@@ -0,0 +1,77 @@
+#ifndef MAGELLAN_MB500_EVENTS_H
+#define MAGELLAN_MB500_EVENTS_H
+
+#include <stddef.h>
+#include <vector>
+#include <stdint.h>
+
+#include "mb500_predictor.hh"
+
+namespace gps {
+    /** One edge of the board's event marker input, from $PASHR,TTT */
+    struct MarkerEvent
+    {
+        /** Number of the event since the driver got created. Gaps mean
+         * that the queue was full */
+        uint64_t sequence;
+        /** Time of the event, in the time scale of gps::Position::time.
+         * It is truncated to the microsecond, see nanoseconds */
+        base::Time time;
+        /** Nanoseconds to add to time, from 0 to 999. The board resolves
+         * 100ns */
+        uint16_t nanoseconds;
+        /** GPS time of week of the event, in seconds, as given by the
+         * board */
+        double gpsTimeOfWeek;
+        /** Host time of the event, from the clock model. Null if the
+         * model was not valid yet */
+        base::Time hostTime;
+        /** True if position is valid */
+        bool hasPosition;
+        /** Position at the event, interpolated between the epochs around
+         * it by the PositionPredictor */
+        PredictedPosition position;
+
+        MarkerEvent()
+            : sequence(0), nanoseconds(0), gpsTimeOfWeek(0), hasPosition(false) {}
+    };
+
+    /** Bounded queue of MarkerEvent between the driver and one consumer
+     * thread
+     *
+     * There is a single producer (the driver) and a single consumer. Both
+     * sides only use atomic loads and stores on their own index, so
+     * neither push() nor pop() waits or allocates. When the consumer falls
+     * behind, push() drops the new events and counts them.
+     */
+    class MarkerEventQueue
+    {
+    public:
+        static const size_t DEFAULT_CAPACITY = 256;
+
+        MarkerEventQueue(size_t capacity = DEFAULT_CAPACITY);
+
+        /** Producer side. Returns false if the queue is full */
+        bool push(MarkerEvent const& event);
+        /** Consumer side. Returns false if the queue is empty */
+        bool pop(MarkerEvent& event);
+
+        /** Number of events waiting. Exact only from one of the two
+         * threads while the other one is idle */
+        size_t size() const;
+        size_t getCapacity() const;
+        /** Events dropped by push() because the queue was full */
+        uint64_t getDroppedCount() const;
+
+    private:
+        std::vector<MarkerEvent> m_events;
+        /** Number of events pushed and popped so far. Event i is in slot i
+         * % capacity */
+        uint64_t m_head;
+        uint64_t m_tail;
+        uint64_t m_dropped;
+    };
+}
+
+#endif
+
@@ -0,0 +1,466 @@
+#include "mb500_geodesy.hh"
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+
+using namespace gps;
+
+static const double DEG_TO_RAD = M_PI / 180;
+
+void gps::geodeticToECEF(double latitude, double longitude, double height, double ecef[3])
+{
+    double lat = latitude * DEG_TO_RAD;
+    double lon = longitude * DEG_TO_RAD;
+    double sin_lat = sin(lat), cos_lat = cos(lat);
+
+    double n = WGS84_A / sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+    ecef[0] = (n + height) * cos_lat * cos(lon);
+    ecef[1] = (n + height) * cos_lat * sin(lon);
+    ecef[2] = (n * (1 - WGS84_E2) + height) * sin_lat;
+}
+
+void gps::ecefToGeodetic(double const ecef[3], double& latitude, double& longitude, double& height)
+{
+    double p   = sqrt(ecef[0] * ecef[0] + ecef[1] * ecef[1]);
+    double lon = atan2(ecef[1], ecef[0]);
+
+    // Fixed-point iteration on the latitude, which converges to below the
+    // millimeter in a few steps for points near the Earth's surface
+    double lat = atan2(ecef[2], p * (1 - WGS84_E2));
+    double n = WGS84_A;
+    for (int i = 0; i < 5; ++i)
+    {
+        double sin_lat = sin(lat);
+        n   = WGS84_A / sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+        lat = atan2(ecef[2] + n * WGS84_E2 * sin_lat, p);
+    }
+
+    double sin_lat = sin(lat), cos_lat = cos(lat);
+    n = WGS84_A / sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+    if (fabs(cos_lat) > 1e-10)
+        height = p / cos_lat - n;
+    else
+        height = fabs(ecef[2]) - n * (1 - WGS84_E2);
+
+    latitude  = lat / DEG_TO_RAD;
+    longitude = lon / DEG_TO_RAD;
+}
+
+/* Sine and cosine kernels, after fdlibm's __kernel_sin and __kernel_cos.
+ * The argument is reduced to [-pi/4, pi/4] with a two-part pi/2, and the
+ * quadrant is selected with bit masks instead of branches, so that the
+ * loops that use them get vectorized.
+ */
+static const double TWO_OVER_PI = 6.36619772367581382433e-01;
+static const double PIO2_HI = 1.57079632673412561417e+00;
+static const double PIO2_LO = 6.07710050650619224932e-11;
+// Adding 1.5 * 2^52 rounds to the nearest integer, which ends up in the
+// low bits of the mantissa
+static const double ROUNDING_SHIFT = 6755399441055744.0;
+
+static const double S1 = -1.66666666666666324348e-01;
+static const double S2 =  8.33333333332248946124e-03;
+static const double S3 = -1.98412698298579493134e-04;
+static const double S4 =  2.75573137070700676789e-06;
+static const double S5 = -2.50507602534068634195e-08;
+static const double S6 =  1.58969099521155010221e-10;
+
+static const double C1 =  4.16666666666666019037e-02;
+static const double C2 = -1.38888888888741095749e-03;
+static const double C3 =  2.48015872894767294178e-05;
+static const double C4 = -2.75573143513906633035e-07;
+static const double C5 =  2.08757232129817482790e-09;
+static const double C6 = -1.13596475577881948265e-11;
+
+static inline uint64_t toBits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline double fromBits(uint64_t bits)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline void sinCosKernel(double x, double& s, double& c)
+{
+    double shifted  = x * TWO_OVER_PI + ROUNDING_SHIFT;
+    uint64_t quadrant = toBits(shifted);
+    double q = shifted - ROUNDING_SHIFT;
+    double r = (x - q * PIO2_HI) - q * PIO2_LO;
+
+    double z  = r * r;
+    double ps = r + r * z * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)))));
+    double pc = 1 - 0.5 * z + z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+
+    // sin and cos get swapped on odd quadrants. sin changes sign on
+    // quadrants 2 and 3, cos on quadrants 1 and 2
+    uint64_t swap = -(quadrant & 1);
+    uint64_t sin_bits = (toBits(pc) & swap) | (toBits(ps) & ~swap);
+    uint64_t cos_bits = (toBits(ps) & swap) | (toBits(pc) & ~swap);
+    s = fromBits(sin_bits ^ ((quadrant & 2) << 62));
+    c = fromBits(cos_bits ^ (((quadrant + 1) & 2) << 62));
+}
+
+/* The conversions are done by blocks of BLOCK_SIZE points, with the
+ * results computed in local arrays first. The compiler knows that these
+ * do not alias the caller's arrays, which it would otherwise have to
+ * check at runtime, and gives up vectorizing when there are too many
+ * arrays to check.
+ */
+static const size_t BLOCK_SIZE = 256;
+
+static void copyBlock(size_t count, double const* x, double const* y, double const* z,
+        double* out_x, double* out_y, double* out_z)
+{
+    memcpy(out_x, x, count * sizeof(double));
+    memcpy(out_y, y, count * sizeof(double));
+    memcpy(out_z, z, count * sizeof(double));
+}
+
+void gps::sinCos(size_t count, double const* angles, double* sin, double* cos)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        double s, c;
+        sinCosKernel(angles[i], s, c);
+        sin[i] = s;
+        cos[i] = c;
+    }
+}
+
+void gps::geodeticToECEF(size_t count, double const* latitude, double const* longitude, double const* height,
+        double* x, double* y, double* z)
+{
+    double bx[BLOCK_SIZE], by[BLOCK_SIZE], bz[BLOCK_SIZE];
+    for (size_t start = 0; start < count; start += BLOCK_SIZE)
+    {
+        size_t block = std::min(BLOCK_SIZE, count - start);
+        double const* lat = latitude + start;
+        double const* lon = longitude + start;
+        double const* hgt = height + start;
+        for (size_t i = 0; i < block; ++i)
+        {
+            double sin_lat, cos_lat, sin_lon, cos_lon;
+            sinCosKernel(lat[i] * DEG_TO_RAD, sin_lat, cos_lat);
+            sinCosKernel(lon[i] * DEG_TO_RAD, sin_lon, cos_lon);
+
+            double h = hgt[i];
+            double n = WGS84_A / sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+            bx[i] = (n + h) * cos_lat * cos_lon;
+            by[i] = (n + h) * cos_lat * sin_lon;
+            bz[i] = (n * (1 - WGS84_E2) + h) * sin_lat;
+        }
+        copyBlock(block, bx, by, bz, x + start, y + start, z + start);
+    }
+}
+
+size_t GeodeticPoints::size() const
+{
+    return latitude.size();
+}
+
+void GeodeticPoints::clear()
+{
+    latitude.clear();
+    longitude.clear();
+    height.clear();
+}
+
+void GeodeticPoints::reserve(size_t size)
+{
+    latitude.reserve(size);
+    longitude.reserve(size);
+    height.reserve(size);
+}
+
+void GeodeticPoints::push_back(double latitude, double longitude, double height)
+{
+    this->latitude.push_back(latitude);
+    this->longitude.push_back(longitude);
+    this->height.push_back(height);
+}
+
+void GeodeticPoints::push_back(gps::Position const& position)
+{
+    push_back(position.latitude, position.longitude, getEllipsoidalHeight(position));
+}
+
+size_t CartesianPoints::size() const
+{
+    return x.size();
+}
+
+void CartesianPoints::resize(size_t size)
+{
+    x.resize(size);
+    y.resize(size);
+    z.resize(size);
+}
+
+void gps::geodeticToECEF(GeodeticPoints const& points, CartesianPoints& ecef)
+{
+    size_t count = points.size();
+    ecef.resize(count);
+    if (count)
+        geodeticToECEF(count, &points.latitude[0], &points.longitude[0], &points.height[0],
+                &ecef.x[0], &ecef.y[0], &ecef.z[0]);
+}
+
+void gps::getLocalRotation(double latitude, double longitude, double rotation[3][3])
+{
+    double lat = latitude * DEG_TO_RAD;
+    double lon = longitude * DEG_TO_RAD;
+    double sin_lat = sin(lat), cos_lat = cos(lat);
+    double sin_lon = sin(lon), cos_lon = cos(lon);
+
+    rotation[0][0] = -sin_lon;
+    rotation[0][1] =  cos_lon;
+    rotation[0][2] =  0;
+    rotation[1][0] = -sin_lat * cos_lon;
+    rotation[1][1] = -sin_lat * sin_lon;
+    rotation[1][2] =  cos_lat;
+    rotation[2][0] =  cos_lat * cos_lon;
+    rotation[2][1] =  cos_lat * sin_lon;
+    rotation[2][2] =  sin_lat;
+}
+
+LocalFrame::LocalFrame(double latitude, double longitude, double height)
+{
+    geodeticToECEF(latitude, longitude, height, m_origin);
+    getLocalRotation(latitude, longitude, m_rotation);
+}
+
+void LocalFrame::fromECEF(size_t count, double const* x, double const* y, double const* z,
+        double* east, double* north, double* up) const
+{
+    // Copy the frame in locals, so that the compiler does not reload it
+    // after each store
+    double const ox = m_origin[0], oy = m_origin[1], oz = m_origin[2];
+    double const r00 = m_rotation[0][0], r01 = m_rotation[0][1];
+    double const r10 = m_rotation[1][0], r11 = m_rotation[1][1], r12 = m_rotation[1][2];
+    double const r20 = m_rotation[2][0], r21 = m_rotation[2][1], r22 = m_rotation[2][2];
+
+    double be[BLOCK_SIZE], bn[BLOCK_SIZE], bu[BLOCK_SIZE];
+    for (size_t start = 0; start < count; start += BLOCK_SIZE)
+    {
+        size_t block = std::min(BLOCK_SIZE, count - start);
+        double const* bx = x + start;
+        double const* by = y + start;
+        double const* bz = z + start;
+        for (size_t i = 0; i < block; ++i)
+        {
+            double dx = bx[i] - ox, dy = by[i] - oy, dz = bz[i] - oz;
+            be[i] = r00 * dx + r01 * dy;
+            bn[i] = r10 * dx + r11 * dy + r12 * dz;
+            bu[i] = r20 * dx + r21 * dy + r22 * dz;
+        }
+        copyBlock(block, be, bn, bu, east + start, north + start, up + start);
+    }
+}
+
+void LocalFrame::fromGeodetic(size_t count, double const* latitude, double const* longitude, double const* height,
+        double* east, double* north, double* up) const
+{
+    double const ox = m_origin[0], oy = m_origin[1], oz = m_origin[2];
+    double const r00 = m_rotation[0][0], r01 = m_rotation[0][1];
+    double const r10 = m_rotation[1][0], r11 = m_rotation[1][1], r12 = m_rotation[1][2];
+    double const r20 = m_rotation[2][0], r21 = m_rotation[2][1], r22 = m_rotation[2][2];
+
+    double be[BLOCK_SIZE], bn[BLOCK_SIZE], bu[BLOCK_SIZE];
+    for (size_t start = 0; start < count; start += BLOCK_SIZE)
+    {
+        size_t block = std::min(BLOCK_SIZE, count - start);
+        double const* lat = latitude + start;
+        double const* lon = longitude + start;
+        double const* hgt = height + start;
+        for (size_t i = 0; i < block; ++i)
+        {
+            double sin_lat, cos_lat, sin_lon, cos_lon;
+            sinCosKernel(lat[i] * DEG_TO_RAD, sin_lat, cos_lat);
+            sinCosKernel(lon[i] * DEG_TO_RAD, sin_lon, cos_lon);
+
+            double h = hgt[i];
+            double n = WGS84_A / sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+            double dx = (n + h) * cos_lat * cos_lon - ox;
+            double dy = (n + h) * cos_lat * sin_lon - oy;
+            double dz = (n * (1 - WGS84_E2) + h) * sin_lat - oz;
+            be[i] = r00 * dx + r01 * dy;
+            bn[i] = r10 * dx + r11 * dy + r12 * dz;
+            bu[i] = r20 * dx + r21 * dy + r22 * dz;
+        }
+        copyBlock(block, be, bn, bu, east + start, north + start, up + start);
+    }
+}
+
+void LocalFrame::fromECEF(CartesianPoints const& ecef, CartesianPoints& enu) const
+{
+    size_t count = ecef.size();
+    enu.resize(count);
+    if (count)
+        fromECEF(count, &ecef.x[0], &ecef.y[0], &ecef.z[0], &enu.x[0], &enu.y[0], &enu.z[0]);
+}
+
+void LocalFrame::fromGeodetic(GeodeticPoints const& points, CartesianPoints& enu) const
+{
+    size_t count = points.size();
+    enu.resize(count);
+    if (count)
+        fromGeodetic(count, &points.latitude[0], &points.longitude[0], &points.height[0],
+                &enu.x[0], &enu.y[0], &enu.z[0]);
+}
+
+void LocalFrame::fromPosition(gps::Position const& position, double enu[3]) const
+{
+    double height = getEllipsoidalHeight(position);
+    fromGeodetic(1, &position.latitude, &position.longitude, &height, &enu[0], &enu[1], &enu[2]);
+}
+
+static const double UTM_SCALE = 0.9996;
+static const double UTM_FALSE_EASTING = 500000;
+static const double UTM_SOUTH_FALSE_NORTHING = 10000000;
+
+// Third flattening, and the coefficients of Krüger's series
+static const double UTM_N  = WGS84_F / (2 - WGS84_F);
+static const double UTM_N2 = UTM_N * UTM_N;
+static const double UTM_N3 = UTM_N2 * UTM_N;
+static const double UTM_N4 = UTM_N3 * UTM_N;
+static const double UTM_RECTIFYING_RADIUS = WGS84_A / (1 + UTM_N) * (1 + UTM_N2 / 4 + UTM_N4 / 64);
+static const double UTM_ALPHA1 = UTM_N / 2 - 2 * UTM_N2 / 3 + 5 * UTM_N3 / 16 + 41 * UTM_N4 / 180;
+static const double UTM_ALPHA2 = 13 * UTM_N2 / 48 - 3 * UTM_N3 / 5 + 557 * UTM_N4 / 1440;
+static const double UTM_ALPHA3 = 61 * UTM_N3 / 240 - 103 * UTM_N4 / 140;
+static const double UTM_ALPHA4 = 49561 * UTM_N4 / 161280;
+
+/** atanh(x) for |x| < 0.1, to double precision */
+static inline double smallAtanh(double x)
+{
+    double x2 = x * x;
+    return x * (1 + x2 * (1. / 3 + x2 * (1. / 5 + x2 * (1. / 7 + x2 * (1. / 9 +
+            x2 * (1. / 11 + x2 * (1. / 13 + x2 * (1. / 15 + x2 * (1. / 17)))))))));
+}
+
+/** exp(x) for |x| < 0.01, to double precision */
+static inline double smallExp(double x)
+{
+    return 1 + x * (1 + x * (1. / 2 + x * (1. / 6 + x * (1. / 24 + x * (1. / 120 +
+            x * (1. / 720 + x * (1. / 5040)))))));
+}
+
+UTMProjection::UTMProjection(int zone, bool north)
+    : m_zone(zone), m_north(north)
+    , m_central_meridian((zone - 1) * 6 - 180 + 3)
+    , m_false_northing(north ? 0 : UTM_SOUTH_FALSE_NORTHING)
+{
+}
+
+int UTMProjection::getZone(double longitude)
+{
+    int zone = static_cast<int>(floor((longitude + 180) / 6)) + 1;
+    return std::min(std::max(zone, 1), 60);
+}
+
+int UTMProjection::getZone() const
+{
+    return m_zone;
+}
+
+bool UTMProjection::isNorth() const
+{
+    return m_north;
+}
+
+void UTMProjection::fromGeodetic(size_t count, double const* latitude, double const* longitude,
+        double* easting, double* northing) const
+{
+    double const e = sqrt(WGS84_E2);
+    double const scale = UTM_SCALE * UTM_RECTIFYING_RADIUS;
+    double const central_meridian = m_central_meridian;
+    double const false_northing = m_false_northing;
+
+    double sin_lon[BLOCK_SIZE], cos_lon[BLOCK_SIZE];
+    double tau[BLOCK_SIZE], xi[BLOCK_SIZE], eta[BLOCK_SIZE], u[BLOCK_SIZE];
+
+    for (size_t start = 0; start < count; start += BLOCK_SIZE)
+    {
+        size_t block = std::min(BLOCK_SIZE, count - start);
+        double const* lat = latitude + start;
+        double const* lon = longitude + start;
+
+        // Vectorized: tangent of the conformal latitude, and the sine of
+        // the longitude on the conformal sphere
+        for (size_t i = 0; i < block; ++i)
+        {
+            double sin_lat, cos_lat;
+            sinCosKernel(lat[i] * DEG_TO_RAD, sin_lat, cos_lat);
+            sinCosKernel((lon[i] - central_meridian) * DEG_TO_RAD, sin_lon[i], cos_lon[i]);
+
+            // tau = sinh(atanh(sin_lat) - e atanh(e sin_lat)). As |e
+            // sin_lat| < 0.082, the second term is computed with series
+            double q = sqrt((1 + sin_lat) / (1 - sin_lat)) * smallExp(-e * smallAtanh(e * sin_lat));
+            tau[i] = 0.5 * (q - 1 / q);
+            u[i]   = sin_lon[i] / sqrt(1 + tau[i] * tau[i]);
+        }
+
+        // Scalar: the transverse Mercator coordinates on the sphere
+        for (size_t i = 0; i < block; ++i)
+        {
+            xi[i]  = atan2(tau[i], cos_lon[i]);
+            eta[i] = 0.5 * log((1 + u[i]) / (1 - u[i]));
+        }
+
+        // Vectorized: Krüger's series, evaluated with Clenshaw's
+        // summation on the complex argument 2 * (xi + i eta)
+        double* east  = easting + start;
+        double* north = northing + start;
+        for (size_t i = 0; i < block; ++i)
+        {
+            double t = tau[i], c = cos_lon[i];
+            double r2 = t * t + c * c;
+            double sin_2xi = 2 * t * c / r2;
+            double cos_2xi = (c * c - t * t) / r2;
+            double exp_2eta = (1 + u[i]) / (1 - u[i]);
+            double cosh_2eta = 0.5 * (exp_2eta + 1 / exp_2eta);
+            double sinh_2eta = 0.5 * (exp_2eta - 1 / exp_2eta);
+
+            // sin and cos of the complex argument
+            double s_re =  sin_2xi * cosh_2eta, s_im = cos_2xi * sinh_2eta;
+            double c_re =  cos_2xi * cosh_2eta, c_im = -sin_2xi * sinh_2eta;
+
+            double b1_re = 0, b1_im = 0, b2_re = 0, b2_im = 0;
+            double const alpha[4] = { UTM_ALPHA4, UTM_ALPHA3, UTM_ALPHA2, UTM_ALPHA1 };
+            for (int k = 0; k < 4; ++k)
+            {
+                double b_re = alpha[k] + 2 * (c_re * b1_re - c_im * b1_im) - b2_re;
+                double b_im =            2 * (c_re * b1_im + c_im * b1_re) - b2_im;
+                b2_re = b1_re; b2_im = b1_im;
+                b1_re = b_re;  b1_im = b_im;
+            }
+            double sum_re = b1_re * s_re - b1_im * s_im;
+            double sum_im = b1_re * s_im + b1_im * s_re;
+
+            east[i]  = UTM_FALSE_EASTING + scale * (eta[i] + sum_im);
+            north[i] = false_northing + scale * (xi[i] + sum_re);
+        }
+    }
+}
+
+void UTMProjection::fromGeodetic(GeodeticPoints const& points, CartesianPoints& utm) const
+{
+    size_t count = points.size();
+    utm.resize(count);
+    if (count)
+    {
+        fromGeodetic(count, &points.latitude[0], &points.longitude[0], &utm.x[0], &utm.y[0]);
+        utm.z = points.height;
+    }
+}
+
+void UTMProjection::fromPosition(gps::Position const& position, double& easting, double& northing) const
+{
+    fromGeodetic(1, &position.latitude, &position.longitude, &easting, &northing);
+}
@@ -0,0 +1,143 @@
+#ifndef MAGELLAN_MB500_GEODESY_H
+#define MAGELLAN_MB500_GEODESY_H
+
+#include <stddef.h>
+#include <vector>
+#include "gps_types.hh"
+
+namespace gps {
+    /** WGS84 ellipsoid parameters */
+    static const double WGS84_A  = 6378137.0;
+    static const double WGS84_F  = 1 / 298.257223563;
+    static const double WGS84_E2 = WGS84_F * (2 - WGS84_F);
+
+    /** Converts WGS84 geodetic coordinates (degrees, and meters above the
+     * ellipsoid) into ECEF coordinates (meters)
+     */
+    void geodeticToECEF(double latitude, double longitude, double height, double ecef[3]);
+
+    /** Converts ECEF coordinates (meters) into WGS84 geodetic coordinates
+     * (degrees, and meters above the ellipsoid)
+     */
+    void ecefToGeodetic(double const ecef[3], double& latitude, double& longitude, double& height);
+
+    /** Rotation from ECEF to the east-north-up frame tangent to the
+     * ellipsoid at the given latitude and longitude, in degrees. The rows
+     * are the east, north and up axes */
+    void getLocalRotation(double latitude, double longitude, double rotation[3][3]);
+
+    /** Height above the ellipsoid of a solution */
+    inline double getEllipsoidalHeight(gps::Position const& position)
+    { return position.altitude + position.geoidalSeparation; }
+
+    /* The batch conversions below work on arrays of coordinates (one
+     * array per coordinate) and are written as branch-free loops, so that
+     * the compiler vectorizes them. They use their own sine and cosine,
+     * accurate to a few ulps for the angles of geodetic coordinates
+     * (|angle| < 1e5 radians). The input and output arrays may be the
+     * same.
+     */
+
+    /** Computes the sine and cosine of \c count angles, in radians */
+    void sinCos(size_t count, double const* angles, double* sin, double* cos);
+
+    /** Batch version of geodeticToECEF */
+    void geodeticToECEF(size_t count, double const* latitude, double const* longitude, double const* height,
+            double* x, double* y, double* z);
+
+    /** A set of WGS84 geodetic coordinates, one array per coordinate
+     *
+     * It is meant to be filled from the solution stream, or from the
+     * columns of a SolutionArchiveReader, and then converted in one go.
+     */
+    struct GeodeticPoints
+    {
+        /** Degrees */
+        std::vector<double> latitude;
+        std::vector<double> longitude;
+        /** Meters above the ellipsoid */
+        std::vector<double> height;
+
+        size_t size() const;
+        void clear();
+        void reserve(size_t size);
+        void push_back(double latitude, double longitude, double height);
+        void push_back(gps::Position const& position);
+    };
+
+    /** A set of points in a cartesian frame (ECEF, ENU or UTM), one array
+     * per coordinate. For UTM, x is the easting and y the northing */
+    struct CartesianPoints
+    {
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> z;
+
+        size_t size() const;
+        void resize(size_t size);
+    };
+
+    void geodeticToECEF(GeodeticPoints const& points, CartesianPoints& ecef);
+
+    /** Local east-north-up frame tangent to the ellipsoid at a fixed
+     * origin. The rotation is computed once, at construction */
+    class LocalFrame
+    {
+    public:
+        LocalFrame(double latitude, double longitude, double height);
+
+        /** Converts ECEF coordinates into this frame */
+        void fromECEF(size_t count, double const* x, double const* y, double const* z,
+                double* east, double* north, double* up) const;
+        /** Converts geodetic coordinates into this frame, without going
+         * through an intermediate ECEF array */
+        void fromGeodetic(size_t count, double const* latitude, double const* longitude, double const* height,
+                double* east, double* north, double* up) const;
+
+        void fromECEF(CartesianPoints const& ecef, CartesianPoints& enu) const;
+        void fromGeodetic(GeodeticPoints const& points, CartesianPoints& enu) const;
+        /** Converts a single solution, e.g. while reading the epoch
+         * stream */
+        void fromPosition(gps::Position const& position, double enu[3]) const;
+
+    private:
+        double m_origin[3];
+        double m_rotation[3][3];
+    };
+
+    /** Universal Transverse Mercator projection on one zone
+     *
+     * The projection uses Krüger's series to the fourth order of the third
+     * flattening, which is accurate to well below the millimeter within
+     * the zone. The special zones of Norway and Svalbard are not handled
+     * by getZone().
+     */
+    class UTMProjection
+    {
+    public:
+        UTMProjection(int zone, bool north);
+
+        /** Returns the standard zone of a longitude, in degrees */
+        static int getZone(double longitude);
+
+        int getZone() const;
+        bool isNorth() const;
+
+        /** Projects geodetic coordinates, in degrees */
+        void fromGeodetic(size_t count, double const* latitude, double const* longitude,
+                double* easting, double* northing) const;
+        /** Projects the points. The z coordinate of \c utm is the height
+         * above the ellipsoid */
+        void fromGeodetic(GeodeticPoints const& points, CartesianPoints& utm) const;
+        void fromPosition(gps::Position const& position, double& easting, double& northing) const;
+
+    private:
+        int m_zone;
+        bool m_north;
+        double m_central_meridian;
+        double m_false_northing;
+    };
+}
+
+#endif
+
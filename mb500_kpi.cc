@@ -0,0 +1,319 @@
+#include "mb500_kpi.hh"
+
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <algorithm>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace gps;
+
+// "MB5K", and the version of the RTKStatistics layout. Bump the version
+// whenever RTKStatistics changes
+static const uint32_t KPI_MAGIC   = 0x4d42354b;
+static const uint32_t KPI_VERSION = 1;
+
+struct gps::RTKStatisticsSegment
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t padding;
+    /** Odd while the statistics are being written */
+    uint64_t sequence;
+    RTKStatistics statistics;
+};
+
+RTKMonitor::RTKMonitor(size_t window)
+    : m_window(window > 0 ? window : 1)
+    , m_segment(NULL)
+{
+    m_window_fixed.resize(m_window);
+    m_window_age.resize(m_window);
+    m_scratch.reserve(m_window);
+    reset();
+}
+
+RTKMonitor::~RTKMonitor()
+{
+    unpublish();
+}
+
+size_t RTKMonitor::getWindow() const
+{
+    return m_window;
+}
+
+void RTKMonitor::reset()
+{
+    memset(&m_statistics, 0, sizeof(m_statistics));
+    m_statistics.correction_age_p50 = NAN;
+    m_statistics.correction_age_p95 = NAN;
+    m_statistics.correction_age_p99 = NAN;
+    m_statistics.correction_age_max = NAN;
+    m_window_next = 0;
+    m_window_fixed_count = 0;
+    m_rtk_fix_lost = base::Time();
+    publishStatistics();
+}
+
+static bool hasFix(int type)
+{
+    return type == gps_base::AUTONOMOUS || type == gps_base::DIFFERENTIAL ||
+        type == gps_base::RTK_FIXED || type == gps_base::RTK_FLOAT;
+}
+
+static bool isDifferential(int type)
+{
+    return type == gps_base::DIFFERENTIAL ||
+        type == gps_base::RTK_FIXED || type == gps_base::RTK_FLOAT;
+}
+
+void RTKMonitor::update(Position const& position, SolutionQuality const& quality,
+        SatelliteInfo const& satellites,
+        base::Time const& time_to_first_fix, base::Time const& time_to_rtk_fix)
+{
+    base::Time now = base::Time::now();
+    int previous_type = m_statistics.epoch_count ? m_statistics.fix_type : gps_base::NO_SOLUTION;
+    int type = position.positionType;
+
+    m_statistics.update_time   = now.toMicroseconds();
+    m_statistics.solution_time = position.time.toMicroseconds();
+    ++m_statistics.epoch_count;
+    if (type >= 0 && type < RTKStatistics::FIX_TYPE_COUNT)
+        ++m_statistics.fix_type_count[type];
+    m_statistics.fix_type = type;
+
+    if (hasFix(previous_type) && !hasFix(type))
+        ++m_statistics.fix_losses;
+    if (previous_type == gps_base::RTK_FIXED && type != gps_base::RTK_FIXED)
+    {
+        ++m_statistics.rtk_fix_losses;
+        m_rtk_fix_lost = now;
+    }
+    else if (type == gps_base::RTK_FIXED && !m_rtk_fix_lost.isNull())
+    {
+        m_statistics.last_rtk_refix_time = (now - m_rtk_fix_lost).toMicroseconds();
+        m_rtk_fix_lost = base::Time();
+    }
+    m_statistics.time_to_first_fix = time_to_first_fix.toMicroseconds();
+    m_statistics.time_to_rtk_fix   = time_to_rtk_fix.toMicroseconds();
+
+    // The window is a ring of the last m_window epochs, the oldest one
+    // gets replaced
+    uint8_t fixed = (type == gps_base::RTK_FIXED);
+    if (m_statistics.window_epochs == m_window)
+        m_window_fixed_count -= m_window_fixed[m_window_next];
+    else
+        ++m_statistics.window_epochs;
+    m_window_fixed[m_window_next] = fixed;
+    m_window_fixed_count += fixed;
+    m_window_age[m_window_next] = isDifferential(type) ? position.ageOfDifferentialCorrections : NAN;
+    m_window_next = (m_window_next + 1) % m_window;
+
+    m_statistics.rtk_fixed_ratio = static_cast<double>(m_window_fixed_count) / m_statistics.window_epochs;
+    computeAgePercentiles();
+
+    m_statistics.used_satellites    = quality.usedSatellites.size();
+    m_statistics.tracked_satellites = satellites.knownSatellites.size();
+    m_statistics.hdop = quality.hdop;
+
+    publishStatistics();
+}
+
+/** Nearest-rank percentile of \c values. The values before \c begin
+ * must all be lower than the ones after, which lets successive calls with
+ * increasing percentiles work on a shrinking range */
+static float percentile(vector<float>& values, size_t& begin, double p)
+{
+    size_t count = values.size();
+    size_t rank = static_cast<size_t>(ceil(p * count));
+    size_t index = rank > 0 ? rank - 1 : 0;
+    if (index < begin)
+        index = begin;
+    nth_element(values.begin() + begin, values.begin() + index, values.end());
+    begin = index;
+    return values[index];
+}
+
+void RTKMonitor::computeAgePercentiles()
+{
+    // m_scratch has the window's capacity, this does not allocate
+    m_scratch.clear();
+    for (size_t i = 0; i < m_statistics.window_epochs; ++i)
+    {
+        if (!isnan(m_window_age[i]))
+            m_scratch.push_back(m_window_age[i]);
+    }
+
+    if (m_scratch.empty())
+    {
+        m_statistics.correction_age_p50 = NAN;
+        m_statistics.correction_age_p95 = NAN;
+        m_statistics.correction_age_p99 = NAN;
+        m_statistics.correction_age_max = NAN;
+        return;
+    }
+
+    size_t begin = 0;
+    m_statistics.correction_age_p50 = percentile(m_scratch, begin, 0.50);
+    m_statistics.correction_age_p95 = percentile(m_scratch, begin, 0.95);
+    m_statistics.correction_age_p99 = percentile(m_scratch, begin, 0.99);
+    m_statistics.correction_age_max = *max_element(m_scratch.begin() + begin, m_scratch.end());
+}
+
+RTKStatistics const& RTKMonitor::getStatistics() const
+{
+    return m_statistics;
+}
+
+bool RTKMonitor::publish(std::string const& name)
+{
+    unpublish();
+
+    // As for SolutionBus, readers of a previous segment of that name keep
+    // their mapping, so create a new one instead of reusing it
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot create the shared memory segment " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    if (ftruncate(fd, sizeof(RTKStatisticsSegment)) == -1)
+    {
+        cerr << "dgps/mb500: cannot resize the shared memory segment " << name << ": " << strerror(errno) << endl;
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void* data = mmap(NULL, sizeof(RTKStatisticsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "dgps/mb500: cannot map the shared memory segment " << name << ": " << strerror(errno) << endl;
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // The segment is zero-filled, i.e. sequence is 0
+    m_shm_name = name;
+    m_segment  = static_cast<RTKStatisticsSegment*>(data);
+    m_segment->version = KPI_VERSION;
+    m_segment->size    = sizeof(RTKStatistics);
+    __atomic_store_n(&m_segment->magic, KPI_MAGIC, __ATOMIC_RELEASE);
+    publishStatistics();
+    return true;
+}
+
+void RTKMonitor::unpublish()
+{
+    if (!m_segment)
+        return;
+
+    // Tell the readers that still have it mapped
+    __atomic_store_n(&m_segment->magic, 0, __ATOMIC_RELEASE);
+    munmap(m_segment, sizeof(RTKStatisticsSegment));
+    shm_unlink(m_shm_name.c_str());
+    m_segment = NULL;
+    m_shm_name.clear();
+}
+
+void RTKMonitor::publishStatistics()
+{
+    if (!m_segment)
+        return;
+
+    // Sequence lock. We are the only writer, so there is no need for an
+    // atomic increment
+    uint64_t sequence = m_segment->sequence;
+    __atomic_store_n(&m_segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&m_segment->statistics, &m_statistics, sizeof(m_statistics));
+    __atomic_store_n(&m_segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+RTKStatisticsReader::RTKStatisticsReader()
+    : m_segment(NULL)
+{
+}
+
+RTKStatisticsReader::~RTKStatisticsReader()
+{
+    close();
+}
+
+bool RTKStatisticsReader::open(std::string const& name)
+{
+    close();
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+
+    struct stat segment_stat;
+    if (fstat(fd, &segment_stat) == -1 ||
+            segment_stat.st_size < static_cast<off_t>(sizeof(RTKStatisticsSegment)))
+    {
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, sizeof(RTKStatisticsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    RTKStatisticsSegment const* segment = static_cast<RTKStatisticsSegment const*>(data);
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != KPI_MAGIC ||
+            segment->version != KPI_VERSION || segment->size != sizeof(RTKStatistics))
+    {
+        cerr << "dgps/mb500: the shared memory segment " << name << " has an incompatible format" << endl;
+        munmap(data, sizeof(RTKStatisticsSegment));
+        return false;
+    }
+    m_segment = segment;
+    return true;
+}
+
+void RTKStatisticsReader::close()
+{
+    if (m_segment)
+        munmap(const_cast<RTKStatisticsSegment*>(m_segment), sizeof(RTKStatisticsSegment));
+    m_segment = NULL;
+}
+
+bool RTKStatisticsReader::isValid() const
+{
+    return m_segment && __atomic_load_n(&m_segment->magic, __ATOMIC_ACQUIRE) == KPI_MAGIC;
+}
+
+bool RTKStatisticsReader::read(RTKStatistics& statistics) const
+{
+    if (!isValid())
+        return false;
+
+    // A writer that died in the middle of an update leaves the sequence
+    // odd forever
+    RTKStatisticsSegment const* segment = m_segment;
+    for (int retry = 0; retry < MAX_READ_RETRIES; ++retry)
+    {
+        uint64_t before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(&statistics, &segment->statistics, sizeof(statistics));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) == before)
+            return statistics.epoch_count > 0;
+    }
+    return false;
+}
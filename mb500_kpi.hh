@@ -0,0 +1,144 @@
+#ifndef MAGELLAN_MB500_KPI_H
+#define MAGELLAN_MB500_KPI_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "gps_types.hh"
+
+namespace gps {
+    /** RTK quality indicators
+     *
+     * This is also the layout of the shared memory segment, so it only
+     * has fixed-size fields. Times are in microseconds, zero meaning
+     * "none yet". The window fields cover the last RTKMonitor::getWindow()
+     * epochs.
+     */
+    struct RTKStatistics
+    {
+        /** Size of fix_type_count, which is indexed by
+         * gps_base::GPS_SOLUTION_TYPES */
+        static const int FIX_TYPE_COUNT = 16;
+
+        /** Host time of the last update */
+        int64_t update_time;
+        /** GPS time of the last solution */
+        int64_t solution_time;
+        uint64_t epoch_count;
+        uint64_t fix_type_count[FIX_TYPE_COUNT];
+        /** Number of times a fix, or an RTK fixed solution, was lost */
+        uint64_t fix_losses;
+        uint64_t rtk_fix_losses;
+
+        int64_t time_to_first_fix;
+        int64_t time_to_rtk_fix;
+        /** Time between the last RTK fix loss and the next RTK fix */
+        int64_t last_rtk_refix_time;
+
+        double rtk_fixed_ratio;
+        /** Age of the differential corrections, in seconds, over the
+         * differential epochs of the window. NaN if there is none */
+        double correction_age_p50;
+        double correction_age_p95;
+        double correction_age_p99;
+        double correction_age_max;
+        double hdop;
+
+        int32_t fix_type;
+        int32_t used_satellites;
+        int32_t tracked_satellites;
+        uint32_t window_epochs;
+    };
+
+    struct RTKStatisticsSegment;
+
+    /** Maintains the RTKStatistics of a solution stream, and optionally
+     * publishes them in a POSIX shared memory segment
+     *
+     * The segment is updated with a sequence lock: the writer never
+     * waits, and readers (RTKStatisticsReader) retry the copy if it
+     * overlapped an update. Monitors can therefore poll it at any rate
+     * without any effect on the acquisition.
+     */
+    class RTKMonitor
+    {
+    public:
+        /** Default window, in epochs */
+        static const size_t DEFAULT_WINDOW = 600;
+
+        RTKMonitor(size_t window = DEFAULT_WINDOW);
+        ~RTKMonitor();
+
+        size_t getWindow() const;
+
+        /** Creates the segment \c name, e.g. "/mb500_rtk", and publishes
+         * the statistics there from now on. An existing segment of that
+         * name is replaced */
+        bool publish(std::string const& name);
+        /** Stops publishing and removes the segment */
+        void unpublish();
+
+        /** Updates the statistics with a new epoch
+         *
+         * @arg time_to_first_fix, time_to_rtk_fix as measured by the driver
+         */
+        void update(gps::Position const& position, gps::SolutionQuality const& quality,
+                gps::SatelliteInfo const& satellites,
+                base::Time const& time_to_first_fix, base::Time const& time_to_rtk_fix);
+        /** Resets all the statistics, e.g. after a board reset */
+        void reset();
+
+        RTKStatistics const& getStatistics() const;
+
+    private:
+        size_t m_window;
+        RTKStatistics m_statistics;
+
+        /** Ring of the window's epochs: whether it was RTK fixed, and its
+         * correction age (NaN if not differential) */
+        std::vector<uint8_t> m_window_fixed;
+        std::vector<float> m_window_age;
+        size_t m_window_next;
+        size_t m_window_fixed_count;
+        std::vector<float> m_scratch;
+
+        base::Time m_rtk_fix_lost;
+
+        std::string m_shm_name;
+        RTKStatisticsSegment* m_segment;
+
+        void computeAgePercentiles();
+        void publishStatistics();
+    };
+
+    /** Reads the statistics published by an RTKMonitor */
+    class RTKStatisticsReader
+    {
+    public:
+        /** Number of attempts of read() while the writer is updating */
+        static const int MAX_READ_RETRIES = 1000;
+
+        RTKStatisticsReader();
+        ~RTKStatisticsReader();
+
+        /** Maps the segment. Fails if it does not exist or has been
+         * created by an incompatible version */
+        bool open(std::string const& name);
+        void close();
+        /** False once the monitor stopped publishing in the segment. The
+         * reader must then be reopened to follow a new monitor */
+        bool isValid() const;
+
+        /** Copies a consistent snapshot of the statistics. Returns false
+         * if the monitor has not published anything yet, stopped
+         * publishing, or kept updating for MAX_READ_RETRIES attempts */
+        bool read(RTKStatistics& statistics) const;
+
+    private:
+        RTKStatisticsSegment const* m_segment;
+    };
+}
+
+#endif
+
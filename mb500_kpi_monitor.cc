@@ -0,0 +1,72 @@
+#include "mb500_kpi.hh"
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+static double toSeconds(int64_t microseconds)
+{
+    return microseconds / 1e6;
+}
+
+int main (int argc, const char** argv){
+    if (argc > 3)
+    {
+        cerr << "usage: mb500_kpi [segment] [period]" << endl;
+        cerr << "  displays the RTK quality indicators published by a driver in the\n"
+            "  shared memory segment (/mb500_rtk by default). If a period is given,\n"
+            "  in seconds, they are displayed at this period until interrupted" << endl;
+        return 1;
+    }
+
+    string name = argc > 1 ? argv[1] : "/mb500_rtk";
+    double period = argc > 2 ? atof(argv[2]) : 0;
+
+    gps::RTKStatisticsReader reader;
+    if (!reader.open(name))
+    {
+        cerr << "cannot open the shared memory segment " << name << endl;
+        return 1;
+    }
+
+    while (true)
+    {
+        // The driver creates a new segment when it gets restarted
+        if (!reader.isValid())
+            reader.open(name);
+
+        gps::RTKStatistics stats;
+        if (reader.read(stats))
+        {
+            cout << fixed << setprecision(2)
+                << "epochs " << stats.epoch_count
+                << " type " << stats.fix_type
+                << " fixed_ratio " << stats.rtk_fixed_ratio << " (" << stats.window_epochs << " epochs)"
+                << " fix_losses " << stats.fix_losses
+                << " rtk_fix_losses " << stats.rtk_fix_losses
+                << " ttff " << toSeconds(stats.time_to_first_fix)
+                << " ttrtk " << toSeconds(stats.time_to_rtk_fix)
+                << " refix " << toSeconds(stats.last_rtk_refix_time)
+                << " age p50/p95/p99/max " << stats.correction_age_p50 << "/" << stats.correction_age_p95
+                << "/" << stats.correction_age_p99 << "/" << stats.correction_age_max
+                << " sats " << stats.used_satellites << "/" << stats.tracked_satellites
+                << " hdop " << stats.hdop << "\n";
+            cout << "  types";
+            for (int i = 0; i < gps::RTKStatistics::FIX_TYPE_COUNT; ++i)
+            {
+                if (stats.fix_type_count[i])
+                    cout << " " << i << ":" << stats.fix_type_count[i];
+            }
+            cout << endl;
+        }
+        else
+            cout << "no solution yet" << endl;
+
+        if (period <= 0)
+            break;
+        usleep(period * 1000000);
+    }
+    return 0;
+}
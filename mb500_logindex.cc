@@ -0,0 +1,41 @@
+#include "mb500_nmealog.hh"
+#include <iostream>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+int main (int argc, const char** argv){
+    if (argc < 2 || argc > 3)
+    {
+        cerr << "usage: mb500_logindex log_file [period]" << endl;
+        cerr << "  creates or updates the time index of a NMEA log in log_file.idx\n"
+            "  If a period is given, in seconds, the index is updated at this\n"
+            "  period until interrupted, to follow a log being recorded" << endl;
+        return 1;
+    }
+
+    gps::NMEALogIndexBuilder builder;
+    if (!builder.open(argv[1]))
+        return 1;
+
+    double period = 0;
+    if (argc == 3)
+        period = atof(argv[2]);
+
+    while (true)
+    {
+        if (!builder.update())
+            return 1;
+        if (period <= 0)
+            break;
+        usleep(period * 1000000);
+    }
+
+    gps::NMEALogIndex index;
+    if (!index.open(string(argv[1]) + ".idx"))
+        return 1;
+    cerr << index.size() << " epochs indexed, from " << index.getStartTime().toSeconds()
+        << " to " << index.getEndTime().toSeconds() << endl;
+    return 0;
+}
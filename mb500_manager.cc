@@ -0,0 +1,366 @@
+#include "mb500_manager.hh"
+#include "mb500.hh"
+
+#include <iostream>
+#include <stdexcept>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+using namespace std;
+using namespace gps;
+
+// The epoll data field stores the kind of file descriptor in the high 16
+// bits, the index in Device::ports in the next 16 bits and the index in
+// m_devices / m_corrections in the low 32 bits
+static const uint64_t DEVICE_FD     = 0;
+static const uint64_t CORRECTION_FD = 1;
+static const int MAX_EVENTS = 16;
+
+static uint64_t encodeEvent(uint64_t kind, int index, int port = 0)
+{ return (kind << 48) | (static_cast<uint64_t>(port) << 32) | static_cast<uint32_t>(index); }
+static uint64_t eventKind(epoll_event const& event)
+{ return event.data.u64 >> 48; }
+static int eventIndex(epoll_event const& event)
+{ return event.data.u64 & 0xFFFFFFFF; }
+
+MB500Manager::MB500Manager()
+    : m_epoll_fd(epoll_create(MAX_EVENTS)), m_listener(NULL)
+{
+    if (m_epoll_fd == -1)
+        throw std::runtime_error(string("dgps/mb500: cannot create epoll instance: ") + strerror(errno));
+}
+
+MB500Manager::~MB500Manager()
+{
+    ::close(m_epoll_fd);
+}
+
+void MB500Manager::setListener(Listener* listener)
+{
+    m_listener = listener;
+}
+
+int MB500Manager::addDevice(MB500& device)
+{
+    Device info;
+    info.driver = &device;
+    info.failed = false;
+    m_devices.push_back(info);
+
+    int device_id = m_devices.size() - 1;
+    if (!updatePorts(device_id))
+    {
+        removePorts(device_id);
+        m_devices.pop_back();
+        return -1;
+    }
+    return device_id;
+}
+
+void MB500Manager::removeDevice(int device_id)
+{
+    Device& info = m_devices[device_id];
+    if (!info.driver)
+        return;
+
+    removePorts(device_id);
+    info.driver = NULL;
+
+    // Keep the slots so that the other IDs stay valid
+    for (size_t i = 0; i < m_corrections.size(); ++i)
+    {
+        CorrectionInput& input = m_corrections[i];
+        if (input.device_id == device_id && input.fd != -1)
+        {
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, input.fd, NULL);
+            input.fd = -1;
+        }
+    }
+}
+
+bool MB500Manager::recoverDevice(int device_id, base::Time const& timeout)
+{
+    Device& info = m_devices[device_id];
+    if (!info.driver)
+        return false;
+
+    // recover() closes the devices, drop them from epoll first
+    removePorts(device_id);
+    info.failed = true;
+    if (!info.driver->recover(timeout))
+        return false;
+    info.failed = false;
+    return updatePorts(device_id);
+}
+
+bool MB500Manager::updateDevice(int device_id)
+{
+    Device& info = m_devices[device_id];
+    if (!info.driver)
+        return false;
+
+    // The new devices may have the numbers of the closed ones, so
+    // register everything from scratch
+    removePorts(device_id);
+    info.failed = false;
+    return updatePorts(device_id);
+}
+
+bool MB500Manager::updatePorts(int device_id)
+{
+    Device& info = m_devices[device_id];
+    MB500& gps = *info.driver;
+
+    // List the distinct file descriptors of the device, and what has to be
+    // waited for on each of them. The roles the board has not been split
+    // for share the command device
+    vector<Port> ports;
+    for (int role = 0; role < MB500::PORT_ROLE_COUNT; ++role)
+    {
+        int fd = gps.getPortFileDescriptor(static_cast<MB500::PORT_ROLE>(role));
+        if (fd == -1)
+            continue;
+
+        size_t i = 0;
+        while (i < ports.size() && ports[i].fd != fd)
+            ++i;
+        if (i == ports.size())
+        {
+            Port port = { fd, 0, 0 };
+            ports.push_back(port);
+        }
+
+        Port& port = ports[i];
+        port.roles |= 1 << role;
+        if (role != MB500::PORT_CORRECTIONS)
+            port.events |= EPOLLIN;
+        if (role == MB500::PORT_COMMAND && gps.hasPendingOutput())
+            port.events |= EPOLLOUT;
+        if (role == MB500::PORT_CORRECTIONS && gps.hasPendingCorrections())
+            port.events |= EPOLLOUT;
+    }
+
+    // Unregister the file descriptors that are gone or have nothing to
+    // wait for. They may already be closed, so ignore errors
+    for (size_t i = 0; i < info.ports.size(); ++i)
+    {
+        Port const& old = info.ports[i];
+        size_t j = 0;
+        while (j < ports.size() && ports[j].fd != old.fd)
+            ++j;
+        if (old.events && (j == ports.size() || !ports[j].events))
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, old.fd, NULL);
+    }
+
+    bool result = true;
+    for (size_t i = 0; i < ports.size(); ++i)
+    {
+        Port& port = ports[i];
+        if (!port.events)
+            continue;
+
+        size_t j = 0;
+        while (j < info.ports.size() && info.ports[j].fd != port.fd)
+            ++j;
+        bool registered = (j < info.ports.size() && info.ports[j].events);
+        if (registered && j == i && info.ports[j].events == port.events)
+            continue;
+
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events   = port.events;
+        event.data.u64 = encodeEvent(DEVICE_FD, device_id, i);
+        int ret = epoll_ctl(m_epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, port.fd, &event);
+        // epoll forgets the closed file descriptors by itself, and a
+        // reopened device may get the same number
+        if (ret == -1 && registered && errno == ENOENT)
+            ret = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, port.fd, &event);
+        if (ret == -1)
+        {
+            cerr << "dgps/mb500: cannot register device in epoll: " << strerror(errno) << endl;
+            port.events = 0;
+            result = false;
+        }
+    }
+    info.ports = ports;
+    return result;
+}
+
+void MB500Manager::failDevice(int device_id)
+{
+    Device& info = m_devices[device_id];
+    int error = info.driver->getProcessError();
+    cerr << "dgps/mb500: device " << device_id << " failed: "
+        << (error ? strerror(error) : "end of file") << endl;
+
+    // A hung up device would wake the loop up continuously
+    removePorts(device_id);
+    info.failed = true;
+    if (m_listener)
+        m_listener->deviceFailed(device_id, *info.driver);
+}
+
+void MB500Manager::removePorts(int device_id)
+{
+    Device& info = m_devices[device_id];
+    for (size_t i = 0; i < info.ports.size(); ++i)
+    {
+        if (info.ports[i].events)
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, info.ports[i].fd, NULL);
+    }
+    info.ports.clear();
+}
+
+bool MB500Manager::addCorrectionInput(int fd, int device_id)
+{
+    if (device_id < 0 || device_id >= static_cast<int>(m_devices.size()) || !m_devices[device_id].driver)
+        return false;
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events   = EPOLLIN;
+    event.data.u64 = encodeEvent(CORRECTION_FD, m_corrections.size());
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        cerr << "dgps/mb500: cannot register correction input in epoll: " << strerror(errno) << endl;
+        return false;
+    }
+
+    CorrectionInput input;
+    input.fd        = fd;
+    input.device_id = device_id;
+    m_corrections.push_back(input);
+    return true;
+}
+
+int MB500Manager::step(int timeout)
+{
+    // Wake up in time for the command timeouts
+    for (size_t i = 0; i < m_devices.size(); ++i)
+    {
+        Device const& info = m_devices[i];
+        int device_timeout = (info.driver && !info.failed) ? info.driver->getNextTimeout() : -1;
+        if (device_timeout != -1 && (timeout < 0 || device_timeout < timeout))
+            timeout = device_timeout;
+    }
+
+    epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(m_epoll_fd, events, MAX_EVENTS, timeout);
+    if (count == -1)
+    {
+        if (errno == EINTR)
+            return 0;
+        cerr << "dgps/mb500: error during epoll_wait(): " << strerror(errno) << endl;
+        return -1;
+    }
+
+    // All the devices processed in this iteration share the same time
+    // reference
+    base::Time wakeup = base::Time::now();
+
+    // Process corrections first, so that they reach the boards as soon as
+    // possible
+    for (int i = 0; i < count; ++i)
+    {
+        if (eventKind(events[i]) == CORRECTION_FD)
+            processCorrection(eventIndex(events[i]));
+    }
+
+    // processAvailable() handles all the ports of a device at once, so
+    // process each device only once
+    vector<bool> ready(m_devices.size(), false);
+    for (int i = 0; i < count; ++i)
+    {
+        if (eventKind(events[i]) == DEVICE_FD)
+            ready[eventIndex(events[i])] = true;
+    }
+
+    int solutions = 0;
+    for (size_t i = 0; i < m_devices.size(); ++i)
+    {
+        Device const& info = m_devices[i];
+        if (info.driver && !info.failed && (ready[i] || info.driver->getNextTimeout() == 0))
+            solutions += processDevice(i, wakeup);
+    }
+    return solutions;
+}
+
+void MB500Manager::run()
+{
+    while (step(-1) >= 0);
+}
+
+int MB500Manager::processDevice(int device_id, base::Time const& wakeup)
+{
+    Device& info = m_devices[device_id];
+    if (!info.driver || info.failed)
+        return 0;
+
+    MB500& gps = *info.driver;
+    int status = gps.processAvailable();
+    if (status & MB500::PROCESS_ERROR)
+    {
+        failDevice(device_id);
+        return 0;
+    }
+
+    int solutions = 0;
+    base::Time solution_time = gps.getSolutionTime();
+    if ((status & MB500::PROCESS_NEW_SOLUTION) && solution_time > info.last_update)
+    {
+        info.last_update = solution_time;
+        if (m_listener)
+        {
+            base::Time host_time = gps.getHostTime(solution_time);
+            if (host_time.isNull())
+                host_time = wakeup - base::Time::fromSeconds(gps.processing_latency);
+            m_listener->solutionReceived(device_id, gps, host_time);
+        }
+        ++solutions;
+    }
+
+    // Wait for the command device to be writable if commands are queued
+    updatePorts(device_id);
+    return solutions;
+}
+
+void MB500Manager::processCorrection(int input_id)
+{
+    CorrectionInput& input = m_corrections[input_id];
+    if (input.fd == -1)
+        return;
+
+    int device_id = input.device_id;
+    MB500& gps = *m_devices[device_id].driver;
+    char buffer[1024];
+    int rd = ::read(input.fd, buffer, 1024);
+    if (rd > 0)
+        gps.queueCorrectionData(buffer, rd);
+    else if (rd == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        // The input stays readable at end of file and after an error,
+        // stop watching it
+        if (rd == 0)
+            cerr << "dgps/mb500: end of file on correction input " << input_id << endl;
+        else
+            cerr << "dgps/mb500: error reading correction input " << input_id << ": " << strerror(errno) << ", dropping it" << endl;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, input.fd, NULL);
+        input.fd = -1;
+        return;
+    }
+
+    // Keep the data of a failed device queued until it is recovered
+    if (m_devices[device_id].failed)
+        return;
+    if (!gps.writeCorrectionQueue())
+        failDevice(device_id);
+    else
+    {
+        // Wait for the correction device to be writable if it did not
+        // take everything
+        updatePorts(device_id);
+    }
+}
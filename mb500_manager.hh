@@ -0,0 +1,137 @@
+#ifndef MAGELLAN_MB500_MANAGER_H
+#define MAGELLAN_MB500_MANAGER_H
+
+#include <vector>
+#include <stdint.h>
+#include <base/Time.hpp>
+
+namespace gps {
+    class MB500;
+
+    /** Drives several MB500 boards, and the sockets that feed them with
+     * correction data, from a single epoll loop
+     *
+     * Devices are registered with addDevice(), after having been opened
+     * and configured (i.e. setPeriodicData() has been called). All the
+     * devices of a board, i.e. the ones given to MB500::openPort(), are
+     * watched. step() then waits for data on any of the registered file
+     * descriptors, processes it with MB500::processAvailable() and
+     * notifies the listener for each device that got a new solution.
+     * Nothing is done for
+     * devices that have no pending data, so the CPU usage depends on the
+     * message rate and not on the number of devices.
+     */
+    class MB500Manager {
+    public:
+        /** Interface used to publish the solutions of the managed devices */
+        struct Listener
+        {
+            virtual ~Listener() {}
+            /** Called when \c device has a new, synchronized set of
+             * information (position and errors of the same epoch)
+             *
+             * @arg device_id the value returned by addDevice for \c device
+             * @arg host_time the time at which the data got received,
+             *      corrected for the board's processing latency. It is
+             *      shared by all devices processed in the same loop
+             *      iteration, and is therefore directly comparable between
+             *      devices.
+             */
+            virtual void solutionReceived(int device_id, MB500 const& device, base::Time const& host_time) = 0;
+            /** Called when reading from or writing to \c device failed.
+             * Its ports have been removed from the loop, call
+             * recoverDevice() to reconnect it */
+            virtual void deviceFailed(int device_id, MB500& device) {}
+        };
+
+        MB500Manager();
+        ~MB500Manager();
+
+        /** Sets the object that gets notified about new solutions. The
+         * manager does not take ownership of it */
+        void setListener(Listener* listener);
+
+        /** Registers a device in the loop. The device must already be
+         * opened, and must stay valid as long as it is registered
+         *
+         * @returns the device ID, or -1 on error
+         */
+        int addDevice(MB500& device);
+        /** Removes a device from the loop, along with the correction
+         * inputs that are attached to it */
+        void removeDevice(int device_id);
+        /** Calls MB500::recover() on a device and registers its new file
+         * descriptors. It blocks the whole loop until the board answers
+         * or \c timeout is reached */
+        bool recoverDevice(int device_id, base::Time const& timeout = base::Time::fromSeconds(30));
+        /** Registers the file descriptors of a device again. Call it
+         * after having reopened the device outside of the manager, e.g.
+         * with MB500::recover() or MB500::openPort() */
+        bool updateDevice(int device_id);
+
+        /** Registers a file descriptor (usually an UDP socket) whose data
+         * gets forwarded to the given device with
+         * MB500::queueCorrectionData. The queued data is written when it
+         * arrives and when the board's correction device becomes
+         * writable, without blocking. The input is dropped when it reaches
+         * end of file or a read error. The manager does not take ownership of \c fd
+         */
+        bool addCorrectionInput(int fd, int device_id);
+
+        /** Waits at most \c timeout milliseconds for data and processes
+         * it. A negative timeout waits indefinitely.
+         *
+         * @returns the number of solutions published during this call, or
+         *          -1 if the wait failed
+         */
+        int step(int timeout);
+
+        /** Calls step() until an error occurs */
+        void run();
+
+    private:
+        /** One file descriptor of a device, registered in epoll. Several
+         * port roles share it if the board has not been split with
+         * MB500::openPort() */
+        struct Port
+        {
+            int fd;
+            /** Bitmask of the MB500::PORT_ROLE served by fd */
+            int roles;
+            /** The epoll events fd is registered for */
+            uint32_t events;
+        };
+        struct Device
+        {
+            MB500* driver;
+            base::Time last_update;
+            std::vector<Port> ports;
+            /** Set after an I/O error, until the device gets recovered */
+            bool failed;
+        };
+        struct CorrectionInput
+        {
+            int fd;
+            int device_id;
+        };
+
+        int m_epoll_fd;
+        Listener* m_listener;
+        std::vector<Device> m_devices;
+        std::vector<CorrectionInput> m_corrections;
+
+        /** Registers the device's ports in epoll, or updates their
+         * registration for the output the driver has pending */
+        bool updatePorts(int device_id);
+        /** Removes the device's ports from epoll */
+        void removePorts(int device_id);
+        /** Stops watching a device after an I/O error and notifies the
+         * listener */
+        void failDevice(int device_id);
+        int processDevice(int device_id, base::Time const& wakeup);
+        void processCorrection(int input_id);
+    };
+}
+
+#endif
+
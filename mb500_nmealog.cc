@@ -0,0 +1,894 @@
+#include "mb500_nmealog.hh"
+#include "mb500.hh"
+
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace gps;
+
+// Each thread gets several chunks, so that a chunk that is slower to
+// parse than the others does not leave the other cores idle at the end
+static const size_t CHUNKS_PER_THREAD = 4;
+// Chunks are not made smaller than this, as each one needs a warm-up
+static const size_t MIN_CHUNK_SIZE = 4 * 1024 * 1024;
+// Number of epochs kept waiting for a ZDA before falling back to counting
+// the days from 1970-01-01, by the index and the parser
+static const size_t INDEX_MAX_PENDING = 100;
+
+static const int64_t USECS_PER_SECOND = 1000000;
+static const int64_t USECS_PER_DAY    = 86400 * USECS_PER_SECOND;
+
+/** Parses a hhmmss.ss NMEA time into microseconds since midnight. Returns
+ * -1 if the field is invalid */
+static int64_t parseTimeOfDay(char const* field, char const* end)
+{
+    if (end - field < 6)
+        return -1;
+    for (int i = 0; i < 6; ++i)
+        if (field[i] < '0' || field[i] > '9')
+            return -1;
+
+    int hours   = (field[0] - '0') * 10 + (field[1] - '0');
+    int minutes = (field[2] - '0') * 10 + (field[3] - '0');
+    int seconds = (field[4] - '0') * 10 + (field[5] - '0');
+    int64_t usecs = 0;
+    if (field + 6 < end && field[6] == '.')
+    {
+        int64_t scale = USECS_PER_SECOND / 10;
+        for (char const* c = field + 7; c < end && *c >= '0' && *c <= '9'; ++c, scale /= 10)
+            usecs += (*c - '0') * scale;
+    }
+    return ((hours * 60 + minutes) * 60 + seconds) * USECS_PER_SECOND + usecs;
+}
+
+/** Returns the start of the given comma-separated field, or NULL */
+static char const* findField(char const* line, char const* end, int index)
+{
+    for (int i = 0; i < index; ++i)
+    {
+        line = static_cast<char const*>(memchr(line, ',', end - line));
+        if (!line)
+            return NULL;
+        ++line;
+    }
+    return line;
+}
+
+/** Parses the unsigned integer at the start of a field, without reading
+ * past \c end. Returns -1 if there is none */
+static int parseInteger(char const* field, char const* end)
+{
+    if (!field || field == end || *field < '0' || *field > '9')
+        return -1;
+    int value = 0;
+    for (; field < end && *field >= '0' && *field <= '9' && value < 100000; ++field)
+        value = value * 10 + (*field - '0');
+    return value;
+}
+
+/** Kind of a sentence, as far as the dates of the epochs are concerned */
+enum LOG_SENTENCE
+{
+    LOG_OTHER,
+    /** GGA or POS, with the time of day of an epoch */
+    LOG_EPOCH,
+    /** ZDA with a date */
+    LOG_DATE
+};
+
+/** Classifies a sentence of the log. For LOG_EPOCH and LOG_DATE, \c
+ * time_of_day is set, and for LOG_DATE \c day as well, in days since
+ * 1970-01-01 */
+static LOG_SENTENCE parseLogSentence(char const* line, char const* end, int64_t& time_of_day, int64_t& day)
+{
+    size_t size = end - line;
+    int time_field;
+    if (size > 7 && memcmp(line, "$GPGGA,", 7) == 0)
+        time_field = 1;
+    else if (size > 11 && memcmp(line, "$PASHR,POS,", 11) == 0)
+        time_field = 4;
+    else if (size > 7 && memcmp(line, "$GPZDA,", 7) == 0)
+    {
+        // $GPZDA,hhmmss.ss,dd,mm,yyyy
+        char const* field = findField(line, end, 1);
+        time_of_day = field ? parseTimeOfDay(field, end) : -1;
+        int day_of_month = parseInteger(findField(line, end, 2), end);
+        int month = parseInteger(findField(line, end, 3), end);
+        int year  = parseInteger(findField(line, end, 4), end);
+        if (time_of_day < 0 || day_of_month < 1 || month < 1 || month > 12 || year < 1970)
+            return LOG_OTHER;
+        day = daysFromCivil(year, month, day_of_month);
+        return LOG_DATE;
+    }
+    else
+        return LOG_OTHER;
+
+    char const* field = findField(line, end, time_field);
+    time_of_day = field ? parseTimeOfDay(field, end) : -1;
+    return time_of_day < 0 ? LOG_OTHER : LOG_EPOCH;
+}
+
+namespace
+{
+    /** Gives access to the framing of MB500, and sets the output profile
+     * without talking to a board */
+    class LogInterpreter : public MB500
+    {
+    public:
+        LogInterpreter(MB500_OUTPUT_PROFILE profile)
+        { m_output_profile = profile; }
+
+        int extract(char const* data, size_t size) const
+        { return extractPacket(reinterpret_cast<uint8_t const*>(data), size); }
+
+        /** Sets the UTC day and the time of day of the last epoch, as a
+         * sequential parse would have them */
+        void setUTCDay(int64_t day, int64_t time_of_day)
+        {
+            m_utc_day = day;
+            m_utc_time_of_day = time_of_day;
+        }
+    };
+
+    /** Number of cores the process may run on */
+    int getCPUCount()
+    {
+#ifdef CPU_COUNT
+        cpu_set_t cpus;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+            return max(1, CPU_COUNT(&cpus));
+#endif
+        return max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    bool isGSVCycleStart(char const* data, size_t size)
+    {
+        // $GPGSV,<count>,1,...
+        if (size < 10 || memcmp(data, "$GPGSV,", 7) != 0)
+            return false;
+        char const* number = static_cast<char const*>(memchr(data + 7, ',', size - 7));
+        if (!number || number + 3 > data + size)
+            return false;
+        return number[1] == '1' && number[2] == ',';
+    }
+}
+
+struct NMEALogParser::Chunk
+{
+    /** Where the parsing starts */
+    size_t warmup_start;
+    /** The range of the log whose solutions are reported */
+    size_t start;
+    size_t end;
+
+    /** UTC day and time of day of the last epoch at warmup_start, see
+     * NMEALogParser::findDates */
+    int64_t utc_day;
+    int64_t utc_time_of_day;
+
+    std::vector<LoggedSolution> solutions;
+    size_t sentence_count;
+    size_t invalid_count;
+};
+
+struct NMEALogParser::ParseContext
+{
+    NMEALogParser const* parser;
+    MB500_OUTPUT_PROFILE profile;
+    std::vector<Chunk>* chunks;
+    pthread_mutex_t mutex;
+    size_t next_chunk;
+};
+
+NMEALogParser::NMEALogParser()
+    : m_data(NULL), m_size(0), m_sentence_count(0), m_invalid_count(0)
+{
+}
+
+NMEALogParser::~NMEALogParser()
+{
+    close();
+}
+
+bool NMEALogParser::open(std::string const& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open log " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    if (file_stat.st_size == 0)
+    {
+        ::close(fd);
+        return true;
+    }
+
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "dgps/mb500: cannot map log " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    m_data = static_cast<char const*>(data);
+    m_size = file_stat.st_size;
+    return true;
+}
+
+void NMEALogParser::close()
+{
+    if (m_data)
+        munmap(const_cast<char*>(m_data), m_size);
+    m_data = NULL;
+    m_size = 0;
+}
+
+size_t NMEALogParser::getSize() const
+{
+    return m_size;
+}
+
+size_t NMEALogParser::getSentenceCount() const
+{
+    return m_sentence_count;
+}
+
+size_t NMEALogParser::getInvalidCount() const
+{
+    return m_invalid_count;
+}
+
+size_t NMEALogParser::findWarmupStart(size_t start) const
+{
+    size_t limit = start > MAX_WARMUP_SIZE ? start - MAX_WARMUP_SIZE : 0;
+
+    int cycles = 0;
+    for (size_t i = start; i-- > limit; )
+    {
+        if (m_data[i] == '$' && isGSVCycleStart(m_data + i, m_size - i))
+        {
+            if (++cycles == WARMUP_CYCLES)
+                return i;
+        }
+    }
+
+    char const* sentence = static_cast<char const*>(memchr(m_data + limit, '$', start - limit));
+    return sentence ? sentence - m_data : start;
+}
+
+int64_t NMEALogParser::findFirstDay() const
+{
+    // As NMEALogIndexBuilder: the date of the first ZDA, if it comes
+    // within the first INDEX_MAX_PENDING epochs. The epochs before it are
+    // on the day before if they are later in the day than the ZDA
+    int64_t first_time_of_day = -1;
+    size_t epochs = 0;
+    for (char const* line = m_data; line && epochs < INDEX_MAX_PENDING; )
+    {
+        char const* end  = m_data + m_size;
+        char const* eol  = static_cast<char const*>(memchr(line, '\n', end - line));
+        char const* sentence = static_cast<char const*>(memchr(line, '$', (eol ? eol : end) - line));
+        if (sentence)
+        {
+            int64_t time_of_day, day;
+            LOG_SENTENCE type = parseLogSentence(sentence, eol ? eol : end, time_of_day, day);
+            if (type == LOG_DATE)
+                return day - (first_time_of_day > time_of_day + USECS_PER_DAY / 2 ? 1 : 0);
+            else if (type == LOG_EPOCH && epochs++ == 0)
+                first_time_of_day = time_of_day;
+        }
+        line = eol ? eol + 1 : NULL;
+    }
+    return 0;
+}
+
+void NMEALogParser::advanceDate(int64_t& day, int64_t& time_of_day, size_t start, size_t end) const
+{
+    char const* line = m_data + start;
+    char const* data_end = m_data + end;
+    while (line < data_end)
+    {
+        char const* eol = static_cast<char const*>(memchr(line, '\n', data_end - line));
+        if (!eol)
+            eol = data_end;
+        char const* sentence = static_cast<char const*>(memchr(line, '$', eol - line));
+        int64_t sentence_time, sentence_day;
+        LOG_SENTENCE type = sentence ? parseLogSentence(sentence, eol, sentence_time, sentence_day) : LOG_OTHER;
+        if (type == LOG_DATE)
+        {
+            day = sentence_day;
+            time_of_day = sentence_time;
+        }
+        else if (type == LOG_EPOCH)
+        {
+            if (time_of_day >= 0 && sentence_time < time_of_day - USECS_PER_DAY / 2)
+                ++day;
+            if (time_of_day < 0 || sentence_time < time_of_day + USECS_PER_DAY / 2)
+                time_of_day = sentence_time;
+        }
+        line = eol + 1;
+    }
+}
+
+void NMEALogParser::findDates(Chunk* chunks, size_t count) const
+{
+    // The date at the start of a chunk comes from the last ZDA before it,
+    // which is usually in the warm-up. Otherwise, the days are counted
+    // from the start of the log
+    int64_t day = -1, time_of_day = -1;
+    size_t scanned = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Chunk& chunk = chunks[i];
+        size_t start = chunk.warmup_start;
+        size_t limit = start > MAX_WARMUP_SIZE ? start - MAX_WARMUP_SIZE : 0;
+        bool found = false;
+        for (size_t offset = start; offset-- > limit && !found; )
+        {
+            if (m_data[offset] != '$' || m_size - offset < 7 || memcmp(m_data + offset, "$GPZDA,", 7) != 0)
+                continue;
+            char const* eol = static_cast<char const*>(memchr(m_data + offset, '\n', start - offset));
+            int64_t zda_day, zda_time;
+            if (parseLogSentence(m_data + offset, eol ? eol : m_data + start, zda_time, zda_day) == LOG_DATE)
+            {
+                chunk.utc_day = zda_day;
+                chunk.utc_time_of_day = zda_time;
+                advanceDate(chunk.utc_day, chunk.utc_time_of_day, offset, start);
+                found = true;
+            }
+        }
+        if (found)
+            continue;
+
+        if (day < 0)
+            day = findFirstDay();
+        advanceDate(day, time_of_day, scanned, start);
+        scanned = start;
+        chunk.utc_day = day;
+        chunk.utc_time_of_day = time_of_day;
+    }
+}
+
+void NMEALogParser::parseChunk(Chunk& chunk, MB500_OUTPUT_PROFILE profile) const
+{
+    LogInterpreter gps(profile);
+    gps.setUTCDay(chunk.utc_day, chunk.utc_time_of_day);
+    base::Time last_solution;
+
+    // Packets end at the next '$' at the latest, and chunks start on a '$',
+    // so a packet never crosses the end of the chunk. A packet that is
+    // still incomplete there is a truncated one.
+    size_t offset = chunk.warmup_start;
+    while (offset < chunk.end)
+    {
+        bool own = (offset >= chunk.start);
+        int packet_size = gps.extract(m_data + offset, chunk.end - offset);
+        if (packet_size <= 0)
+        {
+            if (own && m_data[offset] == '$')
+                ++chunk.invalid_count;
+            if (packet_size == 0)
+                break;
+            offset += -packet_size;
+            continue;
+        }
+
+        try { gps.interpretPeriodicData(boost::string_ref(m_data + offset, packet_size)); }
+        catch(std::exception&)
+        {
+            if (own)
+                ++chunk.invalid_count;
+            offset += packet_size;
+            continue;
+        }
+
+        if (own)
+            ++chunk.sentence_count;
+        if (gps.getSolutionTime() != last_solution)
+        {
+            last_solution = gps.getSolutionTime();
+            if (own)
+            {
+                chunk.solutions.push_back(LoggedSolution());
+                LoggedSolution& solution = chunk.solutions.back();
+                solution.position   = gps.position;
+                solution.errors     = gps.errors;
+                solution.satellites = gps.satellites;
+                solution.quality    = gps.solutionQuality;
+                solution.offset     = offset;
+            }
+        }
+        offset += packet_size;
+    }
+}
+
+void NMEALogParser::parse(std::vector<LoggedSolution>& solutions, uint64_t start, uint64_t end, MB500_OUTPUT_PROFILE profile)
+{
+    solutions.clear();
+    m_sentence_count = 0;
+    m_invalid_count  = 0;
+    end = min<uint64_t>(end, m_size);
+    if (!m_data || start >= end)
+        return;
+
+    Chunk chunk;
+    chunk.warmup_start = findWarmupStart(start);
+    chunk.start = start;
+    chunk.end   = end;
+    chunk.sentence_count = 0;
+    chunk.invalid_count  = 0;
+    findDates(&chunk, 1);
+    parseChunk(chunk, profile);
+
+    solutions.swap(chunk.solutions);
+    m_sentence_count = chunk.sentence_count;
+    m_invalid_count  = chunk.invalid_count;
+}
+
+void* NMEALogParser::threadMain(void* context_ptr)
+{
+    ParseContext& context = *static_cast<ParseContext*>(context_ptr);
+    std::vector<Chunk>& chunks = *context.chunks;
+
+    while (true)
+    {
+        pthread_mutex_lock(&context.mutex);
+        size_t index = context.next_chunk++;
+        pthread_mutex_unlock(&context.mutex);
+
+        if (index >= chunks.size())
+            return NULL;
+        context.parser->parseChunk(chunks[index], context.profile);
+    }
+}
+
+void NMEALogParser::parse(std::vector<LoggedSolution>& solutions, MB500_OUTPUT_PROFILE profile, int threads)
+{
+    solutions.clear();
+    m_sentence_count = 0;
+    m_invalid_count  = 0;
+    if (!m_data)
+        return;
+
+    if (threads <= 0)
+        threads = getCPUCount();
+
+    size_t chunk_count = min(threads * CHUNKS_PER_THREAD, max<size_t>(1, m_size / MIN_CHUNK_SIZE));
+    std::vector<Chunk> chunks;
+    size_t start = 0;
+    for (size_t i = 1; i <= chunk_count; ++i)
+    {
+        size_t end = m_size;
+        if (i < chunk_count)
+        {
+            char const* sentence = static_cast<char const*>(memchr(m_data + m_size * i / chunk_count, '$', m_size - m_size * i / chunk_count));
+            end = sentence ? sentence - m_data : m_size;
+        }
+        if (end <= start)
+            continue;
+
+        Chunk chunk;
+        chunk.warmup_start = findWarmupStart(start);
+        chunk.start = start;
+        chunk.end   = end;
+        chunk.sentence_count = 0;
+        chunk.invalid_count  = 0;
+        chunks.push_back(chunk);
+        start = end;
+    }
+
+    if (!chunks.empty())
+        findDates(&chunks[0], chunks.size());
+
+    ParseContext context;
+    context.parser  = this;
+    context.profile = profile;
+    context.chunks  = &chunks;
+    context.next_chunk = 0;
+    pthread_mutex_init(&context.mutex, NULL);
+
+    // The calling thread does its share of the work
+    threads = min<size_t>(threads, chunks.size());
+    std::vector<pthread_t> thread_ids;
+    for (int i = 1; i < threads; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &NMEALogParser::threadMain, &context) == 0)
+            thread_ids.push_back(thread);
+    }
+    threadMain(&context);
+    for (size_t i = 0; i < thread_ids.size(); ++i)
+        pthread_join(thread_ids[i], NULL);
+    pthread_mutex_destroy(&context.mutex);
+
+    // The chunks follow each other in the log, so concatenating them gives
+    // the log order
+    size_t total = 0;
+    for (size_t i = 0; i < chunks.size(); ++i)
+        total += chunks[i].solutions.size();
+    solutions.reserve(total);
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        solutions.insert(solutions.end(), chunks[i].solutions.begin(), chunks[i].solutions.end());
+        m_sentence_count += chunks[i].sentence_count;
+        m_invalid_count  += chunks[i].invalid_count;
+    }
+}
+
+
+static const char INDEX_MAGIC[4] = { 'M', 'B', '5', 'X' };
+static const uint32_t INDEX_VERSION = 1;
+static const size_t INDEX_HEADER_SIZE = 16;
+// Size of the reads done on the log by NMEALogIndexBuilder::update()
+static const size_t INDEX_READ_SIZE = 1024 * 1024;
+
+NMEALogIndexBuilder::NMEALogIndexBuilder(base::Time const& min_interval)
+    : m_min_interval(min_interval), m_log_fd(-1), m_index_fd(-1)
+    , m_indexed_size(0), m_entry_count(0)
+    , m_day(0), m_last_time(-1), m_has_date(false)
+{
+}
+
+NMEALogIndexBuilder::~NMEALogIndexBuilder()
+{
+    close();
+}
+
+bool NMEALogIndexBuilder::open(std::string const& log_path, std::string const& index_path)
+{
+    close();
+
+    string path = index_path.empty() ? log_path + ".idx" : index_path;
+    m_log_fd = ::open(log_path.c_str(), O_RDONLY);
+    if (m_log_fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open log " << log_path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    m_index_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_index_fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open index " << path << ": " << strerror(errno) << endl;
+        close();
+        return false;
+    }
+
+    struct stat log_stat, index_stat;
+    fstat(m_log_fd, &log_stat);
+    fstat(m_index_fd, &index_stat);
+
+    char header[INDEX_HEADER_SIZE];
+    bool valid = index_stat.st_size >= static_cast<off_t>(INDEX_HEADER_SIZE)
+        && pread(m_index_fd, header, INDEX_HEADER_SIZE, 0) == static_cast<ssize_t>(INDEX_HEADER_SIZE)
+        && memcmp(header, INDEX_MAGIC, 4) == 0;
+    if (valid)
+    {
+        uint32_t version;
+        memcpy(&version, header + 4, 4);
+        memcpy(&m_indexed_size, header + 8, 8);
+        // A log that shrank has been replaced, start over
+        valid = (version == INDEX_VERSION) && m_indexed_size <= static_cast<uint64_t>(log_stat.st_size);
+    }
+
+    if (valid)
+    {
+        // Drop a partially written entry, and the entries written after
+        // the last header update
+        m_entry_count = (index_stat.st_size - INDEX_HEADER_SIZE) / sizeof(NMEALogIndexEntry);
+        NMEALogIndexEntry last;
+        while (m_entry_count > 0)
+        {
+            pread(m_index_fd, &last, sizeof(last), INDEX_HEADER_SIZE + (m_entry_count - 1) * sizeof(last));
+            if (last.offset < m_indexed_size)
+                break;
+            --m_entry_count;
+        }
+        if (ftruncate(m_index_fd, INDEX_HEADER_SIZE + m_entry_count * sizeof(NMEALogIndexEntry)) != 0)
+            valid = false;
+        else if (m_entry_count > 0)
+        {
+            m_has_date  = true;
+            m_day       = last.time / USECS_PER_DAY;
+            m_last_time = last.time;
+        }
+    }
+
+    if (!valid)
+    {
+        m_indexed_size = 0;
+        m_entry_count  = 0;
+        if (ftruncate(m_index_fd, 0) != 0 || !writeHeader(0))
+        {
+            cerr << "dgps/mb500: cannot initialize index " << path << ": " << strerror(errno) << endl;
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void NMEALogIndexBuilder::close()
+{
+    if (m_log_fd != -1)
+        ::close(m_log_fd);
+    if (m_index_fd != -1)
+        ::close(m_index_fd);
+    m_log_fd = m_index_fd = -1;
+    m_indexed_size = 0;
+    m_entry_count  = 0;
+    m_day = 0;
+    m_last_time = -1;
+    m_has_date  = false;
+    m_pending.clear();
+}
+
+size_t NMEALogIndexBuilder::getEntryCount() const
+{
+    return m_entry_count;
+}
+
+bool NMEALogIndexBuilder::writeHeader(uint64_t indexed_size)
+{
+    char header[INDEX_HEADER_SIZE];
+    memcpy(header, INDEX_MAGIC, 4);
+    memcpy(header + 4, &INDEX_VERSION, 4);
+    memcpy(header + 8, &indexed_size, 8);
+    return pwrite(m_index_fd, header, INDEX_HEADER_SIZE, 0) == static_cast<ssize_t>(INDEX_HEADER_SIZE);
+}
+
+void NMEALogIndexBuilder::addEpoch(int64_t time_of_day, uint64_t offset)
+{
+    // GGA and POS only have the time of day, detect midnight
+    int64_t time = m_day * USECS_PER_DAY + time_of_day;
+    if (m_last_time >= 0 && time < m_last_time - USECS_PER_DAY / 2)
+    {
+        ++m_day;
+        time += USECS_PER_DAY;
+    }
+    addEntry(time, offset);
+}
+
+void NMEALogIndexBuilder::addEntry(int64_t time, uint64_t offset)
+{
+    // Keep the index sorted, and at most one entry per min_interval
+    if (m_last_time >= 0 && time < m_last_time + std::max<int64_t>(1, m_min_interval.toMicroseconds()))
+        return;
+
+    NMEALogIndexEntry entry = { time, offset };
+    m_new_entries.push_back(entry);
+    m_last_time = time;
+}
+
+void NMEALogIndexBuilder::processLine(char const* line, size_t size, uint64_t offset)
+{
+    int64_t time_of_day, day;
+    LOG_SENTENCE type = parseLogSentence(line, line + size, time_of_day, day);
+    if (type == LOG_DATE)
+    {
+        if (m_has_date)
+            return;
+
+        m_has_date = true;
+        m_day = day;
+        // The epochs seen so far belong to the day before if they are
+        // later in the day than the ZDA
+        for (size_t i = 0; i < m_pending.size(); ++i)
+        {
+            int64_t pending_day = m_day - (m_pending[i].first > time_of_day + USECS_PER_DAY / 2 ? 1 : 0);
+            addEntry(pending_day * USECS_PER_DAY + m_pending[i].first, m_pending[i].second);
+        }
+        m_pending.clear();
+        return;
+    }
+    else if (type != LOG_EPOCH)
+        return;
+
+    if (m_has_date)
+        addEpoch(time_of_day, offset);
+    else
+    {
+        m_pending.push_back(make_pair(time_of_day, offset));
+        if (m_pending.size() >= INDEX_MAX_PENDING)
+        {
+            // No date in this log
+            m_has_date = true;
+            for (size_t i = 0; i < m_pending.size(); ++i)
+                addEpoch(m_pending[i].first, m_pending[i].second);
+            m_pending.clear();
+        }
+    }
+}
+
+bool NMEALogIndexBuilder::update()
+{
+    if (m_log_fd == -1)
+        return false;
+
+    std::vector<char> buffer(INDEX_READ_SIZE);
+    uint64_t offset = m_indexed_size;
+    while (true)
+    {
+        ssize_t size = pread(m_log_fd, &buffer[0], buffer.size(), offset);
+        if (size < 0)
+        {
+            cerr << "dgps/mb500: cannot read log: " << strerror(errno) << endl;
+            return false;
+        }
+
+        // Process the complete lines, the rest is read again on the next
+        // iteration or the next update()
+        char const* data = &buffer[0];
+        char const* line = data;
+        char const* end  = data + size;
+        while (char const* eol = static_cast<char const*>(memchr(line, '\n', end - line)))
+        {
+            char const* sentence = static_cast<char const*>(memchr(line, '$', eol - line));
+            if (sentence)
+                processLine(sentence, eol - sentence, offset + (sentence - data));
+            line = eol + 1;
+        }
+
+        uint64_t processed = line - data;
+        if (processed == 0)
+        {
+            // A line longer than the buffer is garbage, skip it
+            if (size == static_cast<ssize_t>(buffer.size()))
+                processed = size;
+            else
+                break;
+        }
+        offset += processed;
+    }
+
+    if (!m_new_entries.empty())
+    {
+        size_t size = m_new_entries.size() * sizeof(NMEALogIndexEntry);
+        off_t position = INDEX_HEADER_SIZE + m_entry_count * sizeof(NMEALogIndexEntry);
+        if (pwrite(m_index_fd, &m_new_entries[0], size, position) != static_cast<ssize_t>(size))
+        {
+            cerr << "dgps/mb500: cannot write index: " << strerror(errno) << endl;
+            return false;
+        }
+        m_entry_count += m_new_entries.size();
+        m_new_entries.clear();
+    }
+
+    // The header is updated last, so that the entries it covers are
+    // always complete. The epochs still waiting for a date are not in the
+    // index, stop before them so that they get indexed again after a
+    // reopen
+    m_indexed_size = offset;
+    if (!m_pending.empty())
+        return writeHeader(m_pending.front().second);
+    return writeHeader(m_indexed_size);
+}
+
+NMEALogIndex::NMEALogIndex()
+    : m_data(NULL), m_size(0), m_entries(NULL), m_entry_count(0), m_indexed_size(0)
+{
+}
+
+NMEALogIndex::~NMEALogIndex()
+{
+    close();
+}
+
+bool NMEALogIndex::open(std::string const& index_path)
+{
+    close();
+
+    int fd = ::open(index_path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open index " << index_path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    if (file_stat.st_size < static_cast<off_t>(INDEX_HEADER_SIZE))
+    {
+        ::close(fd);
+        cerr << "dgps/mb500: " << index_path << " is not a log index" << endl;
+        return false;
+    }
+
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "dgps/mb500: cannot map index " << index_path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    m_data = static_cast<uint8_t const*>(data);
+    m_size = file_stat.st_size;
+
+    uint32_t version;
+    memcpy(&version, m_data + 4, 4);
+    if (memcmp(m_data, INDEX_MAGIC, 4) != 0 || version != INDEX_VERSION)
+    {
+        cerr << "dgps/mb500: " << index_path << " is not a log index" << endl;
+        close();
+        return false;
+    }
+    memcpy(&m_indexed_size, m_data + 8, 8);
+
+    // Entries written after the header, by a builder that is still
+    // running, are ignored
+    m_entries = reinterpret_cast<NMEALogIndexEntry const*>(m_data + INDEX_HEADER_SIZE);
+    m_entry_count = (m_size - INDEX_HEADER_SIZE) / sizeof(NMEALogIndexEntry);
+    while (m_entry_count > 0 && m_entries[m_entry_count - 1].offset >= m_indexed_size)
+        --m_entry_count;
+    return true;
+}
+
+void NMEALogIndex::close()
+{
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    m_data = NULL;
+    m_size = 0;
+    m_entries = NULL;
+    m_entry_count  = 0;
+    m_indexed_size = 0;
+}
+
+size_t NMEALogIndex::size() const
+{
+    return m_entry_count;
+}
+
+NMEALogIndexEntry const& NMEALogIndex::operator[](size_t index) const
+{
+    return m_entries[index];
+}
+
+uint64_t NMEALogIndex::getIndexedSize() const
+{
+    return m_indexed_size;
+}
+
+base::Time NMEALogIndex::getStartTime() const
+{
+    if (m_entry_count == 0)
+        return base::Time();
+    return base::Time::fromMicroseconds(m_entries[0].time);
+}
+
+base::Time NMEALogIndex::getEndTime() const
+{
+    if (m_entry_count == 0)
+        return base::Time();
+    return base::Time::fromMicroseconds(m_entries[m_entry_count - 1].time);
+}
+
+static bool isEntryBefore(NMEALogIndexEntry const& entry, int64_t time)
+{
+    return entry.time < time;
+}
+
+uint64_t NMEALogIndex::find(base::Time const& time) const
+{
+    NMEALogIndexEntry const* end = m_entries + m_entry_count;
+    NMEALogIndexEntry const* entry = std::lower_bound(m_entries, end, time.toMicroseconds(), isEntryBefore);
+    if (entry == end)
+        return m_indexed_size;
+    return entry->offset;
+}
@@ -0,0 +1,199 @@
+#ifndef MAGELLAN_MB500_NMEALOG_H
+#define MAGELLAN_MB500_NMEALOG_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "gps_types.hh"
+#include "mb500_types.hh"
+
+namespace gps {
+    /** One epoch re-derived from a recorded log */
+    struct LoggedSolution
+    {
+        gps::Position position;
+        gps::Errors   errors;
+        gps::SatelliteInfo satellites;
+        gps::SolutionQuality quality;
+        /** Offset in the log of the sentence that completed the epoch */
+        uint64_t offset;
+    };
+
+    /** Re-derives the solutions from a raw NMEA capture of the board
+     *
+     * The log is memory-mapped and split into chunks at '$' boundaries.
+     * The chunks are parsed in parallel, each by its own MB500 instance,
+     * so the sentences go through the same framing and interpret*() code
+     * than on a live board.
+     *
+     * To get the state a sequential parse would have at the start of a
+     * chunk, each chunk is first parsed from a warm-up point before it,
+     * without producing solutions. The warm-up starts WARMUP_CYCLES GSV
+     * cycles before the chunk, so that the multi-sentence GSV and GSA
+     * cycles that cross the boundary are complete, as well as all the
+     * sentences sent at the GSV rate or faster (all of the sentences
+     * enabled by MB500::setPeriodicData()). The result is then the same
+     * than the one of a sequential parse.
+     *
+     * The NMEA times have no date. As in NMEALogIndexBuilder, the date
+     * comes from the ZDA sentences of the log, and the day is incremented
+     * when the time of day wraps. Without a ZDA in the first epochs, the
+     * days are counted from 1970-01-01.
+     */
+    class NMEALogParser
+    {
+    public:
+        /** Number of GSV cycles replayed before each chunk */
+        static const int WARMUP_CYCLES = 3;
+        /** Maximum size of the warm-up, for logs without GSV */
+        static const size_t MAX_WARMUP_SIZE = 1024 * 1024;
+
+        NMEALogParser();
+        ~NMEALogParser();
+
+        bool open(std::string const& path);
+        void close();
+
+        /** Size of the log, in bytes */
+        size_t getSize() const;
+
+        /** Parses the log and returns the solutions, in log order
+         *
+         * @arg profile the output profile the log has been recorded with
+         * @arg threads the number of threads, zero to use all the cores
+         */
+        void parse(std::vector<LoggedSolution>& solutions,
+                MB500_OUTPUT_PROFILE profile = MB500_NMEA_OUTPUT, int threads = 0);
+        /** Parses the part of the log between the two offsets, in the
+         * calling thread. The solutions are the ones a parse() of the
+         * whole log would report for sentences in [start, end)
+         *
+         * @see NMEALogIndex::find
+         */
+        void parse(std::vector<LoggedSolution>& solutions, uint64_t start, uint64_t end,
+                MB500_OUTPUT_PROFILE profile = MB500_NMEA_OUTPUT);
+
+        /** Number of sentences interpreted by the last parse(), warm-ups
+         * excluded */
+        size_t getSentenceCount() const;
+        /** Number of sentences rejected by the framing or the
+         * interpretation during the last parse() */
+        size_t getInvalidCount() const;
+
+    private:
+        char const* m_data;
+        size_t m_size;
+        size_t m_sentence_count;
+        size_t m_invalid_count;
+
+        struct Chunk;
+        struct ParseContext;
+        size_t findWarmupStart(size_t start) const;
+        int64_t findFirstDay() const;
+        void advanceDate(int64_t& day, int64_t& time_of_day, size_t start, size_t end) const;
+        void findDates(Chunk* chunks, size_t count) const;
+        void parseChunk(Chunk& chunk, MB500_OUTPUT_PROFILE profile) const;
+        static void* threadMain(void* context);
+    };
+
+    /** Sidecar file that maps UTC times to offsets in an NMEA log
+     *
+     * The file is a 16-byte header (magic, version and the size of the log
+     * already indexed) followed by fixed-size entries: the UTC time of an
+     * epoch, in microseconds, and the offset of its GGA or POS sentence.
+     * Entries are sorted by time and use the host byte order.
+     */
+    struct NMEALogIndexEntry
+    {
+        int64_t  time;
+        uint64_t offset;
+    };
+
+    /** Builds or extends the index of a log
+     *
+     * update() indexes what has been appended to the log since the last
+     * call, up to the last complete line, so it can be called periodically
+     * while the log is being recorded. The index can be reopened later on
+     * and extended from where it stopped.
+     *
+     * The date comes from ZDA. GGA and POS only give the time of day, so
+     * the day is then tracked by detecting midnight. For logs without ZDA,
+     * the times are counted from 1970-01-01.
+     */
+    class NMEALogIndexBuilder
+    {
+    public:
+        /**
+         * @arg min_interval the minimum time between two indexed epochs.
+         *      Zero indexes all epochs
+         */
+        NMEALogIndexBuilder(base::Time const& min_interval = base::Time());
+        ~NMEALogIndexBuilder();
+
+        /** Opens the index of \c log_path, creating it if needed. The
+         * default index path is the log path followed by ".idx" */
+        bool open(std::string const& log_path, std::string const& index_path = "");
+        void close();
+
+        /** Indexes the data appended to the log since the last update */
+        bool update();
+
+        size_t getEntryCount() const;
+
+    private:
+        base::Time m_min_interval;
+        int m_log_fd;
+        int m_index_fd;
+        uint64_t m_indexed_size;
+        size_t m_entry_count;
+
+        int64_t m_day;
+        int64_t m_last_time;
+        bool m_has_date;
+        /** Epochs seen before the first ZDA, as (time of day, offset) */
+        std::vector< std::pair<int64_t, uint64_t> > m_pending;
+        std::vector<NMEALogIndexEntry> m_new_entries;
+
+        void processLine(char const* line, size_t size, uint64_t offset);
+        void addEpoch(int64_t time_of_day, uint64_t offset);
+        void addEntry(int64_t time, uint64_t offset);
+        /** Writes the header, which tells that the log is indexed up to
+         * \c indexed_size */
+        bool writeHeader(uint64_t indexed_size);
+    };
+
+    /** Memory-mapped access to the index written by NMEALogIndexBuilder */
+    class NMEALogIndex
+    {
+    public:
+        NMEALogIndex();
+        ~NMEALogIndex();
+
+        bool open(std::string const& index_path);
+        void close();
+
+        size_t size() const;
+        NMEALogIndexEntry const& operator[](size_t index) const;
+        /** Size of the part of the log covered by the index */
+        uint64_t getIndexedSize() const;
+
+        base::Time getStartTime() const;
+        base::Time getEndTime() const;
+
+        /** Returns the offset of the first indexed epoch at or after \c
+         * time, or getIndexedSize() if there is none. This is a binary
+         * search */
+        uint64_t find(base::Time const& time) const;
+
+    private:
+        uint8_t const* m_data;
+        size_t m_size;
+        NMEALogIndexEntry const* m_entries;
+        size_t m_entry_count;
+        uint64_t m_indexed_size;
+    };
+}
+
+#endif
+
@@ -0,0 +1,522 @@
+#include "mb500_output.hh"
+#include "mb500.hh"
+
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdexcept>
+
+using namespace std;
+using namespace gps;
+using namespace gps_base;
+
+static char const* SOLUTION_NAMES[] = {
+    "NONE",
+    "AUTONOMOUS",
+    "DIFFERENTIAL",
+    "UNUSED",
+    "RTK_FIXED",
+    "RTK_FLOAT"
+};
+static const int MAX_SOLUTION_ID = 5;
+
+static char const* DAY_NAMES[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static char const* MONTH_NAMES[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static const uint64_t POWERS_OF_TEN[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL
+};
+static const int MAX_PRECISION = 12;
+
+/** Counts the used and tracked satellites, per constellation */
+static void countSatellites(SatelliteInfo const& satellites, SolutionQuality const& quality, int used[3], int tracked[3])
+{
+    for (int i = 0; i < 3; ++i)
+        used[i] = tracked[i] = 0;
+
+    for (size_t i = 0; i < quality.usedSatellites.size(); ++i)
+        used[Satellite::getConstellationFromPRN(quality.usedSatellites[i])]++;
+
+    for (size_t i = 0; i < satellites.knownSatellites.size(); ++i)
+    {
+        Satellite const& sat = satellites.knownSatellites[i];
+        if (sat.SNR > 0)
+            tracked[sat.getConstellation()]++;
+    }
+}
+
+SolutionFormatter::SolutionFormatter(FORMAT format)
+    : m_format(format), m_buffer(512), m_size(0)
+    , m_cached_seconds(-1), m_cached_date_size(0)
+{
+}
+
+SolutionFormatter::FORMAT SolutionFormatter::getFormat() const
+{ return m_format; }
+char const* SolutionFormatter::data() const
+{ return &m_buffer[0]; }
+size_t SolutionFormatter::size() const
+{ return m_size; }
+void SolutionFormatter::clear()
+{ m_size = 0; }
+
+void SolutionFormatter::reserve(size_t size)
+{
+    if (m_size + size > m_buffer.size())
+        m_buffer.resize(std::max(m_buffer.size() * 2, m_size + size));
+}
+
+void SolutionFormatter::append(char c)
+{
+    reserve(1);
+    m_buffer[m_size++] = c;
+}
+
+void SolutionFormatter::append(char const* str)
+{
+    append(str, strlen(str));
+}
+
+void SolutionFormatter::append(char const* str, size_t size)
+{
+    reserve(size);
+    memcpy(&m_buffer[m_size], str, size);
+    m_size += size;
+}
+
+void SolutionFormatter::padTo(size_t start, int width)
+{
+    // Right-align what has been written since \c start
+    size_t written = m_size - start;
+    if (width <= 0 || written >= static_cast<size_t>(width))
+        return;
+
+    size_t padding = width - written;
+    reserve(padding);
+    memmove(&m_buffer[start + padding], &m_buffer[start], written);
+    memset(&m_buffer[start], ' ', padding);
+    m_size += padding;
+}
+
+void SolutionFormatter::appendInt(long value, int width)
+{
+    size_t start = m_size;
+    char digits[24];
+    int count = 0;
+    unsigned long magnitude = value < 0 ? -static_cast<unsigned long>(value) : value;
+    do
+    {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    }
+    while (magnitude);
+
+    reserve(count + 1);
+    if (value < 0)
+        m_buffer[m_size++] = '-';
+    while (count)
+        m_buffer[m_size++] = digits[--count];
+    padTo(start, width);
+}
+
+void SolutionFormatter::appendFixed(double value, int precision, int width)
+{
+    size_t start = m_size;
+    if (precision > MAX_PRECISION)
+        precision = MAX_PRECISION;
+
+    double scaled = fabs(value) * POWERS_OF_TEN[precision];
+    bool use_printf = !(scaled < 9e18); // also catches NaN and infinities
+    uint64_t quantized = 0;
+    double remainder = 0;
+    if (!use_printf)
+    {
+        quantized = static_cast<uint64_t>(scaled);
+        remainder = scaled - quantized;
+        // The scaling rounds, and may move a value across a half (2.675 is
+        // stored as 2.67499..., but 2.675 * 100 gives exactly 267.5).
+        // printf rounds the exact value, let it decide near the ties
+        use_printf = fabs(remainder - 0.5) <= scaled * DBL_EPSILON;
+    }
+    if (use_printf)
+    {
+        char tmp[64];
+        int count = snprintf(tmp, sizeof(tmp), "%.*f", precision, value);
+        append(tmp, count);
+        padTo(start, width);
+        return;
+    }
+
+    if (remainder > 0.5)
+        ++quantized;
+    uint64_t integer_part = quantized / POWERS_OF_TEN[precision];
+    uint64_t decimals     = quantized % POWERS_OF_TEN[precision];
+
+    if (value < 0)
+        append('-');
+    char digits[24];
+    int count = 0;
+    do
+    {
+        digits[count++] = '0' + integer_part % 10;
+        integer_part /= 10;
+    }
+    while (integer_part);
+
+    reserve(count + precision + 1);
+    while (count)
+        m_buffer[m_size++] = digits[--count];
+    if (precision > 0)
+    {
+        m_buffer[m_size++] = '.';
+        for (int i = precision - 1; i >= 0; --i)
+        {
+            m_buffer[m_size + i] = '0' + decimals % 10;
+            decimals /= 10;
+        }
+        m_size += precision;
+    }
+    padTo(start, width);
+}
+
+void SolutionFormatter::appendDate(base::Time const& time)
+{
+    // Same format than ctime(), without the trailing newline
+    time_t seconds = time.microseconds / 1000000;
+    if (seconds != m_cached_seconds)
+    {
+        tm local;
+        localtime_r(&seconds, &local);
+        m_cached_date_size = snprintf(m_cached_date, sizeof(m_cached_date), "%s %s%3d %.2d:%.2d:%.2d %d",
+                DAY_NAMES[local.tm_wday], MONTH_NAMES[local.tm_mon], local.tm_mday,
+                local.tm_hour, local.tm_min, local.tm_sec, 1900 + local.tm_year);
+        m_cached_seconds = seconds;
+    }
+    append(m_cached_date, m_cached_date_size);
+}
+
+void SolutionFormatter::formatHeader()
+{
+    clear();
+    switch(m_format)
+    {
+        case TEXT:
+            append("Time                          | Latitude      Longitude         Alt (MSL+geoid)  | dLat   dLong  dAlt | Mode           PDOP    Used (Sum,GP/S/GL)   Tracked (Sum,GP/S/GL) | DiffAge");
+            break;
+        case CSV:
+            append("time,latitude,longitude,altitude,geoidal_separation,"
+                    "deviation_latitude,deviation_longitude,deviation_altitude,"
+                    "solution,hdop,satellites,used_gps,used_sbas,used_glonass,"
+                    "tracked_gps,tracked_sbas,tracked_glonass,correction_age");
+            break;
+        case JSON:
+            break;
+    }
+}
+
+void SolutionFormatter::format(MB500 const& driver)
+{
+    format(driver.position, driver.errors, driver.satellites, driver.solutionQuality);
+}
+
+void SolutionFormatter::format(Position const& pos, Errors const& errors,
+        SatelliteInfo const& satellites, SolutionQuality const& quality)
+{
+    clear();
+    switch(m_format)
+    {
+        case TEXT: formatText(pos, errors, satellites, quality); break;
+        case CSV:  formatCSV(pos, errors, satellites, quality); break;
+        case JSON: formatJSON(pos, errors, satellites, quality); break;
+    }
+}
+
+void SolutionFormatter::formatText(Position const& pos, Errors const& errors,
+        SatelliteInfo const& satellites, SolutionQuality const& quality)
+{
+    appendDate(pos.time);
+    append('.');
+    int msecs = (pos.time.microseconds % 1000000) / 1000;
+    append('0' + msecs / 100);
+    append('0' + (msecs / 10) % 10);
+    append('0' + msecs % 10);
+    append("  | ");
+    appendFixed(pos.latitude, 10, 13);
+    append(' ');
+    appendFixed(pos.longitude, 10, 13);
+    append(' ');
+    appendFixed(pos.altitude, 2, 7);
+    append('+');
+    appendFixed(pos.geoidalSeparation, 2, 7);
+    append("  | ");
+    appendFixed(errors.deviationLatitude, 2, 5);
+    append(' ');
+    appendFixed(errors.deviationLongitude, 2, 5);
+    append(' ');
+    appendFixed(errors.deviationAltitude, 2, 5);
+    append("  | ");
+
+    if (pos.positionType > MAX_SOLUTION_ID)
+    {
+        size_t start = m_size;
+        append("UNDEFINED=");
+        padTo(start, 12);
+        appendInt(pos.positionType);
+    }
+    else
+    {
+        size_t start = m_size;
+        append(SOLUTION_NAMES[pos.positionType]);
+        padTo(start, 12);
+    }
+    append(' ');
+
+    appendFixed(quality.hdop, 1, 5);
+    append(' ');
+    appendInt(pos.noOfSatellites, 5);
+    append(',');
+
+    int used[3], tracked[3];
+    countSatellites(satellites, quality, used, tracked);
+    appendInt(used[0], 2);
+    append('/');
+    appendInt(used[1], 2);
+    append('/');
+    appendInt(used[2], 2);
+    append("   ");
+    appendInt(tracked[0], 2);
+    append('/');
+    appendInt(tracked[1], 2);
+    append('/');
+    appendInt(tracked[2], 2);
+    append("  | ");
+    appendFixed(pos.ageOfDifferentialCorrections, 1);
+}
+
+void SolutionFormatter::formatCSV(Position const& pos, Errors const& errors,
+        SatelliteInfo const& satellites, SolutionQuality const& quality)
+{
+    appendFixed(pos.time.toMicroseconds() / 1e6, 6);
+    append(',');
+    appendFixed(pos.latitude, 10);
+    append(',');
+    appendFixed(pos.longitude, 10);
+    append(',');
+    appendFixed(pos.altitude, 3);
+    append(',');
+    appendFixed(pos.geoidalSeparation, 3);
+    append(',');
+    appendFixed(errors.deviationLatitude, 3);
+    append(',');
+    appendFixed(errors.deviationLongitude, 3);
+    append(',');
+    appendFixed(errors.deviationAltitude, 3);
+    append(',');
+    appendInt(pos.positionType);
+    append(',');
+    appendFixed(quality.hdop, 2);
+    append(',');
+    appendInt(pos.noOfSatellites);
+
+    int used[3], tracked[3];
+    countSatellites(satellites, quality, used, tracked);
+    for (int i = 0; i < 3; ++i)
+    {
+        append(',');
+        appendInt(used[i]);
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        append(',');
+        appendInt(tracked[i]);
+    }
+    append(',');
+    appendFixed(pos.ageOfDifferentialCorrections, 1);
+}
+
+void SolutionFormatter::formatJSON(Position const& pos, Errors const& errors,
+        SatelliteInfo const& satellites, SolutionQuality const& quality)
+{
+    int used[3], tracked[3];
+    countSatellites(satellites, quality, used, tracked);
+
+    append("{\"time\":");
+    appendFixed(pos.time.toMicroseconds() / 1e6, 6);
+    append(",\"latitude\":");
+    appendFixed(pos.latitude, 10);
+    append(",\"longitude\":");
+    appendFixed(pos.longitude, 10);
+    append(",\"altitude\":");
+    appendFixed(pos.altitude, 3);
+    append(",\"geoidal_separation\":");
+    appendFixed(pos.geoidalSeparation, 3);
+    append(",\"deviation_latitude\":");
+    appendFixed(errors.deviationLatitude, 3);
+    append(",\"deviation_longitude\":");
+    appendFixed(errors.deviationLongitude, 3);
+    append(",\"deviation_altitude\":");
+    appendFixed(errors.deviationAltitude, 3);
+    append(",\"solution\":\"");
+    if (pos.positionType > MAX_SOLUTION_ID)
+        append("UNDEFINED");
+    else
+        append(SOLUTION_NAMES[pos.positionType]);
+    append("\",\"hdop\":");
+    appendFixed(quality.hdop, 2);
+    append(",\"satellites\":");
+    appendInt(pos.noOfSatellites);
+    append(",\"used\":[");
+    appendInt(used[0]);
+    append(',');
+    appendInt(used[1]);
+    append(',');
+    appendInt(used[2]);
+    append("],\"tracked\":[");
+    appendInt(tracked[0]);
+    append(',');
+    appendInt(tracked[1]);
+    append(',');
+    appendInt(tracked[2]);
+    append("],\"correction_age\":");
+    appendFixed(pos.ageOfDifferentialCorrections, 1);
+    append('}');
+}
+
+AsyncOutputSink::AsyncOutputSink(int fd, size_t capacity)
+    : m_fd(fd), m_buffer(capacity), m_read(0), m_size(0), m_quit(false)
+    , m_dropped_bytes(0), m_dropped_count(0)
+{
+    if (capacity == 0)
+        throw std::runtime_error("dgps/mb500: the output buffer cannot be empty");
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_data_available, NULL);
+    pthread_cond_init(&m_data_written, NULL);
+    if (pthread_create(&m_thread, NULL, &AsyncOutputSink::threadMain, this) != 0)
+        throw std::runtime_error("dgps/mb500: cannot start the output thread");
+}
+
+AsyncOutputSink::~AsyncOutputSink()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_quit = true;
+    pthread_cond_signal(&m_data_available);
+    pthread_mutex_unlock(&m_mutex);
+    pthread_join(m_thread, NULL);
+
+    pthread_cond_destroy(&m_data_written);
+    pthread_cond_destroy(&m_data_available);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+bool AsyncOutputSink::push(char const* data, size_t size)
+{
+    return push(data, size, NULL, 0);
+}
+
+bool AsyncOutputSink::pushLine(SolutionFormatter const& formatter)
+{
+    return push(formatter.data(), formatter.size(), "\n", 1);
+}
+
+size_t AsyncOutputSink::getCapacity() const
+{
+    return m_buffer.size();
+}
+
+void AsyncOutputSink::copyToBuffer(char const* data, size_t size)
+{
+    if (size == 0)
+        return;
+    size_t write_pos  = (m_read + m_size) % m_buffer.size();
+    size_t first_part = std::min(size, m_buffer.size() - write_pos);
+    memcpy(&m_buffer[write_pos], data, first_part);
+    memcpy(&m_buffer[0], data + first_part, size - first_part);
+    m_size += size;
+}
+
+bool AsyncOutputSink::push(char const* data, size_t size, char const* suffix, size_t suffix_size)
+{
+    pthread_mutex_lock(&m_mutex);
+    if (m_buffer.size() - m_size < size + suffix_size)
+    {
+        m_dropped_bytes += size + suffix_size;
+        m_dropped_count++;
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+
+    copyToBuffer(data, size);
+    copyToBuffer(suffix, suffix_size);
+    pthread_cond_signal(&m_data_available);
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+}
+
+void AsyncOutputSink::flush()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (m_size > 0)
+        pthread_cond_wait(&m_data_written, &m_mutex);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+size_t AsyncOutputSink::getDroppedBytes() const
+{
+    pthread_mutex_lock(&m_mutex);
+    size_t result = m_dropped_bytes;
+    pthread_mutex_unlock(&m_mutex);
+    return result;
+}
+
+size_t AsyncOutputSink::getDroppedCount() const
+{
+    pthread_mutex_lock(&m_mutex);
+    size_t result = m_dropped_count;
+    pthread_mutex_unlock(&m_mutex);
+    return result;
+}
+
+void* AsyncOutputSink::threadMain(void* sink)
+{
+    static_cast<AsyncOutputSink*>(sink)->writeLoop();
+    return NULL;
+}
+
+void AsyncOutputSink::writeLoop()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (true)
+    {
+        while (m_size == 0 && !m_quit)
+            pthread_cond_wait(&m_data_available, &m_mutex);
+        if (m_size == 0)
+            break;
+
+        size_t start = m_read;
+        size_t chunk = std::min(m_size, m_buffer.size() - m_read);
+        pthread_mutex_unlock(&m_mutex);
+
+        ssize_t written = ::write(m_fd, &m_buffer[start], chunk);
+        if (written < 0)
+        {
+            // Drop what we cannot write, we must not stall the producer
+            if (errno == EAGAIN)
+                usleep(1000);
+            if (errno == EINTR || errno == EAGAIN)
+                written = 0;
+            else
+                written = chunk;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        m_read  = (m_read + written) % m_buffer.size();
+        m_size -= written;
+        pthread_cond_broadcast(&m_data_written);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
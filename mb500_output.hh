@@ -0,0 +1,134 @@
+#ifndef MAGELLAN_MB500_OUTPUT_H
+#define MAGELLAN_MB500_OUTPUT_H
+
+#include <vector>
+#include <string>
+#include <time.h>
+#include <pthread.h>
+
+#include "gps_types.hh"
+
+namespace gps {
+    class MB500;
+
+    /** Formats solutions into a reusable character buffer
+     *
+     * Numbers are converted by hand instead of going through iostreams,
+     * and the buffer is kept between calls, so formatting an epoch does
+     * not allocate once the buffer has grown to its working size.
+     */
+    class SolutionFormatter
+    {
+    public:
+        enum FORMAT
+        {
+            /** Same layout as MB500::display */
+            TEXT,
+            /** One comma-separated line per epoch */
+            CSV,
+            /** One JSON object per line */
+            JSON
+        };
+
+        SolutionFormatter(FORMAT format = TEXT);
+
+        FORMAT getFormat() const;
+
+        /** Replaces the buffer content with the header line of the format
+         * (empty for JSON). The line is not terminated. */
+        void formatHeader();
+        /** Replaces the buffer content with one epoch. The line is not
+         * terminated, so that callers can add their own fields. */
+        void format(gps::Position const& pos, gps::Errors const& errors, gps::SatelliteInfo const& info, gps::SolutionQuality const& quality);
+        void format(MB500 const& driver);
+
+        void clear();
+        void append(char c);
+        void append(char const* str);
+        void append(char const* str, size_t size);
+        /** Appends an integer, right-aligned on \c width characters */
+        void appendInt(long value, int width = 0);
+        /** Appends a number in fixed-point notation, right-aligned on \c
+         * width characters */
+        void appendFixed(double value, int precision, int width = 0);
+
+        char const* data() const;
+        size_t size() const;
+
+    private:
+        FORMAT m_format;
+        std::vector<char> m_buffer;
+        size_t m_size;
+
+        // Formatting the date is the most expensive part, and only changes
+        // once per second
+        time_t m_cached_seconds;
+        char   m_cached_date[32];
+        size_t m_cached_date_size;
+
+        void reserve(size_t size);
+        void padTo(size_t start, int width);
+        void appendDate(base::Time const& time);
+        void formatText(gps::Position const& pos, gps::Errors const& errors, gps::SatelliteInfo const& info, gps::SolutionQuality const& quality);
+        void formatCSV(gps::Position const& pos, gps::Errors const& errors, gps::SatelliteInfo const& info, gps::SolutionQuality const& quality);
+        void formatJSON(gps::Position const& pos, gps::Errors const& errors, gps::SatelliteInfo const& info, gps::SolutionQuality const& quality);
+    };
+
+    /** Writes data to a file descriptor from a background thread
+     *
+     * push() copies the data in a bounded ring buffer and never blocks. If
+     * the buffer is full, because the output is slower than the data
+     * rate, the data is dropped and counted instead of slowing down the
+     * caller.
+     */
+    class AsyncOutputSink
+    {
+    public:
+        /** The sink does not take ownership of \c fd. \c capacity is the
+         * size of the buffer, in bytes, and cannot be zero */
+        AsyncOutputSink(int fd, size_t capacity = 1024 * 1024);
+        /** Writes the queued data and stops the thread */
+        ~AsyncOutputSink();
+
+        /** Queues \c size bytes. Returns false if they got dropped because
+         * the buffer is full. Data larger than getCapacity() is always
+         * dropped */
+        bool push(char const* data, size_t size);
+        /** Queues the current content of the formatter, followed by a
+         * newline */
+        bool pushLine(SolutionFormatter const& formatter);
+
+        /** Size of the buffer, in bytes */
+        size_t getCapacity() const;
+
+        /** Waits until all queued data has been written */
+        void flush();
+
+        /** Number of bytes dropped because the buffer was full */
+        size_t getDroppedBytes() const;
+        /** Number of push() calls whose data got dropped */
+        size_t getDroppedCount() const;
+
+    private:
+        int m_fd;
+        std::vector<char> m_buffer;
+        size_t m_read;
+        size_t m_size;
+        bool m_quit;
+        size_t m_dropped_bytes;
+        size_t m_dropped_count;
+
+        mutable pthread_mutex_t m_mutex;
+        pthread_cond_t m_data_available;
+        pthread_cond_t m_data_written;
+        pthread_t m_thread;
+
+        bool push(char const* data, size_t size, char const* suffix, size_t suffix_size);
+        void copyToBuffer(char const* data, size_t size);
+        static void* threadMain(void* sink);
+        void writeLoop();
+    };
+}
+
+#endif
+
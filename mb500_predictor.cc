@@ -0,0 +1,265 @@
+#include "mb500_predictor.hh"
+#include "mb500_geodesy.hh"
+
+#include <math.h>
+#include <string.h>
+#include <sched.h>
+
+using namespace gps;
+
+// Epochs further apart than this are not used to derive velocities or
+// to learn the acceleration, in seconds
+static const double MAX_EPOCH_GAP = 2;
+// Weight of a new epoch in the acceleration RMS
+static const double ACCELERATION_WEIGHT = 0.1;
+
+/** Meters per radian of latitude and of longitude around a point */
+static void getScales(double latitude, double height, double& north, double& east)
+{
+    double sin_lat = sin(latitude * M_PI / 180);
+    double w = sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+    north = WGS84_A * (1 - WGS84_E2) / (w * w * w) + height;
+    east  = (WGS84_A / w + height) * cos(latitude * M_PI / 180);
+}
+
+/** Offset of \c to with respect to \c from, in a local east-north-up
+ * frame. Epochs are close enough for the curvature to be negligible */
+template<typename Sample>
+static void getOffset(Sample const& from, Sample const& to, double offset[3])
+{
+    double north, east;
+    getScales(from.latitude, from.height, north, east);
+    offset[0] = (to.longitude - from.longitude) * M_PI / 180 * east;
+    offset[1] = (to.latitude - from.latitude) * M_PI / 180 * north;
+    offset[2] = to.height - from.height;
+}
+
+PositionPredictor::PositionPredictor(base::Time const& max_extrapolation)
+    : m_max_extrapolation(max_extrapolation.toMicroseconds())
+    , m_sequence(0)
+{
+    memset(&m_history, 0, sizeof(m_history));
+}
+
+void PositionPredictor::beginWrite()
+{
+    // Sequence lock, we are the only writer
+    __atomic_store_n(&m_sequence, m_sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void PositionPredictor::endWrite()
+{
+    __atomic_store_n(&m_sequence, m_sequence + 1, __ATOMIC_RELEASE);
+}
+
+void PositionPredictor::readHistory(History& history) const
+{
+    while (true)
+    {
+        uint64_t before = __atomic_load_n(&m_sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(&history, &m_history, sizeof(history));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&m_sequence, __ATOMIC_RELAXED) == before)
+            return;
+    }
+}
+
+void PositionPredictor::clear()
+{
+    beginWrite();
+    memset(&m_history, 0, sizeof(m_history));
+    endWrite();
+}
+
+void PositionPredictor::push(base::Time const& host_time, Position const& position,
+        Errors const& errors, Velocity const& velocity)
+{
+    Sample sample;
+    sample.hostTime  = host_time.toMicroseconds();
+    sample.gpsTime   = position.time.toMicroseconds();
+    sample.latitude  = position.latitude;
+    sample.longitude = position.longitude;
+    sample.height    = getEllipsoidalHeight(position);
+    sample.horizontalError = sqrt(errors.deviationLatitude * errors.deviationLatitude +
+            errors.deviationLongitude * errors.deviationLongitude);
+    sample.verticalError   = errors.deviationAltitude;
+
+    Sample const* previous = NULL;
+    if (m_history.count > 0)
+    {
+        previous = &m_history.samples[(m_history.count - 1) % HISTORY_SIZE];
+        if (sample.hostTime <= previous->hostTime || sample.gpsTime <= previous->gpsTime)
+            return;
+    }
+
+    sample.hasVelocity = (!velocity.time.isNull() && velocity.time == position.time);
+    if (sample.hasVelocity)
+    {
+        double course = velocity.course * M_PI / 180;
+        sample.velocity[0] = velocity.speed * sin(course);
+        sample.velocity[1] = velocity.speed * cos(course);
+        sample.velocity[2] = velocity.verticalSpeed;
+    }
+    else if (previous && (sample.gpsTime - previous->gpsTime) / 1e6 < MAX_EPOCH_GAP)
+    {
+        double dt = (sample.gpsTime - previous->gpsTime) / 1e6;
+        getOffset(*previous, sample, sample.velocity);
+        for (int i = 0; i < 3; ++i)
+            sample.velocity[i] /= dt;
+    }
+    else
+        sample.velocity[0] = sample.velocity[1] = sample.velocity[2] = 0;
+
+    beginWrite();
+    if (previous)
+        learnAcceleration(*previous, sample);
+    m_history.samples[m_history.count % HISTORY_SIZE] = sample;
+    ++m_history.count;
+    endWrite();
+}
+
+void PositionPredictor::learnAcceleration(Sample const& previous, Sample const& sample)
+{
+    double dt = (sample.gpsTime - previous.gpsTime) / 1e6;
+    if (dt >= MAX_EPOCH_GAP)
+        return;
+
+    // Error of the extrapolation of the previous epoch, expressed as the
+    // constant acceleration that would explain it
+    double offset[3];
+    getOffset(previous, sample, offset);
+    double error_east  = offset[0] - previous.velocity[0] * dt;
+    double error_north = offset[1] - previous.velocity[1] * dt;
+    double error_up    = offset[2] - previous.velocity[2] * dt;
+    double horizontal = 2 * sqrt(error_east * error_east + error_north * error_north) / (dt * dt);
+    double vertical   = 2 * fabs(error_up) / (dt * dt);
+
+    if (m_history.horizontalAcceleration == 0 && m_history.verticalAcceleration == 0)
+    {
+        m_history.horizontalAcceleration = horizontal;
+        m_history.verticalAcceleration   = vertical;
+        return;
+    }
+    double h2 = m_history.horizontalAcceleration * m_history.horizontalAcceleration;
+    double v2 = m_history.verticalAcceleration * m_history.verticalAcceleration;
+    m_history.horizontalAcceleration = sqrt(h2 + ACCELERATION_WEIGHT * (horizontal * horizontal - h2));
+    m_history.verticalAcceleration   = sqrt(v2 + ACCELERATION_WEIGHT * (vertical * vertical - v2));
+}
+
+void PositionPredictor::updateVelocity(Velocity const& velocity)
+{
+    if (m_history.count == 0)
+        return;
+    Sample& last = m_history.samples[(m_history.count - 1) % HISTORY_SIZE];
+    if (velocity.time.toMicroseconds() != last.gpsTime)
+        return;
+
+    double course = velocity.course * M_PI / 180;
+    beginWrite();
+    last.velocity[0] = velocity.speed * sin(course);
+    last.velocity[1] = velocity.speed * cos(course);
+    last.velocity[2] = velocity.verticalSpeed;
+    last.hasVelocity = true;
+    endWrite();
+}
+
+bool PositionPredictor::predict(base::Time const& host_time, PredictedPosition& result) const
+{
+    History history;
+    readHistory(history);
+    if (history.count == 0)
+        return false;
+
+    int64_t time = host_time.toMicroseconds();
+    int size = history.count < static_cast<uint64_t>(HISTORY_SIZE) ? history.count : HISTORY_SIZE;
+    int last = (history.count - 1) % HISTORY_SIZE;
+    Sample const& newest = history.samples[last];
+
+    Sample const* from = NULL;
+    Sample const* to = NULL;
+    if (time >= newest.hostTime)
+    {
+        if (time - newest.hostTime > m_max_extrapolation)
+            return false;
+        from = &newest;
+    }
+    else
+    {
+        for (int i = 1; i < size; ++i)
+        {
+            Sample const& sample = history.samples[(last - i + HISTORY_SIZE) % HISTORY_SIZE];
+            if (sample.hostTime <= time)
+            {
+                from = &sample;
+                to   = &history.samples[(last - i + 1 + HISTORY_SIZE) % HISTORY_SIZE];
+                break;
+            }
+        }
+        if (!from)
+            return false;
+    }
+
+    double offset[3], velocity[3];
+    if (!to)
+    {
+        double dt = (time - from->hostTime) / 1e6;
+        for (int i = 0; i < 3; ++i)
+        {
+            offset[i]   = from->velocity[i] * dt;
+            velocity[i] = from->velocity[i];
+        }
+        double h = 0.5 * history.horizontalAcceleration * dt * dt;
+        double v = 0.5 * history.verticalAcceleration * dt * dt;
+        result.horizontalError = sqrt(from->horizontalError * from->horizontalError + h * h);
+        result.verticalError   = sqrt(from->verticalError * from->verticalError + v * v);
+        result.extrapolated = true;
+    }
+    else
+    {
+        double span = (to->hostTime - from->hostTime) / 1e6;
+        double s = (time - from->hostTime) / 1e6 / span;
+        double end[3];
+        getOffset(*from, *to, end);
+        if (from->hasVelocity && to->hasVelocity)
+        {
+            // Cubic Hermite curve, which matches the positions and
+            // velocities of both epochs
+            double s2 = s * s, s3 = s2 * s;
+            double h10 = s3 - 2 * s2 + s, h01 = -2 * s3 + 3 * s2, h11 = s3 - s2;
+            double d10 = 3 * s2 - 4 * s + 1, d01 = -6 * s2 + 6 * s, d11 = 3 * s2 - 2 * s;
+            for (int i = 0; i < 3; ++i)
+            {
+                offset[i]   = h10 * span * from->velocity[i] + h01 * end[i] + h11 * span * to->velocity[i];
+                velocity[i] = d10 * from->velocity[i] + d01 * end[i] / span + d11 * to->velocity[i];
+            }
+        }
+        else
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                offset[i]   = s * end[i];
+                velocity[i] = end[i] / span;
+            }
+        }
+        result.horizontalError = from->horizontalError + s * (to->horizontalError - from->horizontalError);
+        result.verticalError   = from->verticalError + s * (to->verticalError - from->verticalError);
+        result.extrapolated = false;
+    }
+
+    double north, east;
+    getScales(from->latitude, from->height, north, east);
+    result.time      = host_time;
+    result.latitude  = from->latitude + offset[1] / north * 180 / M_PI;
+    result.longitude = from->longitude + offset[0] / east * 180 / M_PI;
+    result.height    = from->height + offset[2];
+    result.velocityEast  = velocity[0];
+    result.velocityNorth = velocity[1];
+    result.velocityUp    = velocity[2];
+    return true;
+}
@@ -0,0 +1,116 @@
+#ifndef MAGELLAN_MB500_PREDICTOR_H
+#define MAGELLAN_MB500_PREDICTOR_H
+
+#include <stdint.h>
+#include "gps_types.hh"
+#include "mb500_types.hh"
+
+namespace gps {
+    /** Result of PositionPredictor::predict() */
+    struct PredictedPosition
+    {
+        /** Host time of the prediction */
+        base::Time time;
+        /** Degrees, and meters above the ellipsoid */
+        double latitude;
+        double longitude;
+        double height;
+        /** Velocity in m/s */
+        double velocityEast;
+        double velocityNorth;
+        double velocityUp;
+        /** Estimated 1-sigma error, in meters */
+        double horizontalError;
+        double verticalError;
+        /** True if the time is after the last epoch */
+        bool extrapolated;
+    };
+
+    /** Position at arbitrary host times, from the last epochs
+     *
+     * The driver pushes each epoch, stamped with its host time. predict()
+     * interpolates between the two epochs around the requested time, with
+     * a cubic Hermite curve when both have a velocity and linearly
+     * otherwise, and extrapolates from the last epoch with its velocity.
+     *
+     * The extrapolation error grows with the square of the extrapolation
+     * time, with an acceleration learned from the error of the
+     * extrapolation of the previous epoch to the next one.
+     *
+     * There is one writer, the driver, and any number of readers in other
+     * threads. The history is a fixed-size ring protected by a sequence
+     * lock, so neither push() nor predict() allocate or wait on a lock.
+     * Readers retry if an epoch was pushed while they were copying the
+     * history, which at GPS rates practically never happens.
+     */
+    class PositionPredictor
+    {
+    public:
+        /** Number of epochs kept */
+        static const int HISTORY_SIZE = 8;
+
+        /**
+         * @arg max_extrapolation how far after the last epoch predict()
+         *      accepts to extrapolate
+         */
+        PositionPredictor(base::Time const& max_extrapolation = base::Time::fromSeconds(1));
+
+        void clear();
+
+        /** Adds an epoch. \c velocity is used only if it has the same
+         * time than \c position, otherwise the velocity of the epoch is
+         * derived from the previous one
+         */
+        void push(base::Time const& host_time, gps::Position const& position,
+                gps::Errors const& errors, gps::Velocity const& velocity);
+        /** Sets the velocity of the last epoch, for velocity sentences
+         * received after the epoch was pushed. Ignored if \c velocity is
+         * not for the last epoch */
+        void updateVelocity(gps::Velocity const& velocity);
+
+        /** Position at \c host_time
+         *
+         * @returns false if there is no epoch yet, or if \c host_time is
+         *          before the oldest epoch kept or too far after the last
+         */
+        bool predict(base::Time const& host_time, PredictedPosition& result) const;
+
+    private:
+        struct Sample
+        {
+            int64_t hostTime;
+            int64_t gpsTime;
+            double latitude;
+            double longitude;
+            double height;
+            double velocity[3];
+            double horizontalError;
+            double verticalError;
+            bool hasVelocity;
+        };
+
+        /** What the readers copy */
+        struct History
+        {
+            Sample samples[HISTORY_SIZE];
+            /** Number of epochs pushed since clear() */
+            uint64_t count;
+            /** RMS of the acceleration seen by the extrapolations, m/s^2 */
+            double horizontalAcceleration;
+            double verticalAcceleration;
+        };
+
+        int64_t m_max_extrapolation;
+        /** Odd while m_history is being written */
+        uint64_t m_sequence;
+        History m_history;
+
+        void beginWrite();
+        void endWrite();
+        void readHistory(History& history) const;
+        void learnAcceleration(Sample const& previous, Sample const& sample);
+    };
+}
+
+#endif
+
@@ -0,0 +1,301 @@
+#include "mb500_raw.hh"
+
+#include <math.h>
+#include <string.h>
+
+using namespace gps;
+
+static const double SPEED_OF_LIGHT = 299792458.0;
+static const double GPS_L1 = 1575.42e6;
+static const double GPS_L2 = 1227.60e6;
+static const double GLONASS_L1 = 1602e6;
+static const double GLONASS_L1_STEP = 0.5625e6;
+static const double GLONASS_L2 = 1246e6;
+static const double GLONASS_L2_STEP = 0.4375e6;
+
+/** Pseudorange modulus ambiguity units of 1004 and 1012, in meters */
+static const double GPS_AMBIGUITY_UNIT     = 299792.458;
+static const double GLONASS_AMBIGUITY_UNIT = 599584.916;
+
+/** The receiver shifts the phase - pseudorange offsets by this many
+ * cycles when they would exceed the range of the message fields */
+static const double PHASE_ROLLOVER = 1500;
+
+static const int64_t DAY  = 86400LL * 1000000;
+static const int64_t WEEK = 7 * DAY;
+/** Start of the GPS time scale, 1980-01-06, in microseconds since the
+ * UNIX epoch */
+static const int64_t GPS_ORIGIN = 315964800LL * 1000000;
+/** GLONASS time is UTC(SU), three hours ahead of UTC */
+static const int64_t GLONASS_UTC_OFFSET = 3 * 3600LL * 1000000;
+
+/** Invalid values of the 1004 and 1012 fields */
+static const int32_t INVALID_PHASE_OFFSET = -524288;
+static const int32_t INVALID_L2_DIFFERENCE = -8192;
+
+static uint32_t getBits(uint8_t const* data, size_t position, int length)
+{
+    uint32_t result = 0;
+    for (size_t i = position; i < position + length; ++i)
+        result = (result << 1) | ((data[i / 8] >> (7 - i % 8)) & 1);
+    return result;
+}
+
+static int32_t getSignedBits(uint8_t const* data, size_t position, int length)
+{
+    uint32_t value = getBits(data, position, length);
+    if (value & (1U << (length - 1)))
+        return static_cast<int32_t>(value) - (1 << length);
+    return value;
+}
+
+/** Lock time in seconds of the lock time indicators DF013 and DF043 */
+static uint16_t getLockTime(int indicator)
+{
+    if (indicator < 24)  return indicator;
+    if (indicator < 48)  return 2 * indicator - 24;
+    if (indicator < 72)  return 4 * indicator - 120;
+    if (indicator < 96)  return 8 * indicator - 408;
+    if (indicator < 120) return 16 * indicator - 1176;
+    if (indicator < 127) return 32 * indicator - 3096;
+    return 937;
+}
+
+RawObservationDecoder::RawObservationDecoder()
+{
+    reset();
+}
+
+void RawObservationDecoder::reset()
+{
+    m_epoch   = RawEpoch();
+    m_pending = RawEpoch();
+    memset(m_tracking, 0, sizeof(m_tracking));
+}
+
+uint32_t RawObservationDecoder::crc24q(uint8_t const* data, size_t size)
+{
+    uint32_t crc = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc ^= static_cast<uint32_t>(data[i]) << 16;
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc <<= 1;
+            if (crc & 0x1000000)
+                crc ^= 0x1864CFB;
+        }
+    }
+    return crc & 0xFFFFFF;
+}
+
+int RawObservationDecoder::extractFrame(uint8_t const* buffer, size_t buffer_size)
+{
+    if (buffer[0] != 0xD3)
+        return -1;
+    if (buffer_size < 3)
+        return 0;
+    // The six bits after the preamble are reserved and zero, which
+    // filters most of the false preambles
+    if (buffer[1] & 0xFC)
+        return -1;
+
+    size_t length = (static_cast<size_t>(buffer[1] & 0x03) << 8) | buffer[2];
+    size_t frame_size = length + 6;
+    if (buffer_size < frame_size)
+        return 0;
+
+    uint32_t crc = (static_cast<uint32_t>(buffer[length + 3]) << 16) |
+        (static_cast<uint32_t>(buffer[length + 4]) << 8) | buffer[length + 5];
+    if (crc24q(buffer, length + 3) != crc)
+        return -1;
+    return frame_size;
+}
+
+RawEpoch const& RawObservationDecoder::getEpoch() const
+{
+    return m_epoch;
+}
+
+bool RawObservationDecoder::decode(uint8_t const* frame, size_t size, base::Time const& reference)
+{
+    if (size < 8)
+        return false;
+
+    uint8_t const* payload = frame + 3;
+    size_t payload_size = size - 6;
+    int message = getBits(payload, 0, 12);
+    if (message != 1004 && message != 1012)
+        return false;
+    return decodeObservations(payload, payload_size, message, reference);
+}
+
+int64_t RawObservationDecoder::resolveTime(int64_t time, int64_t period, int64_t origin, base::Time const& reference) const
+{
+    // After the first epoch, the previous one is the best reference
+    int64_t ref;
+    if (!m_epoch.time.isNull())
+        ref = m_epoch.time.toMicroseconds();
+    else
+        ref = reference.toMicroseconds() + GPS_LEAP_SECONDS * 1000000LL;
+
+    int64_t start = ref - (ref - origin) % period;
+    int64_t result = start + time;
+    if (result - ref > period / 2)
+        result -= period;
+    else if (ref - result > period / 2)
+        result += period;
+    return result;
+}
+
+bool RawObservationDecoder::decodeObservations(uint8_t const* payload, size_t size, int message, base::Time const& reference)
+{
+    bool glonass = (message == 1012);
+    size_t header_size    = glonass ? 61 : 64;
+    size_t satellite_size = glonass ? 130 : 125;
+    if (size * 8 < header_size)
+        return false;
+
+    int64_t time;
+    bool synchronous;
+    int satellite_count;
+    if (glonass)
+    {
+        int64_t glonass_time = getBits(payload, 24, 27) * 1000LL;
+        int64_t gps_time = glonass_time - GLONASS_UTC_OFFSET + GPS_LEAP_SECONDS * 1000000LL;
+        gps_time = ((gps_time % DAY) + DAY) % DAY;
+        time = resolveTime(gps_time, DAY, 0, reference);
+        synchronous = getBits(payload, 51, 1);
+        satellite_count = getBits(payload, 52, 5);
+    }
+    else
+    {
+        time = resolveTime(getBits(payload, 24, 30) * 1000LL, WEEK, GPS_ORIGIN, reference);
+        synchronous = getBits(payload, 54, 1);
+        satellite_count = getBits(payload, 55, 5);
+    }
+    if (size * 8 < header_size + satellite_count * satellite_size)
+        return false;
+
+    // A message of another epoch while the current one is not complete:
+    // its last message got lost
+    bool completed = false;
+    if (!m_pending.time.isNull() && m_pending.time.toMicroseconds() != time)
+    {
+        completeEpoch();
+        completed = true;
+    }
+    m_pending.time = base::Time::fromMicroseconds(time);
+
+    size_t position = header_size;
+    for (int i = 0; i < satellite_count; ++i, position += satellite_size)
+    {
+        uint8_t const* p = payload;
+        size_t bit = position;
+        int id = getBits(p, bit, 6);                                bit += 6;
+        if (id == 0 || m_pending.satelliteCount == RawEpoch::MAX_SATELLITES)
+            continue;
+
+        RawSatelliteObservation& sat = m_pending.satellites[m_pending.satelliteCount];
+        sat.constellation = glonass ? RAW_GLONASS : RAW_GPS;
+        sat.prn = id;
+        sat.code[0] = getBits(p, bit, 1);                           bit += 1;
+        int channel = 0;
+        if (glonass)
+        {
+            channel = getBits(p, bit, 5);                           bit += 5;
+        }
+        uint32_t l1_range = getBits(p, bit, glonass ? 25 : 24);     bit += glonass ? 25 : 24;
+        int32_t l1_offset = getSignedBits(p, bit, 20);              bit += 20;
+        int l1_lock       = getBits(p, bit, 7);                     bit += 7;
+        int ambiguity     = getBits(p, bit, glonass ? 7 : 8);       bit += glonass ? 7 : 8;
+        int l1_cn0        = getBits(p, bit, 8);                     bit += 8;
+        sat.code[1]       = getBits(p, bit, 2);                     bit += 2;
+        int32_t l2_range  = getSignedBits(p, bit, 14);              bit += 14;
+        int32_t l2_offset = getSignedBits(p, bit, 20);              bit += 20;
+        int l2_lock       = getBits(p, bit, 7);                     bit += 7;
+        int l2_cn0        = getBits(p, bit, 8);
+
+        double wavelength[2];
+        if (glonass)
+        {
+            // Frequency channel numbers are sent as channel + 7, larger
+            // values are unknown
+            sat.frequencyChannel = channel <= 13 ? channel - 7 : 0;
+            wavelength[0] = channel <= 13 ? SPEED_OF_LIGHT / (GLONASS_L1 + sat.frequencyChannel * GLONASS_L1_STEP) : NAN;
+            wavelength[1] = channel <= 13 ? SPEED_OF_LIGHT / (GLONASS_L2 + sat.frequencyChannel * GLONASS_L2_STEP) : NAN;
+        }
+        else
+        {
+            sat.frequencyChannel = 0;
+            wavelength[0] = SPEED_OF_LIGHT / GPS_L1;
+            wavelength[1] = SPEED_OF_LIGHT / GPS_L2;
+        }
+
+        double l1 = l1_range * 0.02 + ambiguity * (glonass ? GLONASS_AMBIGUITY_UNIT : GPS_AMBIGUITY_UNIT);
+        sat.pseudorange[0] = l1;
+        sat.pseudorange[1] = (l2_range != INVALID_L2_DIFFERENCE) ? l1 + l2_range * 0.02 : NAN;
+        sat.cn0[0] = l1_cn0 ? l1_cn0 * 0.25 : NAN;
+        sat.cn0[1] = l2_cn0 ? l2_cn0 * 0.25 : NAN;
+        sat.lockTime[0] = getLockTime(l1_lock);
+        sat.lockTime[1] = getLockTime(l2_lock);
+
+        int32_t offsets[2] = { l1_offset, l2_offset };
+        for (int f = 0; f < 2; ++f)
+        {
+            sat.lossOfLock[f] = false;
+            if (offsets[f] == INVALID_PHASE_OFFSET || isnan(wavelength[f]))
+            {
+                sat.carrierPhase[f] = NAN;
+                m_tracking[sat.constellation][sat.prn][f].time = 0;
+                continue;
+            }
+            double offset = track(sat, f, time, offsets[f] * 0.0005 / wavelength[f]);
+            sat.carrierPhase[f] = l1 / wavelength[f] + offset;
+        }
+        ++m_pending.satelliteCount;
+    }
+
+    if (!synchronous)
+    {
+        completeEpoch();
+        completed = true;
+    }
+    return completed;
+}
+
+double RawObservationDecoder::track(RawSatelliteObservation& sat, int frequency, int64_t time, double offset)
+{
+    TrackingState& state = m_tracking[sat.constellation][sat.prn][frequency];
+    uint16_t lock_time = sat.lockTime[frequency];
+
+    // The lock time is a lower bound of the time since the lock. If it
+    // decreased, or is smaller than the time since the last epoch, the
+    // lock got lost in between
+    if (state.time != 0)
+    {
+        int64_t gap = (time - state.time) / 1000000;
+        sat.lossOfLock[frequency] = (lock_time < state.lockTime || lock_time < gap);
+    }
+
+    if (state.time != 0 && !sat.lossOfLock[frequency])
+    {
+        double change = offset - state.phaseOffset;
+        if (change < -PHASE_ROLLOVER / 2)
+            offset += PHASE_ROLLOVER * floor(-change / PHASE_ROLLOVER + 0.5);
+        else if (change > PHASE_ROLLOVER / 2)
+            offset -= PHASE_ROLLOVER * floor(change / PHASE_ROLLOVER + 0.5);
+    }
+
+    state.time = time;
+    state.lockTime = lock_time;
+    state.phaseOffset = offset;
+    return offset;
+}
+
+void RawObservationDecoder::completeEpoch()
+{
+    m_epoch = m_pending;
+    m_pending.time = base::Time();
+    m_pending.satelliteCount = 0;
+}
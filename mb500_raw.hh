@@ -0,0 +1,81 @@
+#ifndef MAGELLAN_MB500_RAW_H
+#define MAGELLAN_MB500_RAW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mb500_types.hh"
+
+namespace gps {
+    /** Decodes the raw observations of the board's RTCM 3 output
+     *
+     * The board sends its code and carrier phase measurements as RTCM 3
+     * messages 1004 (GPS) and 1012 (GLONASS), L1 and L2 extended
+     * observables. The messages of one epoch are aggregated into a
+     * RawEpoch, using the synchronous GNSS flag of the message header to
+     * know when the epoch is complete.
+     *
+     * The decoder uses no dynamic memory: the per-satellite state needed
+     * to reconstruct the carrier phases and the loss of lock indicators
+     * is kept in fixed arrays.
+     */
+    class RawObservationDecoder
+    {
+    public:
+        /** UTC - GPS offset, used to convert the GLONASS epoch times */
+        static const int GPS_LEAP_SECONDS = 18;
+
+        RawObservationDecoder();
+
+        void reset();
+
+        /** Frames an RTCM 3 message at the beginning of \c buffer, with
+         * the conventions of iodrivers_base::Driver::extractPacket. The
+         * CRC is verified */
+        static int extractFrame(uint8_t const* buffer, size_t buffer_size);
+        /** The CRC-24Q of RTCM 3 */
+        static uint32_t crc24q(uint8_t const* data, size_t size);
+
+        /** Decodes one RTCM 3 frame, as extracted by extractFrame()
+         *
+         * Messages other than 1004 and 1012 are ignored.
+         *
+         * @arg reference the current UTC time, approximately. It resolves
+         *      the week (GPS) or day (GLONASS) of the first epochs, the
+         *      message times being relative to those
+         * @returns true if an epoch has been completed, see getEpoch()
+         */
+        bool decode(uint8_t const* frame, size_t size, base::Time const& reference);
+        /** The last complete epoch */
+        RawEpoch const& getEpoch() const;
+
+    private:
+        static const int MAX_SATELLITE_ID = 64;
+
+        RawEpoch m_epoch;
+        /** The epoch whose messages are being received */
+        RawEpoch m_pending;
+
+        /** Lock time and phase - pseudorange offset at the last epoch of
+         * each satellite and frequency, per constellation */
+        struct TrackingState
+        {
+            int64_t time;
+            uint16_t lockTime;
+            double phaseOffset;
+        };
+        TrackingState m_tracking[2][MAX_SATELLITE_ID][2];
+
+        /** Adds the observations of a 1004 or 1012 message to m_pending */
+        bool decodeObservations(uint8_t const* payload, size_t size, int message, base::Time const& reference);
+        /** Full GPS time in microseconds of a message, from its time in
+         * the week (GPS) or in the day (GLONASS) */
+        int64_t resolveTime(int64_t time, int64_t period, int64_t origin, base::Time const& reference) const;
+        /** Corrects the phase - pseudorange offset of a measurement, in
+         * cycles, for the rollovers the receiver applies to keep it in
+         * the message's range, and detects losses of lock */
+        double track(RawSatelliteObservation& sat, int frequency, int64_t time, double offset);
+        void completeEpoch();
+    };
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include "mb500_nmealog.hh"
+#include "mb500_output.hh"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+using namespace std;
+
+/** Parses either seconds since the epoch, or an ISO 8601 UTC date such as
+ * 2024-03-01T12:30:00 */
+base::Time parseTime(char const* arg)
+{
+    tm date;
+    memset(&date, 0, sizeof(date));
+    double seconds = 0;
+    if (sscanf(arg, "%d-%d-%dT%d:%d:%lf", &date.tm_year, &date.tm_mon, &date.tm_mday,
+                &date.tm_hour, &date.tm_min, &seconds) == 6)
+    {
+        date.tm_year -= 1900;
+        date.tm_mon  -= 1;
+        return base::Time::fromSeconds(timegm(&date) + seconds);
+    }
+    return base::Time::fromSeconds(atof(arg));
+}
+
+int main (int argc, const char** argv){
+    if (argc < 2 || argc > 7 || argc == 6)
+    {
+        cerr << "usage: mb500_replay log_file [nmea|pos] [text|csv|json] [threads] [start end]" << endl;
+        cerr << "  re-derives the solutions from a raw capture of the board's output\n"
+            "  If start and end are given, as seconds since the epoch or as\n"
+            "  YYYY-MM-DDTHH:MM:SS UTC, only the solutions in this window are\n"
+            "  output. The window is found with the log's index, log_file.idx,\n"
+            "  which is created or updated as needed" << endl;
+        return 1;
+    }
+
+    gps::MB500_OUTPUT_PROFILE profile = gps::MB500_NMEA_OUTPUT;
+    if (argc >= 3 && string(argv[2]) == "pos")
+        profile = gps::MB500_POS_OUTPUT;
+    gps::SolutionFormatter::FORMAT format = gps::SolutionFormatter::TEXT;
+    if (argc >= 4 && string(argv[3]) == "csv")
+        format = gps::SolutionFormatter::CSV;
+    else if (argc >= 4 && string(argv[3]) == "json")
+        format = gps::SolutionFormatter::JSON;
+    int threads = 0;
+    if (argc >= 5)
+        threads = atoi(argv[4]);
+
+    gps::NMEALogParser parser;
+    if (!parser.open(argv[1]))
+        return 1;
+
+    base::Time start = base::Time::now();
+    vector<gps::LoggedSolution> solutions;
+    if (argc == 7)
+    {
+        gps::NMEALogIndexBuilder builder;
+        if (!builder.open(argv[1]) || !builder.update())
+            return 1;
+        builder.close();
+
+        gps::NMEALogIndex index;
+        if (!index.open(string(argv[1]) + ".idx"))
+            return 1;
+        parser.parse(solutions, index.find(parseTime(argv[5])), index.find(parseTime(argv[6])), profile);
+    }
+    else
+        parser.parse(solutions, profile, threads);
+    double duration = (base::Time::now() - start).toSeconds();
+    cerr << solutions.size() << " solutions, " << parser.getSentenceCount() << " sentences, "
+        << parser.getInvalidCount() << " invalid, parsed in " << duration << " s ("
+        << parser.getSize() / duration / 1e6 << " MB/s)" << endl;
+
+    gps::SolutionFormatter formatter(format);
+    gps::AsyncOutputSink output(fileno(stdout));
+    formatter.formatHeader();
+    if (formatter.size() > 0)
+        output.pushLine(formatter);
+    for (size_t i = 0; i < solutions.size(); ++i)
+    {
+        gps::LoggedSolution const& solution = solutions[i];
+        formatter.format(solution.position, solution.errors, solution.satellites, solution.quality);
+        // Never drop data when writing to a file or a pipe, unless the
+        // line would not fit even in an empty buffer
+        if (formatter.size() + 1 > output.getCapacity())
+        {
+            cerr << "the solution at offset " << solution.offset << " does not fit in the output buffer, dropping it" << endl;
+            continue;
+        }
+        while (!output.pushLine(formatter))
+            output.flush();
+    }
+    return 0;
+}
@@ -0,0 +1,301 @@
+#include "mb500_rinex.hh"
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+using namespace gps;
+
+static const size_t BUFFER_SIZE = 64 * 1024;
+/** Upper bound on the size of one epoch, header records included */
+static const size_t MAX_EPOCH_SIZE = 16 * 1024;
+/** Number of observation types per constellation: C, L and S on L1 and L2 */
+static const int OBSERVATION_COUNT = 6;
+
+const int8_t RinexObservationWriter::UNKNOWN_CHANNEL;
+
+RinexObservationWriter::RinexObservationWriter()
+    : m_fd(-1)
+    , m_buffer_size(0)
+    , m_header_written(false)
+{
+}
+
+RinexObservationWriter::~RinexObservationWriter()
+{
+    close();
+}
+
+bool RinexObservationWriter::open(std::string const& path, std::string const& marker)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        cerr << "dgps/mb500: cannot open RINEX file " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    m_fd = fd;
+    m_marker = marker;
+    m_buffer.resize(BUFFER_SIZE);
+    m_buffer_size = 0;
+    m_header_written = false;
+    memset(m_glonass_channels, UNKNOWN_CHANNEL, sizeof(m_glonass_channels));
+    return true;
+}
+
+void RinexObservationWriter::close()
+{
+    if (m_fd == -1)
+        return;
+
+    flush();
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+bool RinexObservationWriter::flush()
+{
+    size_t written = 0;
+    while (written < m_buffer_size)
+    {
+        int ret = ::write(m_fd, &m_buffer[written], m_buffer_size - written);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            cerr << "dgps/mb500: error writing RINEX file: " << strerror(errno) << endl;
+            m_buffer_size = 0;
+            return false;
+        }
+        written += ret;
+    }
+    m_buffer_size = 0;
+    return true;
+}
+
+void RinexObservationWriter::append(char const* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t available = m_buffer.size() - m_buffer_size;
+    int size = vsnprintf(&m_buffer[m_buffer_size], available, format, args);
+    va_end(args);
+    if (size > 0)
+        m_buffer_size += (static_cast<size_t>(size) < available) ? size : available - 1;
+}
+
+void RinexObservationWriter::appendHeaderLine(std::string const& label, char const* format, ...)
+{
+    char line[61];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    append("%-60s%-20s\n", line, label.c_str());
+}
+
+/** RINEX code of the signals given by the RTCM code indicators */
+static char getCode(int constellation, int frequency, int indicator)
+{
+    if (constellation == RAW_GPS && frequency == 1)
+    {
+        static const char codes[] = { 'X', 'P', 'D', 'W' };
+        return codes[indicator & 3];
+    }
+    return indicator ? 'P' : 'C';
+}
+
+static void getCalendar(base::Time const& time, tm& calendar, double& seconds)
+{
+    int64_t microseconds = time.toMicroseconds();
+    time_t integer = microseconds / 1000000;
+    gmtime_r(&integer, &calendar);
+    seconds = calendar.tm_sec + (microseconds % 1000000) / 1e6;
+}
+
+void RinexObservationWriter::writeHeader(RawEpoch const& epoch)
+{
+    // Defaults for the constellations absent from the first epoch
+    m_codes[RAW_GPS][0] = 'C';
+    m_codes[RAW_GPS][1] = 'W';
+    m_codes[RAW_GLONASS][0] = 'C';
+    m_codes[RAW_GLONASS][1] = 'P';
+    bool found[2][2] = { { false, false }, { false, false } };
+    for (int i = 0; i < epoch.satelliteCount; ++i)
+    {
+        RawSatelliteObservation const& sat = epoch.satellites[i];
+        for (int f = 0; f < 2; ++f)
+        {
+            if (found[sat.constellation][f] || isnan(sat.pseudorange[f]))
+                continue;
+            m_codes[sat.constellation][f] = getCode(sat.constellation, f, sat.code[f]);
+            found[sat.constellation][f] = true;
+        }
+    }
+
+    time_t now = time(NULL);
+    tm now_calendar;
+    gmtime_r(&now, &now_calendar);
+    char date[21];
+    strftime(date, sizeof(date), "%Y%m%d %H%M%S UTC", &now_calendar);
+
+    appendHeaderLine("RINEX VERSION / TYPE", "%9.2f%11s%-20s%-20s", 3.03, "", "OBSERVATION DATA", "M");
+    appendHeaderLine("PGM / RUN BY / DATE", "%-20s%-20s%-20s", "mb500", "", date);
+    appendHeaderLine("MARKER NAME", "%s", m_marker.c_str());
+    appendHeaderLine("OBSERVER / AGENCY", "%-20s%-40s", "", "");
+    appendHeaderLine("REC # / TYPE / VERS", "%-20s%-20s%-20s", "", "MAGELLAN MB500", "");
+    appendHeaderLine("ANT # / TYPE", "%-20s%-20s", "", "");
+    appendHeaderLine("APPROX POSITION XYZ", "%14.4f%14.4f%14.4f", 0.0, 0.0, 0.0);
+    appendHeaderLine("ANTENNA: DELTA H/E/N", "%14.4f%14.4f%14.4f", 0.0, 0.0, 0.0);
+    char const systems[2] = { 'G', 'R' };
+    for (int c = 0; c < 2; ++c)
+    {
+        appendHeaderLine("SYS / # / OBS TYPES", "%c  %3d C1%c L1%c S1%c C2%c L2%c S2%c",
+                systems[c], OBSERVATION_COUNT,
+                m_codes[c][0], m_codes[c][0], m_codes[c][0],
+                m_codes[c][1], m_codes[c][1], m_codes[c][1]);
+    }
+    appendHeaderLine("SIGNAL STRENGTH UNIT", "%-20s", "DBHZ");
+
+    tm first;
+    double seconds;
+    getCalendar(epoch.time, first, seconds);
+    appendHeaderLine("TIME OF FIRST OBS", "%6d%6d%6d%6d%6d%13.7f%5s%-3s",
+            first.tm_year + 1900, first.tm_mon + 1, first.tm_mday,
+            first.tm_hour, first.tm_min, seconds, "", "GPS");
+    appendHeaderLine("SYS / PHASE SHIFT", "G");
+    appendHeaderLine("SYS / PHASE SHIFT", "R");
+    updateGlonassSlots(epoch);
+    appendGlonassSlots();
+    appendHeaderLine("GLONASS COD/PHS/BIS", " C1C %8.3f C1P %8.3f C2C %8.3f C2P %8.3f", 0.0, 0.0, 0.0, 0.0);
+    appendHeaderLine("END OF HEADER", "");
+    m_header_written = true;
+}
+
+bool RinexObservationWriter::updateGlonassSlots(RawEpoch const& epoch)
+{
+    bool changed = false;
+    for (int i = 0; i < epoch.satelliteCount; ++i)
+    {
+        RawSatelliteObservation const& sat = epoch.satellites[i];
+        if (sat.constellation != RAW_GLONASS || sat.prn >= GLONASS_SLOTS)
+            continue;
+        if (m_glonass_channels[sat.prn] != sat.frequencyChannel)
+        {
+            m_glonass_channels[sat.prn] = sat.frequencyChannel;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+int RinexObservationWriter::appendGlonassSlots()
+{
+    int count = 0;
+    for (int slot = 0; slot < GLONASS_SLOTS; ++slot)
+        count += (m_glonass_channels[slot] != UNKNOWN_CHANNEL);
+
+    // Eight slots per record, the first one starting with the count
+    char line[61];
+    size_t line_size = snprintf(line, sizeof(line), "%3d ", count);
+    int in_line = 0, lines = 0;
+    for (int slot = 0; slot < GLONASS_SLOTS; ++slot)
+    {
+        if (m_glonass_channels[slot] == UNKNOWN_CHANNEL)
+            continue;
+        line_size += snprintf(line + line_size, sizeof(line) - line_size, "R%02d %2d ",
+                slot, m_glonass_channels[slot]);
+        if (++in_line == 8)
+        {
+            appendHeaderLine("GLONASS SLOT / FRQ #", "%s", line);
+            ++lines;
+            line_size = snprintf(line, sizeof(line), "%4s", "");
+            in_line = 0;
+        }
+    }
+    if (in_line > 0 || lines == 0)
+    {
+        appendHeaderLine("GLONASS SLOT / FRQ #", "%s", line);
+        ++lines;
+    }
+    return lines;
+}
+
+/** Signal strength indicator of RINEX, from 1 to 9 */
+static char getStrength(float cn0)
+{
+    if (isnan(cn0))
+        return ' ';
+    int strength = cn0 / 6;
+    if (strength < 1)
+        strength = 1;
+    else if (strength > 9)
+        strength = 9;
+    return '0' + strength;
+}
+
+bool RinexObservationWriter::write(RawEpoch const& epoch)
+{
+    if (m_fd == -1)
+        return false;
+    if (m_buffer.size() - m_buffer_size < MAX_EPOCH_SIZE && !flush())
+        return false;
+
+    if (!m_header_written)
+        writeHeader(epoch);
+    else if (updateGlonassSlots(epoch))
+    {
+        // New slots are declared in header records inserted before the
+        // epoch, announced by an event with flag 4. The count of records
+        // comes first, so write them at the end and move them
+        size_t start = m_buffer_size;
+        append(">%30s%1d%3d\n", "", 4, 0);
+        size_t records = m_buffer_size;
+        int count = appendGlonassSlots();
+        snprintf(&m_buffer[start + 32], 4, "%3d", count);
+        m_buffer[records - 1] = '\n';
+    }
+
+    tm calendar;
+    double seconds;
+    getCalendar(epoch.time, calendar, seconds);
+    append("> %4d %02d %02d %02d %02d%11.7f  %1d%3d\n",
+            calendar.tm_year + 1900, calendar.tm_mon + 1, calendar.tm_mday,
+            calendar.tm_hour, calendar.tm_min, seconds, 0, epoch.satelliteCount);
+
+    for (int i = 0; i < epoch.satelliteCount; ++i)
+    {
+        RawSatelliteObservation const& sat = epoch.satellites[i];
+        append("%c%02d", sat.constellation == RAW_GLONASS ? 'R' : 'G', sat.prn);
+        for (int f = 0; f < 2; ++f)
+        {
+            char strength = getStrength(sat.cn0[f]);
+            double values[3] = { sat.pseudorange[f], sat.carrierPhase[f], sat.cn0[f] };
+            for (int o = 0; o < 3; ++o)
+            {
+                if (isnan(values[o]))
+                {
+                    append("%16s", "");
+                    continue;
+                }
+                char lli = (o == 1 && sat.lossOfLock[f]) ? '1' : ' ';
+                append("%14.3f%c%c", values[o], lli, o < 2 ? strength : ' ');
+            }
+        }
+        // Trailing blanks are not needed
+        while (m_buffer[m_buffer_size - 1] == ' ')
+            --m_buffer_size;
+        append("\n");
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef MAGELLAN_MB500_RINEX_H
+#define MAGELLAN_MB500_RINEX_H
+
+#include <string>
+#include <vector>
+#include "mb500_types.hh"
+
+namespace gps {
+    /** Writes raw observations as a RINEX 3.03 observation file
+     *
+     * The file is written as the epochs come, through a buffer of fixed
+     * size that is flushed whenever it could not hold another epoch. The
+     * memory use does not depend on the length of the recording.
+     *
+     * The header is written with the first epoch, as it needs its time and
+     * the observation types. These are C, L and S on L1 and L2, with the
+     * codes tracked in the first epoch; the board does not change them
+     * during a recording. GLONASS satellites that appear after the first
+     * epoch are declared in header records inserted in the data (event
+     * flag 4), as the RINEX format allows.
+     */
+    class RinexObservationWriter
+    {
+    public:
+        RinexObservationWriter();
+        ~RinexObservationWriter();
+
+        /** Creates the file, replacing any existing one
+         *
+         * @arg marker the name of the MARKER NAME header record
+         */
+        bool open(std::string const& path, std::string const& marker = "MB500");
+        /** Writes the buffered epochs and closes the file */
+        void close();
+
+        bool write(RawEpoch const& epoch);
+        /** Writes the buffered epochs to the file */
+        bool flush();
+
+    private:
+        int m_fd;
+        std::string m_marker;
+        std::vector<char> m_buffer;
+        size_t m_buffer_size;
+        bool m_header_written;
+
+        /** Observation codes of L1 and L2, per constellation */
+        char m_codes[2][2];
+        /** Frequency channel declared for each GLONASS slot, or
+         * UNKNOWN_CHANNEL */
+        static const int8_t UNKNOWN_CHANNEL = 127;
+        static const int GLONASS_SLOTS = 64;
+        int8_t m_glonass_channels[GLONASS_SLOTS];
+
+        void append(char const* format, ...);
+        void appendHeaderLine(std::string const& label, char const* format, ...);
+        void writeHeader(RawEpoch const& epoch);
+        /** Writes the GLONASS SLOT / FRQ # records, and returns their
+         * number */
+        int appendGlonassSlots();
+        /** Declares the GLONASS slots of \c epoch that are not known yet */
+        bool updateGlonassSlots(RawEpoch const& epoch);
+    };
+}
+
+#endif
@@ -1,8 +1,11 @@
 #include "mb500.hh"
+#include "mb500_output.hh"
+#include "mb500_rinex.hh"
 #include <iostream>
 #include <sys/time.h>
 #include <time.h>
 #include <iomanip>
+#include <fstream>
 #include <fcntl.h>
 
 #include <errno.h>
@@ -11,9 +14,69 @@
 #include <netdb.h>
 
 #include <memory>
+#include <stdlib.h>
+#include <signal.h>
 
 using namespace std;
 
+// The board needs 12.5 minutes of tracking to receive a complete almanac
+static const double ALMANAC_SAVE_DELAY = 15 * 60;
+
+static volatile sig_atomic_t interrupted = 0;
+
+void handleTermination(int)
+{
+    interrupted = 1;
+}
+
+string getWarmStartPath()
+{
+    char const* path = getenv("MB500_WARM_START");
+    return path ? path : "";
+}
+
+string getKPISegment()
+{
+    char const* name = getenv("MB500_KPI_SHM");
+    return name ? name : "";
+}
+
+string getSolutionSegment()
+{
+    char const* name = getenv("MB500_SOLUTION_SHM");
+    return name ? name : "";
+}
+
+string getRinexPath()
+{
+    char const* path = getenv("MB500_RINEX");
+    return path ? path : "";
+}
+
+string getDataDevice()
+{
+    char const* path = getenv("MB500_DATA_DEVICE");
+    return path ? path : "";
+}
+
+string getCorrectionDevice()
+{
+    char const* path = getenv("MB500_CORRECTION_DEVICE");
+    return path ? path : "";
+}
+
+string getEventLogPath()
+{
+    char const* path = getenv("MB500_EVENT_LOG");
+    return path ? path : "";
+}
+
+bool useHeading()
+{
+    char const* value = getenv("MB500_HEADING");
+    return value && string(value) != "0";
+}
+
 int openSocket(std::string const& port)
 {
     struct addrinfo hints;
@@ -62,6 +125,68 @@ int openSocket(std::string const& port)
     return sfd;
 }
 
+/** Appends the heading of the current epoch, or dashes if the board
+ * sent none */
+void appendHeading(gps::SolutionFormatter& line, gps::MB500 const& gps)
+{
+    gps::Heading const& heading = gps.getHeading();
+    if (heading.time != gps.position.time)
+    {
+        line.append(" - - - - -");
+        return;
+    }
+    line.append(' ');
+    line.appendFixed(heading.heading, 3);
+    line.append(' ');
+    line.appendFixed(heading.pitch, 3);
+    line.append(' ');
+    line.appendFixed(heading.deviationHeading, 3);
+    line.append(' ');
+    line.appendFixed(heading.deviationPitch, 3);
+    line.append(' ');
+    line.appendFixed(heading.baselineLength, 3);
+}
+
+/** Writes the marker events received so far, one line each: sequence
+ * number, time (with the nanoseconds), GPS time of week, and the
+ * interpolated position and its errors, or dashes if there is none */
+void writeMarkerEvents(ostream& io, gps::MB500& gps)
+{
+    gps::MarkerEvent event;
+    while (gps.getMarkerEvents().pop(event))
+    {
+        int64_t time = event.time.toMicroseconds();
+        io << event.sequence << " " << time / 1000000 << "."
+            << setfill('0') << setw(6) << time % 1000000 << setw(3) << event.nanoseconds
+            << setfill(' ') << " " << fixed << setprecision(7) << event.gpsTimeOfWeek;
+        if (event.hasPosition)
+        {
+            gps::PredictedPosition const& position = event.position;
+            io << " " << setprecision(9) << position.latitude << " " << position.longitude
+                << " " << setprecision(3) << position.height
+                << " " << position.horizontalError << " " << position.verticalError
+                << " " << (position.extrapolated ? 1 : 0);
+        }
+        else
+            io << " - - - - - -";
+        io << endl;
+    }
+}
+
+/** Waits for the board to come back after an outage, see
+ * MB500::recover() */
+void recoverBoard(gps::MB500& gps)
+{
+    while (!gps.recover())
+        cerr << "still trying to reach the board" << endl;
+
+    gps::RecoveryStatistics const& stats = gps.getRecoveryStatistics();
+    cerr << "board recovered after " << stats.lastDowntime.toSeconds() << " s ("
+        << stats.disconnections << " disconnections, " << stats.stalls << " stalls, "
+        << stats.boardResets << " board resets, "
+        << stats.totalDowntime.toSeconds() << " s of downtime in total)" << endl;
+}
+
 void usage()
 {
     cerr << "usage: dgps_rover device_name port_name correction_source" << endl;
@@ -70,7 +195,36 @@ void usage()
         "  expected as UDP packets sent to the given port, and\n"
         "  are sent to the command port port_name. In the second\n"
         "  case, corrections are expected on the given board port,\n"
-        "  which has to be different than port_name" << endl;
+        "  which has to be different than port_name\n"
+        "\n"
+        "  If MB500_WARM_START is set, the last position is saved in the\n"
+        "  file it names, and used to speed up the next acquisition. The\n"
+        "  almanac is saved there as well when the program is interrupted\n"
+        "  after having tracked the satellites long enough\n"
+        "\n"
+        "  If MB500_KPI_SHM is set, the RTK quality indicators are\n"
+        "  published in the shared memory segment it names (e.g.\n"
+        "  /mb500_rtk), see mb500_kpi\n"
+        "\n"
+        "  If MB500_SOLUTION_SHM is set, each solution is published in the\n"
+        "  shared memory segment it names (e.g. /mb500_solutions), see\n"
+        "  mb500_solutions\n"
+        "\n"
+        "  If MB500_RINEX is set, the raw measurements are recorded in the\n"
+        "  RINEX observation file it names\n"
+        "\n"
+        "  MB500_DATA_DEVICE and MB500_CORRECTION_DEVICE can name serial\n"
+        "  devices connected to other ports of the board. The periodic data\n"
+        "  is then read from the first one, and the UDP corrections are\n"
+        "  written to the second one, instead of going through device_name\n"
+        "\n"
+        "  If MB500_HEADING is set (and not 0), the corrections are expected\n"
+        "  from a moving base, and the heading, pitch, their deviations (in\n"
+        "  degrees) and the baseline length are added at the end of each line\n"
+        "\n"
+        "  If MB500_EVENT_LOG is set, the event marker input is enabled, and\n"
+        "  each event is written in the file it names with the position\n"
+        "  interpolated at its time" << endl;
 }
 
 int main (int argc, const char** argv){
@@ -110,9 +264,42 @@ int main (int argc, const char** argv){
         correction_input_port = correction_source;
     }
 
+    string warm_start_path = getWarmStartPath();
+    if (!warm_start_path.empty())
+        gps.setWarmStartCache(warm_start_path);
+    string kpi_segment = getKPISegment();
+    if (!kpi_segment.empty() && !gps.publishRTKStatistics(kpi_segment))
+        cerr << "RTK quality indicators will not be published" << endl;
+    string solution_segment = getSolutionSegment();
+    if (!solution_segment.empty() && !gps.publishSolutions(solution_segment))
+        cerr << "solutions will not be published" << endl;
     if(!gps.openRover(device_name))
         return 1;
 
+    string data_port = port_name;
+    string data_device = getDataDevice();
+    if (!data_device.empty())
+    {
+        if (!gps.openPort(gps::MB500::PORT_DATA, data_device))
+        {
+            cerr << "could not use " << data_device << " for the periodic data" << endl;
+            return 1;
+        }
+        data_port = gps.getPortName(gps::MB500::PORT_DATA);
+        cerr << "reading the periodic data from " << data_device << " (port " << data_port << ")" << endl;
+    }
+    string correction_device = getCorrectionDevice();
+    if (correction_socket != -1 && !correction_device.empty())
+    {
+        if (!gps.openPort(gps::MB500::PORT_CORRECTIONS, correction_device))
+        {
+            cerr << "could not use " << correction_device << " for the corrections" << endl;
+            return 1;
+        }
+        correction_input_port = gps.getPortName(gps::MB500::PORT_CORRECTIONS);
+        cerr << "writing the corrections to " << correction_device << " (port " << correction_input_port << ")" << endl;
+    }
+
     if (!gps.setFastRTK(false))
     {
         cerr << "could not disable fast RTK" << endl;
@@ -123,59 +310,200 @@ int main (int argc, const char** argv){
         cerr << "could not setup correction input" << endl;
         return 1;
     }
-    gps.setPeriodicData(port_name, 1);
+    gps.setPeriodicData(data_port, 1);
+
+    bool heading = useHeading();
+    if (heading && (!gps.setMovingBase(true) || !gps.setHeadingOutput(data_port, 1)))
+    {
+        cerr << "could not setup the heading output, the board may lack the moving base option" << endl;
+        return 1;
+    }
+
+    gps::RinexObservationWriter rinex;
+    string rinex_path = getRinexPath();
+    if (!rinex_path.empty())
+    {
+        if (!rinex.open(rinex_path) || !gps.setRawDataOutput(data_port, 1))
+        {
+            cerr << "could not setup the raw data recording" << endl;
+            return 1;
+        }
+        cerr << "recording raw measurements in " << rinex_path << endl;
+    }
+    ofstream event_log;
+    string event_log_path = getEventLogPath();
+    if (!event_log_path.empty())
+    {
+        event_log.open(event_log_path.c_str(), ios::app);
+        if (!event_log || !gps.setEventMarker(data_port, true))
+        {
+            cerr << "could not setup the event marker recording" << endl;
+            return 1;
+        }
+        cerr << "recording the marker events in " << event_log_path << endl;
+    }
+
+    base::Time last_raw_epoch;
+    int data_fd = gps.getPortFileDescriptor(gps::MB500::PORT_DATA);
+    int correction_fd = gps.getPortFileDescriptor(gps::MB500::PORT_CORRECTIONS);
+    uint64_t dropped_corrections = 0;
     cout << "gps::MB500 board initialized" << endl;
     gps::MB500::displayHeader(cout);
 
+    // Display is done in a separate thread, so that it never delays the
+    // correction forwarding or the acquisition
+    gps::SolutionFormatter formatter, line;
+    gps::AsyncOutputSink output(fileno(stdout));
+
+    // Leave the loop on SIGINT and SIGTERM, to save the almanac without
+    // delaying the solutions
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleTermination;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
     base::Time last_update;
 
     char buffer[1024];
     int diff_count = 0;
     int seq = 0;
-    while(true)
+    bool first_fix_reported = false, rtk_fix_reported = false;
+    base::Time first_fix_time;
+    while(!interrupted)
     {
-        fd_set fds;
+        bool link_lost = false;
+        fd_set fds, write_fds;
         FD_ZERO(&fds);
+        FD_ZERO(&write_fds);
         if (correction_socket != -1)
             FD_SET(correction_socket, &fds);
-        FD_SET(gps.getFileDescriptor(), &fds);
-        int ret = select(std::max(correction_socket, gps.getFileDescriptor()) + 1, &fds, NULL, NULL, NULL);
+        FD_SET(data_fd, &fds);
+        // Corrections are queued, and written only when the board's port
+        // accepts them, so that a burst never delays the solutions
+        if (gps.hasPendingCorrections())
+            FD_SET(correction_fd, &write_fds);
+        int max_fd = std::max(std::max(correction_socket, data_fd), correction_fd);
+        // Wake up regularly to check that the solutions still come
+        timeval timeout = { 0, 200000 };
+        int ret = select(max_fd + 1, &fds, &write_fds, NULL, &timeout);
         if (ret < 0)
         {
+            if (errno == EINTR)
+                continue;
             cerr << "error during select()" << endl;
             return 1;
         }
-        else if (ret == 0)
-            cerr << "zero return value" << endl;
-        
+        else if (ret == 0 && gps.isStalled())
+        {
+            cerr << "the board stopped sending solutions" << endl;
+            link_lost = true;
+        }
+
         if (correction_socket != -1 && FD_ISSET(correction_socket, &fds))
         {
-            int rd = recv(correction_socket, buffer, 1024, 0);
-            if (rd > 0)
+            int rd;
+            while ((rd = recv(correction_socket, buffer, 1024, 0)) > 0)
             {
-                gps.writeCorrectionData(buffer, rd, 1000);
+                gps.queueCorrectionData(buffer, rd);
                 diff_count += rd;
             }
-            else if (rd < 0)
-            {
+            if (rd < 0 && errno != EAGAIN)
                 cerr << "error reading socket: " << strerror(errno) << endl;
+            FD_SET(correction_fd, &write_fds);
+        }
+        if (FD_ISSET(correction_fd, &write_fds))
+        {
+            if (!gps.writeCorrectionQueue())
+            {
+                cerr << "error writing corrections: " << strerror(gps.getProcessError()) << endl;
+                link_lost = true;
+            }
+
+            gps::MB500::CorrectionQueueStatus const& status = gps.getCorrectionQueueStatus();
+            if (status.droppedFrames != dropped_corrections)
+            {
+                cerr << "the board's port is saturated, dropped " << status.droppedFrames - dropped_corrections
+                    << " correction frames (" << status.droppedFrames << " in total)" << endl;
+                dropped_corrections = status.droppedFrames;
             }
         }
 
-        if (FD_ISSET(gps.getFileDescriptor(), &fds))
+        if (FD_ISSET(data_fd, &fds))
         {
             try {
                 gps.collectPeriodicData();
-                if (gps.position.time == gps.errors.time && (gps.position.time > last_update || last_update == base::Time()))
+                if (gps.getRawEpoch().time != last_raw_epoch)
+                {
+                    last_raw_epoch = gps.getRawEpoch().time;
+                    rinex.write(gps.getRawEpoch());
+                }
+                if (event_log.is_open())
+                    writeMarkerEvents(event_log, gps);
+                // With the POS profile, there is no GST whose time would
+                // match the position's
+                base::Time solution_time = gps.getSolutionTime();
+                if (!solution_time.isNull() && solution_time > last_update)
                 {
                     ++seq;
-                    last_update = gps.position.time;
-                    cout << seq << " ";
-                    gps::MB500::display(cout, gps) << " " << diff_count << endl;
+                    last_update = solution_time;
+                    formatter.format(gps);
+                    line.clear();
+                    line.appendInt(seq);
+                    line.append(' ');
+                    line.append(formatter.data(), formatter.size());
+                    line.append(' ');
+                    line.appendInt(diff_count);
+                    if (heading)
+                        appendHeading(line, gps);
+                    output.pushLine(line);
                     diff_count = 0;
                 }
+
+                if (!first_fix_reported && !gps.getTimeToFirstFix().isNull())
+                {
+                    first_fix_reported = true;
+                    first_fix_time = base::Time::now();
+                    cerr << "time to first fix: " << gps.getTimeToFirstFix().toSeconds() << " s" << endl;
+                }
+                if (!rtk_fix_reported && !gps.getTimeToRTKFix().isNull())
+                {
+                    rtk_fix_reported = true;
+                    cerr << "time to RTK fix: " << gps.getTimeToRTKFix().toSeconds() << " s" << endl;
+                }
+                // At most once per save period, after the solution went out
+                if (gps.hasWarmStartUpdate())
+                    gps.saveWarmStart();
             }
             catch(iodrivers_base::TimeoutError) {}
+            catch(std::runtime_error& e)
+            {
+                cerr << e.what() << endl;
+                link_lost = true;
+            }
+        }
+
+        if (link_lost)
+        {
+            recoverBoard(gps);
+            data_fd = gps.getPortFileDescriptor(gps::MB500::PORT_DATA);
+            correction_fd = gps.getPortFileDescriptor(gps::MB500::PORT_CORRECTIONS);
+        }
+    }
+
+    // Querying the almanac takes seconds, which is only acceptable once the
+    // solutions are not needed anymore
+    if (!warm_start_path.empty() && first_fix_reported &&
+            (base::Time::now() - first_fix_time).toSeconds() > ALMANAC_SAVE_DELAY)
+    {
+        cerr << "saving the almanac in " << warm_start_path << endl;
+        try {
+            if (!gps.saveAlmanac())
+                cerr << "could not save the almanac" << endl;
+        }
+        catch(std::runtime_error& e)
+        {
+            cerr << "could not save the almanac: " << e.what() << endl;
         }
     }
     gps.close();
@@ -0,0 +1,62 @@
+#include "mb500.hh"
+#include "mb500_bus.hh"
+#include <iostream>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+int main (int argc, const char** argv){
+    if (argc > 3)
+    {
+        cerr << "usage: mb500_solutions [segment] [poll_period]" << endl;
+        cerr << "  displays the solutions published by a driver in the shared\n"
+            "  memory segment (/mb500_solutions by default), in the format of\n"
+            "  mb500_rover. The segment is polled every poll_period seconds\n"
+            "  (0.01 by default). Solutions missed because the display was too\n"
+            "  slow are reported on stderr" << endl;
+        return 1;
+    }
+
+    string name = argc > 1 ? argv[1] : "/mb500_solutions";
+    double period = argc > 2 ? atof(argv[2]) : 0.01;
+
+    gps::SolutionBusReader reader;
+    if (!reader.open(name))
+    {
+        cerr << "cannot open the shared memory segment " << name << endl;
+        return 1;
+    }
+
+    gps::MB500::displayHeader(cout);
+    gps::SolutionRecord record;
+    gps::Position position;
+    gps::Errors errors;
+    gps::SolutionQuality quality;
+    gps::SatelliteInfo satellites;
+    uint64_t lost = 0;
+    while (true)
+    {
+        while (reader.read(record))
+        {
+            gps::SolutionBusReader::unpack(record, position, errors, quality, satellites);
+            gps::MB500::display(cout, position, errors, satellites, quality) << endl;
+        }
+        if (reader.getLostCount() != lost)
+        {
+            cerr << "lost " << reader.getLostCount() - lost << " solutions" << endl;
+            lost = reader.getLostCount();
+        }
+
+        // The driver stopped publishing, wait for the next one
+        if (!reader.isValid())
+        {
+            cerr << "the driver stopped publishing, waiting for it to restart" << endl;
+            while (!reader.open(name))
+                sleep(1);
+            lost = 0;
+        }
+        usleep(period * 1000000);
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include "mb500_survey.hh"
+#include "mb500_geodesy.hh"
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <boost/lexical_cast.hpp>
+
+using namespace std;
+using namespace gps;
+using namespace gps_base;
+
+/** Ranking of the fix types, higher is better. Zero means unusable */
+static int fixRank(GPS_SOLUTION_TYPES type)
+{
+    switch(type)
+    {
+        case AUTONOMOUS:   return 1;
+        case DIFFERENTIAL: return 2;
+        case RTK_FLOAT:    return 3;
+        case RTK_FIXED:    return 4;
+        default:           return 0;
+    }
+}
+
+// Lower bound on the per-axis standard deviation, so that a board
+// reporting zero deviations does not get an infinite weight
+static const double MIN_DEVIATION = 0.005;
+
+SurveyIn::SurveyIn(double target_error, double min_duration, double max_duration)
+    : m_target_error(target_error), m_min_duration(min_duration), m_max_duration(max_duration)
+{
+    reset();
+}
+
+void SurveyIn::reset()
+{
+    m_fix_type = NO_SOLUTION;
+    m_start_time = base::Time();
+    m_last_time  = base::Time();
+    m_count = 0;
+    m_sum_weights = 0;
+    m_sum_squared_weights = 0;
+    for (int i = 0; i < 3; ++i)
+        m_mean[i] = m_m2[i] = 0;
+}
+
+bool SurveyIn::update(Position const& position, Errors const& errors)
+{
+    int rank = fixRank(position.positionType);
+    if (rank == 0 || rank < fixRank(m_fix_type))
+        return isComplete();
+    else if (rank > fixRank(m_fix_type))
+    {
+        reset();
+        m_fix_type = position.positionType;
+    }
+
+    double variance = 0;
+    double deviations[3] = { errors.deviationLatitude, errors.deviationLongitude, errors.deviationAltitude };
+    for (int i = 0; i < 3; ++i)
+    {
+        double dev = std::max(deviations[i], MIN_DEVIATION);
+        variance += dev * dev;
+    }
+    double weight = 1 / variance;
+
+    double ecef[3];
+    geodeticToECEF(position.latitude, position.longitude,
+            position.altitude + position.geoidalSeparation, ecef);
+
+    if (m_count == 0)
+        m_start_time = position.time;
+    m_last_time = position.time;
+    ++m_count;
+    m_sum_weights         += weight;
+    m_sum_squared_weights += weight * weight;
+    for (int i = 0; i < 3; ++i)
+    {
+        double delta = ecef[i] - m_mean[i];
+        m_mean[i] += delta * weight / m_sum_weights;
+        m_m2[i]   += weight * delta * (ecef[i] - m_mean[i]);
+    }
+    return isComplete();
+}
+
+size_t SurveyIn::getSampleCount() const
+{ return m_count; }
+base::Time SurveyIn::getDuration() const
+{ return m_last_time - m_start_time; }
+GPS_SOLUTION_TYPES SurveyIn::getFixType() const
+{ return m_fix_type; }
+
+double SurveyIn::getStandardError() const
+{
+    if (m_count < 2)
+        return INFINITY;
+
+    // Effective number of samples of the weighted mean, and standard error
+    // from the weighted sample variance
+    double n_eff = m_sum_weights * m_sum_weights / m_sum_squared_weights;
+    double squared_error = 0;
+    for (int i = 0; i < 3; ++i)
+        squared_error += m_m2[i] / m_sum_weights / n_eff;
+    return sqrt(squared_error);
+}
+
+bool SurveyIn::isComplete() const
+{
+    if (m_count < 2)
+        return false;
+
+    double duration = getDuration().toSeconds();
+    if (duration >= m_max_duration)
+        return true;
+    return duration >= m_min_duration && getStandardError() < m_target_error;
+}
+
+void SurveyIn::getPosition(double& latitude, double& longitude, double& height) const
+{
+    ecefToGeodetic(m_mean, latitude, longitude, height);
+}
+
+SurveyedPosition::SurveyedPosition()
+    : latitude(0), longitude(0), height(0), standard_error(0)
+{
+}
+
+bool SurveyedPosition::load(std::string const& path)
+{
+    ifstream file(path.c_str());
+    if (!file)
+        return false;
+
+    int fields = 0;
+    string line;
+    while (getline(file, line))
+    {
+        size_t separator = line.find('=');
+        if (separator == string::npos)
+            continue;
+
+        string key   = line.substr(0, separator);
+        string value = line.substr(separator + 1);
+        try
+        {
+            if (key == "board_id")
+                board_id = value;
+            else if (key == "latitude")
+                latitude = boost::lexical_cast<double>(value);
+            else if (key == "longitude")
+                longitude = boost::lexical_cast<double>(value);
+            else if (key == "height")
+                height = boost::lexical_cast<double>(value);
+            else if (key == "standard_error")
+                standard_error = boost::lexical_cast<double>(value);
+            else if (key == "time")
+                time = base::Time::fromMicroseconds(boost::lexical_cast<int64_t>(value));
+            else continue;
+        }
+        catch(boost::bad_lexical_cast&) { return false; }
+        ++fields;
+    }
+    return fields == 6;
+}
+
+bool SurveyedPosition::save(std::string const& path) const
+{
+    string tmp_path = path + ".tmp";
+    {
+        ofstream file(tmp_path.c_str());
+        if (!file)
+            return false;
+
+        file << "board_id=" << board_id << "\n"
+            << setprecision(12) << fixed
+            << "latitude=" << latitude << "\n"
+            << "longitude=" << longitude << "\n"
+            << setprecision(4)
+            << "height=" << height << "\n"
+            << "standard_error=" << standard_error << "\n"
+            << "time=" << time.toMicroseconds() << "\n";
+        file.flush();
+        if (!file)
+            return false;
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+double SurveyedPosition::distanceTo(double latitude, double longitude, double height) const
+{
+    double a[3], b[3];
+    geodeticToECEF(this->latitude, this->longitude, this->height, a);
+    geodeticToECEF(latitude, longitude, height, b);
+    return sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+}
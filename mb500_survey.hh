@@ -0,0 +1,105 @@
+#ifndef MAGELLAN_MB500_SURVEY_H
+#define MAGELLAN_MB500_SURVEY_H
+
+#include <stddef.h>
+#include <string>
+#include "gps_types.hh"
+
+namespace gps {
+    /** Estimates the position of a static receiver by averaging its
+     * solutions
+     *
+     * The solutions are averaged in ECEF with a streaming weighted mean
+     * (West's variant of Welford's algorithm). Each sample is weighted by
+     * the inverse of its GST variance. Only the samples of the best fix
+     * type seen so far are used: when a better fix type shows up, the
+     * estimate is restarted.
+     *
+     * The survey is complete when the standard error of the mean falls
+     * below the target error, once the minimum duration and sample count
+     * are reached, or when the maximum duration is reached. GPS errors are
+     * correlated in time, so the standard error is optimistic on short
+     * windows: the minimum duration should cover a few correlation times.
+     */
+    class SurveyIn
+    {
+    public:
+        /**
+         * @arg target_error the standard error (3D, in meters) below which
+         *      the survey is complete
+         * @arg min_duration the minimum survey duration in seconds
+         * @arg max_duration the maximum survey duration in seconds
+         */
+        SurveyIn(double target_error = 0.5, double min_duration = 10, double max_duration = 600);
+
+        void reset();
+
+        /** Adds a solution to the estimate
+         *
+         * @returns true if the survey is complete
+         */
+        bool update(gps::Position const& position, gps::Errors const& errors);
+
+        bool isComplete() const;
+        /** Number of samples in the current estimate */
+        size_t getSampleCount() const;
+        /** Duration covered by the current estimate */
+        base::Time getDuration() const;
+        /** Fix type of the samples in the current estimate */
+        gps_base::GPS_SOLUTION_TYPES getFixType() const;
+        /** Standard error of the estimate, 3D, in meters */
+        double getStandardError() const;
+        /** Estimated position, as WGS84 latitude and longitude in degrees
+         * and height above the ellipsoid in meters */
+        void getPosition(double& latitude, double& longitude, double& height) const;
+
+    private:
+        double m_target_error;
+        double m_min_duration;
+        double m_max_duration;
+
+        gps_base::GPS_SOLUTION_TYPES m_fix_type;
+        base::Time m_start_time;
+        base::Time m_last_time;
+        size_t m_count;
+        double m_sum_weights;
+        double m_sum_squared_weights;
+        double m_mean[3];
+        double m_m2[3];
+    };
+
+    /** A base station position, as stored between runs of a base station
+     *
+     * The file is a small key=value text file. It is written in a temporary
+     * file first and then renamed, so an interrupted save leaves the
+     * previous position intact.
+     */
+    struct SurveyedPosition
+    {
+        /** The ID of the board that surveyed the position, as returned by
+         * MB500::getBoardID() */
+        std::string board_id;
+        /** WGS84 latitude and longitude in degrees, height above the
+         * ellipsoid in meters */
+        double latitude;
+        double longitude;
+        double height;
+        /** 3D standard error of the position in meters, zero if it has
+         * been given by the user */
+        double standard_error;
+        /** When the position got determined */
+        base::Time time;
+
+        SurveyedPosition();
+
+        bool load(std::string const& path);
+        bool save(std::string const& path) const;
+
+        /** Returns the distance, in meters, between this position and the
+         * given one */
+        double distanceTo(double latitude, double longitude, double height) const;
+    };
+}
+
+#endif
+
@@ -1,4 +1,5 @@
 #include "mb500.hh"
+#include "mb500_output.hh"
 #include <iostream>
 #include <sys/time.h>
 #include <time.h>
@@ -9,33 +10,59 @@ using namespace std;
 int main (int argc, const char** argv){
     gps::MB500 gps;
 
-    if (argc != 3)
+    if (argc < 3 || argc > 5)
     {
-        cerr << "usage: dgps_test device_name port_name" << endl;
+        cerr << "usage: dgps_test device_name port_name [nmea|pos] [text|csv|json]" << endl;
         return 1;
     }
 
     string device_name = argv[1];
     string port_name   = argv[2];
+    gps::MB500_OUTPUT_PROFILE profile = gps::MB500_NMEA_OUTPUT;
+    if (argc >= 4 && string(argv[3]) == "pos")
+        profile = gps::MB500_POS_OUTPUT;
+    gps::SolutionFormatter::FORMAT format = gps::SolutionFormatter::TEXT;
+    if (argc == 5 && string(argv[4]) == "csv")
+        format = gps::SolutionFormatter::CSV;
+    else if (argc == 5 && string(argv[4]) == "json")
+        format = gps::SolutionFormatter::JSON;
 
     if(!gps.open(device_name))
         return 1;
 
-    gps.setPeriodicData(port_name, 1);
-    cout << "gps::MB500 board initialized" << endl;
-    gps::MB500::displayHeader(cout);
+    gps.setPeriodicData(port_name, 1, profile);
+    cerr << "gps::MB500 board initialized" << endl;
+
+    // Output is done in a separate thread, so that a slow terminal or disk
+    // does not delay the acquisition
+    gps::SolutionFormatter formatter(format);
+    gps::AsyncOutputSink output(fileno(stdout));
+    formatter.formatHeader();
+    if (formatter.size() > 0)
+        output.pushLine(formatter);
 
     base::Time last_update;
+    bool first_fix_reported = false, rtk_fix_reported = false;
 
     while(true)
     {
 	try {
 		gps.collectPeriodicData();
-		if (gps.position.time == gps.errors.time && (gps.position.time > last_update || last_update == base::Time()))
+		if (gps.getSolutionTime() > last_update)
 		{
-		    last_update = gps.position.time;
-		    gps::MB500::display(cout, gps) << endl;
-
+		    last_update = gps.getSolutionTime();
+		    formatter.format(gps);
+		    output.pushLine(formatter);
+		}
+		if (!first_fix_reported && !gps.getTimeToFirstFix().isNull())
+		{
+		    first_fix_reported = true;
+		    cerr << "time to first fix: " << gps.getTimeToFirstFix().toSeconds() << " s" << endl;
+		}
+		if (!rtk_fix_reported && !gps.getTimeToRTKFix().isNull())
+		{
+		    rtk_fix_reported = true;
+		    cerr << "time to RTK fix: " << gps.getTimeToRTKFix().toSeconds() << " s" << endl;
 		}
 	} 
         catch(iodrivers_base::TimeoutError) {}
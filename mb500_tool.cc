@@ -6,7 +6,26 @@ using namespace std;
 
 void usage()
 {
-    cerr << "usage: dgps_tool <device> <cold-reset|warm-reset|status|almanac|moving|satellites|edge|strobe>" << endl;
+    cerr << "usage: dgps_tool <device> <cold-reset|warm-reset|status|almanac|moving|satellites|edge|strobe|baudrate [max_rate]|integrity [duration]>" << endl;
+    cerr << "  integrity streams the periodic data at 10Hz for duration seconds\n"
+        "  (10 by default) and reports what got lost on the link" << endl;
+}
+
+void displayIntegrity(ostream& io, gps::MB500 const& gps)
+{
+    gps::LinkStatistics const& link = gps.getLinkStatistics(gps::MB500::PORT_DATA);
+    gps::StreamStatistics const& stream = gps.getStreamStatistics();
+    io << "bytes received:         " << link.bytesReceived << "\n"
+        << "packets:                " << link.packets << "\n"
+        << "bytes dropped:          " << link.bytesDropped << "\n"
+        << "truncated packets:      " << link.truncatedPackets << "\n"
+        << "checksum failures:      " << link.checksumFailures << "\n"
+        << "unknown sentences:      " << stream.unknownSentences << "\n"
+        << "invalid sentences:      " << stream.invalidSentences << "\n"
+        << "incomplete GSV cycles:  " << stream.incompleteGSVCycles << "\n"
+        << "incomplete GSA cycles:  " << stream.incompleteGSACycles << "\n"
+        << "epochs:                 " << stream.epochs << "\n"
+        << "missing epochs:         " << stream.missingEpochs << endl;
 }
 
 int main(int argc, char** argv)
@@ -76,6 +95,38 @@ int main(int argc, char** argv)
 
         gps.setProcessingRate(boost::lexical_cast<int>(argv[3]));
     }
+    else if (command == "baudrate")
+    {
+        int max_rate = 921600;
+        if (argc == 4)
+            max_rate = boost::lexical_cast<int>(argv[3]);
+
+        cerr << "board found at " << gps.getBaudrate() << " bauds" << endl;
+        int rate = gps.negotiateBaudrate(max_rate);
+        if (rate == 0)
+        {
+            cerr << "cannot negotiate the baud rate" << endl;
+            return 1;
+        }
+        cout << rate << endl;
+    }
+    else if (command == "integrity")
+    {
+        double duration = 10;
+        if (argc == 4)
+            duration = boost::lexical_cast<double>(argv[3]);
+
+        if (!gps.setPeriodicData(0.1))
+        {
+            cerr << "cannot enable the periodic data" << endl;
+            return 1;
+        }
+        base::Time end = base::Time::now() + base::Time::fromSeconds(duration);
+        while (base::Time::now() < end)
+            gps.collectPeriodicData();
+        gps.stopPeriodicData();
+        displayIntegrity(cout, gps);
+    }
     else
         usage();
 
@@ -5,7 +5,9 @@
 #include <vector>
 #endif
 
+#include <stdint.h>
 #include <base/Time.hpp>
+#include <gps_base/BaseTypes.hpp>
 
 namespace gps {
     enum MB500_FIRMWARE_OPTIONS
@@ -52,6 +54,213 @@ namespace gps {
         MB500_GPGL_L1L2 = 4,
         MB500_GPGL_L1L2CS = 5
     };
+
+    /** Set of sentences used to build the periodic solution */
+    enum MB500_OUTPUT_PROFILE
+    {
+        /** GGA, GST, ZDA, VTG and LTN at the output rate */
+        MB500_NMEA_OUTPUT = 0,
+        /** $PASHR,POS at the output rate, GST and LTN at the statistics rate */
+        MB500_POS_OUTPUT  = 1
+    };
+
+    /** Velocity over ground, from VTG, RMC or $PASHR,POS */
+    struct Velocity
+    {
+        /** GPS time of the epoch */
+        base::Time time;
+        /** Course over ground, in degrees clockwise from true north */
+        double course;
+        /** Speed over ground, in m/s */
+        double speed;
+        /** Vertical speed, in m/s, positive upwards. Only POS gives it,
+         * it is zero otherwise */
+        double verticalSpeed;
+
+        Velocity()
+            : course(0), speed(0), verticalSpeed(0) {}
+    };
+
+    /** Vector from the antenna of the (moving) base to the antenna of
+     * the rover, from $PASHR,VEC */
+    struct Baseline
+    {
+        /** GPS time of the epoch */
+        base::Time time;
+        /** Solution type of the vector. Only RTK_FIXED gives an accurate
+         * heading */
+        gps_base::GPS_SOLUTION_TYPES solutionType;
+        int satelliteCount;
+        /** ECEF components, in meters */
+        double x;
+        double y;
+        double z;
+        /** Standard deviations of the ECEF components, in meters */
+        double deviationX;
+        double deviationY;
+        double deviationZ;
+        /** Correlation coefficients of the ECEF components */
+        double correlationXY;
+        double correlationXZ;
+        double correlationYZ;
+        /** Components in the local east-north-up frame of the rover, in
+         * meters */
+        double east;
+        double north;
+        double up;
+        /** ID of the base that sent the corrections */
+        int baseStationID;
+
+        Baseline()
+            : solutionType(gps_base::NO_SOLUTION), satelliteCount(0)
+            , x(0), y(0), z(0), deviationX(0), deviationY(0), deviationZ(0)
+            , correlationXY(0), correlationXZ(0), correlationYZ(0)
+            , east(0), north(0), up(0), baseStationID(0) {}
+    };
+
+    /** Orientation of the base to rover baseline, in degrees */
+    struct Heading
+    {
+        /** GPS time of the epoch */
+        base::Time time;
+        gps_base::GPS_SOLUTION_TYPES solutionType;
+        /** Clockwise from true north */
+        double heading;
+        /** Positive when the rover antenna is above the base antenna */
+        double pitch;
+        /** Standard deviations of heading and pitch, propagated from the
+         * baseline covariance. NaN, as well as pitch, when the epoch only
+         * had a HDT sentence */
+        double deviationHeading;
+        double deviationPitch;
+        /** Length of the baseline, in meters. NaN when the epoch only had
+         * a HDT sentence */
+        double baselineLength;
+
+        Heading()
+            : solutionType(gps_base::NO_SOLUTION), heading(0), pitch(0)
+            , deviationHeading(0), deviationPitch(0), baselineLength(0) {}
+    };
+
+    /** Integrity of the data received on one link, see
+     * MB500::getLinkStatistics() */
+    struct LinkStatistics
+    {
+        uint64_t bytesReceived;
+        /** Packets framed successfully */
+        uint64_t packets;
+        /** Bytes discarded by the framing: garbage between packets, and
+         * the packets counted below */
+        uint64_t bytesDropped;
+        /** Sentences cut by the start of another packet, without a
+         * checksum, or larger than the read buffer */
+        uint64_t truncatedPackets;
+        /** NMEA sentences and RTCM 3 frames whose checksum did not match */
+        uint64_t checksumFailures;
+
+        LinkStatistics()
+            : bytesReceived(0), packets(0), bytesDropped(0)
+            , truncatedPackets(0), checksumFailures(0) {}
+    };
+
+    /** Integrity of the stream of sentences, see
+     * MB500::getStreamStatistics() */
+    struct StreamStatistics
+    {
+        /** Sentences the driver does not interpret. The replies to the
+         * driver's commands and queries are not counted */
+        uint64_t unknownSentences;
+        /** Sentences that passed the checksum but could not be
+         * interpreted, e.g. because of missing fields */
+        uint64_t invalidSentences;
+        /** GSV cycles that missed sentences. GSA has no sentence count,
+         * its cycles are counted as incomplete when a packet got dropped
+         * on the link while they were received */
+        uint64_t incompleteGSVCycles;
+        uint64_t incompleteGSACycles;
+        /** Complete epochs received, and epochs missing in the sequence
+         * of their UTC times given the period of the periodic data */
+        uint64_t epochs;
+        uint64_t missingEpochs;
+
+        StreamStatistics()
+            : unknownSentences(0), invalidSentences(0), incompleteGSVCycles(0), incompleteGSACycles(0)
+            , epochs(0), missingEpochs(0) {}
+    };
+
+    /** Link outages handled by MB500::recover() */
+    struct RecoveryStatistics
+    {
+        /** Outages where the device failed (e.g. USB disconnection), and
+         * where it stayed up but the board stopped sending solutions */
+        uint32_t disconnections;
+        uint32_t stalls;
+        /** Outages where the board turned out to have been reset, and
+         * therefore lost its configuration */
+        uint32_t boardResets;
+        /** Attempts to reopen the device and reach the board */
+        uint32_t attempts;
+        /** Calls to recover() that gave up */
+        uint32_t failures;
+        /** Time between the last data received before an outage and the
+         * end of its recovery */
+        base::Time lastDowntime;
+        base::Time maxDowntime;
+        base::Time totalDowntime;
+        /** When the last recovery completed */
+        base::Time lastRecovery;
+
+        RecoveryStatistics()
+            : disconnections(0), stalls(0), boardResets(0), attempts(0), failures(0) {}
+    };
+
+    enum RAW_CONSTELLATION
+    {
+        RAW_GPS     = 0,
+        RAW_GLONASS = 1
+    };
+
+    /** Raw measurements of one satellite at one epoch. Index 0 of the
+     * arrays is L1 and index 1 is L2. Missing measurements are NaN */
+    struct RawSatelliteObservation
+    {
+        /** One of RAW_CONSTELLATION */
+        uint8_t constellation;
+        /** GPS PRN or GLONASS slot number */
+        uint8_t prn;
+        /** GLONASS frequency channel number, from -7 to 6 */
+        int8_t frequencyChannel;
+        /** Tracked code, as the RTCM 3 code indicators: on L1, 0 for C/A
+         * and 1 for P. On L2, 0 for C/A (L2C for GPS), 1 for P and 2 or 3
+         * for the GPS codeless modes */
+        uint8_t code[2];
+        /** Set if the carrier tracking may have been interrupted since the
+         * previous epoch */
+        bool lossOfLock[2];
+        /** Pseudorange, in meters */
+        double pseudorange[2];
+        /** Carrier phase, in cycles */
+        double carrierPhase[2];
+        /** Carrier to noise density ratio, in dB-Hz */
+        float cn0[2];
+        /** Time since the carrier lock, in seconds */
+        uint16_t lockTime[2];
+    };
+
+    /** Raw measurements of all the satellites at one epoch */
+    struct RawEpoch
+    {
+        static const int MAX_SATELLITES = 64;
+
+        /** Receiver time of the epoch, in the GPS time scale: the date of
+         * this time is the GPS date, without the UTC leap seconds */
+        base::Time time;
+        int satelliteCount;
+        RawSatelliteObservation satellites[MAX_SATELLITES];
+
+        RawEpoch()
+            : satelliteCount(0) {}
+    };
 }
 
 #endif
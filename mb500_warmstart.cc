@@ -0,0 +1,93 @@
+#include "mb500_warmstart.hh"
+#include <stdio.h>
+#include <fstream>
+#include <iomanip>
+#include <boost/lexical_cast.hpp>
+
+using namespace std;
+using namespace gps;
+
+WarmStartData::WarmStartData()
+    : latitude(0), longitude(0), height(0)
+    , deviation_latitude(0), deviation_longitude(0), deviation_altitude(0)
+{
+}
+
+bool WarmStartData::hasPosition() const
+{
+    return !time.isNull();
+}
+
+bool WarmStartData::load(std::string const& path)
+{
+    ifstream file(path.c_str());
+    if (!file)
+        return false;
+
+    *this = WarmStartData();
+    string line;
+    while (getline(file, line))
+    {
+        size_t separator = line.find('=');
+        if (separator == string::npos)
+            continue;
+
+        string key   = line.substr(0, separator);
+        string value = line.substr(separator + 1);
+        try
+        {
+            if (key == "latitude")
+                latitude = boost::lexical_cast<double>(value);
+            else if (key == "longitude")
+                longitude = boost::lexical_cast<double>(value);
+            else if (key == "height")
+                height = boost::lexical_cast<double>(value);
+            else if (key == "deviation_latitude")
+                deviation_latitude = boost::lexical_cast<double>(value);
+            else if (key == "deviation_longitude")
+                deviation_longitude = boost::lexical_cast<double>(value);
+            else if (key == "deviation_altitude")
+                deviation_altitude = boost::lexical_cast<double>(value);
+            else if (key == "time")
+                time = base::Time::fromMicroseconds(boost::lexical_cast<int64_t>(value));
+            else if (key == "almanac_time")
+                almanac_time = base::Time::fromMicroseconds(boost::lexical_cast<int64_t>(value));
+            else if (key == "almanac")
+                almanac.push_back(value);
+        }
+        catch(boost::bad_lexical_cast&)
+        {
+            *this = WarmStartData();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool WarmStartData::save(std::string const& path) const
+{
+    string tmp_path = path + ".tmp";
+    {
+        ofstream file(tmp_path.c_str());
+        if (!file)
+            return false;
+
+        file << setprecision(12) << fixed
+            << "latitude=" << latitude << "\n"
+            << "longitude=" << longitude << "\n"
+            << setprecision(4)
+            << "height=" << height << "\n"
+            << "deviation_latitude=" << deviation_latitude << "\n"
+            << "deviation_longitude=" << deviation_longitude << "\n"
+            << "deviation_altitude=" << deviation_altitude << "\n"
+            << "time=" << time.toMicroseconds() << "\n"
+            << "almanac_time=" << almanac_time.toMicroseconds() << "\n";
+        for (size_t i = 0; i < almanac.size(); ++i)
+            file << "almanac=" << almanac[i] << "\n";
+        file.flush();
+        if (!file)
+            return false;
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
@@ -0,0 +1,46 @@
+#ifndef MAGELLAN_MB500_WARMSTART_H
+#define MAGELLAN_MB500_WARMSTART_H
+
+#include <string>
+#include <vector>
+#include "gps_types.hh"
+
+namespace gps {
+    /** What the driver saves of the receiver state to speed up the next
+     * acquisition
+     *
+     * The file uses the same key=value layout as SurveyedPosition, with
+     * one "almanac=" line per $PASHR,ALM sentence. It is written in a
+     * temporary file first and then renamed.
+     */
+    struct WarmStartData
+    {
+        /** WGS84 latitude and longitude in degrees, height above the
+         * ellipsoid in meters */
+        double latitude;
+        double longitude;
+        double height;
+        /** Standard deviation of the position, in meters */
+        double deviation_latitude;
+        double deviation_longitude;
+        double deviation_altitude;
+        /** UTC time of the position */
+        base::Time time;
+
+        /** The almanac, as the $PASHR,ALM sentences returned by the board */
+        std::vector<std::string> almanac;
+        /** When the almanac got captured */
+        base::Time almanac_time;
+
+        WarmStartData();
+
+        /** True if a position has been saved */
+        bool hasPosition() const;
+
+        bool load(std::string const& path);
+        bool save(std::string const& path) const;
+    };
+}
+
+#endif
+
@@ -0,0 +1,271 @@
+#include "mb500_archive.hh"
+#include "testing.hh"
+
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace gps;
+
+static const int EPOCH_COUNT = 2500;
+
+/** Epoch i of the test archive. The time has a gap, and the values go up
+ * and down so that the deltas change sign */
+static ArchivedSolution makeSolution(int i)
+{
+    ArchivedSolution s;
+    int64_t time = 1600000000000000LL + i * 100000LL;
+    if (i >= 1500)
+        time += 3600000000LL;
+    s.position.time = base::Time::fromMicroseconds(time);
+    s.position.latitude  = 53.1 + i * 1e-7 - (i % 7) * 3e-9;
+    s.position.longitude = -8.8 - i * 2e-7;
+    s.position.altitude  = 12.345 + sin(i / 50.0) * 2;
+    s.position.geoidalSeparation = 40.1;
+    s.position.positionType = (i % 100 < 90) ? gps_base::RTK_FIXED : gps_base::RTK_FLOAT;
+    s.position.noOfSatellites = 8 + i % 5;
+    s.position.ageOfDifferentialCorrections = 0.1 * (i % 20);
+    s.errors.time = s.position.time;
+    s.errors.deviationLatitude  = 0.012 + (i % 3) * 0.001;
+    s.errors.deviationLongitude = 0.013;
+    s.errors.deviationAltitude  = 0.03 + (i % 90 >= 80 ? 0.5 : 0);
+    s.pdop = 1.5;
+    s.hdop = 0.9 + (i % 4) * 0.01;
+    s.vdop = 1.2;
+    return s;
+}
+
+static void writeArchive(string const& path, int first, int last)
+{
+    SolutionArchiveWriter writer;
+    CHECK(writer.open(path));
+    for (int i = first; i < last; ++i)
+    {
+        ArchivedSolution s = makeSolution(i);
+        SolutionQuality quality;
+        quality.pdop = s.pdop;
+        quality.hdop = s.hdop;
+        quality.vdop = s.vdop;
+        writer.append(s.position, s.errors, quality);
+    }
+}
+
+static void checkSolution(ArchivedSolution const& actual, int i)
+{
+    ArchivedSolution expected = makeSolution(i);
+    CHECK(actual.position.time == expected.position.time);
+    CHECK_CLOSE(actual.position.latitude, expected.position.latitude, 0.5e-9);
+    CHECK_CLOSE(actual.position.longitude, expected.position.longitude, 0.5e-9);
+    CHECK_CLOSE(actual.position.altitude, expected.position.altitude, 0.0005);
+    CHECK_CLOSE(actual.position.geoidalSeparation, expected.position.geoidalSeparation, 0.0005);
+    CHECK(actual.position.positionType == expected.position.positionType);
+    CHECK(actual.position.noOfSatellites == expected.position.noOfSatellites);
+    CHECK_CLOSE(actual.position.ageOfDifferentialCorrections, expected.position.ageOfDifferentialCorrections, 0.05);
+    CHECK_CLOSE(actual.errors.deviationLatitude, expected.errors.deviationLatitude, 0.0005);
+    CHECK_CLOSE(actual.errors.deviationLongitude, expected.errors.deviationLongitude, 0.0005);
+    CHECK_CLOSE(actual.errors.deviationAltitude, expected.errors.deviationAltitude, 0.0005);
+    CHECK_CLOSE(actual.pdop, expected.pdop, 0.005);
+    CHECK_CLOSE(actual.hdop, expected.hdop, 0.005);
+    CHECK_CLOSE(actual.vdop, expected.vdop, 0.005);
+}
+
+static void testRoundTrip(string const& path)
+{
+    writeArchive(path, 0, EPOCH_COUNT);
+
+    SolutionArchiveReader reader;
+    CHECK(reader.open(path));
+    CHECK(reader.getBlockCount() == 3);
+    CHECK(reader.getSolutionCount() == static_cast<size_t>(EPOCH_COUNT));
+    CHECK(reader.getBlockSize(2) == EPOCH_COUNT - 2 * SolutionArchiveWriter::ARCHIVE_BLOCK_SIZE);
+
+    int index = 0;
+    for (size_t block = 0; block < reader.getBlockCount(); ++block)
+    {
+        vector<ArchivedSolution> solutions;
+        reader.readBlock(block, solutions);
+        CHECK(solutions.size() == reader.getBlockSize(block));
+        CHECK(reader.getBlockStartTime(block) == makeSolution(index).position.time);
+        CHECK(reader.getBlockEndTime(block) == makeSolution(index + solutions.size() - 1).position.time);
+
+        // A single column decodes to the same values as the whole block
+        vector<double> altitudes;
+        reader.readColumn(block, ARCHIVE_ALTITUDE, altitudes);
+        CHECK(altitudes.size() == solutions.size());
+        for (size_t i = 0; i < solutions.size() && i < altitudes.size(); ++i)
+        {
+            CHECK(altitudes[i] == solutions[i].position.altitude);
+            checkSolution(solutions[i], index + i);
+        }
+        index += solutions.size();
+    }
+
+    // About 16 bytes per epoch on a steady solution, much less than the
+    // ~100 bytes of the text output
+    struct stat archive_stat;
+    CHECK(stat(path.c_str(), &archive_stat) == 0);
+    CHECK(archive_stat.st_size < 40 * EPOCH_COUNT);
+}
+
+static void testPartialBlock(string const& path)
+{
+    // A crash in the middle of the last write leaves a partial block,
+    // which the readers ignore and the writer drops before appending
+    struct stat archive_stat;
+    stat(path.c_str(), &archive_stat);
+    CHECK(truncate(path.c_str(), archive_stat.st_size - 5) == 0);
+    {
+        SolutionArchiveReader reader;
+        CHECK(reader.open(path));
+        CHECK(reader.getBlockCount() == 2);
+        CHECK(reader.getSolutionCount() == 2u * SolutionArchiveWriter::ARCHIVE_BLOCK_SIZE);
+    }
+
+    writeArchive(path, 2 * SolutionArchiveWriter::ARCHIVE_BLOCK_SIZE, EPOCH_COUNT);
+    SolutionArchiveReader reader;
+    CHECK(reader.open(path));
+    CHECK(reader.getBlockCount() == 3);
+    CHECK(reader.getSolutionCount() == static_cast<size_t>(EPOCH_COUNT));
+    vector<ArchivedSolution> solutions;
+    reader.readBlock(2, solutions);
+    for (size_t i = 0; i < solutions.size(); ++i)
+        checkSolution(solutions[i], 2 * SolutionArchiveWriter::ARCHIVE_BLOCK_SIZE + i);
+}
+
+static void testUnknownValues(string const& path)
+{
+    // Unknown deviations are normal with the POS profile and no GST
+    unlink(path.c_str());
+    {
+        SolutionArchiveWriter writer;
+        CHECK(writer.open(path));
+        for (int i = 0; i < 10; ++i)
+        {
+            ArchivedSolution s = makeSolution(i);
+            if (i >= 3 && i < 6)
+            {
+                s.errors.deviationLatitude  = NAN;
+                s.errors.deviationLongitude = NAN;
+                s.errors.deviationAltitude  = NAN;
+            }
+            if (i == 7)
+                s.position.altitude = 1e300;
+            SolutionQuality quality;
+            quality.pdop = s.pdop;
+            quality.hdop = s.hdop;
+            quality.vdop = i == 8 ? NAN : s.vdop;
+            writer.append(s.position, s.errors, quality);
+        }
+    }
+
+    SolutionArchiveReader reader;
+    CHECK(reader.open(path));
+    vector<ArchivedSolution> solutions;
+    reader.readBlock(0, solutions);
+    CHECK(solutions.size() == 10u);
+    for (size_t i = 0; i < solutions.size(); ++i)
+    {
+        ArchivedSolution expected = makeSolution(i);
+        if (i >= 3 && i < 6)
+        {
+            CHECK(isnan(solutions[i].errors.deviationLatitude));
+            CHECK(isnan(solutions[i].errors.deviationAltitude));
+        }
+        else
+            CHECK_CLOSE(solutions[i].errors.deviationAltitude, expected.errors.deviationAltitude, 0.0005);
+
+        if (i == 7)
+            CHECK(isnan(solutions[i].position.altitude));
+        else
+            CHECK_CLOSE(solutions[i].position.altitude, expected.position.altitude, 0.0005);
+        if (i == 8)
+            CHECK(isnan(solutions[i].vdop));
+        else
+            CHECK_CLOSE(solutions[i].vdop, expected.vdop, 0.005);
+    }
+
+    vector<double> deviations;
+    reader.readColumn(0, ARCHIVE_DEVIATION_LONGITUDE, deviations);
+    CHECK(deviations.size() == 10u && isnan(deviations[4]) && !isnan(deviations[6]));
+}
+
+static void testWriteFailure(string const& path)
+{
+    // The file size limit makes the write of the second block stop
+    // midway. The partial block gets removed and the epochs stay pending
+    unlink(path.c_str());
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit original;
+    getrlimit(RLIMIT_FSIZE, &original);
+
+    SolutionArchiveWriter writer;
+    CHECK(writer.open(path));
+    for (int i = 0; i < SolutionArchiveWriter::ARCHIVE_BLOCK_SIZE; ++i)
+    {
+        ArchivedSolution s = makeSolution(i);
+        SolutionQuality quality;
+        quality.pdop = s.pdop;
+        quality.hdop = s.hdop;
+        quality.vdop = s.vdop;
+        writer.append(s.position, s.errors, quality);
+    }
+    struct stat archive_stat;
+    stat(path.c_str(), &archive_stat);
+    off_t first_block = archive_stat.st_size;
+
+    rlimit limit = original;
+    limit.rlim_cur = first_block + 1000;
+    CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    for (int i = SolutionArchiveWriter::ARCHIVE_BLOCK_SIZE; i < EPOCH_COUNT; ++i)
+    {
+        ArchivedSolution s = makeSolution(i);
+        SolutionQuality quality;
+        quality.pdop = s.pdop;
+        quality.hdop = s.hdop;
+        quality.vdop = s.vdop;
+        writer.append(s.position, s.errors, quality);
+    }
+    CHECK(!writer.flush());
+    stat(path.c_str(), &archive_stat);
+    CHECK(archive_stat.st_size == first_block);
+
+    // Once the disk is writable again, nothing is missing
+    CHECK(setrlimit(RLIMIT_FSIZE, &original) == 0);
+    CHECK(writer.flush());
+    writer.close();
+
+    SolutionArchiveReader reader;
+    CHECK(reader.open(path));
+    CHECK(reader.getSolutionCount() == static_cast<size_t>(EPOCH_COUNT));
+    int index = 0;
+    for (size_t block = 0; block < reader.getBlockCount(); ++block)
+    {
+        vector<ArchivedSolution> solutions;
+        reader.readBlock(block, solutions);
+        for (size_t i = 0; i < solutions.size(); ++i)
+            checkSolution(solutions[i], index++);
+    }
+    CHECK(index == EPOCH_COUNT);
+}
+
+int main()
+{
+    char path[] = "/tmp/mb500_test_archiveXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+        return 1;
+    close(fd);
+    unlink(path);
+
+    testRoundTrip(path);
+    testPartialBlock(path);
+    testUnknownValues(path);
+    testWriteFailure(path);
+    unlink(path);
+    return testResult();
+}
@@ -0,0 +1,98 @@
+#include "mb500_clock.hh"
+#include "testing.hh"
+
+#include <stdlib.h>
+
+using namespace gps;
+
+static const int64_t GPS_START  = 1704067200LL * 1000000;
+static const int64_t HOST_START = 12345LL * 1000000;
+static const double DRIFT = 50e-6;
+/** Constant part of the latency, which the model cannot observe */
+static const double MIN_DELAY = 5000;
+
+/** Host time at which the board's event at GPS time gps_time would be
+ * seen without any jitter, in microseconds */
+static double getTrueHostTime(int64_t gps_time)
+{
+    return HOST_START + (gps_time - GPS_START) * (1 + DRIFT) + MIN_DELAY;
+}
+
+/** Exponential latency jitter of 1ms on average, with 2% of 50ms spikes,
+ * in microseconds. Reproducible through srand48() */
+static double getJitter()
+{
+    double jitter = -log(1 - drand48()) * 1000;
+    if (drand48() < 0.02)
+        jitter += 50000;
+    return jitter;
+}
+
+static void testValidity()
+{
+    ClockModel model;
+    CHECK(!model.isValid());
+    for (size_t i = 0; i < ClockModel::MIN_SAMPLES; ++i)
+    {
+        int64_t gps_time = GPS_START + i * 1000000;
+        model.addSample(base::Time::fromMicroseconds(gps_time),
+                base::Time::fromMicroseconds(getTrueHostTime(gps_time)));
+    }
+    CHECK(model.isValid());
+    model.reset();
+    CHECK(!model.isValid());
+}
+
+static void testJitter()
+{
+    srand48(1);
+    ClockModel model;
+
+    // One sample per second for an hour. Once the window is full, compare
+    // the stamps with the jitter-free times
+    double sum = 0, sum2 = 0, raw2 = 0;
+    int count = 0;
+    for (int i = 0; i < 3600; ++i)
+    {
+        int64_t gps_time = GPS_START + i * 1000000LL;
+        double true_host = getTrueHostTime(gps_time);
+        double jitter = getJitter();
+        model.addSample(base::Time::fromMicroseconds(gps_time),
+                base::Time::fromMicroseconds(static_cast<int64_t>(true_host + jitter)));
+        if (i < static_cast<int>(ClockModel::DEFAULT_WINDOW) || !model.isValid())
+            continue;
+
+        int64_t stamp = model.toHostTime(base::Time::fromMicroseconds(gps_time)).toMicroseconds();
+        double error = stamp - true_host;
+        sum += error;
+        sum2 += error * error;
+        raw2 += jitter * jitter;
+        ++count;
+
+        // toGPSTime is the inverse of toHostTime
+        int64_t back = model.toGPSTime(base::Time::fromMicroseconds(stamp)).toMicroseconds();
+        CHECK_CLOSE(back, gps_time, 2);
+    }
+    CHECK(count > 3000);
+
+    // The lower envelope stays close to the minimum delay, and is much
+    // less noisy than the raw arrival times
+    double mean = sum / count;
+    double deviation = sqrt(sum2 / count - mean * mean);
+    CHECK(fabs(mean) < 500);
+    CHECK(deviation < 200);
+    CHECK(deviation < sqrt(raw2 / count) / 10);
+
+    ClockModelStatistics const& statistics = model.getStatistics();
+    CHECK(statistics.samples == ClockModel::DEFAULT_WINDOW);
+    CHECK(statistics.outliers > 0);
+    CHECK_CLOSE(statistics.drift_ppm, DRIFT * 1e6, 1);
+    CHECK(statistics.residual_max < 0.05);
+}
+
+int main()
+{
+    testValidity();
+    testJitter();
+    return testResult();
+}
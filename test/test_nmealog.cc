@@ -0,0 +1,258 @@
+#include "mb500_nmealog.hh"
+#include "testing.hh"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace gps;
+
+/** The log starts two minutes before midnight, 2026-10-18 UTC, and has
+ * one epoch per second */
+static const int EPOCH_COUNT = 240;
+static const int START_TIME_OF_DAY = 23 * 3600 + 58 * 60;
+
+static int64_t getStartTime()
+{
+    tm date = tm();
+    date.tm_year = 2026 - 1900;
+    date.tm_mon  = 9;
+    date.tm_mday = 18;
+    return static_cast<int64_t>(timegm(&date) + START_TIME_OF_DAY) * 1000000;
+}
+
+static string makeNMEA(string const& body)
+{
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < body.size(); ++i)
+        checksum ^= static_cast<uint8_t>(body[i]);
+    char trailer[8];
+    snprintf(trailer, sizeof(trailer), "*%02X\r\n", checksum);
+    return "$" + body + trailer;
+}
+
+static string makeGGA(int epoch)
+{
+    int time = (START_TIME_OF_DAY + epoch) % 86400;
+    char body[128];
+    snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.00,4500.0000000,N,00500.0000000,E,4,12,0.8,100.000,M,50.000,M,1.0,0001",
+            time / 3600, time / 60 % 60, time % 60);
+    return makeNMEA(body);
+}
+
+static string makeGST(int epoch)
+{
+    int time = (START_TIME_OF_DAY + epoch) % 86400;
+    char body[128];
+    snprintf(body, sizeof(body), "GPGST,%02d%02d%02d.00,0.1,0.1,0.1,0,0.010,0.010,0.020",
+            time / 3600, time / 60 % 60, time % 60);
+    return makeNMEA(body);
+}
+
+static string makeZDA(int epoch)
+{
+    int time = START_TIME_OF_DAY + epoch;
+    char body[128];
+    snprintf(body, sizeof(body), "GPZDA,%02d%02d%02d.00,18,10,2026,00,00",
+            time / 3600, time / 60 % 60, time % 60);
+    return makeNMEA(body);
+}
+
+/** The log, with GGA and GST epochs, a GSV cycle between them and the
+ * ZDA sent after the epoch \c zda_epoch. The offsets of the GGA sentences
+ * are saved in \c offsets */
+static string makeLog(int zda_epoch, vector<uint64_t>& offsets)
+{
+    string log;
+    for (int i = 0; i < EPOCH_COUNT; ++i)
+    {
+        offsets.push_back(log.size());
+        log += makeGGA(i);
+        log += makeGST(i);
+        log += makeNMEA("GPGSV,1,1,04,01,45,090,45,02,30,180,42,03,60,270,47,04,10,000,35");
+        if (i == zda_epoch)
+            log += makeZDA(i);
+    }
+    return log;
+}
+
+static void writeFile(string const& path, string const& data, char const* mode)
+{
+    FILE* file = fopen(path.c_str(), mode);
+    CHECK(file != NULL);
+    if (!file)
+        return;
+    fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+}
+
+static vector<NMEALogIndexEntry> readIndex(string const& path)
+{
+    vector<NMEALogIndexEntry> entries;
+    NMEALogIndex index;
+    CHECK(index.open(path + ".idx"));
+    for (size_t i = 0; i < index.size(); ++i)
+        entries.push_back(index[i]);
+    return entries;
+}
+
+static void checkEntries(vector<NMEALogIndexEntry> const& entries, vector<uint64_t> const& offsets)
+{
+    CHECK(entries.size() == static_cast<size_t>(EPOCH_COUNT));
+    if (entries.size() != static_cast<size_t>(EPOCH_COUNT))
+        return;
+    for (int i = 0; i < EPOCH_COUNT; ++i)
+    {
+        CHECK(entries[i].time == getStartTime() + i * 1000000LL);
+        CHECK(entries[i].offset == offsets[i]);
+    }
+}
+
+static void testFullBuild(string const& path)
+{
+    // The midnight crossing is detected from the time of day
+    vector<uint64_t> offsets;
+    writeFile(path, makeLog(0, offsets), "w");
+    unlink((path + ".idx").c_str());
+
+    NMEALogIndexBuilder builder;
+    CHECK(builder.open(path));
+    CHECK(builder.update());
+    CHECK(builder.getEntryCount() == static_cast<size_t>(EPOCH_COUNT));
+    builder.close();
+    checkEntries(readIndex(path), offsets);
+
+    NMEALogIndex index;
+    CHECK(index.open(path + ".idx"));
+    CHECK(index.getStartTime() == base::Time::fromMicroseconds(getStartTime()));
+    CHECK(index.getEndTime() == base::Time::fromMicroseconds(getStartTime() + (EPOCH_COUNT - 1) * 1000000LL));
+    CHECK(index.find(base::Time::fromMicroseconds(getStartTime() + 150 * 1000000LL)) == offsets[150]);
+    CHECK(index.find(base::Time::fromMicroseconds(getStartTime() + 150 * 1000000LL - 500000)) == offsets[150]);
+    CHECK(index.find(base::Time()) == offsets[0]);
+    CHECK(index.find(base::Time::fromMicroseconds(getStartTime() + EPOCH_COUNT * 1000000LL)) == index.getIndexedSize());
+}
+
+static void testIncrementalBuild(string const& path)
+{
+    // The log is recorded while being indexed, and gets cut in the middle
+    // of lines. The ZDA comes after a few epochs, which wait for it
+    // across reopens of the builder
+    vector<uint64_t> offsets;
+    string log = makeLog(10, offsets);
+    writeFile(path, "", "w");
+    unlink((path + ".idx").c_str());
+
+    NMEALogIndexBuilder builder;
+    CHECK(builder.open(path));
+    for (size_t written = 0; written < log.size(); )
+    {
+        size_t size = std::min<size_t>(log.size() - written, 97);
+        writeFile(path, log.substr(written, size), "a");
+        written += size;
+        CHECK(builder.update());
+        if (written % 5 == 0)
+            CHECK(builder.open(path));
+    }
+    builder.close();
+    checkEntries(readIndex(path), offsets);
+}
+
+static void testPendingEpochs(string const& path)
+{
+    // Epochs before the first ZDA are not in the index yet, but survive a
+    // reopen of the builder
+    vector<uint64_t> offsets;
+    string log = makeLog(10, offsets);
+    size_t zda = log.find("$GPZDA");
+    writeFile(path, log.substr(0, zda), "w");
+    unlink((path + ".idx").c_str());
+    {
+        NMEALogIndexBuilder builder;
+        CHECK(builder.open(path));
+        CHECK(builder.update());
+        CHECK(builder.getEntryCount() == 0);
+    }
+    {
+        NMEALogIndex index;
+        CHECK(index.open(path + ".idx"));
+        CHECK(index.size() == 0);
+        CHECK(index.getIndexedSize() == 0);
+    }
+
+    writeFile(path, log.substr(zda), "a");
+    NMEALogIndexBuilder builder;
+    CHECK(builder.open(path));
+    CHECK(builder.update());
+    builder.close();
+    checkEntries(readIndex(path), offsets);
+}
+
+static void testMinInterval(string const& path)
+{
+    vector<uint64_t> offsets;
+    writeFile(path, makeLog(0, offsets), "w");
+    unlink((path + ".idx").c_str());
+
+    NMEALogIndexBuilder builder(base::Time::fromSeconds(10));
+    CHECK(builder.open(path));
+    CHECK(builder.update());
+    builder.close();
+
+    vector<NMEALogIndexEntry> entries = readIndex(path);
+    CHECK(entries.size() == static_cast<size_t>(EPOCH_COUNT / 10));
+    for (int i = 0; i < static_cast<int>(entries.size()); ++i)
+    {
+        CHECK(entries[i].time == getStartTime() + i * 10000000LL);
+        CHECK(entries[i].offset == offsets[i * 10]);
+    }
+}
+
+static void checkSolutions(vector<LoggedSolution> const& solutions, int first, int count)
+{
+    CHECK(solutions.size() == static_cast<size_t>(count));
+    if (solutions.size() != static_cast<size_t>(count))
+        return;
+    for (int i = 0; i < count; ++i)
+        CHECK(solutions[i].position.time.toMicroseconds() == getStartTime() + (first + i) * 1000000LL);
+}
+
+static void testParserDates(string const& path)
+{
+    // The solutions are dated from the ZDA as the index entries, across
+    // midnight and whatever the chunk the epochs are parsed in
+    vector<uint64_t> offsets;
+    writeFile(path, makeLog(10, offsets), "w");
+
+    NMEALogParser parser;
+    CHECK(parser.open(path));
+    vector<LoggedSolution> solutions;
+    parser.parse(solutions, MB500_NMEA_OUTPUT, 4);
+    checkSolutions(solutions, 0, EPOCH_COUNT);
+
+    solutions.clear();
+    parser.parse(solutions, offsets[150], offsets[200]);
+    checkSolutions(solutions, 150, 50);
+}
+
+int main()
+{
+    char directory[] = "/tmp/mb500_test_nmealogXXXXXX";
+    if (!mkdtemp(directory))
+        return 1;
+    string path = string(directory) + "/log.nmea";
+
+    testFullBuild(path);
+    testIncrementalBuild(path);
+    testPendingEpochs(path);
+    testMinInterval(path);
+    testParserDates(path);
+
+    unlink(path.c_str());
+    unlink((path + ".idx").c_str());
+    rmdir(directory);
+    return testResult();
+}
@@ -0,0 +1,298 @@
+#include "mb500.hh"
+#include "mb500_raw.hh"
+#include "mb500_rinex.hh"
+#include "testing.hh"
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace gps;
+
+static const double SPEED_OF_LIGHT = 299792458.0;
+static const double GPS_L1_WAVELENGTH = SPEED_OF_LIGHT / 1575.42e6;
+// Sunday 2025-10-19 00:00 UTC, i.e. the start of a GPS week
+static const int64_t WEEK_START = 1760832000;
+
+/** Packs the fields of an RTCM 3 message, most significant bit first */
+struct BitWriter
+{
+    uint8_t data[1024];
+    size_t bit;
+
+    BitWriter() : bit(0) { memset(data, 0, sizeof(data)); }
+    void put(int64_t value, int bits)
+    {
+        for (int i = bits - 1; i >= 0; --i, ++bit)
+        {
+            if ((value >> i) & 1)
+                data[bit / 8] |= 0x80 >> (bit % 8);
+        }
+    }
+};
+
+static vector<uint8_t> makeFrame(BitWriter const& payload)
+{
+    size_t length = (payload.bit + 7) / 8;
+    vector<uint8_t> frame(length + 6);
+    frame[0] = 0xD3;
+    frame[1] = length >> 8;
+    frame[2] = length & 0xFF;
+    memcpy(&frame[3], payload.data, length);
+    uint32_t crc = RawObservationDecoder::crc24q(&frame[0], length + 3);
+    frame[length + 3] = crc >> 16;
+    frame[length + 4] = crc >> 8;
+    frame[length + 5] = crc;
+    return frame;
+}
+
+/** A 1004 message whose satellites i = 0..count-1 have PRN i + 1 and a
+ * pseudorange of pseudorange + 1000 * i. phase_offset is the L1
+ * phase - pseudorange difference, in meters */
+static vector<uint8_t> make1004(uint32_t tow_ms, bool more_messages, int count,
+        double pseudorange, double phase_offset, int lock_time)
+{
+    BitWriter w;
+    w.put(1004, 12); w.put(0, 12); w.put(tow_ms, 30); w.put(more_messages, 1);
+    w.put(count, 5); w.put(0, 1); w.put(0, 3);
+    for (int i = 0; i < count; ++i)
+    {
+        double range = pseudorange + 1000 * i;
+        int ambiguity = static_cast<int>(range / 299792.458);
+        double remainder = range - ambiguity * 299792.458;
+        w.put(i + 1, 6); w.put(0, 1);
+        w.put(llround(remainder / 0.02), 24);
+        w.put(llround(phase_offset / 0.0005) & 0xFFFFF, 20);
+        w.put(lock_time, 7); w.put(ambiguity, 8); w.put(180, 8);
+        // L2 P code, 1.5m above L1
+        w.put(1, 2); w.put(llround(1.5 / 0.02) & 0x3FFF, 14);
+        w.put(llround(2.0 / 0.0005) & 0xFFFFF, 20);
+        w.put(lock_time, 7); w.put(160, 8);
+    }
+    return makeFrame(w);
+}
+
+/** A 1012 message without L2, the satellites having slots 3.. and
+ * frequency channels -2.. */
+static vector<uint8_t> make1012(uint32_t tod_ms, int count, double pseudorange)
+{
+    BitWriter w;
+    w.put(1012, 12); w.put(0, 12); w.put(tod_ms, 27); w.put(0, 1);
+    w.put(count, 5); w.put(0, 1); w.put(0, 3);
+    for (int i = 0; i < count; ++i)
+    {
+        double range = pseudorange + 1000 * i;
+        int ambiguity = static_cast<int>(range / 599584.916);
+        double remainder = range - ambiguity * 599584.916;
+        w.put(i + 3, 6); w.put(0, 1); w.put(i + 5, 5);
+        w.put(llround(remainder / 0.02), 25);
+        w.put(llround(1.0 / 0.0005) & 0xFFFFF, 20);
+        w.put(100, 7); w.put(ambiguity, 7); w.put(170, 8);
+        // No L2: invalid range difference and phase
+        w.put(1, 2); w.put(-8192 & 0x3FFF, 14); w.put(-524288 & 0xFFFFF, 20);
+        w.put(0, 7); w.put(0, 8);
+    }
+    return makeFrame(w);
+}
+
+static string makeNMEA(string const& body)
+{
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < body.size(); ++i)
+        checksum ^= static_cast<uint8_t>(body[i]);
+    char trailer[8];
+    snprintf(trailer, sizeof(trailer), "*%02X\r\n", checksum);
+    return "$" + body + trailer;
+}
+
+static void testCRC()
+{
+    // Check value of CRC-24Q
+    char const* data = "123456789";
+    CHECK(RawObservationDecoder::crc24q(reinterpret_cast<uint8_t const*>(data), 9) == 0xCDE703);
+}
+
+static void testFraming()
+{
+    vector<uint8_t> frame = make1004(0, false, 2, 2.2e7, 1.0, 100);
+    CHECK(RawObservationDecoder::extractFrame(&frame[0], frame.size()) == static_cast<int>(frame.size()));
+    CHECK(RawObservationDecoder::extractFrame(&frame[0], 10) == 0);
+
+    frame[10] ^= 1;
+    CHECK(RawObservationDecoder::extractFrame(&frame[0], frame.size()) == -1);
+    frame[10] ^= 1;
+
+    uint8_t garbage[] = { '$', 0xD3 };
+    CHECK(RawObservationDecoder::extractFrame(garbage, 2) == -1);
+}
+
+static void testEpoch()
+{
+    RawObservationDecoder decoder;
+    base::Time reference = base::Time::fromSeconds(WEEK_START);
+
+    // Sunday 12:00 GPS time. The GPS message announces the GLONASS one,
+    // which completes the epoch. GLONASS time is UTC + 3h
+    uint32_t tow = 12 * 3600 * 1000;
+    vector<uint8_t> gps = make1004(tow, true, 2, 2.2e7, 1.0, 100);
+    CHECK(!decoder.decode(&gps[0], gps.size(), reference));
+    uint32_t tod = (12 * 3600 - RawObservationDecoder::GPS_LEAP_SECONDS + 3 * 3600) * 1000;
+    vector<uint8_t> glonass = make1012(tod, 2, 2.1e7);
+    CHECK(decoder.decode(&glonass[0], glonass.size(), reference));
+
+    RawEpoch const& epoch = decoder.getEpoch();
+    CHECK(epoch.time == base::Time::fromSeconds(WEEK_START + 12 * 3600));
+    CHECK(epoch.satelliteCount == 4);
+    if (epoch.satelliteCount != 4)
+        return;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        RawSatelliteObservation const& sat = epoch.satellites[i];
+        CHECK(sat.constellation == RAW_GPS);
+        CHECK(sat.prn == i + 1);
+        CHECK_CLOSE(sat.pseudorange[0], 2.2e7 + 1000 * i, 0.01);
+        CHECK_CLOSE(sat.carrierPhase[0] * GPS_L1_WAVELENGTH - sat.pseudorange[0], 1.0, 0.001);
+        CHECK_CLOSE(sat.pseudorange[1], sat.pseudorange[0] + 1.5, 0.01);
+        CHECK(sat.code[1] == 1);
+        CHECK_CLOSE(sat.cn0[0], 45, 1e-6);
+        CHECK(!sat.lossOfLock[0]);
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        RawSatelliteObservation const& sat = epoch.satellites[2 + i];
+        CHECK(sat.constellation == RAW_GLONASS);
+        CHECK(sat.prn == i + 3);
+        CHECK(sat.frequencyChannel == i - 2);
+        CHECK_CLOSE(sat.pseudorange[0], 2.1e7 + 1000 * i, 0.01);
+        double wavelength = SPEED_OF_LIGHT / (1602e6 + sat.frequencyChannel * 0.5625e6);
+        CHECK_CLOSE(sat.carrierPhase[0] * wavelength - sat.pseudorange[0], 1.0, 0.001);
+        CHECK(isnan(sat.pseudorange[1]));
+        CHECK(isnan(sat.carrierPhase[1]));
+    }
+}
+
+static void testPhaseTracking()
+{
+    RawObservationDecoder decoder;
+    base::Time reference = base::Time::fromSeconds(WEEK_START);
+    uint32_t tow = 12 * 3600 * 1000;
+
+    vector<uint8_t> frame = make1004(tow, false, 1, 2.2e7, 261.0, 100);
+    decoder.decode(&frame[0], frame.size(), reference);
+    double before = decoder.getEpoch().satellites[0].carrierPhase[0];
+
+    // The receiver keeps the phase - range difference in the message's
+    // range by 1500 cycles steps, which must not show in the phase
+    frame = make1004(tow + 1000, false, 1, 2.2e7, 261.5 - 1500 * GPS_L1_WAVELENGTH, 101);
+    decoder.decode(&frame[0], frame.size(), reference);
+    RawSatelliteObservation const& sat = decoder.getEpoch().satellites[0];
+    CHECK_CLOSE(sat.carrierPhase[0] - before, 0.5 / GPS_L1_WAVELENGTH, 0.01);
+    CHECK(!sat.lossOfLock[0]);
+
+    // A lock time that went down means that the lock got lost
+    frame = make1004(tow + 2000, false, 1, 2.2e7, 3.0, 5);
+    decoder.decode(&frame[0], frame.size(), reference);
+    CHECK(decoder.getEpoch().satellites[0].lossOfLock[0]);
+}
+
+static void testMixedStream()
+{
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    MB500 gps;
+    gps.setFileDescriptor(fds[0]);
+
+    // RTCM frames between the NMEA sentences, split by line noise
+    uint32_t tow = 12 * 3600 * 1000;
+    vector<uint8_t> frame = make1004(tow, false, 3, 2.2e7, 1.0, 100);
+    string stream = "\x01\x02";
+    stream += makeNMEA("GPGGA,115942.00,4500.0000000,N,00500.0000000,E,4,12,0.8,100.000,M,50.000,M,1.0,0001");
+    stream.append(frame.begin(), frame.end());
+    stream += makeNMEA("GPGST,115942.00,0.1,0.1,0.1,0,0.010,0.010,0.020");
+    CHECK(write(fds[1], stream.data(), stream.size()) == static_cast<ssize_t>(stream.size()));
+
+    int status = gps.processAvailable();
+    CHECK(status & MB500::PROCESS_NEW_RAW_EPOCH);
+    CHECK(status & MB500::PROCESS_NEW_SOLUTION);
+    CHECK(gps.getRawEpoch().satelliteCount == 3);
+    CHECK_CLOSE(gps.position.latitude, 45, 1e-9);
+
+    LinkStatistics const& link = gps.getLinkStatistics(MB500::PORT_COMMAND);
+    CHECK(link.packets == 3);
+    CHECK(link.checksumFailures == 0);
+    CHECK(link.bytesDropped == 2);
+    ::close(fds[1]);
+}
+
+static void testMalformedSentences()
+{
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    MB500 gps;
+    gps.setFileDescriptor(fds[0]);
+
+    // Valid checksums but missing fields. They are counted and dropped,
+    // and the sentences after them still get interpreted
+    string stream = makeNMEA("GPVTG,1.0,T");
+    stream += makeNMEA("PASHR,TTT,3,12:34:5");
+    stream += makeNMEA("GPGGA,115942.00,4500.0000000,N,00500.0000000,E,4,12,0.8,100.000,M,50.000,M,1.0,0001");
+    stream += makeNMEA("GPGST,115942.00,0.1,0.1,0.1,0,0.010,0.010,0.020");
+    CHECK(write(fds[1], stream.data(), stream.size()) == static_cast<ssize_t>(stream.size()));
+
+    int status = gps.processAvailable();
+    CHECK(!(status & MB500::PROCESS_ERROR));
+    CHECK(status & MB500::PROCESS_NEW_SOLUTION);
+    CHECK(gps.getStreamStatistics().invalidSentences == 2);
+    ::close(fds[1]);
+}
+
+static long getMaxRSS()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void testRinexMemory()
+{
+    // The writer goes through a fixed buffer, its memory does not depend
+    // on the length of the recording
+    RawObservationDecoder decoder;
+    RinexObservationWriter writer;
+    CHECK(writer.open("/dev/null", "TEST"));
+    base::Time reference = base::Time::fromSeconds(WEEK_START);
+
+    long rss = 0;
+    for (int i = 0; i < 20000; ++i)
+    {
+        vector<uint8_t> frame = make1004(i * 100, false, 20, 2.2e7 + i, 1.0 + i * 1e-4, 100);
+        if (decoder.decode(&frame[0], frame.size(), reference))
+            CHECK(writer.write(decoder.getEpoch()));
+        if (i == 2000)
+            rss = getMaxRSS();
+    }
+    writer.close();
+    CHECK(getMaxRSS() - rss < 256);
+}
+
+int main()
+{
+    testCRC();
+    testFraming();
+    testEpoch();
+    testPhaseTracking();
+    testMixedStream();
+    testMalformedSentences();
+    testRinexMemory();
+    return testResult();
+}
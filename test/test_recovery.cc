@@ -0,0 +1,291 @@
+#include "mb500.hh"
+#include "mb500_clock.hh"
+#include "mb500_manager.hh"
+#include "testing.hh"
+
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <pthread.h>
+#include <termios.h>
+
+using namespace std;
+using namespace gps;
+
+/** A board on a pseudo-terminal. It acknowledges the $PASHS commands
+ * except $PASHS,NOACK, answers the port query, and sends GGA and GST at
+ * 10Hz once the NMEA output got enabled.
+ *
+ * The device is a symbolic link to the pseudo-terminal so that it can be
+ * unplugged and plugged again, as a USB adapter would
+ */
+struct FakeBoard
+{
+    enum EVENT { NO_EVENT, UNPLUG, RESET };
+
+    string device;
+    int master;
+    int slave;
+    pthread_t thread;
+    bool quit;
+    int event;
+    bool streaming;
+    int plug_count;
+    int nmea_on_count;
+    int epoch;
+
+    FakeBoard(string const& device)
+        : device(device), master(-1), slave(-1), quit(false), event(NO_EVENT)
+        , streaming(false), plug_count(0), nmea_on_count(0), epoch(0) {}
+
+    int get(int const& counter) const { return __atomic_load_n(&counter, __ATOMIC_ACQUIRE); }
+    void signal(EVENT value) { __atomic_store_n(&event, value, __ATOMIC_RELEASE); }
+
+    void plug()
+    {
+        char name[64];
+        if (openpty(&master, &slave, name, NULL, NULL) != 0)
+            return;
+        termios settings;
+        tcgetattr(slave, &settings);
+        cfmakeraw(&settings);
+        tcsetattr(slave, TCSANOW, &settings);
+        unlink(device.c_str());
+        symlink(name, device.c_str());
+        __atomic_add_fetch(&plug_count, 1, __ATOMIC_RELEASE);
+    }
+
+    void unplug()
+    {
+        unlink(device.c_str());
+        ::close(master);
+        ::close(slave);
+        master = slave = -1;
+        streaming = false;
+    }
+
+    void send(string const& body)
+    {
+        unsigned int checksum = 0;
+        for (size_t i = 0; i < body.size(); ++i)
+            checksum ^= static_cast<uint8_t>(body[i]);
+        char trailer[8];
+        snprintf(trailer, sizeof(trailer), "*%02X\r\n", checksum);
+        string sentence = "$" + body + trailer;
+        if (write(master, sentence.data(), sentence.size()) != static_cast<ssize_t>(sentence.size()))
+            fprintf(stderr, "fake board: short write\n");
+    }
+
+    void processCommand(string const& line)
+    {
+        if (line.compare(0, 10, "$PASHQ,PRT") == 0)
+            send("PASHR,PRT,A,9");
+        else if (line.compare(0, 12, "$PASHS,NOACK") == 0)
+            return;
+        else if (line.compare(0, 6, "$PASHS") == 0)
+        {
+            send("PASHR,ACK");
+            if (line.find("GGA") != string::npos && line.find("ON") != string::npos)
+            {
+                streaming = true;
+                __atomic_add_fetch(&nmea_on_count, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    void run()
+    {
+        string input;
+        base::Time next_epoch = getMonotonicTime();
+        while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE))
+        {
+            int current = __atomic_exchange_n(&event, NO_EVENT, __ATOMIC_ACQ_REL);
+            if (current == UNPLUG)
+            {
+                unplug();
+                input.clear();
+                usleep(300000);
+                plug();
+            }
+            else if (current == RESET)
+                streaming = false;
+
+            pollfd fd = { master, POLLIN, 0 };
+            if (poll(&fd, 1, 2) > 0 && (fd.revents & POLLIN))
+            {
+                char buffer[1024];
+                ssize_t size = read(master, buffer, sizeof(buffer));
+                if (size > 0)
+                    input.append(buffer, size);
+                size_t eol;
+                while ((eol = input.find('\n')) != string::npos)
+                {
+                    processCommand(input.substr(0, eol));
+                    input.erase(0, eol + 1);
+                }
+            }
+
+            if (streaming && getMonotonicTime() >= next_epoch)
+            {
+                next_epoch = getMonotonicTime() + base::Time::fromMilliseconds(100);
+                int tenths = ++epoch;
+                char time[32];
+                snprintf(time, sizeof(time), "%02d%02d%02d.%d0",
+                        tenths / 36000, tenths / 600 % 60, tenths / 10 % 60, tenths % 10);
+                send(string("GPGGA,") + time + ",4500.0000000,N,00500.0000000,E,4,12,0.8,100.000,M,50.000,M,1.0,0001");
+                send(string("GPGST,") + time + ",0.1,0.1,0.1,0,0.010,0.010,0.020");
+            }
+        }
+        unplug();
+    }
+
+    static void* threadMain(void* board)
+    {
+        static_cast<FakeBoard*>(board)->run();
+        return NULL;
+    }
+
+    void start()
+    {
+        plug();
+        pthread_create(&thread, NULL, threadMain, this);
+    }
+
+    void stop()
+    {
+        __atomic_store_n(&quit, true, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+    }
+};
+
+/** Recovers the devices from the listener, as an application would */
+struct RecoveringListener : public MB500Manager::Listener
+{
+    MB500Manager& manager;
+    int solutions;
+    int failures;
+    bool recovered;
+
+    RecoveringListener(MB500Manager& manager)
+        : manager(manager), solutions(0), failures(0), recovered(false) {}
+
+    void solutionReceived(int, MB500 const&, base::Time const&)
+    { ++solutions; }
+    void deviceFailed(int device_id, MB500&)
+    {
+        ++failures;
+        recovered = manager.recoverDevice(device_id, base::Time::fromSeconds(5));
+    }
+};
+
+static void testUnplug(FakeBoard& board, MB500& gps)
+{
+    MB500Manager manager;
+    RecoveringListener listener(manager);
+    manager.setListener(&listener);
+    int device_id = manager.addDevice(gps);
+    CHECK(device_id != -1);
+
+    base::Time end = getMonotonicTime() + base::Time::fromSeconds(1);
+    while (getMonotonicTime() < end)
+        manager.step(100);
+    CHECK(listener.solutions > 5);
+
+    // The board gets unplugged while it has a command to answer, the
+    // command gets aborted by the recovery
+    int operation = gps.queueCommand("$PASHS,NOACK\r\n", "command without reply");
+    manager.step(0);
+    board.signal(FakeBoard::UNPLUG);
+
+    int before = listener.solutions;
+    end = getMonotonicTime() + base::Time::fromSeconds(3);
+    bool aborted = false;
+    while (getMonotonicTime() < end)
+    {
+        manager.step(100);
+        MB500::CommandResult result;
+        while (gps.popCommandResult(result))
+        {
+            CHECK(result.operation == operation);
+            CHECK(result.status == MB500::COMMAND_ABORTED);
+            aborted = true;
+        }
+    }
+    CHECK(aborted);
+    CHECK(listener.failures == 1);
+    CHECK(listener.recovered);
+    CHECK(listener.solutions - before > 5);
+
+    // The NMEA output got enabled again on the new device
+    CHECK(board.get(board.plug_count) == 2);
+    CHECK(board.get(board.nmea_on_count) == 2);
+
+    RecoveryStatistics const& stats = gps.getRecoveryStatistics();
+    CHECK(stats.disconnections == 1);
+    CHECK(stats.stalls == 0);
+    CHECK(stats.failures == 0);
+    CHECK(stats.attempts >= 1);
+    CHECK(stats.lastDowntime.toSeconds() > 0.3);
+    CHECK(stats.lastDowntime < base::Time::fromSeconds(3));
+    manager.removeDevice(device_id);
+}
+
+static void testStall(FakeBoard& board, MB500& gps)
+{
+    // The board stops sending, as after a reset
+    board.signal(FakeBoard::RESET);
+    int solutions = 0;
+    bool stalled = false;
+    base::Time end = getMonotonicTime() + base::Time::fromSeconds(3);
+    while (getMonotonicTime() < end)
+    {
+        pollfd fd = { gps.getFileDescriptor(), POLLIN, 0 };
+        poll(&fd, 1, 100);
+        if (gps.processAvailable() & MB500::PROCESS_NEW_SOLUTION)
+            ++solutions;
+        if (gps.isStalled())
+        {
+            CHECK(!stalled);
+            stalled = true;
+            solutions = 0;
+            CHECK(gps.recover(base::Time::fromSeconds(2)));
+        }
+    }
+    CHECK(stalled);
+    CHECK(solutions > 5);
+    CHECK(board.get(board.nmea_on_count) == 3);
+
+    RecoveryStatistics const& stats = gps.getRecoveryStatistics();
+    CHECK(stats.disconnections == 1);
+    CHECK(stats.stalls == 1);
+    CHECK(stats.boardResets == 1);
+    CHECK(stats.failures == 0);
+    CHECK(stats.maxDowntime >= stats.lastDowntime);
+}
+
+int main()
+{
+    char directory[] = "/tmp/mb500_test_recoveryXXXXXX";
+    if (!mkdtemp(directory))
+        return 1;
+    FakeBoard board(string(directory) + "/device");
+    board.start();
+
+    MB500 gps;
+    bool configured = gps.openSerial(board.device) && gps.setPeriodicData(0.1);
+    CHECK(configured);
+    CHECK(board.get(board.nmea_on_count) == 1);
+    if (configured)
+    {
+        testUnplug(board, gps);
+        testStall(board, gps);
+    }
+
+    gps.close();
+    board.stop();
+    rmdir(directory);
+    return testResult();
+}
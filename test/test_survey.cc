@@ -0,0 +1,138 @@
+#include "mb500_survey.hh"
+#include "mb500_geodesy.hh"
+#include "testing.hh"
+
+#include <stdlib.h>
+
+using namespace gps;
+
+static const double LATITUDE  = 53.1;
+static const double LONGITUDE = 8.8;
+static const double HEIGHT    = 100;
+static const double GEOIDAL_SEPARATION = 40;
+
+/** Normally distributed noise, reproducible through srand48() */
+static double gaussian(double sigma)
+{
+    double u = 1 - drand48(), v = drand48();
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/** A solution around the reference point, with the given horizontal and
+ * vertical noise in meters */
+static Position makePosition(double time, gps_base::GPS_SOLUTION_TYPES type, double horizontal, double vertical)
+{
+    Position p;
+    p.time = base::Time::fromSeconds(time);
+    p.positionType = type;
+    p.latitude  = LATITUDE + gaussian(horizontal) / 111000;
+    p.longitude = LONGITUDE + gaussian(horizontal) / 67000;
+    p.altitude  = HEIGHT - GEOIDAL_SEPARATION + gaussian(vertical);
+    p.geoidalSeparation = GEOIDAL_SEPARATION;
+    return p;
+}
+
+static Errors makeErrors(double horizontal, double vertical)
+{
+    Errors e;
+    e.deviationLatitude  = horizontal;
+    e.deviationLongitude = horizontal;
+    e.deviationAltitude  = vertical;
+    return e;
+}
+
+static void testGeodesy()
+{
+    double points[][3] = { { LATITUDE, LONGITUDE, HEIGHT }, { -89.9, -170, -50 }, { 0, 180, 8000 } };
+    for (int i = 0; i < 3; ++i)
+    {
+        double ecef[3], latitude, longitude, height;
+        geodeticToECEF(points[i][0], points[i][1], points[i][2], ecef);
+        ecefToGeodetic(ecef, latitude, longitude, height);
+        CHECK_CLOSE(latitude, points[i][0], 1e-9);
+        CHECK_CLOSE(fmod(longitude - points[i][1] + 540, 360) - 180, 0, 1e-9);
+        CHECK_CLOSE(height, points[i][2], 1e-4);
+    }
+
+    // On the equator at the prime meridian, x is the semi-major axis
+    double ecef[3];
+    geodeticToECEF(0, 0, 0, ecef);
+    CHECK_CLOSE(ecef[0], 6378137.0, 1e-6);
+    CHECK_CLOSE(ecef[1], 0, 1e-6);
+    CHECK_CLOSE(ecef[2], 0, 1e-6);
+}
+
+static void testConvergence()
+{
+    srand48(1);
+    SurveyIn survey(0.5, 10, 600);
+    int i = 0;
+    while (i < 600 && !survey.update(makePosition(1000 + i, gps_base::AUTONOMOUS, 2, 3), makeErrors(2, 3)))
+        ++i;
+
+    // sqrt(2^2 + 2^2 + 3^2) / sqrt(n) < 0.5 needs about 68 samples
+    CHECK(survey.isComplete());
+    CHECK(survey.getSampleCount() > 60 && survey.getSampleCount() < 80);
+    CHECK(survey.getStandardError() < 0.5);
+    CHECK(survey.getFixType() == gps_base::AUTONOMOUS);
+
+    double latitude, longitude, height;
+    survey.getPosition(latitude, longitude, height);
+    CHECK_CLOSE((latitude - LATITUDE) * 111000, 0, 1);
+    CHECK_CLOSE((longitude - LONGITUDE) * 67000, 0, 1);
+    CHECK_CLOSE(height, HEIGHT, 1.5);
+}
+
+static void testMinimumDuration()
+{
+    // Precise solutions still have to cover the minimum duration
+    srand48(2);
+    SurveyIn survey(0.5, 10, 600);
+    int i = 0;
+    while (i < 600 && !survey.update(makePosition(1000 + i * 0.1, gps_base::RTK_FIXED, 0.01, 0.02), makeErrors(0.01, 0.02)))
+        ++i;
+    CHECK(survey.getDuration().toSeconds() >= 10);
+    CHECK(survey.getDuration().toSeconds() < 10.5);
+}
+
+static void testFixTypes()
+{
+    srand48(3);
+    SurveyIn survey(0.01, 10, 600);
+    for (int i = 0; i < 20; ++i)
+        survey.update(makePosition(1000 + i, gps_base::AUTONOMOUS, 2, 3), makeErrors(2, 3));
+    CHECK(survey.getSampleCount() == 20);
+
+    // A better fix type restarts the estimate, worse ones are ignored
+    survey.update(makePosition(1020, gps_base::RTK_FLOAT, 0.2, 0.3), makeErrors(0.2, 0.3));
+    CHECK(survey.getSampleCount() == 1);
+    CHECK(survey.getFixType() == gps_base::RTK_FLOAT);
+    survey.update(makePosition(1021, gps_base::AUTONOMOUS, 2, 3), makeErrors(2, 3));
+    CHECK(survey.getSampleCount() == 1);
+    survey.update(makePosition(1022, gps_base::RTK_FLOAT, 0.2, 0.3), makeErrors(0.2, 0.3));
+    CHECK(survey.getSampleCount() == 2);
+}
+
+static void testMaximumDuration()
+{
+    // The target cannot be reached, the survey stops at the maximum
+    // duration
+    srand48(4);
+    SurveyIn survey(0.001, 10, 60);
+    int i = 0;
+    while (i < 600 && !survey.update(makePosition(1000 + i, gps_base::AUTONOMOUS, 2, 3), makeErrors(2, 3)))
+        ++i;
+    CHECK(survey.isComplete());
+    CHECK_CLOSE(survey.getDuration().toSeconds(), 60, 1);
+    CHECK(survey.getStandardError() > 0.001);
+}
+
+int main()
+{
+    testGeodesy();
+    testConvergence();
+    testMinimumDuration();
+    testFixTypes();
+    testMaximumDuration();
+    return testResult();
+}
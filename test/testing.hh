@@ -0,0 +1,31 @@
+#ifndef MAGELLAN_MB500_TESTING_H
+#define MAGELLAN_MB500_TESTING_H
+
+#include <iostream>
+#include <math.h>
+
+/** Minimal checks for the unit tests. A failed check is reported on
+ * stderr and makes testResult(), which main() returns, nonzero */
+static int test_failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+        ++test_failures; } } while(0)
+
+#define CHECK_CLOSE(value, expected, tolerance) \
+    do { double check_value = (value), check_expected = (expected); \
+        if (!(fabs(check_value - check_expected) <= (tolerance))) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": " #value " is " << check_value \
+            << ", expected " << check_expected << " +/- " << (tolerance) << std::endl; \
+        ++test_failures; } } while(0)
+
+static int testResult()
+{
+    if (test_failures)
+        std::cerr << test_failures << " check(s) failed" << std::endl;
+    return test_failures ? 1 : 0;
+}
+
+#endif
+